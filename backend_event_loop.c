@@ -20,28 +20,372 @@
 #include <sys/epoll.h>
 #include <string.h>
 #include <errno.h>
-#include <sys/time.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <libusb-1.0/libusb.h>
 
 #include "backend_event_loop.h"
+#ifdef BACKEND_IO_URING
+#include "backend_uring.h"
+#endif
 
-struct backend_event_loop* backend_event_loop_create()
+#ifdef BACKEND_INSTRUMENT
+static inline uint64_t backend_event_loop_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static void backend_event_loop_reset_instr(struct backend_event_loop *del)
+{
+    backend_histogram_reset(&(del->instr.wait));
+    backend_histogram_reset(&(del->instr.libusb_cb));
+    backend_histogram_reset(&(del->instr.fd_cb));
+    backend_histogram_reset(&(del->instr.timer_cb));
+    backend_histogram_reset(&(del->instr.itr_cb));
+    backend_histogram_reset(&(del->instr.timer_lateness));
+    del->instr.interval_start = backend_event_loop_now_ns();
+}
+#endif
+
+void backend_event_loop_print_instr(struct backend_event_loop *del, FILE *out)
+{
+#ifdef BACKEND_INSTRUMENT
+    fprintf(out, "Event loop instrumentation, last %.3f sec:\n",
+            (backend_event_loop_now_ns() - del->instr.interval_start) / 1e9);
+    backend_histogram_print(out, "  wait", &(del->instr.wait), 1000, "us");
+    backend_histogram_print(out, "  libusb cb", &(del->instr.libusb_cb), 1000,
+            "us");
+    backend_histogram_print(out, "  fd cb", &(del->instr.fd_cb), 1000, "us");
+    backend_histogram_print(out, "  timer cb", &(del->instr.timer_cb), 1000,
+            "us");
+    backend_histogram_print(out, "  itr cb", &(del->instr.itr_cb), 1000, "us");
+    backend_histogram_print(out, "  timer lateness",
+            &(del->instr.timer_lateness), 1000, "us");
+    backend_event_loop_reset_instr(del);
+#endif
+}
+
+static int32_t backend_event_loop_ctl(struct backend_event_loop *del,
+        uint32_t events, int32_t op, int32_t fd, void *ptr)
+{
+    struct epoll_event ev;
+
+#ifdef BACKEND_IO_URING
+    if (del->type == BACKEND_TYPE_IO_URING)
+        return backend_uring_update(del->uring, events, op, fd, ptr);
+#endif
+
+    ev.events = events;
+    ev.data.ptr = ptr;
+
+    return epoll_ctl(del->efd, op, fd, &ev);
+}
+
+static int backend_event_loop_wait(struct backend_event_loop *del,
+        struct epoll_event *events, int maxevents, int timeout)
+{
+#ifdef BACKEND_IO_URING
+    if (del->type == BACKEND_TYPE_IO_URING)
+        return backend_uring_wait(del->uring, events, maxevents, timeout);
+#endif
+
+    return epoll_wait(del->efd, events, maxevents, timeout);
+}
+
+static void backend_event_loop_timerfd_cb(void *ptr, int32_t fd,
+        uint32_t events)
+{
+    uint64_t num_expirations;
+
+    //Timers are run on every iteration of the loop, so we only need to consume
+    //the expiration counter here
+    if (read(fd, &num_expirations, sizeof(num_expirations)) < 0)
+        return;
+}
+
+//The timerfd is an optimization, so the loop works without it
+static void backend_event_loop_create_timerfd(struct backend_event_loop *del)
+{
+    del->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (del->tfd == -1)
+        return;
+
+    //Timerfd is created disarmed
+    del->tfd_clock = UINT64_MAX;
+    backend_configure_epoll_handle(&(del->tfd_handle), del, del->tfd,
+            backend_event_loop_timerfd_cb);
+
+    if (backend_event_loop_ctl(del, EPOLLIN, EPOLL_CTL_ADD, del->tfd,
+                &(del->tfd_handle))) {
+        close(del->tfd);
+        del->tfd = -1;
+    }
+}
+
+static void backend_event_loop_task_cb(void *ptr, int32_t fd,
+        uint32_t events)
+{
+    struct backend_event_loop *del = ptr;
+    struct backend_task *task;
+    eventfd_t val;
+    uint32_t i;
+    uint8_t allocated;
+
+    eventfd_read(fd, &val);
+
+    //Clear before draining, a post that sees task_pending set is guaranteed
+    //that its task is found below
+    atomic_store(&(del->task_pending), 0);
+
+    for (i = 0; i < MAX_TASKS_PER_WAKEUP; i++) {
+        task = backend_task_queue_pop(&(del->task_queue));
+
+        if (!task)
+            return;
+
+        //The callback is free to reuse or release an application task
+        allocated = task->allocated;
+        ++del->stats.tasks;
+        task->cb(task->data);
+
+        if (allocated)
+            free(task);
+    }
+
+    //There might be more tasks, but give the other fds a chance first
+    atomic_store(&(del->task_pending), 1);
+    eventfd_write(fd, 1);
+}
+
+//Without the eventfd, backend_event_loop_post() fails
+static void backend_event_loop_create_taskfd(struct backend_event_loop *del)
+{
+    backend_task_queue_init(&(del->task_queue));
+    atomic_init(&(del->task_pending), 0);
+
+    del->task_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (del->task_fd == -1)
+        return;
+
+    backend_configure_epoll_handle(&(del->task_handle), del, del->task_fd,
+            backend_event_loop_task_cb);
+
+    if (backend_event_loop_ctl(del, EPOLLIN, EPOLL_CTL_ADD, del->task_fd,
+                &(del->task_handle))) {
+        close(del->task_fd);
+        del->task_fd = -1;
+    }
+}
+
+static int32_t backend_event_loop_push_task(struct backend_event_loop *del,
+        struct backend_task *task, backend_task_cb cb, void *ptr)
+{
+    if (del->task_fd == -1)
+        return -1;
+
+    task->cb = cb;
+    task->data = ptr;
+    backend_task_queue_push(&(del->task_queue), task);
+
+    //Only the first post after the loop has started draining the queue needs
+    //to wake up the loop
+    if (!atomic_exchange(&(del->task_pending), 1))
+        eventfd_write(del->task_fd, 1);
+
+    return 0;
+}
+
+int32_t backend_event_loop_post_task(struct backend_event_loop *del,
+        struct backend_task *task, backend_task_cb cb, void *ptr)
+{
+    task->allocated = 0;
+    return backend_event_loop_push_task(del, task, cb, ptr);
+}
+
+int32_t backend_event_loop_post(struct backend_event_loop *del,
+        backend_task_cb cb, void *ptr)
+{
+    struct backend_task *task = malloc(sizeof(struct backend_task));
+
+    if (!task)
+        return -1;
+
+    task->allocated = 1;
+
+    if (backend_event_loop_push_task(del, task, cb, ptr)) {
+        free(task);
+        return -1;
+    }
+
+    return 0;
+}
+
+uint64_t backend_event_loop_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000ULL) + (ts.tv_nsec / 1000000);
+}
+
+//Create the epoll fd or io_uring instance used by the loop
+static int32_t backend_event_loop_init_backend(struct backend_event_loop *del,
+        uint8_t type)
+{
+    del->type = type;
+    del->efd = -1;
+
+    if (type == BACKEND_TYPE_EPOLL) {
+        del->efd = epoll_create(MAX_EPOLL_EVENTS);
+        return del->efd == -1 ? -1 : 0;
+    }
+
+#ifdef BACKEND_IO_URING
+    if (type == BACKEND_TYPE_IO_URING) {
+        del->uring = malloc(sizeof(struct backend_uring));
+
+        if (!del->uring)
+            return -1;
+
+        if (backend_uring_init(del->uring)) {
+            free(del->uring);
+            del->uring = NULL;
+            return -1;
+        }
+
+        return 0;
+    }
+#endif
+
+    return -1;
+}
+
+static void backend_event_loop_deinit_backend(struct backend_event_loop *del)
 {
-    struct backend_event_loop *del = calloc(sizeof(struct backend_event_loop), 1);
+    if (del->efd != -1)
+        close(del->efd);
+
+#ifdef BACKEND_IO_URING
+    if (del->uring) {
+        backend_uring_deinit(del->uring);
+        free(del->uring);
+    }
+#endif
+}
+
+int32_t backend_event_loop_init_type(struct backend_event_loop *del,
+        uint8_t type)
+{
+    memset(del, 0, sizeof(struct backend_event_loop));
+
+    if (backend_event_loop_init_backend(del, type))
+        return -1;
+
+    del->timeout_heap = calloc(sizeof(struct backend_timeout_handle*),
+            TIMEOUT_HEAP_INIT_SIZE);
+    del->events = calloc(sizeof(struct epoll_event), MAX_EPOLL_EVENTS);
+
+    if (!del->timeout_heap || !del->events) {
+        backend_event_loop_deinit_backend(del);
+        free(del->timeout_heap);
+        free(del->events);
+        return -1;
+    }
+
+    del->timeout_heap_size = TIMEOUT_HEAP_INIT_SIZE;
+    del->events_size = MAX_EPOLL_EVENTS;
+
+    if (backend_pool_init(&(del->timeout_pool),
+                sizeof(struct backend_timeout_handle), HANDLE_POOL_SLAB_SIZE,
+                0) ||
+        backend_pool_init(&(del->epoll_pool),
+                sizeof(struct backend_epoll_handle), HANDLE_POOL_SLAB_SIZE,
+                0)) {
+        backend_pool_deinit(&(del->timeout_pool));
+        backend_event_loop_deinit_backend(del);
+        free(del->timeout_heap);
+        free(del->events);
+        return -1;
+    }
+
+    backend_event_loop_create_timerfd(del);
+    backend_event_loop_create_taskfd(del);
+
+#ifdef BACKEND_INSTRUMENT
+    backend_event_loop_reset_instr(del);
+#endif
+
+    return 0;
+}
+
+int32_t backend_event_loop_init(struct backend_event_loop *del)
+{
+    return backend_event_loop_init_type(del, BACKEND_TYPE_EPOLL);
+}
+
+struct backend_event_loop* backend_event_loop_create_type(uint8_t type)
+{
+    struct backend_event_loop *del = malloc(sizeof(struct backend_event_loop));
 
     if(!del)
         return NULL;
 
-    if((del->efd = epoll_create(MAX_EPOLL_EVENTS)) == -1){
+    if (backend_event_loop_init_type(del, type)) {
         free(del);
         return NULL;
     }
 
-    LIST_INIT(&(del->timeout_list));
-
     return del;
 }
 
+struct backend_event_loop* backend_event_loop_create()
+{
+    return backend_event_loop_create_type(BACKEND_TYPE_EPOLL);
+}
+
+void backend_event_loop_deinit(struct backend_event_loop *del)
+{
+    struct backend_task *task;
+    uint32_t i;
+
+    //Make sure handles that outlive the loop are not considered armed
+    for (i = 0; i < del->num_timeouts; i++) {
+        del->timeout_heap[i]->heap_idx = TIMEOUT_HEAP_IDX_NONE;
+        del->timeout_heap[i]->del = NULL;
+    }
+
+    if (del->tfd != -1)
+        close(del->tfd);
+
+    //Tasks that have not been run are dropped
+    while ((task = backend_task_queue_pop(&(del->task_queue)))) {
+        if (task->allocated)
+            free(task);
+    }
+
+    if (del->task_fd != -1)
+        close(del->task_fd);
+
+    backend_event_loop_deinit_backend(del);
+    free(del->timeout_heap);
+    free(del->events);
+    backend_pool_deinit(&(del->timeout_pool));
+    backend_pool_deinit(&(del->epoll_pool));
+}
+
+void backend_event_loop_free(struct backend_event_loop *del)
+{
+    backend_event_loop_deinit(del);
+    free(del);
+}
+
 void backend_configure_epoll_handle(struct backend_epoll_handle *handle,
 		void *ptr, int fd, backend_epoll_cb cb)
 {
@@ -55,122 +399,350 @@ void backend_event_loop_stop(struct backend_event_loop *del)
     del->stop = 1;
 }
 
+void backend_event_loop_set_edge_triggered(struct backend_event_loop *del,
+        uint8_t edge_triggered)
+{
+    del->edge_triggered = edge_triggered;
+}
+
 struct backend_epoll_handle* backend_create_epoll_handle(
         void *ptr, int fd, backend_epoll_cb cb, uint8_t libusb_fd){
     struct backend_epoll_handle *handle =
         calloc(sizeof(struct backend_epoll_handle), 1);
 
-    if(handle != NULL)
+    if(handle != NULL) {
 		backend_configure_epoll_handle(handle, ptr, fd, cb);
+        handle->libusb_fd = libusb_fd;
+    }
 
-    handle->libusb_fd = libusb_fd;
+    return handle;
+}
+
+struct backend_epoll_handle* backend_event_loop_create_epoll_handle(
+        struct backend_event_loop *del, void *ptr, int fd, backend_epoll_cb cb,
+        uint8_t libusb_fd)
+{
+    struct backend_epoll_handle *handle =
+        backend_pool_alloc(&(del->epoll_pool));
+
+    if (handle != NULL) {
+        backend_configure_epoll_handle(handle, ptr, fd, cb);
+        handle->libusb_fd = libusb_fd;
+    }
 
     return handle;
 }
 
+void backend_event_loop_free_epoll_handle(struct backend_event_loop *del,
+        struct backend_epoll_handle *handle)
+{
+    backend_pool_free(&(del->epoll_pool), handle);
+}
+
 int32_t backend_event_loop_update(struct backend_event_loop *del, uint32_t events,
         int32_t op, int32_t fd, void *ptr)
 {
-    struct epoll_event ev;
+    int32_t retval;
 
-    ev.events = events;
-    ev.data.ptr = ptr;
+    if (del->edge_triggered && op != EPOLL_CTL_DEL)
+        events |= EPOLLET;
 
-    return epoll_ctl(del->efd, op, fd, &ev);
-} 
+    retval = backend_event_loop_ctl(del, events, op, fd, ptr);
 
-void backend_event_loop_insert_timeout(struct backend_event_loop *del,
-                                   struct backend_timeout_handle *handle)
+    if (retval)
+        return retval;
+
+    //The event array is resized by the loop itself, as update can be called
+    //while the loop iterates over the array
+    if (op == EPOLL_CTL_ADD)
+        ++del->num_fds;
+    else if (op == EPOLL_CTL_DEL && del->num_fds)
+        --del->num_fds;
+
+    return retval;
+}
+
+static inline void backend_event_loop_heap_set(struct backend_event_loop *del,
+        uint32_t idx, struct backend_timeout_handle *handle)
+{
+    del->timeout_heap[idx] = handle;
+    handle->heap_idx = idx;
+}
+
+//Move the timeout at idx towards the root until heap order is restored
+static void backend_event_loop_heap_up(struct backend_event_loop *del,
+        uint32_t idx)
 {
-    struct backend_timeout_handle *itr = del->timeout_list.lh_first, *prev_itr;
+    struct backend_timeout_handle *handle = del->timeout_heap[idx];
+    uint32_t parent;
 
-    if (itr == NULL ||
-        handle->timeout_clock < itr->timeout_clock) {
-        LIST_INSERT_HEAD(&(del->timeout_list), handle, timeout_next);
-        return;
-    } 
+    while (idx) {
+        parent = (idx - 1) / 2;
 
-    //Move to a separate insert function
-    for (; itr != NULL; itr = itr->timeout_next.le_next) {
-        if (handle->timeout_clock < itr->timeout_clock)
+        if (del->timeout_heap[parent]->timeout_clock <= handle->timeout_clock)
             break;
 
-        prev_itr = itr;
+        backend_event_loop_heap_set(del, idx, del->timeout_heap[parent]);
+        idx = parent;
     }
 
-    LIST_INSERT_AFTER(prev_itr, handle, timeout_next);
+    backend_event_loop_heap_set(del, idx, handle);
+}
+
+//Move the timeout at idx towards the leaves until heap order is restored
+static void backend_event_loop_heap_down(struct backend_event_loop *del,
+        uint32_t idx)
+{
+    struct backend_timeout_handle *handle = del->timeout_heap[idx];
+    uint32_t child;
+
+    while ((child = (2 * idx) + 1) < del->num_timeouts) {
+        if (child + 1 < del->num_timeouts &&
+            del->timeout_heap[child + 1]->timeout_clock <
+            del->timeout_heap[child]->timeout_clock)
+            child++;
+
+        if (handle->timeout_clock <= del->timeout_heap[child]->timeout_clock)
+            break;
+
+        backend_event_loop_heap_set(del, idx, del->timeout_heap[child]);
+        idx = child;
+    }
+
+    backend_event_loop_heap_set(del, idx, handle);
+}
+
+int32_t backend_event_loop_insert_timeout(struct backend_event_loop *del,
+                                   struct backend_timeout_handle *handle)
+{
+    struct backend_timeout_handle **heap;
+    uint32_t idx;
+
+    //Timeout is already armed, so we only need to restore heap order. The new
+    //timeout_clock can be both earlier and later than the old one
+    if (handle->heap_idx != TIMEOUT_HEAP_IDX_NONE && handle->del == del) {
+        idx = handle->heap_idx;
+        backend_event_loop_heap_up(del, idx);
+
+        if (handle->heap_idx == idx)
+            backend_event_loop_heap_down(del, idx);
+
+        return 0;
+    }
+
+    if (del->num_timeouts == del->timeout_heap_size) {
+        heap = realloc(del->timeout_heap, sizeof(struct backend_timeout_handle*)
+                * del->timeout_heap_size * 2);
+
+        if (!heap)
+            return -1;
+
+        del->timeout_heap = heap;
+        del->timeout_heap_size *= 2;
+    }
+
+    handle->del = del;
+    backend_event_loop_heap_set(del, del->num_timeouts++, handle);
+    backend_event_loop_heap_up(del, handle->heap_idx);
+
+    return 0;
 }
 
 void backend_event_loop_remove_timeout(struct backend_timeout_handle *timeout)
 {
-    LIST_REMOVE(timeout, timeout_next);
-    timeout->timeout_next.le_next = NULL;
-    timeout->timeout_next.le_prev = NULL;
+    struct backend_event_loop *del = timeout->del;
+    struct backend_timeout_handle *last;
+    uint32_t idx = timeout->heap_idx;
+
+    if (idx == TIMEOUT_HEAP_IDX_NONE || !del)
+        return;
+
+    timeout->heap_idx = TIMEOUT_HEAP_IDX_NONE;
+    last = del->timeout_heap[--del->num_timeouts];
+
+    if (last == timeout)
+        return;
+
+    //Fill the hole with the last element and move it up or down
+    backend_event_loop_heap_set(del, idx, last);
+    backend_event_loop_heap_up(del, idx);
+
+    if (last->heap_idx == idx)
+        backend_event_loop_heap_down(del, idx);
+}
+
+int32_t backend_event_loop_add_timeout_handle(struct backend_event_loop *del,
+        struct backend_timeout_handle *handle, uint64_t timeout_clock,
+        backend_timeout_cb timeout_cb, void *ptr, uint32_t intvl)
+{
+    handle->timeout_clock = timeout_clock;
+    handle->cb = timeout_cb;
+    handle->data = ptr;
+    handle->intvl = intvl;
+    handle->heap_idx = TIMEOUT_HEAP_IDX_NONE;
+    handle->del = NULL;
+
+    return backend_event_loop_insert_timeout(del, handle);
 }
 
 struct backend_timeout_handle* backend_event_loop_add_timeout(
         struct backend_event_loop *del, uint64_t timeout_clock,
         backend_timeout_cb timeout_cb, void *ptr, uint32_t intvl)
 {
-    //In an improved version, handle can be passed as argument so that it is up
-    //to application how to allocate it
     struct backend_timeout_handle *handle =
-        calloc(sizeof(struct backend_timeout_handle), 1);
+        backend_pool_alloc(&(del->timeout_pool));
 
     if (!handle)
         return NULL;
 
-    handle->timeout_clock = timeout_clock;
-    handle->cb = timeout_cb;
-    handle->data = ptr;
-    handle->intvl = intvl;
+    if (backend_event_loop_add_timeout_handle(del, handle, timeout_clock,
+                timeout_cb, ptr, intvl)) {
+        backend_pool_free(&(del->timeout_pool), handle);
+        return NULL;
+    }
 
-    backend_event_loop_insert_timeout(del, handle);
     return handle;
 }
 
+void backend_event_loop_free_timeout(struct backend_event_loop *del,
+        struct backend_timeout_handle *timeout)
+{
+    backend_event_loop_remove_timeout(timeout);
+    backend_pool_free(&(del->timeout_pool), timeout);
+}
+
+//Next deadline for a periodic timeout. Deadlines are kept on the grid defined
+//by the first timeout_clock and intvl, so callback latency does not accumulate.
+//If the loop has been blocked for more than one interval, the missed
+//expirations are skipped instead of being run back-to-back
+static inline uint64_t backend_event_loop_next_deadline(
+        const struct backend_timeout_handle *timeout, uint64_t cur_time)
+{
+    uint64_t deadline = timeout->timeout_clock + timeout->intvl;
+
+    if (deadline <= cur_time)
+        deadline += (((cur_time - deadline) / timeout->intvl) + 1) *
+            timeout->intvl;
+
+    return deadline;
+}
+
 static void backend_event_loop_run_timers(struct backend_event_loop *del)
 {
-    struct backend_timeout_handle *timeout = del->timeout_list.lh_first;
     struct backend_timeout_handle *cur_timeout;
-    struct timeval tv;
-    uint64_t cur_time;
-
-    gettimeofday(&tv, NULL);
-    cur_time = (tv.tv_sec * 1e3) + (tv.tv_usec / 1e3);
-
-    while (timeout != NULL) {
-        if (timeout->timeout_clock <= cur_time) {
-            cur_timeout = timeout;
-            timeout = timeout->timeout_next.le_next;
-
-            //Execute and remove timeout from list
-            cur_timeout->cb(cur_timeout->data);
-            LIST_REMOVE(cur_timeout, timeout_next);
-            cur_timeout->timeout_next.le_next = NULL;
-            cur_timeout->timeout_next.le_prev = NULL;
-
-            //Rearm timer or free memory if we are done
-            if (cur_timeout->intvl) {
-                cur_timeout->timeout_clock = cur_time + cur_timeout->intvl;
-                backend_event_loop_insert_timeout(del, cur_timeout);
+    uint64_t cur_time = backend_event_loop_now();
+#ifdef BACKEND_INSTRUMENT
+    uint64_t start_ns;
+#endif
+
+    while (del->num_timeouts &&
+           del->timeout_heap[0]->timeout_clock <= cur_time) {
+        //Remove timeout from heap before executing it, so that the callback is
+        //free to re-insert or remove the timeout itself
+        cur_timeout = del->timeout_heap[0];
+        backend_event_loop_remove_timeout(cur_timeout);
+
+#ifdef BACKEND_INSTRUMENT
+        start_ns = backend_event_loop_now_ns();
+        backend_histogram_add(&(del->instr.timer_lateness),
+                start_ns > cur_timeout->timeout_clock * 1000000 ?
+                start_ns - (cur_timeout->timeout_clock * 1000000) : 0);
+#endif
+
+        cur_timeout->cb(cur_timeout->data);
+
+#ifdef BACKEND_INSTRUMENT
+        backend_histogram_add(&(del->instr.timer_cb),
+                backend_event_loop_now_ns() - start_ns);
+#endif
+
+        //Rearm timer unless callback has already done so
+        if (cur_timeout->intvl &&
+            cur_timeout->heap_idx == TIMEOUT_HEAP_IDX_NONE) {
+            cur_timeout->timeout_clock = backend_event_loop_next_deadline(
+                    cur_timeout, cur_time);
+            backend_event_loop_insert_timeout(del, cur_timeout);
+        }
+    }
+}
+
+//Compute the timeout to use for epoll_wait. If we have a timerfd, it is armed
+//with the absolute time of the next timeout and we can block until any fd is
+//ready. The timerfd is only touched when the first timeout changes
+static int backend_event_loop_get_sleep_time(struct backend_event_loop *del)
+{
+    struct itimerspec its = {{0, 0}, {0, 0}};
+    uint64_t next_clock = UINT64_MAX, cur_time;
+
+    if (del->num_timeouts)
+        next_clock = del->timeout_heap[0]->timeout_clock;
+
+    if (del->tfd != -1) {
+        if (next_clock != del->tfd_clock) {
+            //A zero it_value disarms the timerfd, so a timeout at time 0 (which
+            //has already expired) is moved forward by 1 ns
+            if (next_clock != UINT64_MAX) {
+                its.it_value.tv_sec = next_clock / 1000;
+                its.it_value.tv_nsec = ((next_clock % 1000) * 1000000) +
+                    (next_clock ? 0 : 1);
             }
-        } else {
-            break;
+
+            if (timerfd_settime(del->tfd, TFD_TIMER_ABSTIME, &its, NULL))
+                return 0;
+
+            del->tfd_clock = next_clock;
         }
+
+        return -1;
     }
+
+    if (next_clock == UINT64_MAX)
+        return -1;
+
+    cur_time = backend_event_loop_now();
+
+    if (cur_time > next_clock)
+        return 0;
+    else
+        return next_clock - cur_time;
+}
+
+//Grow the event array so that one epoll_wait can return all registered file
+//descriptors (including the timerfd). The array is never shrunk
+static void backend_event_loop_resize_events(struct backend_event_loop *del)
+{
+    struct epoll_event *events;
+    uint32_t events_size = del->events_size;
+
+    while (events_size < del->num_fds + 1 &&
+           events_size < MAX_EPOLL_EVENTS_LIMIT)
+        events_size *= 2;
+
+    if (events_size > MAX_EPOLL_EVENTS_LIMIT)
+        events_size = MAX_EPOLL_EVENTS_LIMIT;
+
+    if (events_size == del->events_size)
+        return;
+
+    //Keep the old array if we fail to allocate a larger one
+    events = realloc(del->events, sizeof(struct epoll_event) * events_size);
+
+    if (!events)
+        return;
+
+    del->events = events;
+    del->events_size = events_size;
 }
 
 void backend_event_loop_run(struct backend_event_loop *del)
 {
     struct backend_epoll_handle *cur_handle, *usb_handle = NULL;
-    struct epoll_event events[MAX_EPOLL_EVENTS];
-    int nfds, i, sleep_time;
+    struct epoll_event *events;
+    int nfds, i;
+#ifdef BACKEND_INSTRUMENT
+    uint64_t start_ns;
+#endif
 
-    struct timeval tv;
-    uint64_t cur_time = 0;
-    struct backend_timeout_handle *timeout = NULL;
-   
     del->stop = 0;
 
     while (1){
@@ -178,35 +750,44 @@ void backend_event_loop_run(struct backend_event_loop *del)
             return;
 
         usb_handle = NULL;
-        if (del->timeout_list.lh_first) {
-            timeout = del->timeout_list.lh_first;
-            gettimeofday(&tv, NULL);
-            cur_time = (tv.tv_sec * 1e3) + (tv.tv_usec / 1e3);
-        }
-       
-        if (timeout != NULL) {
-            if (cur_time > timeout->timeout_clock)
-                sleep_time = 0;
-            else
-                sleep_time = timeout->timeout_clock - cur_time;
-        } else {
-            sleep_time = -1;
-        }
 
-		nfds = epoll_wait(del->efd, events, MAX_EPOLL_EVENTS, sleep_time);
+        if (del->num_fds >= del->events_size)
+            backend_event_loop_resize_events(del);
+
+        events = del->events;
+
+#ifdef BACKEND_INSTRUMENT
+        start_ns = backend_event_loop_now_ns();
+#endif
+
+		nfds = backend_event_loop_wait(del, events, del->events_size,
+                backend_event_loop_get_sleep_time(del));
+
+#ifdef BACKEND_INSTRUMENT
+        backend_histogram_add(&(del->instr.wait),
+                backend_event_loop_now_ns() - start_ns);
+#endif
 
 		if (nfds < 0)
 			continue;
 
+        ++del->stats.wakeups;
+        del->stats.events += nfds;
+
+        if (!nfds)
+            ++del->stats.empty_wakeups;
+        else if ((uint32_t) nfds == del->events_size)
+            ++del->stats.full_batches;
+
+        if ((uint32_t) nfds > del->stats.max_events)
+            del->stats.max_events = nfds;
+
         //TODO: Make sure the order of processing is safe wrt event caching and
         //so on. I can't think of any problems right now, since we will not for
         //example free a device in the internal libusb_list. So a USB event will
         //always work as intended, only difference is that event might be
         //removed from list, but our code should handle that
-
-        //No callbacks have been called between last timeout check and here, so
-        //I can recycle timeout value
-        if (timeout != NULL)
+        if (del->num_timeouts)
             backend_event_loop_run_timers(del);
 
         for(i=0; i<nfds; i++) {
@@ -215,17 +796,46 @@ void backend_event_loop_run(struct backend_event_loop *del)
             if (cur_handle->libusb_fd) {
                 usb_handle = cur_handle;
                 continue;
-            } else {
-                cur_handle->cb(cur_handle->data, cur_handle->fd, events[i].events);
             }
+
+#ifdef BACKEND_INSTRUMENT
+            start_ns = backend_event_loop_now_ns();
+#endif
+
+            cur_handle->cb(cur_handle->data, cur_handle->fd, events[i].events);
+
+#ifdef BACKEND_INSTRUMENT
+            backend_histogram_add(&(del->instr.fd_cb),
+                    backend_event_loop_now_ns() - start_ns);
+#endif
         }
 
         //We should only run usb_handle once per loop. Keeping it here makes it
         //easier also when I remove descriptors
-        if (usb_handle)
+        if (usb_handle) {
+#ifdef BACKEND_INSTRUMENT
+            start_ns = backend_event_loop_now_ns();
+#endif
+
             usb_handle->cb(usb_handle->data, usb_handle->fd, 0);
 
-        if (del->itr_cb != NULL)
+#ifdef BACKEND_INSTRUMENT
+            backend_histogram_add(&(del->instr.libusb_cb),
+                    backend_event_loop_now_ns() - start_ns);
+#endif
+        }
+
+        if (del->itr_cb != NULL) {
+#ifdef BACKEND_INSTRUMENT
+            start_ns = backend_event_loop_now_ns();
+#endif
+
             del->itr_cb(del->itr_data);
+
+#ifdef BACKEND_INSTRUMENT
+            backend_histogram_add(&(del->instr.itr_cb),
+                    backend_event_loop_now_ns() - start_ns);
+#endif
+        }
     }
 }
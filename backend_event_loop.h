@@ -18,9 +18,41 @@
 #ifndef BACKEND_EVENT_LOOP_H
 #define BACKEND_EVENT_LOOP_H
 
-#include <sys/queue.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/epoll.h>
 
+#include "backend_pool.h"
+#include "backend_task_queue.h"
+
+#ifdef BACKEND_INSTRUMENT
+#include "backend_histogram.h"
+#endif
+
+//Initial number of events returned by one epoll_wait. The batch grows with the
+//number of registered file descriptors, up to MAX_EPOLL_EVENTS_LIMIT
 #define MAX_EPOLL_EVENTS 10
+#define MAX_EPOLL_EVENTS_LIMIT 4096
+
+//Initial number of slots in the timeout heap, the heap doubles when full
+#define TIMEOUT_HEAP_INIT_SIZE 16
+
+//Number of handles in every slab of the timeout and epoll handle pools
+#define HANDLE_POOL_SLAB_SIZE 32
+
+//Max. number of posted tasks run per wakeup, so that a thread that posts a lot
+//can not starve the file descriptors
+#define MAX_TASKS_PER_WAKEUP 64
+
+//The file descriptor part of the loop can be backed by epoll (default) or, when
+//built with BACKEND_IO_URING, io_uring
+enum {
+    BACKEND_TYPE_EPOLL = 0,
+    BACKEND_TYPE_IO_URING,
+};
+
+//heap_idx of a timeout that is not a member of the timeout heap
+#define TIMEOUT_HEAP_IDX_NONE UINT32_MAX
 
 //Any resource used by the callback is stored in the implementing "class".
 //Assume one separate callback function per type of event
@@ -30,6 +62,8 @@ typedef void(*backend_epoll_cb)(void *ptr, int32_t fd, uint32_t events);
 typedef void(*backend_timeout_cb)(void *ptr);
 typedef backend_timeout_cb backend_itr_cb;
 
+struct backend_uring;
+
 struct backend_epoll_handle{
     void *data;
     int32_t fd;
@@ -42,49 +76,180 @@ struct backend_epoll_handle{
     uint8_t libusb_fd;
 };
 
-//timeout_clock is first timeout in wallclock (ms), intvl is frequency after
-//that. Set to 0 if no repeat is needed
+//timeout_clock is first timeout in ms on the monotonic clock returned by
+//backend_event_loop_now(), intvl is frequency after that. Set to 0 if no repeat
+//is needed. Periodic timeouts are rearmed relative to their previous deadline,
+//not to when they were run, so they do not drift. heap_idx and del are
+//maintained by the event loop and must not be touched by the application
 struct backend_timeout_handle{
     uint64_t timeout_clock;
     backend_timeout_cb cb;
-    LIST_ENTRY(backend_timeout_handle) timeout_next;
+    struct backend_event_loop *del;
+    uint32_t heap_idx;
     uint32_t intvl;
     void *data;
 };
 
+//Counters describing how much work is done per wakeup of the loop. A wakeup is
+//one return from epoll_wait, empty_wakeups are the ones without any ready file
+//descriptors (timeouts). full_batches counts the wakeups where the event array
+//was filled, i.e., more events could have been ready. tasks is the number of
+//tasks posted from other threads that have been run
+struct backend_event_loop_stats{
+    uint64_t wakeups;
+    uint64_t empty_wakeups;
+    uint64_t events;
+    uint64_t full_batches;
+    uint64_t tasks;
+    uint32_t max_events;
+};
+
+#ifdef BACKEND_INSTRUMENT
+//Where the loop spends its time, only collected when built with
+//BACKEND_INSTRUMENT. All values are ns. wait is the time blocked waiting for
+//events, the *_cb histograms the time spent in the different callback types and
+//timer_lateness how late timeouts are run compared to their timeout_clock. The
+//histograms cover the interval since interval_start, and are reset every time
+//they are printed
+struct backend_event_loop_instr{
+    struct backend_histogram wait;
+    struct backend_histogram libusb_cb;
+    struct backend_histogram fd_cb;
+    struct backend_histogram timer_cb;
+    struct backend_histogram itr_cb;
+    struct backend_histogram timer_lateness;
+    uint64_t interval_start;
+};
+#endif
+
+//Timeouts are stored in a binary min-heap ordered on timeout_clock, so insert
+//and remove are O(log n) and the next timeout is always timeout_heap[0]. When
+//available, the next timeout is armed on a timerfd which is part of the epoll
+//set (tfd is -1 otherwise and the timeout of epoll_wait is used instead).
+//tfd_clock is the timeout the timerfd is currently armed with. Handles created
+//by the loop are allocated from timeout_pool and epoll_pool. efd is -1 when
+//the loop is backed by io_uring (uring). Tasks posted from other threads are
+//queued in task_queue and the loop is woken up through the eventfd task_fd.
+//task_pending is set while a wakeup is outstanding, so that only the first post
+//after the queue has been drained writes to the eventfd
 struct backend_event_loop{
     int32_t efd;
-    LIST_HEAD(timeout, backend_timeout_handle) timeout_list;
+    struct backend_uring *uring;
+    int32_t tfd;
+    uint64_t tfd_clock;
+    struct backend_epoll_handle tfd_handle;
+    int32_t task_fd;
+    atomic_uchar task_pending;
+    struct backend_epoll_handle task_handle;
+    struct backend_task_queue task_queue;
+    struct backend_timeout_handle **timeout_heap;
+    uint32_t num_timeouts;
+    uint32_t timeout_heap_size;
+    struct epoll_event *events;
+    uint32_t events_size;
+    uint32_t num_fds;
+    struct backend_event_loop_stats stats;
+#ifdef BACKEND_INSTRUMENT
+    struct backend_event_loop_instr instr;
+#endif
+    struct backend_pool timeout_pool;
+    struct backend_pool epoll_pool;
     backend_itr_cb itr_cb;
     void *itr_data;
+    uint8_t edge_triggered;
+    uint8_t type;
     uint8_t stop;
 };
 
-//Create an backend_event_loop struct
-//TODO: Currently, allocations are made from heap. Add support for using
-//deciding how the struct should be allocated. This also applies to
-//backend_create_epoll_handle()
+//Create (allocate) a backend_event_loop struct
 struct backend_event_loop* backend_event_loop_create();
 
-//Update file descriptor + ptr to efd in events according to op
+//Create a backend_event_loop struct using the given BACKEND_TYPE_*. Returns
+//NULL if the type is not supported (not built or not supported by the kernel)
+struct backend_event_loop* backend_event_loop_create_type(uint8_t type);
+
+//Initialize an event loop that has been allocated by the application, for
+//example as part of another struct. Returns 0 on success and -1 on failure
+int32_t backend_event_loop_init(struct backend_event_loop *del);
+
+//Same as backend_event_loop_init(), but using the given BACKEND_TYPE_*
+int32_t backend_event_loop_init_type(struct backend_event_loop *del,
+        uint8_t type);
+
+//Free an event loop created by backend_event_loop_create(). Handles allocated
+//from the pools of the loop are released, while handles allocated by the
+//application are not touched
+void backend_event_loop_free(struct backend_event_loop *del);
+
+//Release the resources of an event loop initialized with
+//backend_event_loop_init(), but not the struct itself
+void backend_event_loop_deinit(struct backend_event_loop *del);
+
+//Update file descriptor + ptr to the loop in events according to op (same
+//semantics as epoll_ctl, also for io_uring). If the loop is
+//edge-triggered (or EPOLLET is part of events), the callback must consume all
+//available data/events on the file descriptor. Remove file descriptors with
+//EPOLL_CTL_DEL before closing them, the number of registered file descriptors
+//is used to size the event batch
 int32_t backend_event_loop_update(struct backend_event_loop *del, uint32_t events,
         int32_t op, int32_t fd, void *ptr);
 
+//Current time (ms) of the monotonic clock used for all timeouts. Unlike
+//wallclock, this clock is not affected by NTP or the user setting the time
+uint64_t backend_event_loop_now();
+
+//Print the instrumentation collected since the last call and start a new
+//interval. Does nothing unless built with BACKEND_INSTRUMENT
+void backend_event_loop_print_instr(struct backend_event_loop *del, FILE *out);
+
+//Post a task that will be run (cb(ptr)) by the thread running the loop. Can be
+//called from any thread. The task is allocated with malloc and released by the
+//loop after cb has been run. Tasks still queued when the loop is destroyed are
+//released without being run. Returns 0 on success and -1 on failure
+int32_t backend_event_loop_post(struct backend_event_loop *del,
+        backend_task_cb cb, void *ptr);
+
+//Same as backend_event_loop_post(), but for a task allocated by the
+//application. The task must not be touched again before cb has been run
+int32_t backend_event_loop_post_task(struct backend_event_loop *del,
+        struct backend_task *task, backend_task_cb cb, void *ptr);
+
 //Stop the event loop
 void backend_event_loop_stop(struct backend_event_loop *del);
 
-//Add a timeout which is controlled by main loop
+//Register all file descriptors added or modified after this call as
+//edge-triggered (EPOLLET). Reduces the number of wakeups when callbacks drain
+//their file descriptors anyway, which is the case for libusb
+void backend_event_loop_set_edge_triggered(struct backend_event_loop *del,
+        uint8_t edge_triggered);
+
+//Add a timeout which is controlled by main loop. The handle is allocated from
+//the timeout pool of the loop and must be released with
+//backend_event_loop_free_timeout()
 struct backend_timeout_handle* backend_event_loop_add_timeout(
         struct backend_event_loop *del, uint64_t timeout_clock,
         backend_timeout_cb timeout_cb, void *ptr,
         uint32_t intvl);
 
-//Remove timeout from timeout list
+//Same as backend_event_loop_add_timeout(), but for a handle allocated by the
+//application. Returns 0 on success and -1 on failure
+int32_t backend_event_loop_add_timeout_handle(struct backend_event_loop *del,
+        struct backend_timeout_handle *handle, uint64_t timeout_clock,
+        backend_timeout_cb timeout_cb, void *ptr, uint32_t intvl);
+
+//Remove a timeout created by backend_event_loop_add_timeout() and return it
+//to the timeout pool
+void backend_event_loop_free_timeout(struct backend_event_loop *del,
+        struct backend_timeout_handle *timeout);
+
+//Remove timeout from timeout heap. Removing a timeout that is not armed is a
+//no-op
 void backend_event_loop_remove_timeout(struct backend_timeout_handle *timeout);
 
-//Insert an updated timeout in list. Note that it is not checked if timeout is
-//already a member of list
-void backend_event_loop_insert_timeout(struct backend_event_loop *del,
+//Insert an updated timeout in heap. If timeout is already a member of the heap,
+//its position is updated according to the new timeout_clock. Returns 0 on
+//success and -1 if the heap could not be grown
+int32_t backend_event_loop_insert_timeout(struct backend_event_loop *del,
                                    struct backend_timeout_handle *handle);
 
 //Fill handle with ptr, fd, and cb. Used by create_epoll_handle and can be used
@@ -96,6 +261,17 @@ void backend_configure_epoll_handle(struct backend_epoll_handle *handle,
 struct backend_epoll_handle* backend_create_epoll_handle(void *ptr, int fd,
         backend_epoll_cb cb, uint8_t libusb_fd);
 
+//Create a new epoll handle from the epoll handle pool of the loop. The handle
+//must be released with backend_event_loop_free_epoll_handle()
+struct backend_epoll_handle* backend_event_loop_create_epoll_handle(
+        struct backend_event_loop *del, void *ptr, int fd, backend_epoll_cb cb,
+        uint8_t libusb_fd);
+
+//Return an epoll handle to the epoll handle pool of the loop. The fd must
+//already have been removed from the loop
+void backend_event_loop_free_epoll_handle(struct backend_event_loop *del,
+        struct backend_epoll_handle *handle);
+
 //Run event loop described by efd. Let it be up to the user how efd shall be
 //stored
 //Function is for now never supposed to return. If it returns, something has
@@ -0,0 +1,141 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "backend_hash.h"
+
+static int32_t backend_hash_resize(struct backend_hash *hash,
+        uint32_t num_buckets)
+{
+    struct backend_hash_node **buckets, *node, *next;
+    uint32_t i, idx;
+
+    buckets = calloc(sizeof(struct backend_hash_node*), num_buckets);
+
+    if (!buckets)
+        return -1;
+
+    for (i = 0; i < hash->num_buckets; i++) {
+        for (node = hash->buckets[i]; node != NULL; node = next) {
+            next = node->next;
+            idx = node->hash & (num_buckets - 1);
+            node->next = buckets[idx];
+            buckets[idx] = node;
+        }
+    }
+
+    free(hash->buckets);
+    hash->buckets = buckets;
+    hash->num_buckets = num_buckets;
+
+    return 0;
+}
+
+int32_t backend_hash_init(struct backend_hash *hash, uint32_t num_buckets)
+{
+    uint32_t size = 1;
+
+    hash->buckets = NULL;
+    hash->num_buckets = 0;
+    hash->num_nodes = 0;
+
+    while (size < num_buckets)
+        size <<= 1;
+
+    return backend_hash_resize(hash, size);
+}
+
+void backend_hash_deinit(struct backend_hash *hash)
+{
+    free(hash->buckets);
+    hash->buckets = NULL;
+    hash->num_buckets = 0;
+    hash->num_nodes = 0;
+}
+
+uint32_t backend_hash_bytes(const void *key, size_t len)
+{
+    const uint8_t *buf = key;
+    uint32_t val = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        val ^= buf[i];
+        val *= 16777619U;
+    }
+
+    return val;
+}
+
+void backend_hash_insert(struct backend_hash *hash,
+        struct backend_hash_node *node, uint32_t node_hash)
+{
+    uint32_t idx;
+
+    if (hash->num_nodes >= hash->num_buckets)
+        backend_hash_resize(hash, hash->num_buckets << 1);
+
+    idx = node_hash & (hash->num_buckets - 1);
+    node->hash = node_hash;
+    node->next = hash->buckets[idx];
+    hash->buckets[idx] = node;
+    ++hash->num_nodes;
+}
+
+void backend_hash_remove(struct backend_hash *hash,
+        struct backend_hash_node *node)
+{
+    struct backend_hash_node **itr =
+        &(hash->buckets[node->hash & (hash->num_buckets - 1)]);
+
+    while (*itr != NULL) {
+        if (*itr == node) {
+            *itr = node->next;
+            node->next = NULL;
+            --hash->num_nodes;
+            return;
+        }
+
+        itr = &((*itr)->next);
+    }
+}
+
+struct backend_hash_node* backend_hash_first(const struct backend_hash *hash,
+        uint32_t node_hash)
+{
+    struct backend_hash_node *node =
+        hash->buckets[node_hash & (hash->num_buckets - 1)];
+
+    while (node != NULL && node->hash != node_hash)
+        node = node->next;
+
+    return node;
+}
+
+struct backend_hash_node* backend_hash_next(struct backend_hash_node *node)
+{
+    uint32_t node_hash = node->hash;
+
+    node = node->next;
+
+    while (node != NULL && node->hash != node_hash)
+        node = node->next;
+
+    return node;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef BACKEND_HASH_H
+#define BACKEND_HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Intrusive hash table with chaining. The application embeds a
+//backend_hash_node in its objects and computes the hash of the key (for
+//example with backend_hash_bytes()), the table does not know about keys. Lookup
+//walks the nodes with a matching hash using backend_hash_first() and
+//backend_hash_next(), and the application compares the keys. The number of
+//buckets is a power of two and is doubled when there are more nodes than
+//buckets, so chains stay short
+struct backend_hash_node{
+    struct backend_hash_node *next;
+    uint32_t hash;
+};
+
+struct backend_hash{
+    struct backend_hash_node **buckets;
+    uint32_t num_buckets;
+    uint32_t num_nodes;
+};
+
+//Get the object containing node, where member is the name of the node in type
+#define BACKEND_HASH_ENTRY(node, type, member) \
+    ((type*) (((char*) (node)) - offsetof(type, member)))
+
+//Initialize a hash table in place with (at least) num_buckets buckets. Returns
+//0 on success and -1 on failure
+int32_t backend_hash_init(struct backend_hash *hash, uint32_t num_buckets);
+
+//Release the buckets. The nodes are owned by the application
+void backend_hash_deinit(struct backend_hash *hash);
+
+//FNV-1a hash of len bytes of key
+uint32_t backend_hash_bytes(const void *key, size_t len);
+
+//Insert node with the given hash. Inserting never fails, if the table could not
+//be grown the chains just get longer
+void backend_hash_insert(struct backend_hash *hash,
+        struct backend_hash_node *node, uint32_t node_hash);
+
+//Remove a node that is a member of the table
+void backend_hash_remove(struct backend_hash *hash,
+        struct backend_hash_node *node);
+
+//Get the first node with the given hash, or NULL
+struct backend_hash_node* backend_hash_first(const struct backend_hash *hash,
+        uint32_t node_hash);
+
+//Get the next node with the same hash as node, or NULL
+struct backend_hash_node* backend_hash_next(struct backend_hash_node *node);
+
+#endif
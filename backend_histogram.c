@@ -0,0 +1,117 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "backend_histogram.h"
+
+static inline uint32_t backend_histogram_bucket(uint64_t value)
+{
+    uint32_t msb;
+
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return (uint32_t) value;
+
+    //Position of the most significant bit, the next HISTOGRAM_SUB_BITS bits
+    //decide the bucket within the power of two
+    msb = 63 - __builtin_clzll(value);
+
+    return ((msb - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) +
+        ((value >> (msb - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+//Largest value that maps to bucket
+static uint64_t backend_histogram_bucket_max(uint32_t bucket)
+{
+    uint32_t msb, sub;
+
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+
+    msb = (bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+    sub = bucket & (HISTOGRAM_SUB_BUCKETS - 1);
+
+    return ((((uint64_t) HISTOGRAM_SUB_BUCKETS + sub + 1) <<
+                (msb - HISTOGRAM_SUB_BITS)) - 1);
+}
+
+void backend_histogram_reset(struct backend_histogram *hist)
+{
+    memset(hist, 0, sizeof(struct backend_histogram));
+    hist->min = UINT64_MAX;
+}
+
+void backend_histogram_add(struct backend_histogram *hist, uint64_t value)
+{
+    ++hist->buckets[backend_histogram_bucket(value)];
+    ++hist->count;
+    hist->sum += value;
+
+    if (value < hist->min)
+        hist->min = value;
+
+    if (value > hist->max)
+        hist->max = value;
+}
+
+uint64_t backend_histogram_percentile(const struct backend_histogram *hist,
+        double pct)
+{
+    uint64_t target, seen = 0, value;
+    uint32_t i;
+
+    if (!hist->count)
+        return 0;
+
+    target = (uint64_t) ((pct / 100.0) * hist->count);
+
+    if (target < 1)
+        target = 1;
+
+    for (i = 0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+        seen += hist->buckets[i];
+
+        if (seen >= target)
+            break;
+    }
+
+    value = backend_histogram_bucket_max(i);
+
+    return value > hist->max ? hist->max : value;
+}
+
+void backend_histogram_print(FILE *out, const char *name,
+        const struct backend_histogram *hist, uint64_t div, const char *unit)
+{
+    if (!hist->count) {
+        fprintf(out, "%s: no samples\n", name);
+        return;
+    }
+
+    fprintf(out, "%s: n %llu, min %.1f%s, mean %.1f%s, p50 %.1f%s, "
+            "p90 %.1f%s, p99 %.1f%s, p99.9 %.1f%s, max %.1f%s\n", name,
+            (unsigned long long) hist->count,
+            (double) hist->min / div, unit,
+            ((double) hist->sum / hist->count) / div, unit,
+            (double) backend_histogram_percentile(hist, 50) / div, unit,
+            (double) backend_histogram_percentile(hist, 90) / div, unit,
+            (double) backend_histogram_percentile(hist, 99) / div, unit,
+            (double) backend_histogram_percentile(hist, 99.9) / div, unit,
+            (double) hist->max / div, unit);
+}
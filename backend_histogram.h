@@ -0,0 +1,55 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef BACKEND_HISTOGRAM_H
+#define BACKEND_HISTOGRAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+//Log-linear histogram of 64 bit values (typically ns). Every power of two is
+//split into 2^HISTOGRAM_SUB_BITS buckets, so the relative error of a
+//percentile is at most 12.5%. Values below 2^HISTOGRAM_SUB_BITS have their own
+//bucket
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_NUM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * \
+        HISTOGRAM_SUB_BUCKETS)
+
+struct backend_histogram{
+    uint64_t buckets[HISTOGRAM_NUM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+};
+
+void backend_histogram_reset(struct backend_histogram *hist);
+
+void backend_histogram_add(struct backend_histogram *hist, uint64_t value);
+
+//Get the value at percentile pct (0 - 100). The upper bound of the bucket
+//containing the percentile is returned, capped by the maximum value seen
+uint64_t backend_histogram_percentile(const struct backend_histogram *hist,
+        double pct);
+
+//Write one line with count, mean and percentiles of hist. Values are divided by
+//div before being printed (e.g., 1000 to print ns as us) and unit appended
+void backend_histogram_print(FILE *out, const char *name,
+        const struct backend_histogram *hist, uint64_t div, const char *unit);
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backend_pool.h"
+
+//Objects must be large enough to hold the free list pointer, and are aligned
+//like the slab header so that any object type can be stored
+static size_t backend_pool_obj_size(size_t obj_size)
+{
+    size_t align = sizeof(void*) > sizeof(uint64_t) ? sizeof(void*) :
+        sizeof(uint64_t);
+
+    if (obj_size < sizeof(void*))
+        obj_size = sizeof(void*);
+
+    return (obj_size + align - 1) & ~(align - 1);
+}
+
+static int32_t backend_pool_add_slab(struct backend_pool *pool)
+{
+    struct backend_pool_slab *slab;
+    uint8_t *obj;
+    uint32_t i;
+    size_t slab_hdr = backend_pool_obj_size(sizeof(struct backend_pool_slab));
+
+    if (pool->max_slabs && pool->num_slabs == pool->max_slabs)
+        return -1;
+
+    slab = malloc(slab_hdr + (pool->obj_size * pool->objs_per_slab));
+
+    if (!slab)
+        return -1;
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    ++pool->num_slabs;
+
+    //Link all objects in the new slab into the free list
+    obj = ((uint8_t*) slab) + slab_hdr;
+
+    for (i = 0; i < pool->objs_per_slab; i++) {
+        *((void**) obj) = pool->free_list;
+        pool->free_list = obj;
+        obj += pool->obj_size;
+    }
+
+    return 0;
+}
+
+int32_t backend_pool_init(struct backend_pool *pool, size_t obj_size,
+        uint32_t objs_per_slab, uint32_t max_slabs)
+{
+    memset(pool, 0, sizeof(struct backend_pool));
+
+    if (!objs_per_slab)
+        return -1;
+
+    pool->obj_size = backend_pool_obj_size(obj_size);
+    pool->objs_per_slab = objs_per_slab;
+    pool->max_slabs = max_slabs;
+
+    return backend_pool_add_slab(pool);
+}
+
+void backend_pool_deinit(struct backend_pool *pool)
+{
+    struct backend_pool_slab *slab = pool->slabs, *next_slab;
+
+    while (slab != NULL) {
+        next_slab = slab->next;
+        free(slab);
+        slab = next_slab;
+    }
+
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+    pool->num_slabs = 0;
+}
+
+void* backend_pool_alloc(struct backend_pool *pool)
+{
+    void *obj;
+
+    if (!pool->free_list && backend_pool_add_slab(pool))
+        return NULL;
+
+    obj = pool->free_list;
+    pool->free_list = *((void**) obj);
+    memset(obj, 0, pool->obj_size);
+
+    if (++pool->in_use > pool->high_water)
+        pool->high_water = pool->in_use;
+
+    return obj;
+}
+
+void backend_pool_free(struct backend_pool *pool, void *obj)
+{
+    *((void**) obj) = pool->free_list;
+    pool->free_list = obj;
+    --pool->in_use;
+}
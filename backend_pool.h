@@ -0,0 +1,60 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef BACKEND_POOL_H
+#define BACKEND_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Objects are carved out of slabs of objs_per_slab objects. Free objects are
+//kept in a free list (the first bytes of a free object is the next pointer),
+//so alloc and free never touch malloc as long as there are free objects. A new
+//slab is allocated when the pool is empty, unless max_slabs is reached (0 means
+//no limit). Slabs are only released when the pool is destroyed
+struct backend_pool_slab{
+    struct backend_pool_slab *next;
+};
+
+struct backend_pool{
+    struct backend_pool_slab *slabs;
+    void *free_list;
+    size_t obj_size;
+    uint32_t objs_per_slab;
+    uint32_t max_slabs;
+    uint32_t num_slabs;
+    //Number of objects currently allocated and the highest number of objects
+    //allocated at the same time
+    uint32_t in_use;
+    uint32_t high_water;
+};
+
+//Initialize a pool in place and allocate the first slab. Returns 0 on success
+//and -1 on failure
+int32_t backend_pool_init(struct backend_pool *pool, size_t obj_size,
+        uint32_t objs_per_slab, uint32_t max_slabs);
+
+//Release all slabs owned by the pool. All objects must have been returned
+void backend_pool_deinit(struct backend_pool *pool);
+
+//Get a zeroed object from pool, or NULL if the pool is exhausted
+void* backend_pool_alloc(struct backend_pool *pool);
+
+//Return an object to the pool it was allocated from
+void backend_pool_free(struct backend_pool *pool, void *obj);
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stddef.h>
+
+#include "backend_task_queue.h"
+
+void backend_task_queue_init(struct backend_task_queue *queue)
+{
+    atomic_init(&(queue->stub.next), NULL);
+    atomic_init(&(queue->head), &(queue->stub));
+    queue->tail = &(queue->stub);
+}
+
+void backend_task_queue_push(struct backend_task_queue *queue,
+        struct backend_task *task)
+{
+    struct backend_task *prev;
+
+    atomic_store_explicit(&(task->next), NULL, memory_order_relaxed);
+
+    //The task is the new head as soon as the exchange is done, but it is not
+    //reachable by the consumer before prev has been linked to it
+    prev = atomic_exchange_explicit(&(queue->head), task, memory_order_acq_rel);
+    atomic_store_explicit(&(prev->next), task, memory_order_release);
+}
+
+struct backend_task* backend_task_queue_pop(struct backend_task_queue *queue)
+{
+    struct backend_task *tail = queue->tail;
+    struct backend_task *next = atomic_load_explicit(&(tail->next),
+            memory_order_acquire);
+
+    //Skip the stub
+    if (tail == &(queue->stub)) {
+        if (!next)
+            return NULL;
+
+        queue->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&(tail->next), memory_order_acquire);
+    }
+
+    if (next) {
+        queue->tail = next;
+        return tail;
+    }
+
+    //tail is not the last task, but a producer has not linked the next one yet
+    if (tail != atomic_load_explicit(&(queue->head), memory_order_acquire))
+        return NULL;
+
+    //tail is the last task. Re-insert the stub behind it, so that we can return
+    //tail without leaving the queue empty
+    backend_task_queue_push(queue, &(queue->stub));
+    next = atomic_load_explicit(&(tail->next), memory_order_acquire);
+
+    if (next) {
+        queue->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
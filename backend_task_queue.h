@@ -0,0 +1,59 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef BACKEND_TASK_QUEUE_H
+#define BACKEND_TASK_QUEUE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+typedef void(*backend_task_cb)(void *ptr);
+
+//A task is a callback posted to the event loop from another thread. Tasks are
+//linked directly into the queue, so pushing a task never allocates. allocated
+//is set for tasks allocated by backend_event_loop_post(), they are freed by the
+//loop after cb has been run
+struct backend_task{
+    _Atomic(struct backend_task*) next;
+    backend_task_cb cb;
+    void *data;
+    uint8_t allocated;
+};
+
+//Intrusive multi-producer/single-consumer queue (Vyukov). Any number of
+//threads can push concurrently, only one thread (the one running the loop) can
+//pop. Push is wait-free (one exchange), pop is lock-free. stub is a dummy task
+//that is kept in the queue so that it is never empty
+struct backend_task_queue{
+    _Atomic(struct backend_task*) head;
+    struct backend_task *tail;
+    struct backend_task stub;
+};
+
+//Initialize an empty queue in place
+void backend_task_queue_init(struct backend_task_queue *queue);
+
+//Push task to the queue. Thread-safe
+void backend_task_queue_push(struct backend_task_queue *queue,
+        struct backend_task *task);
+
+//Pop the oldest task from the queue. Returns NULL if the queue is empty, or if
+//the next task is in the middle of being pushed by another thread. Must only be
+//called by the consumer
+struct backend_task* backend_task_queue_pop(struct backend_task_queue *queue);
+
+#endif
@@ -0,0 +1,387 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "backend_uring.h"
+
+//user_data of requests whose completion we are not interested in. Polls use
+//the fd in the lower 32 bit and the generation of the registration in the
+//upper 32 bit, so a stale completion (fd removed or modified) is detected
+#define BACKEND_URING_IGNORE UINT64_MAX
+
+//Events that can be passed on to a poll request. Poll requests are oneshot
+//and re-armed, which is level-triggered, so EPOLLET is not supported (the
+//logger rejects -e together with -u)
+#define BACKEND_URING_POLL_MASK (EPOLLIN | EPOLLOUT | EPOLLPRI | EPOLLERR | \
+        EPOLLHUP | EPOLLRDHUP)
+
+static int backend_uring_enter(int32_t ring_fd, uint32_t to_submit,
+        uint32_t min_complete, uint32_t flags)
+{
+    return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+            flags, NULL, 0);
+}
+
+static inline uint64_t backend_uring_poll_data(uint32_t fd, uint32_t gen)
+{
+    return (((uint64_t) gen) << 32) | fd;
+}
+
+//Make queued entries visible to the kernel and submit them
+static int backend_uring_submit(struct backend_uring *ur, uint32_t min_complete)
+{
+    int retval;
+
+    __atomic_store_n(ur->sq_tail, ur->sq_local_tail, __ATOMIC_RELEASE);
+
+    if (!ur->to_submit && !min_complete)
+        return 0;
+
+    retval = backend_uring_enter(ur->ring_fd, ur->to_submit, min_complete,
+            min_complete ? IORING_ENTER_GETEVENTS : 0);
+
+    if (retval >= 0)
+        ur->to_submit -= ((uint32_t) retval > ur->to_submit ? ur->to_submit :
+                (uint32_t) retval);
+
+    return retval;
+}
+
+static struct io_uring_sqe* backend_uring_get_sqe(struct backend_uring *ur)
+{
+    struct io_uring_sqe *sqe;
+    uint32_t idx;
+
+    //Submission queue is full, so we have to flush it first
+    if (ur->sq_local_tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) ==
+            ur->sq_entries) {
+        if (backend_uring_submit(ur, 0) < 0)
+            return NULL;
+    }
+
+    idx = ur->sq_local_tail & *ur->sq_mask;
+    sqe = &(ur->sqes[idx]);
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ur->sq_array[idx] = idx;
+    ++ur->sq_local_tail;
+    ++ur->to_submit;
+
+    return sqe;
+}
+
+static int32_t backend_uring_queue_pending(struct backend_uring *ur, int32_t fd)
+{
+    int32_t *pending;
+
+    if (ur->regs[fd].pending)
+        return 0;
+
+    if (ur->num_pending == ur->pending_size) {
+        pending = realloc(ur->pending, sizeof(int32_t) *
+                (ur->pending_size ? ur->pending_size * 2 : 16));
+
+        if (!pending)
+            return -1;
+
+        ur->pending = pending;
+        ur->pending_size = ur->pending_size ? ur->pending_size * 2 : 16;
+    }
+
+    ur->pending[ur->num_pending++] = fd;
+    ur->regs[fd].pending = 1;
+
+    return 0;
+}
+
+static int32_t backend_uring_remove_poll(struct backend_uring *ur, int32_t fd)
+{
+    struct backend_uring_reg *reg = &(ur->regs[fd]);
+    struct io_uring_sqe *sqe;
+
+    if (!reg->armed)
+        return 0;
+
+    sqe = backend_uring_get_sqe(ur);
+
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = backend_uring_poll_data(fd, reg->gen);
+    sqe->user_data = BACKEND_URING_IGNORE;
+    reg->armed = 0;
+
+    return 0;
+}
+
+int32_t backend_uring_init(struct backend_uring *ur)
+{
+    struct io_uring_params params;
+
+    memset(ur, 0, sizeof(struct backend_uring));
+    memset(&params, 0, sizeof(params));
+
+    ur->ring_fd = (int32_t) syscall(__NR_io_uring_setup, BACKEND_URING_ENTRIES,
+            &params);
+
+    if (ur->ring_fd < 0)
+        return -1;
+
+    //We need the single mmap layout (5.4) and the kernel to buffer
+    //completions instead of dropping them when the CQ ring is full (5.5)
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_NODROP)) {
+        close(ur->ring_fd);
+        return -1;
+    }
+
+    //Both rings are part of the same mapping
+    ur->ring_size = params.sq_off.array +
+        (params.sq_entries * sizeof(uint32_t));
+
+    if (params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe)) >
+            ur->ring_size)
+        ur->ring_size = params.cq_off.cqes +
+            (params.cq_entries * sizeof(struct io_uring_cqe));
+
+    ur->ring = mmap(NULL, ur->ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQ_RING);
+
+    if (ur->ring == MAP_FAILED) {
+        close(ur->ring_fd);
+        return -1;
+    }
+
+    ur->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ur->sqes = mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQES);
+
+    if (ur->sqes == MAP_FAILED) {
+        munmap(ur->ring, ur->ring_size);
+        close(ur->ring_fd);
+        return -1;
+    }
+
+    ur->sq_head = (uint32_t*) ((uint8_t*) ur->ring + params.sq_off.head);
+    ur->sq_tail = (uint32_t*) ((uint8_t*) ur->ring + params.sq_off.tail);
+    ur->sq_mask = (uint32_t*) ((uint8_t*) ur->ring +
+            params.sq_off.ring_mask);
+    ur->sq_array = (uint32_t*) ((uint8_t*) ur->ring + params.sq_off.array);
+    ur->sq_entries = params.sq_entries;
+    ur->sq_local_tail = *ur->sq_tail;
+
+    ur->cq_head = (uint32_t*) ((uint8_t*) ur->ring + params.cq_off.head);
+    ur->cq_tail = (uint32_t*) ((uint8_t*) ur->ring + params.cq_off.tail);
+    ur->cq_mask = (uint32_t*) ((uint8_t*) ur->ring +
+            params.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe*) ((uint8_t*) ur->ring +
+            params.cq_off.cqes);
+
+    return 0;
+}
+
+void backend_uring_deinit(struct backend_uring *ur)
+{
+    munmap(ur->sqes, ur->sqes_size);
+    munmap(ur->ring, ur->ring_size);
+    close(ur->ring_fd);
+    free(ur->regs);
+    free(ur->pending);
+}
+
+int32_t backend_uring_update(struct backend_uring *ur, uint32_t events,
+        int32_t op, int32_t fd, void *ptr)
+{
+    struct backend_uring_reg *regs, *reg;
+    uint32_t regs_size;
+
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if ((uint32_t) fd >= ur->regs_size) {
+        if (op != EPOLL_CTL_ADD) {
+            errno = ENOENT;
+            return -1;
+        }
+
+        regs_size = ur->regs_size ? ur->regs_size : 64;
+
+        while (regs_size <= (uint32_t) fd)
+            regs_size *= 2;
+
+        regs = realloc(ur->regs, sizeof(struct backend_uring_reg) * regs_size);
+
+        if (!regs)
+            return -1;
+
+        memset(regs + ur->regs_size, 0, sizeof(struct backend_uring_reg) *
+                (regs_size - ur->regs_size));
+        ur->regs = regs;
+        ur->regs_size = regs_size;
+    }
+
+    reg = &(ur->regs[fd]);
+
+    if (op == EPOLL_CTL_ADD && reg->active) {
+        errno = EEXIST;
+        return -1;
+    } else if (op != EPOLL_CTL_ADD && !reg->active) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    //Any request in flight belongs to the old registration. Bumping the
+    //generation makes sure that its completion is ignored
+    if (op != EPOLL_CTL_ADD && backend_uring_remove_poll(ur, fd))
+        return -1;
+
+    ++reg->gen;
+
+    if (op == EPOLL_CTL_DEL) {
+        reg->active = 0;
+        return 0;
+    }
+
+    reg->ptr = ptr;
+    reg->events = events & BACKEND_URING_POLL_MASK;
+    reg->active = 1;
+
+    return backend_uring_queue_pending(ur, fd);
+}
+
+//Queue a poll request for every fd that has been added or has completed since
+//the last wait
+static void backend_uring_arm(struct backend_uring *ur)
+{
+    struct backend_uring_reg *reg;
+    struct io_uring_sqe *sqe;
+    uint32_t i;
+    int32_t fd;
+
+    for (i = 0; i < ur->num_pending; i++) {
+        fd = ur->pending[i];
+        reg = &(ur->regs[fd]);
+        reg->pending = 0;
+
+        if (!reg->active || reg->armed)
+            continue;
+
+        sqe = backend_uring_get_sqe(ur);
+
+        //Try again on the next wait
+        if (!sqe) {
+            memmove(ur->pending, ur->pending + i,
+                    sizeof(int32_t) * (ur->num_pending - i));
+            ur->num_pending -= i;
+            reg->pending = 1;
+            return;
+        }
+
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = reg->events;
+        sqe->user_data = backend_uring_poll_data(fd, reg->gen);
+        reg->armed = 1;
+    }
+
+    ur->num_pending = 0;
+}
+
+int backend_uring_wait(struct backend_uring *ur, struct epoll_event *events,
+        int maxevents, int timeout)
+{
+    struct backend_uring_reg *reg;
+    struct io_uring_sqe *sqe = NULL;
+    struct io_uring_cqe *cqe;
+    uint32_t head, tail, fd, gen, min_complete = timeout ? 1 : 0;
+    int nevents = 0;
+
+    backend_uring_arm(ur);
+
+    //The timeout request completes either when it expires or when one other
+    //request has completed, so it never outlives the wait by much. If it can
+    //not be queued (the submission queue is full and could not be flushed), we
+    //must not block without it, as the next timer of the loop would be missed.
+    //The wait is then non-blocking and the loop calls us again
+    if (timeout > 0 && !(sqe = backend_uring_get_sqe(ur)))
+        min_complete = 0;
+
+    if (timeout > 0 && sqe) {
+        ur->ts.tv_sec = timeout / 1000;
+        ur->ts.tv_nsec = (timeout % 1000) * 1000000;
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = (uint64_t) (uintptr_t) &(ur->ts);
+        sqe->len = 1;
+        sqe->off = 1;
+        sqe->user_data = BACKEND_URING_IGNORE;
+    }
+
+    if (backend_uring_submit(ur, min_complete) < 0 && errno != EINTR &&
+            errno != EBUSY && errno != EAGAIN)
+        return -1;
+
+    head = *ur->cq_head;
+    tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail && nevents < maxevents) {
+        cqe = &(ur->cqes[head & *ur->cq_mask]);
+        head++;
+
+        if (cqe->user_data == BACKEND_URING_IGNORE)
+            continue;
+
+        fd = (uint32_t) cqe->user_data;
+        gen = (uint32_t) (cqe->user_data >> 32);
+
+        if (fd >= ur->regs_size)
+            continue;
+
+        reg = &(ur->regs[fd]);
+
+        if (!reg->active || reg->gen != gen)
+            continue;
+
+        reg->armed = 0;
+
+        //Something is wrong with the fd, report it like epoll and do not
+        //re-arm, as the request would fail again
+        if (cqe->res < 0) {
+            events[nevents].events = EPOLLERR;
+            events[nevents++].data.ptr = reg->ptr;
+            continue;
+        }
+
+        events[nevents].events = (uint32_t) cqe->res;
+        events[nevents++].data.ptr = reg->ptr;
+        backend_uring_queue_pending(ur, fd);
+    }
+
+    __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+
+    return nevents;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef BACKEND_URING_H
+#define BACKEND_URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <linux/io_uring.h>
+
+//Number of entries in the submission queue. The completion queue is twice as
+//large
+#define BACKEND_URING_ENTRIES 256
+
+//io_uring implementation of the file descriptor part of backend_event_loop.
+//Every registered fd has a oneshot poll request in flight, which is re-armed
+//before the next wait after it has completed. This gives the same
+//(level-triggered) semantics as epoll. All poll, poll remove and timeout
+//requests queued since the last wait are submitted with a single
+//io_uring_enter(), which also waits for the first completion, and completions
+//are reaped from the shared ring without any system call
+struct backend_uring_reg{
+    void *ptr;
+    uint32_t events;
+    uint32_t gen;
+    uint8_t active;
+    uint8_t armed;
+    uint8_t pending;
+};
+
+struct backend_uring{
+    int32_t ring_fd;
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t *sq_mask;
+    uint32_t *sq_array;
+    uint32_t sq_entries;
+    uint32_t sq_local_tail;
+    uint32_t to_submit;
+    struct io_uring_sqe *sqes;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring;
+    size_t ring_size;
+    size_t sqes_size;
+    //Registrations indexed by fd, and fds waiting to be (re-)armed
+    struct backend_uring_reg *regs;
+    uint32_t regs_size;
+    int32_t *pending;
+    uint32_t num_pending;
+    uint32_t pending_size;
+    struct __kernel_timespec ts;
+};
+
+//Create the ring. Returns 0 on success and -1 if io_uring is not available
+int32_t backend_uring_init(struct backend_uring *ur);
+
+void backend_uring_deinit(struct backend_uring *ur);
+
+//Same semantics as epoll_ctl(), data.ptr is the only supported epoll_data
+int32_t backend_uring_update(struct backend_uring *ur, uint32_t events,
+        int32_t op, int32_t fd, void *ptr);
+
+//Same semantics as epoll_wait()
+int backend_uring_wait(struct backend_uring *ur, struct epoll_event *events,
+        int maxevents, int timeout);
+
+#endif
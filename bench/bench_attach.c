@@ -0,0 +1,250 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <libusb-1.0/libusb.h>
+
+#include "portpilot_bench.h"
+#include "portpilot_logger.h"
+#include "portpilot_helpers.h"
+#include "portpilot_dev_cache.h"
+#include "backend_event_loop.h"
+
+//Attach devices that fail to attach, with the libusb events lock held like in
+//portpilot_run_shard(). Once with an interface that can not be claimed
+//(LIBUSB_ERROR_BUSY), once with a desired serial number (-d) that devices
+//without a serial number do not match. Both failures happen in the attach
+//timeout, outside of libusb event handling. The busy interface is also tried
+//with a cache entry with another serial number for every device, which must be
+//replaced by the (empty) serial number read from the device. The libusb device
+//calls below replace the ones in the library (the definitions in the executable
+//take precedence), so no device has to be connected. Like the real one, the
+//fake libusb_close() needs the events lock outside of event handling, a close
+//with the lock held would deadlock. Fails if a device is not closed, if a close
+//would have deadlocked or if a stale serial number is kept
+#define BENCH_ATTACH_NUM_DEVS 8
+#define BENCH_ATTACH_TIMEOUT 1000
+
+static struct {
+    uint8_t locked;
+    uint32_t num_close;
+    uint32_t num_deadlocks;
+} bench_attach_usb;
+
+static uint8_t bench_attach_devs[BENCH_ATTACH_NUM_DEVS];
+
+void libusb_lock_events(libusb_context *ctx)
+{
+    if (bench_attach_usb.locked)
+        ++bench_attach_usb.num_deadlocks;
+
+    bench_attach_usb.locked = 1;
+}
+
+void libusb_unlock_events(libusb_context *ctx)
+{
+    bench_attach_usb.locked = 0;
+}
+
+libusb_device* libusb_ref_device(libusb_device *dev)
+{
+    return dev;
+}
+
+void libusb_unref_device(libusb_device *dev)
+{
+}
+
+int libusb_get_device_descriptor(libusb_device *dev,
+        struct libusb_device_descriptor *desc)
+{
+    memset(desc, 0, sizeof(*desc));
+    desc->idVendor = PORTPILOT_VID;
+    desc->idProduct = PORTPILOT_PID;
+
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_open(libusb_device *dev, libusb_device_handle **dev_handle)
+{
+    *dev_handle = (libusb_device_handle*) dev;
+    return LIBUSB_SUCCESS;
+}
+
+//The events are never handled by the benchmark, so every close is outside of
+//event handling
+void libusb_close(libusb_device_handle *dev_handle)
+{
+    if (bench_attach_usb.locked)
+        ++bench_attach_usb.num_deadlocks;
+
+    ++bench_attach_usb.num_close;
+}
+
+int libusb_kernel_driver_active(libusb_device_handle *dev_handle,
+        int interface_number)
+{
+    return 0;
+}
+
+int libusb_claim_interface(libusb_device_handle *dev_handle,
+        int interface_number)
+{
+    return LIBUSB_ERROR_BUSY;
+}
+
+int libusb_release_interface(libusb_device_handle *dev_handle,
+        int interface_number)
+{
+    return LIBUSB_SUCCESS;
+}
+
+//Stop once every device has been freed
+static void bench_attach_check_cb(void *ptr)
+{
+    struct portpilot_ctx *pp_ctx = ptr;
+
+    if (!pp_ctx->dev_list_len)
+        backend_event_loop_stop(pp_ctx->event_loop);
+}
+
+static void bench_attach_stop_cb(void *ptr)
+{
+    backend_event_loop_stop(ptr);
+}
+
+static void bench_attach_run(const char *name, const char *desired_serial,
+        const char *stale_serial)
+{
+    struct portpilot_shards shards = {0};
+    struct portpilot_ctx *pp_ctx = calloc(sizeof(struct portpilot_ctx), 1);
+    struct portpilot_dev_info info = {{0}};
+    struct backend_timeout_handle *check_handle, *stop_handle;
+    struct libusb_device_descriptor desc;
+    uint32_t i, num_replaced = 0;
+    uint8_t path[2];
+
+    if (!pp_ctx || !portpilot_dev_index_init(&(pp_ctx->dev_index))) {
+        fprintf(stderr, "Failed to allocate context\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&bench_attach_usb, 0, sizeof(bench_attach_usb));
+    shards.num_shards = 1;
+    shards.dev_cache = portpilot_dev_cache_create(NULL);
+    pp_ctx->shards = &shards;
+    pp_ctx->queue_depth = 1;
+    pp_ctx->desired_serial = desired_serial;
+    pp_ctx->event_loop = backend_event_loop_create();
+    //Never dereferenced, the fakes above do not use the context
+    pp_ctx->usb_ctx = (libusb_context*) &bench_attach_usb;
+    LIST_INIT(&(pp_ctx->dev_head));
+    backend_histogram_reset(&(pp_ctx->attach_latency));
+
+    if (!shards.dev_cache || !pp_ctx->event_loop) {
+        fprintf(stderr, "Failed to create context\n");
+        exit(EXIT_FAILURE);
+    }
+
+    info.max_packet_size = 64;
+    info.input_endpoint = 0x81;
+    libusb_get_device_descriptor(NULL, &desc);
+
+    if (stale_serial)
+        snprintf((char*) info.serial_number, sizeof(info.serial_number), "%s",
+                stale_serial);
+
+    for (i = 0; i < BENCH_ATTACH_NUM_DEVS; i++) {
+        path[0] = 1;
+        path[1] = i + 1;
+
+        if (stale_serial)
+            portpilot_dev_cache_insert(shards.dev_cache, path, sizeof(path),
+                    &desc, &info);
+
+        if (!portpilot_helpers_create_dev(
+                    (libusb_device*) &(bench_attach_devs[i]), pp_ctx, &info,
+                    stale_serial != NULL, path, sizeof(path))) {
+            fprintf(stderr, "Failed to create device\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    check_handle = backend_event_loop_add_timeout(pp_ctx->event_loop,
+            backend_event_loop_now() + 1, bench_attach_check_cb, pp_ctx, 1);
+    stop_handle = backend_event_loop_add_timeout(pp_ctx->event_loop,
+            backend_event_loop_now() + BENCH_ATTACH_TIMEOUT,
+            bench_attach_stop_cb, pp_ctx->event_loop, 0);
+
+    if (!check_handle || !stop_handle) {
+        fprintf(stderr, "Failed to add timeouts\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //A deadlock in libusb_close() would hang here, the fake one counts it
+    //instead. Devices that are not freed in time are reported as not closed
+    portpilot_helpers_lock_usb_events(pp_ctx);
+    backend_event_loop_run(pp_ctx->event_loop);
+    portpilot_helpers_unlock_usb_events(pp_ctx);
+
+    portpilot_bench_note(name, "%u of %u devices closed, %u closes would "
+            "deadlock", bench_attach_usb.num_close, BENCH_ATTACH_NUM_DEVS,
+            bench_attach_usb.num_deadlocks);
+
+    if (bench_attach_usb.num_close != BENCH_ATTACH_NUM_DEVS ||
+        bench_attach_usb.num_deadlocks) {
+        fprintf(stderr, "Failed attach was not cleaned up correctly\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; stale_serial && i < BENCH_ATTACH_NUM_DEVS; i++) {
+        path[0] = 1;
+        path[1] = i + 1;
+
+        if (portpilot_dev_cache_lookup(shards.dev_cache, path, sizeof(path),
+                    &desc, &info) && !info.serial_number[0])
+            ++num_replaced;
+    }
+
+    if (stale_serial) {
+        portpilot_bench_note(name, "%u of %u stale serial numbers replaced",
+                num_replaced, BENCH_ATTACH_NUM_DEVS);
+
+        if (num_replaced != BENCH_ATTACH_NUM_DEVS) {
+            fprintf(stderr, "Stale serial number was kept\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    backend_event_loop_free_timeout(pp_ctx->event_loop, check_handle);
+    backend_event_loop_free_timeout(pp_ctx->event_loop, stop_handle);
+    backend_event_loop_free(pp_ctx->event_loop);
+    portpilot_dev_cache_free(shards.dev_cache);
+    portpilot_dev_index_deinit(&(pp_ctx->dev_index));
+    free(pp_ctx);
+}
+
+void portpilot_bench_attach()
+{
+    bench_attach_run("attach/claim-busy", NULL, NULL);
+    bench_attach_run("attach/serial-mismatch", "BENCH", NULL);
+    bench_attach_run("attach/stale-cache", NULL, "STALE");
+}
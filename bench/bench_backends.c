@@ -0,0 +1,148 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "portpilot_bench.h"
+#include "backend_event_loop.h"
+
+//Every iteration of the loop makes BENCH_BACKENDS_ACTIVE of the registered
+//eventfds readable, and the callbacks drain them. The number of registered fds
+//grows, while the number of active fds per iteration is constant, which is
+//what we see with many mostly idle libusb fds
+#define BENCH_BACKENDS_ACTIVE 16
+#define BENCH_BACKENDS_RUN_MS 500
+
+static const uint32_t bench_backends_counts[] = {16, 128, 512};
+
+#define NUM_BENCH_BACKENDS_COUNTS (sizeof(bench_backends_counts) / \
+        sizeof(bench_backends_counts[0]))
+
+struct bench_backends_ctx {
+    struct backend_event_loop *del;
+    struct backend_epoll_handle **handles;
+    uint64_t num_events;
+    uint32_t num_fds;
+    uint32_t next_fd;
+};
+
+static void bench_backends_event_cb(void *ptr, int32_t fd, uint32_t events)
+{
+    struct bench_backends_ctx *ctx = ptr;
+    uint64_t val;
+
+    if (read(fd, &val, sizeof(val)) > 0)
+        ++ctx->num_events;
+}
+
+static void bench_backends_itr_cb(void *ptr)
+{
+    struct bench_backends_ctx *ctx = ptr;
+    uint64_t val = 1;
+    uint32_t i;
+
+    for (i = 0; i < BENCH_BACKENDS_ACTIVE; i++) {
+        if (write(ctx->handles[ctx->next_fd]->fd, &val, sizeof(val)) < 0)
+            return;
+
+        //Step with a prime to spread activity over all fds
+        ctx->next_fd = (ctx->next_fd + 7919) % ctx->num_fds;
+    }
+}
+
+static void bench_backends_stop_cb(void *ptr)
+{
+    backend_event_loop_stop(ptr);
+}
+
+static void bench_backends_measure(const char *type_name, uint8_t type,
+        uint32_t num_fds)
+{
+    struct bench_backends_ctx ctx = {0};
+    struct backend_timeout_handle *stop_handle;
+    uint64_t start;
+    uint32_t i;
+    char name[64];
+
+    ctx.del = backend_event_loop_create_type(type);
+
+    if (!ctx.del) {
+        fprintf(stderr, "Event loop type %s not supported\n", type_name);
+        return;
+    }
+
+    ctx.num_fds = num_fds;
+    ctx.handles = calloc(sizeof(struct backend_epoll_handle*), num_fds);
+
+    if (!ctx.handles) {
+        fprintf(stderr, "Failed to allocate handles\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_fds; i++) {
+        ctx.handles[i] = backend_event_loop_create_epoll_handle(ctx.del, &ctx,
+                eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+                bench_backends_event_cb, 0);
+
+        if (!ctx.handles[i] || ctx.handles[i]->fd == -1 ||
+            backend_event_loop_update(ctx.del, EPOLLIN, EPOLL_CTL_ADD,
+                ctx.handles[i]->fd, ctx.handles[i])) {
+            fprintf(stderr, "Failed to add eventfd\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    ctx.del->itr_cb = bench_backends_itr_cb;
+    ctx.del->itr_data = &ctx;
+    bench_backends_itr_cb(&ctx);
+
+    stop_handle = backend_event_loop_add_timeout(ctx.del,
+            backend_event_loop_now() + BENCH_BACKENDS_RUN_MS,
+            bench_backends_stop_cb, ctx.del, 0);
+
+    start = portpilot_bench_now_ns();
+    backend_event_loop_run(ctx.del);
+    snprintf(name, sizeof(name), "backends/%s/%u", type_name, num_fds);
+    portpilot_bench_report(name, ctx.num_events,
+            portpilot_bench_now_ns() - start);
+
+    for (i = 0; i < num_fds; i++) {
+        backend_event_loop_update(ctx.del, 0, EPOLL_CTL_DEL,
+                ctx.handles[i]->fd, NULL);
+        close(ctx.handles[i]->fd);
+    }
+
+    backend_event_loop_free_timeout(ctx.del, stop_handle);
+    backend_event_loop_free(ctx.del);
+    free(ctx.handles);
+}
+
+void portpilot_bench_backends()
+{
+    uint32_t i;
+
+    for (i = 0; i < NUM_BENCH_BACKENDS_COUNTS; i++) {
+        bench_backends_measure("epoll", BACKEND_TYPE_EPOLL,
+                bench_backends_counts[i]);
+        bench_backends_measure("io_uring", BACKEND_TYPE_IO_URING,
+                bench_backends_counts[i]);
+    }
+}
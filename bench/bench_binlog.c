@@ -0,0 +1,151 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "portpilot_bench.h"
+#include "portpilot_logger.h"
+#include "portpilot_binlog.h"
+#include "portpilot_binlog_reader.h"
+#include "portpilot_io.h"
+
+//Write BENCH_BINLOG_NUM_RECORDS records from BENCH_BINLOG_NUM_DEVS devices
+//(1000 packets per second each) to a binary log, then read it back: all of it,
+//and a one second slice from the middle, which should only touch the blocks of
+//that second
+#define BENCH_BINLOG_NUM_DEVS 100
+#define BENCH_BINLOG_NUM_RECORDS 2000000
+#define BENCH_BINLOG_SLICE_NS 1000000000ULL
+
+static void bench_binlog_count(void *ptr, const uint8_t *serial_number,
+        const struct portpilot_binlog_record *record)
+{
+    uint64_t *sum = ptr;
+
+    *sum += record->v_in;
+}
+
+static void bench_binlog_write(const char *path, struct portpilot_dev *devs)
+{
+    struct portpilot_binlog_writer *writer;
+    struct portpilot_binlog *binlog = NULL;
+    struct portpilot_data pp_data = {0};
+    struct portpilot_io_opts io_opts = {0};
+    struct portpilot_io *io;
+    uint64_t start;
+    uint32_t i;
+
+    io = portpilot_io_create(&io_opts);
+
+    if (!io || !(binlog = portpilot_binlog_create(path, io)) ||
+        !(writer = portpilot_binlog_writer_create(binlog))) {
+        fprintf(stderr, "Failed to create binary log\n");
+        exit(EXIT_FAILURE);
+    }
+
+    start = portpilot_bench_now_ns();
+
+    for (i = 0; i < BENCH_BINLOG_NUM_RECORDS; i++) {
+        pp_data.host_ns = (i / BENCH_BINLOG_NUM_DEVS) * 1000000ULL;
+        pp_data.tstamp = i / (BENCH_BINLOG_NUM_DEVS * 1000);
+        pp_data.v_in = 5000 + (i % 64);
+        pp_data.v_out = 4950 + (i % 64);
+        pp_data.current = i % 2000;
+        pp_data.num_readings = 1;
+
+        portpilot_binlog_write(writer, &devs[i % BENCH_BINLOG_NUM_DEVS],
+                &pp_data);
+    }
+
+    portpilot_binlog_writer_free(writer);
+
+    if (!portpilot_binlog_close(binlog)) {
+        fprintf(stderr, "Failed to write binary log\n");
+        exit(EXIT_FAILURE);
+    }
+
+    portpilot_io_stop(io);
+
+    portpilot_bench_report("binlog/write", BENCH_BINLOG_NUM_RECORDS,
+            portpilot_bench_now_ns() - start);
+}
+
+static void bench_binlog_read(const char *path, const char *name,
+        uint8_t slice)
+{
+    struct portpilot_binlog_map *map;
+    uint64_t start, sum = 0, from_ns = 0, to_ns = UINT64_MAX;
+    int64_t num_records;
+
+    start = portpilot_bench_now_ns();
+    map = portpilot_binlog_map_open(path);
+
+    if (!map) {
+        fprintf(stderr, "Failed to open binary log\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (slice) {
+        from_ns = map->index[map->num_entries / 2].first_ns;
+        to_ns = from_ns + BENCH_BINLOG_SLICE_NS - 1;
+    }
+
+    num_records = portpilot_binlog_map_foreach(map, from_ns, to_ns, NULL,
+            bench_binlog_count, &sum);
+    portpilot_binlog_map_close(map);
+
+    if (num_records <= 0) {
+        fprintf(stderr, "Failed to read binary log\n");
+        exit(EXIT_FAILURE);
+    }
+
+    portpilot_bench_report(name, num_records,
+            portpilot_bench_now_ns() - start);
+}
+
+void portpilot_bench_binlog()
+{
+    struct portpilot_dev *devs;
+    char path[] = "/tmp/portpilot-bench-XXXXXX";
+    int32_t fd;
+    uint32_t i;
+
+    devs = calloc(sizeof(struct portpilot_dev), BENCH_BINLOG_NUM_DEVS);
+    fd = mkstemp(path);
+
+    if (!devs || fd < 0) {
+        fprintf(stderr, "Failed to set up binary log benchmark\n");
+        exit(EXIT_FAILURE);
+    }
+
+    close(fd);
+
+    for (i = 0; i < BENCH_BINLOG_NUM_DEVS; i++)
+        snprintf((char*) devs[i].serial_number, MAX_USB_STR_LEN, "BENCH%06u",
+                i);
+
+    bench_binlog_write(path, devs);
+    bench_binlog_read(path, "binlog/read-all", 0);
+    bench_binlog_read(path, "binlog/read-slice", 1);
+
+    unlink(path);
+    free(devs);
+}
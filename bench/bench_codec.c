@@ -0,0 +1,152 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "portpilot_bench.h"
+#include "portpilot_logger.h"
+#include "portpilot_binlog.h"
+#include "portpilot_codec.h"
+#include "portpilot_sink.h"
+
+//Encode and decode BENCH_CODEC_NUM_SAMPLES samples from BENCH_CODEC_NUM_DEVS
+//devices sending 1000 packets per second each, with up to 50 us of jitter on
+//when a packet arrives. Voltages are noisy around 5V, the current ramps up
+//and down with some noise and total energy is monotonic, like the readings
+//of a real Portpilot. The encoded size is compared to CSV and to the binary
+//log (including block headers)
+#define BENCH_CODEC_NUM_DEVS 100
+#define BENCH_CODEC_NUM_SAMPLES 1000000
+
+struct bench_codec_sample {
+    uint8_t *serial_number;
+    struct portpilot_data pp_data;
+};
+
+static void bench_codec_fill(struct bench_codec_sample *samples,
+        uint8_t (*serials)[MAX_USB_STR_LEN + 1])
+{
+    struct portpilot_data *pp_data;
+    uint32_t seed = 1, i, dev, step, ramp;
+
+    for (i = 0; i < BENCH_CODEC_NUM_SAMPLES; i++) {
+        dev = i % BENCH_CODEC_NUM_DEVS;
+        step = i / BENCH_CODEC_NUM_DEVS;
+        ramp = step % 2000;
+
+        samples[i].serial_number = serials[dev];
+        pp_data = &(samples[i].pp_data);
+        pp_data->host_ns = (step * 1000000ULL) + (dev * 1000ULL) +
+            ((rand_r(&seed) % 50) * 1000ULL);
+        pp_data->tstamp = 1000 + (step / 1000);
+        pp_data->v_in = 5000 + (rand_r(&seed) % 8);
+        pp_data->v_out = pp_data->v_in - 40 - (rand_r(&seed) % 8);
+        pp_data->current = (ramp < 1000 ? ramp : 2000 - ramp) +
+            (rand_r(&seed) % 16);
+        pp_data->max_current = 1015;
+        pp_data->energy = (pp_data->v_out * pp_data->current) / 1000;
+        pp_data->total_energy = 3600 + (step / 720);
+        pp_data->num_readings = 1;
+    }
+}
+
+void portpilot_bench_codec()
+{
+    uint8_t (*serials)[MAX_USB_STR_LEN + 1];
+    struct bench_codec_sample *samples;
+    struct portpilot_codec codec;
+    struct portpilot_data pp_data;
+    const uint8_t *serial_number;
+    uint64_t start, len = 0, csv_len = 0, binlog_len, checksum = 0;
+    char line[SINK_MAX_LINE];
+    uint8_t *buf;
+    uint32_t i, consumed;
+
+    serials = calloc(BENCH_CODEC_NUM_DEVS, sizeof(serials[0]));
+    samples = calloc(BENCH_CODEC_NUM_SAMPLES, sizeof(samples[0]));
+    buf = malloc((uint64_t) BENCH_CODEC_NUM_SAMPLES * CODEC_MAX_LEN);
+
+    if (!serials || !samples || !buf) {
+        fprintf(stderr, "Failed to allocate memory for codec benchmark\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < BENCH_CODEC_NUM_DEVS; i++)
+        snprintf((char*) serials[i], MAX_USB_STR_LEN, "PP%08u", i);
+
+    bench_codec_fill(samples, serials);
+
+    if (!portpilot_codec_init(&codec)) {
+        fprintf(stderr, "Failed to initialize codec\n");
+        exit(EXIT_FAILURE);
+    }
+
+    start = portpilot_bench_now_ns();
+
+    for (i = 0; i < BENCH_CODEC_NUM_SAMPLES; i++)
+        len += portpilot_codec_encode(&codec, buf + len,
+                samples[i].serial_number, &(samples[i].pp_data));
+
+    portpilot_bench_report("codec/encode", BENCH_CODEC_NUM_SAMPLES,
+            portpilot_bench_now_ns() - start);
+    portpilot_codec_deinit(&codec);
+
+    portpilot_codec_init(&codec);
+    start = portpilot_bench_now_ns();
+
+    for (i = 0; i < len; i += consumed) {
+        consumed = portpilot_codec_decode(&codec, buf + i, len - i,
+                &serial_number, &pp_data);
+
+        if (!consumed) {
+            fprintf(stderr, "Failed to decode sample\n");
+            exit(EXIT_FAILURE);
+        }
+
+        checksum += pp_data.v_in + pp_data.current;
+    }
+
+    portpilot_bench_report("codec/decode", BENCH_CODEC_NUM_SAMPLES,
+            portpilot_bench_now_ns() - start);
+    portpilot_codec_deinit(&codec);
+
+    for (i = 0; i < BENCH_CODEC_NUM_SAMPLES; i++)
+        csv_len += portpilot_sink_format_csv(line, samples[i].serial_number,
+                &(samples[i].pp_data));
+
+    binlog_len = (BENCH_CODEC_NUM_SAMPLES *
+            sizeof(struct portpilot_binlog_record)) +
+        ((BENCH_CODEC_NUM_SAMPLES / BINLOG_BLOCK_RECORDS) *
+         sizeof(struct portpilot_binlog_block));
+
+    portpilot_bench_note("codec/size", "%.2f bytes/sample (CSV %.2f, %.1fx; "
+            "binary log %.2f, %.1fx)", (double) len / BENCH_CODEC_NUM_SAMPLES,
+            (double) csv_len / BENCH_CODEC_NUM_SAMPLES, (double) csv_len / len,
+            (double) binlog_len / BENCH_CODEC_NUM_SAMPLES,
+            (double) binlog_len / len);
+
+    //Keep the decoding from being optimized away
+    if (!checksum)
+        fprintf(stderr, "Unexpected checksum\n");
+
+    free(buf);
+    free(samples);
+    free(serials);
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libusb-1.0/libusb.h>
+
+#include "portpilot_bench.h"
+#include "portpilot_logger.h"
+#include "portpilot_decode.h"
+#include "portpilot_helpers.h"
+
+//Packets are stored back-to-back, like in a capture. The batch is decoded
+//BENCH_DECODE_ROUNDS times into one aggregate. Before measuring, every batch
+//decoder is checked against portpilot_decode_pkt(), also with the values where
+//abs() is the most likely to go wrong
+#define BENCH_DECODE_NUM_PKTS 4096
+#define BENCH_DECODE_ROUNDS 2000
+
+static const int16_t bench_decode_extremes[] = {INT16_MIN, INT16_MIN + 1, -1,
+    0, 1, INT16_MAX};
+
+#define NUM_BENCH_DECODE_EXTREMES (sizeof(bench_decode_extremes) / \
+        sizeof(bench_decode_extremes[0]))
+
+static uint8_t bench_decode_cmp(const struct portpilot_data *a,
+        const struct portpilot_data *b)
+{
+    return a->tstamp == b->tstamp && a->v_in == b->v_in &&
+        a->v_out == b->v_out && a->energy == b->energy &&
+        a->total_energy == b->total_energy && a->current == b->current &&
+        a->max_current == b->max_current &&
+        a->num_readings == b->num_readings;
+}
+
+static void bench_decode_verify(const uint8_t *pkts, uint32_t num_pkts)
+{
+    struct portpilot_data ref = {0}, res;
+    uint32_t i, len;
+    uint8_t type;
+
+    //Odd lengths exercise the scalar tail of the SIMD versions
+    for (len = num_pkts - 3; len <= num_pkts; len++) {
+        memset(&ref, 0, sizeof(ref));
+
+        for (i = 0; i < len; i++)
+            portpilot_decode_pkt(&ref, (const struct portpilot_pkt*)
+                    (pkts + (i * sizeof(struct portpilot_pkt))));
+
+        for (type = 0; type < PORTPILOT_DECODE_MAX; type++) {
+            memset(&res, 0, sizeof(res));
+
+            if (portpilot_decode_batch_type(type, &res, pkts,
+                        sizeof(struct portpilot_pkt), len))
+                continue;
+
+            if (!bench_decode_cmp(&ref, &res)) {
+                fprintf(stderr, "Batch decoder %s differs from scalar decode "
+                        "(%u packets)\n", portpilot_decode_type_name(type),
+                        len);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+}
+
+//What the read callback does with every packet when output is aggregated (-i)
+static void bench_decode_process(const uint8_t *pkts)
+{
+    struct portpilot_ctx *pp_ctx = calloc(sizeof(struct portpilot_ctx), 1);
+    struct portpilot_dev *pp_dev = calloc(sizeof(struct portpilot_dev), 1);
+    struct portpilot_data agg_data = {0};
+    uint64_t start;
+    uint32_t i, j;
+
+    if (!pp_ctx || !pp_dev) {
+        fprintf(stderr, "Failed to allocate device\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pp_ctx->output_interval = 1;
+    pp_dev->pp_ctx = pp_ctx;
+    pp_dev->agg_data = &agg_data;
+
+    start = portpilot_bench_now_ns();
+
+    for (j = 0; j < BENCH_DECODE_ROUNDS; j++) {
+        for (i = 0; i < BENCH_DECODE_NUM_PKTS; i++)
+            portpilot_helpers_process_pkt(pp_dev,
+                    pkts + (i * sizeof(struct portpilot_pkt)),
+                    sizeof(struct portpilot_pkt), i);
+    }
+
+    portpilot_bench_report("decode/process-pkt-agg",
+            (uint64_t) BENCH_DECODE_ROUNDS * BENCH_DECODE_NUM_PKTS,
+            portpilot_bench_now_ns() - start);
+
+    if (agg_data.num_readings == 1)
+        fprintf(stderr, "Unexpected number of readings\n");
+
+    free(pp_dev);
+    free(pp_ctx);
+}
+
+void portpilot_bench_decode()
+{
+    struct portpilot_data pp_data = {0};
+    struct portpilot_pkt *pp_pkt;
+    uint8_t *pkts;
+    uint64_t start;
+    uint32_t i, j;
+    uint8_t type;
+    char name[64];
+
+    pkts = malloc(sizeof(struct portpilot_pkt) * BENCH_DECODE_NUM_PKTS);
+
+    if (!pkts) {
+        fprintf(stderr, "Failed to allocate packets\n");
+        exit(EXIT_FAILURE);
+    }
+
+    portpilot_bench_fill_pkts(pkts, sizeof(struct portpilot_pkt),
+            BENCH_DECODE_NUM_PKTS);
+
+    for (i = 0; i < NUM_BENCH_DECODE_EXTREMES; i++) {
+        pp_pkt = (struct portpilot_pkt*) (pkts +
+                (i * 7 * sizeof(struct portpilot_pkt)));
+        pp_pkt->v_in = bench_decode_extremes[i];
+        pp_pkt->v_out = bench_decode_extremes[NUM_BENCH_DECODE_EXTREMES - 1 -
+            i];
+        pp_pkt->current = bench_decode_extremes[i];
+        pp_pkt->energy = bench_decode_extremes[i];
+    }
+
+    bench_decode_verify(pkts, BENCH_DECODE_NUM_PKTS);
+
+    start = portpilot_bench_now_ns();
+
+    for (j = 0; j < BENCH_DECODE_ROUNDS; j++) {
+        for (i = 0; i < BENCH_DECODE_NUM_PKTS; i++)
+            portpilot_decode_pkt(&pp_data, (const struct portpilot_pkt*)
+                    (pkts + (i * sizeof(struct portpilot_pkt))));
+    }
+
+    portpilot_bench_report("decode/pkt", (uint64_t) BENCH_DECODE_ROUNDS *
+            BENCH_DECODE_NUM_PKTS, portpilot_bench_now_ns() - start);
+
+    bench_decode_process(pkts);
+
+    for (type = 0; type < PORTPILOT_DECODE_MAX; type++) {
+        snprintf(name, sizeof(name), "decode/batch-%s",
+                portpilot_decode_type_name(type));
+        start = portpilot_bench_now_ns();
+
+        for (j = 0; j < BENCH_DECODE_ROUNDS; j++) {
+            if (portpilot_decode_batch_type(type, &pp_data, pkts,
+                        sizeof(struct portpilot_pkt), BENCH_DECODE_NUM_PKTS))
+                break;
+        }
+
+        if (j < BENCH_DECODE_ROUNDS) {
+            portpilot_bench_skip(name, "not supported by CPU");
+            continue;
+        }
+
+        portpilot_bench_report(name, (uint64_t) BENCH_DECODE_ROUNDS *
+                BENCH_DECODE_NUM_PKTS, portpilot_bench_now_ns() - start);
+    }
+
+    //Keep the compiler from throwing the results away
+    if (pp_data.num_readings == 1)
+        fprintf(stderr, "Unexpected number of readings\n");
+
+    free(pkts);
+}
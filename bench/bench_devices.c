@@ -0,0 +1,222 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include "portpilot_bench.h"
+#include "portpilot_logger.h"
+#include "portpilot_dev_cache.h"
+#include "portpilot_dev_index.h"
+#include "portpilot_helpers.h"
+
+//Attach, look up and detach BENCH_DEVICES_NUM simulated devices, like a large
+//hub farm. Attach is what the hotplug callback does when a device arrives,
+//except for talking to the device: look up the device cache (inserting the
+//device on a miss), allocate the device and add it to the device list and
+//index. The hashed lookups are compared to walking the device list, which is
+//how devices used to be found
+#define BENCH_DEVICES_NUM 5000
+#define BENCH_DEVICES_PATH_LEN 4
+
+LIST_HEAD(bench_dev_list, portpilot_dev);
+
+static void bench_devices_path(uint8_t *path, uint32_t idx)
+{
+    path[0] = (idx >> 12) + 1;
+    path[1] = ((idx >> 8) & 0xf) + 1;
+    path[2] = ((idx >> 4) & 0xf) + 1;
+    path[3] = (idx & 0xf) + 1;
+}
+
+static void bench_devices_serial(uint8_t *serial, uint32_t idx)
+{
+    snprintf((char*) serial, MAX_USB_STR_LEN, "BENCH%06u", idx);
+}
+
+static uint64_t bench_devices_attach(struct portpilot_dev_cache *cache,
+        struct portpilot_dev_index *index, struct bench_dev_list *dev_head,
+        struct portpilot_dev **devs)
+{
+    struct libusb_device_descriptor desc = {0};
+    struct portpilot_dev_info info;
+    struct portpilot_dev *pp_dev;
+    uint8_t path[USB_MAX_PATH];
+    uint64_t start = portpilot_bench_now_ns();
+    uint32_t i;
+
+    desc.idVendor = PORTPILOT_VID;
+    desc.idProduct = PORTPILOT_PID;
+
+    for (i = 0; i < BENCH_DEVICES_NUM; i++) {
+        bench_devices_path(path, i);
+
+        //What would have been read from the device on a miss
+        if (!portpilot_dev_cache_lookup(cache, path, BENCH_DEVICES_PATH_LEN,
+                    &desc, &info)) {
+            memset(&info, 0, sizeof(info));
+            bench_devices_serial(info.serial_number, i);
+            info.max_packet_size = 64;
+            info.input_endpoint = 0x81;
+            portpilot_dev_cache_insert(cache, path, BENCH_DEVICES_PATH_LEN,
+                    &desc, &info);
+        }
+
+        pp_dev = calloc(sizeof(struct portpilot_dev), 1);
+
+        if (!pp_dev) {
+            fprintf(stderr, "Failed to allocate device\n");
+            exit(EXIT_FAILURE);
+        }
+
+        memcpy(pp_dev->serial_number, info.serial_number,
+                sizeof(pp_dev->serial_number));
+        pp_dev->max_packet_size = info.max_packet_size;
+        pp_dev->input_endpoint = info.input_endpoint;
+        memcpy(pp_dev->path, path, BENCH_DEVICES_PATH_LEN);
+        pp_dev->path_len = BENCH_DEVICES_PATH_LEN;
+
+        LIST_INSERT_HEAD(dev_head, pp_dev, next_dev);
+        portpilot_dev_index_add(index, pp_dev);
+        devs[i] = pp_dev;
+    }
+
+    return portpilot_bench_now_ns() - start;
+}
+
+static uint64_t bench_devices_detach(struct portpilot_dev_index *index,
+        struct portpilot_dev **devs)
+{
+    uint64_t start = portpilot_bench_now_ns();
+    uint32_t i;
+
+    for (i = 0; i < BENCH_DEVICES_NUM; i++) {
+        LIST_REMOVE(devs[i], next_dev);
+        portpilot_dev_index_remove(index, devs[i]);
+        free(devs[i]);
+    }
+
+    return portpilot_bench_now_ns() - start;
+}
+
+static struct portpilot_dev* bench_devices_find_list(
+        const struct bench_dev_list *dev_head, const uint8_t *path,
+        uint8_t path_len)
+{
+    struct portpilot_dev *ppd_itr = dev_head->lh_first;
+
+    while (ppd_itr != NULL) {
+        if (ppd_itr->path_len == path_len &&
+            !memcmp(ppd_itr->path, path, path_len))
+            return ppd_itr;
+
+        ppd_itr = ppd_itr->next_dev.le_next;
+    }
+
+    return NULL;
+}
+
+void portpilot_bench_devices()
+{
+    struct portpilot_dev_cache *cache = portpilot_dev_cache_create(NULL);
+    struct portpilot_ctx *pp_ctx = calloc(sizeof(struct portpilot_ctx), 1);
+    struct bench_dev_list dev_head;
+    struct portpilot_dev **devs = calloc(sizeof(struct portpilot_dev*),
+            BENCH_DEVICES_NUM);
+    uint32_t *order = calloc(sizeof(uint32_t), BENCH_DEVICES_NUM);
+    uint8_t path[USB_MAX_PATH];
+    uint32_t i, j, tmp, seed = 1, found = 0;
+    uint64_t start, ns;
+
+    if (!cache || !devs || !order || !pp_ctx ||
+        !portpilot_dev_index_init(&(pp_ctx->dev_index))) {
+        fprintf(stderr, "Failed to allocate memory for devices benchmark\n");
+        exit(EXIT_FAILURE);
+    }
+
+    LIST_INIT(&dev_head);
+
+    //Devices are looked up in random order
+    for (i = 0; i < BENCH_DEVICES_NUM; i++)
+        order[i] = i;
+
+    for (i = BENCH_DEVICES_NUM - 1; i > 0; i--) {
+        j = rand_r(&seed) % (i + 1);
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    ns = bench_devices_attach(cache, &(pp_ctx->dev_index), &dev_head, devs);
+    portpilot_bench_report("devices/attach-cold", BENCH_DEVICES_NUM, ns);
+
+    start = portpilot_bench_now_ns();
+
+    for (i = 0; i < BENCH_DEVICES_NUM; i++) {
+        bench_devices_path(path, order[i]);
+        found += portpilot_dev_index_find_path(&(pp_ctx->dev_index), path,
+                BENCH_DEVICES_PATH_LEN) != NULL;
+    }
+
+    portpilot_bench_report("devices/find-path", BENCH_DEVICES_NUM,
+            portpilot_bench_now_ns() - start);
+
+    //What the hotplug callback does when a device leaves
+    start = portpilot_bench_now_ns();
+
+    for (i = 0; i < BENCH_DEVICES_NUM; i++) {
+        bench_devices_path(path, order[i]);
+        found += portpilot_helpers_find_dev(pp_ctx, path,
+                BENCH_DEVICES_PATH_LEN) != NULL;
+    }
+
+    portpilot_bench_report("devices/find-dev", BENCH_DEVICES_NUM,
+            portpilot_bench_now_ns() - start);
+
+    start = portpilot_bench_now_ns();
+
+    for (i = 0; i < BENCH_DEVICES_NUM; i++) {
+        bench_devices_path(path, order[i]);
+        found += bench_devices_find_list(&dev_head, path,
+                BENCH_DEVICES_PATH_LEN) != NULL;
+    }
+
+    portpilot_bench_report("devices/find-path-list", BENCH_DEVICES_NUM,
+            portpilot_bench_now_ns() - start);
+
+    if (found != BENCH_DEVICES_NUM * 3)
+        fprintf(stderr, "Only found %u of %u devices\n", found,
+                BENCH_DEVICES_NUM * 3);
+
+    ns = bench_devices_detach(&(pp_ctx->dev_index), devs);
+    portpilot_bench_report("devices/detach", BENCH_DEVICES_NUM, ns);
+
+    //All devices come back, for example after a hub has been power cycled
+    ns = bench_devices_attach(cache, &(pp_ctx->dev_index), &dev_head, devs);
+    portpilot_bench_report("devices/attach-cached", BENCH_DEVICES_NUM, ns);
+
+    bench_devices_detach(&(pp_ctx->dev_index), devs);
+
+    portpilot_dev_index_deinit(&(pp_ctx->dev_index));
+    portpilot_dev_cache_free(cache);
+    free(pp_ctx);
+    free(order);
+    free(devs);
+}
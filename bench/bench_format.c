@@ -0,0 +1,180 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libusb-1.0/libusb.h>
+
+#include "portpilot_bench.h"
+#include "portpilot_logger.h"
+#include "portpilot_helpers.h"
+#include "portpilot_sink.h"
+
+//Format BENCH_FORMAT_NUM_PKTS decoded packets the way they are output, as text,
+//as CSV, as CSV to both the console and a file (-c/-f), and compressed (-z,
+//all packets are from the same device). Output goes to
+///dev/null, so what is measured is the formatting and the write calls. The
+//fprintf modes are the formatting that was used before the sinks, for
+//comparison. The io mode hands the buffers to an I/O thread (like the logger
+//does), so the writes are moved off the formatting thread
+#define BENCH_FORMAT_NUM_PKTS 1000000
+
+enum {
+    BENCH_FORMAT_FPRINTF = 0,
+    BENCH_FORMAT_SINK,
+};
+
+struct bench_format_mode {
+    const char *name;
+    uint8_t type;
+    uint8_t format;
+    uint8_t num_sinks;
+    uint8_t use_io;
+};
+
+static const struct bench_format_mode bench_format_modes[] = {
+    {"format/fprintf-text", BENCH_FORMAT_FPRINTF, SINK_FORMAT_TEXT, 1, 0},
+    {"format/fprintf-csv", BENCH_FORMAT_FPRINTF, SINK_FORMAT_CSV, 1, 0},
+    {"format/sink-text", BENCH_FORMAT_SINK, SINK_FORMAT_TEXT, 1, 0},
+    {"format/sink-csv", BENCH_FORMAT_SINK, SINK_FORMAT_CSV, 1, 0},
+    {"format/sink-csv-file", BENCH_FORMAT_SINK, SINK_FORMAT_CSV, 2, 0},
+    {"format/sink-csv-io", BENCH_FORMAT_SINK, SINK_FORMAT_CSV, 2, 1},
+    {"format/sink-delta", BENCH_FORMAT_SINK, SINK_FORMAT_DELTA, 1, 0},
+};
+
+#define BENCH_FORMAT_NUM_MODES (sizeof(bench_format_modes) / \
+        sizeof(bench_format_modes[0]))
+
+static void bench_format_fprintf(FILE *out, uint8_t format,
+        const uint8_t *serial_number, const struct portpilot_data *pp_data)
+{
+    if (format == SINK_FORMAT_CSV)
+        fprintf(out, "%s,%u,%u,%u,%u,%u,%u,%u\n",
+            serial_number,
+            pp_data->tstamp,
+            pp_data->v_in/pp_data->num_readings,
+            pp_data->v_out/pp_data->num_readings,
+            pp_data->current/pp_data->num_readings,
+            pp_data->max_current,
+            pp_data->energy/pp_data->num_readings,
+            pp_data->total_energy);
+    else
+        fprintf(out, "Serial %s, tstamp %usec, v_in %umV, v_out %u mV"
+            ", current %umA, max. current %umA, energy %umW"
+            ", total energy %umWh\n",
+            serial_number,
+            pp_data->tstamp,
+            pp_data->v_in/pp_data->num_readings,
+            pp_data->v_out/pp_data->num_readings,
+            pp_data->current/pp_data->num_readings,
+            pp_data->max_current,
+            pp_data->energy/pp_data->num_readings,
+            pp_data->total_energy);
+}
+
+static void bench_format_run(const struct bench_format_mode *mode,
+        struct portpilot_dev *pp_dev, FILE *null_file)
+{
+    struct portpilot_ctx *pp_ctx = pp_dev->pp_ctx;
+    struct portpilot_data pp_data = {0};
+    struct portpilot_io_opts io_opts = {0};
+    struct portpilot_io *io = NULL;
+    uint64_t start;
+    uint32_t seed = 1, i;
+    uint8_t j;
+
+    if (mode->use_io && !(io = portpilot_io_create(&io_opts))) {
+        fprintf(stderr, "Failed to start I/O thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (mode->type == BENCH_FORMAT_SINK) {
+        for (j = 0; j < mode->num_sinks; j++) {
+            pp_ctx->sinks[j] = portpilot_sink_create(fileno(null_file),
+                    j ? SINK_FORMAT_CSV : mode->format, 0, io);
+
+            if (!pp_ctx->sinks[j]) {
+                fprintf(stderr, "Failed to create sink\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        pp_ctx->num_sinks = mode->num_sinks;
+    }
+
+    start = portpilot_bench_now_ns();
+
+    //Values in the range a Portpilot reports, so that the number of digits
+    //varies like in real output
+    for (i = 0; i < BENCH_FORMAT_NUM_PKTS; i++) {
+        pp_data.tstamp = 1000 + (i / 10);
+        pp_data.v_in = 5000 + (rand_r(&seed) % 64);
+        pp_data.v_out = 4950 + (rand_r(&seed) % 64);
+        pp_data.current = rand_r(&seed) % 2000;
+        pp_data.max_current = 1800;
+        pp_data.energy = (pp_data.v_out * pp_data.current) / 1000;
+        pp_data.total_energy = 1000 + (i / 100);
+        pp_data.num_readings = 1;
+
+        if (mode->type == BENCH_FORMAT_SINK)
+            portpilot_helpers_output_data(pp_dev, &pp_data);
+        else
+            bench_format_fprintf(null_file, mode->format,
+                    pp_dev->serial_number, &pp_data);
+    }
+
+    if (mode->type == BENCH_FORMAT_SINK) {
+        for (j = 0; j < pp_ctx->num_sinks; j++)
+            portpilot_sink_free(pp_ctx->sinks[j]);
+
+        pp_ctx->num_sinks = 0;
+    } else {
+        fflush(null_file);
+    }
+
+    if (io)
+        portpilot_io_stop(io);
+
+    portpilot_bench_report(mode->name, BENCH_FORMAT_NUM_PKTS,
+            portpilot_bench_now_ns() - start);
+}
+
+void portpilot_bench_format()
+{
+    struct portpilot_ctx *pp_ctx = calloc(sizeof(struct portpilot_ctx), 1);
+    struct portpilot_dev *pp_dev = calloc(sizeof(struct portpilot_dev), 1);
+    FILE *null_file = fopen("/dev/null", "w");
+    uint32_t i;
+
+    if (!pp_ctx || !pp_dev || !null_file) {
+        fprintf(stderr, "Failed to set up format benchmark\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pp_dev->pp_ctx = pp_ctx;
+    snprintf((char*) pp_dev->serial_number, sizeof(pp_dev->serial_number),
+            "PP%08u", 1234);
+
+    for (i = 0; i < BENCH_FORMAT_NUM_MODES; i++)
+        bench_format_run(&bench_format_modes[i], pp_dev, null_file);
+
+    fclose(null_file);
+    free(pp_dev);
+    free(pp_ctx);
+}
@@ -0,0 +1,438 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
+#include <libusb-1.0/libusb.h>
+
+#include "portpilot_bench.h"
+#include "portpilot_logger.h"
+#include "portpilot_helpers.h"
+#include "portpilot_hidraw.h"
+#include "portpilot_sink.h"
+#include "backend_event_loop.h"
+
+//Run the hidraw backend (-H) against a fake sysfs tree in a temporary
+//directory, with FIFOs as the /dev/hidrawN nodes. BENCH_HIDRAW_NUM_DEVS
+//Portpilots (the last one without a serial number) and one other HID device
+//are found by the scan, one more Portpilot is added by a uevent, and all are
+//removed by uevents. Every Portpilot has BENCH_HIDRAW_NUM_PKTS reports queued
+//in its FIFO, which must all come out of the CSV output, decoded and in order.
+//Reported is how fast the reports were read and decoded
+#define BENCH_HIDRAW_NUM_DEVS 8
+#define BENCH_HIDRAW_NUM_PKTS 512
+#define BENCH_HIDRAW_TIMEOUT 5000
+
+//hidraw index of the HID device that is not a Portpilot, and of the Portpilot
+//that is hotplugged
+#define BENCH_HIDRAW_OTHER_IDX BENCH_HIDRAW_NUM_DEVS
+#define BENCH_HIDRAW_HOTPLUG_IDX (BENCH_HIDRAW_NUM_DEVS + 1)
+#define BENCH_HIDRAW_NUM_IDX (BENCH_HIDRAW_NUM_DEVS + 2)
+
+struct bench_hidraw {
+    char root[PATH_MAX];
+    char sysfs_root[PATH_MAX];
+    char dev_root[PATH_MAX];
+    //Relative to the sysfs root, as in a uevent
+    char devpaths[BENCH_HIDRAW_NUM_IDX][PATH_MAX];
+    int32_t fifo_fds[BENCH_HIDRAW_NUM_IDX];
+    struct backend_event_loop *event_loop;
+    uint8_t timed_out;
+};
+
+//Format a path into buf (PATH_MAX bytes), the temporary root is short so
+//truncation means something is badly wrong
+static void bench_hidraw_path(char *buf, const char *fmt, ...)
+{
+    va_list ap;
+    int32_t len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, PATH_MAX, fmt, ap);
+    va_end(ap);
+
+    if (len < 0 || len >= PATH_MAX) {
+        fprintf(stderr, "Path too long\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void bench_hidraw_mkdirs(const char *path)
+{
+    char dir[PATH_MAX], *p;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+
+    for (p = dir + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+
+        *p = '\0';
+
+        if (mkdir(dir, 0755) && errno != EEXIST)
+            break;
+
+        *p = '/';
+    }
+
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        fprintf(stderr, "Failed to create %s\n", dir);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static uint8_t bench_hidraw_is_portpilot(uint32_t idx)
+{
+    return idx != BENCH_HIDRAW_OTHER_IDX;
+}
+
+//Serial number of device idx, empty for the last device found by the scan
+static void bench_hidraw_serial(char *serial, uint32_t idx)
+{
+    if (idx == BENCH_HIDRAW_NUM_DEVS - 1)
+        serial[0] = '\0';
+    else
+        snprintf(serial, MAX_USB_STR_LEN, "BENCH%02u", idx);
+}
+
+//Report n of device idx. v_in tells the devices apart, also the one without a
+//serial number
+static void bench_hidraw_fill_pkt(uint8_t *buf, uint32_t idx, uint32_t n)
+{
+    struct portpilot_pkt *pp_pkt = (struct portpilot_pkt*) buf;
+
+    memset(buf, 0, HIDRAW_REPORT_LEN);
+    pp_pkt->tstamp = 1000 + n;
+    pp_pkt->v_in = 5000 + idx;
+    pp_pkt->v_out = 4900;
+    pp_pkt->current = 100 + (n % 50);
+    pp_pkt->max_current = 1800;
+    pp_pkt->total_energy = 3600 * (10 + n);
+    pp_pkt->energy = 500;
+}
+
+//Create device idx on its own USB port: the HID device with its uevent, the
+//hidraw node below it (linked from class/hidraw) and a FIFO in the dev root
+//with all reports queued. The FIFO is kept open for writing, so that reading
+//from it does not see EOF
+static void bench_hidraw_create_dev(struct bench_hidraw *bh, uint32_t idx)
+{
+    char hid_dir[PATH_MAX], node_dir[PATH_MAX], path[PATH_MAX];
+    char serial[MAX_USB_STR_LEN + 1];
+    uint8_t buf[HIDRAW_REPORT_LEN];
+    uint16_t pid = bench_hidraw_is_portpilot(idx) ? PORTPILOT_PID : 0x0001;
+    uint32_t n;
+    FILE *fp;
+
+    bench_hidraw_path(hid_dir, "%s/devices/pci0000:00/0000:00:14.0/"
+            "usb1/1-%u/1-%u:1.0/0003:%04X:%04X.%04X", bh->sysfs_root, idx + 1,
+            idx + 1, PORTPILOT_VID, pid, idx + 1);
+    bench_hidraw_path(node_dir, "%s/hidraw/hidraw%u", hid_dir, idx);
+    bench_hidraw_mkdirs(node_dir);
+    snprintf(bh->devpaths[idx], sizeof(bh->devpaths[idx]), "%s",
+            node_dir + strlen(bh->sysfs_root));
+
+    //As in sysfs, the device of a hidraw node is the HID device, and the class
+    //entry links to the node
+    bench_hidraw_path(path, "%s/device", node_dir);
+
+    if (symlink("../..", path)) {
+        fprintf(stderr, "Failed to create %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    bench_hidraw_path(path, "%s/class/hidraw/hidraw%u", bh->sysfs_root, idx);
+
+    if (symlink(node_dir, path)) {
+        fprintf(stderr, "Failed to create %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    bench_hidraw_path(path, "%s/uevent", hid_dir);
+    fp = fopen(path, "we");
+
+    if (!fp) {
+        fprintf(stderr, "Failed to create %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    bench_hidraw_serial(serial, idx);
+    fprintf(fp, "DRIVER=hid-generic\nHID_ID=0003:%08X:%08X\n"
+            "HID_NAME=Portpilot\n", PORTPILOT_VID, pid);
+
+    if (serial[0])
+        fprintf(fp, "HID_UNIQ=%s\n", serial);
+
+    fclose(fp);
+
+    bench_hidraw_path(path, "%s/hidraw%u", bh->dev_root, idx);
+
+    if (mkfifo(path, 0600) ||
+        (bh->fifo_fds[idx] = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "Failed to create %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    for (n = 0; n < BENCH_HIDRAW_NUM_PKTS; n++) {
+        bench_hidraw_fill_pkt(buf, idx, n);
+
+        if (write(bh->fifo_fds[idx], buf, sizeof(buf)) != sizeof(buf)) {
+            fprintf(stderr, "Failed to queue reports for hidraw%u\n", idx);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+//Send the uevent the kernel sends when hidraw node idx is added or removed
+static void bench_hidraw_uevent(struct bench_hidraw *bh,
+        struct portpilot_hidraw *hidraw, const char *action, uint32_t idx)
+{
+    char buf[PATH_MAX * 2];
+    int32_t len;
+
+    len = snprintf(buf, sizeof(buf), "%s@%s%cACTION=%s%cDEVPATH=%s%c"
+            "SUBSYSTEM=hidraw%cDEVNAME=hidraw%u%c", action, bh->devpaths[idx],
+            '\0', action, '\0', bh->devpaths[idx], '\0', '\0', idx, '\0');
+
+    if (len < 0 || len >= sizeof(buf)) {
+        fprintf(stderr, "Failed to create uevent\n");
+        exit(EXIT_FAILURE);
+    }
+
+    portpilot_hidraw_handle_uevent(hidraw, buf, len);
+}
+
+static void bench_hidraw_timeout_cb(void *ptr)
+{
+    struct bench_hidraw *bh = ptr;
+
+    bh->timed_out = 1;
+    backend_event_loop_stop(bh->event_loop);
+}
+
+//Run the loop until every Portpilot has read all of its reports, the loop is
+//then stopped like with -r. Returns the time (ns) it took
+static uint64_t bench_hidraw_run(struct bench_hidraw *bh)
+{
+    struct backend_timeout_handle *timeout_handle;
+    uint64_t start;
+
+    timeout_handle = backend_event_loop_add_timeout(bh->event_loop,
+            backend_event_loop_now() + BENCH_HIDRAW_TIMEOUT,
+            bench_hidraw_timeout_cb, bh, 0);
+
+    if (!timeout_handle) {
+        fprintf(stderr, "Failed to add timeout\n");
+        exit(EXIT_FAILURE);
+    }
+
+    start = portpilot_bench_now_ns();
+    backend_event_loop_run(bh->event_loop);
+    start = portpilot_bench_now_ns() - start;
+
+    backend_event_loop_free_timeout(bh->event_loop, timeout_handle);
+
+    if (bh->timed_out) {
+        fprintf(stderr, "Timed out waiting for hidraw reports\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return start;
+}
+
+//Check that every report of the Portpilots is in the output (fd), decoded and
+//in order. Returns the number of samples that are wrong or missing
+static uint32_t bench_hidraw_check(int32_t fd)
+{
+    uint32_t counts[BENCH_HIDRAW_NUM_IDX] = {0};
+    uint32_t tstamp, v_in, v_out, current, max_current, energy, total_energy;
+    uint32_t idx, n, num_wrong = 0;
+    char line[SINK_MAX_LINE], serial[MAX_USB_STR_LEN + 1], *comma;
+    FILE *fp;
+
+    if (lseek(fd, 0, SEEK_SET) || !(fp = fdopen(dup(fd), "r"))) {
+        fprintf(stderr, "Failed to read output\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        comma = strchr(line, ',');
+
+        if (!comma || sscanf(comma + 1, "%u,%u,%u,%u,%u,%u,%u", &tstamp,
+                    &v_in, &v_out, &current, &max_current, &energy,
+                    &total_energy) != 7 ||
+            v_in < 5000 || v_in - 5000 >= BENCH_HIDRAW_NUM_IDX ||
+            !bench_hidraw_is_portpilot(v_in - 5000)) {
+            num_wrong++;
+            continue;
+        }
+
+        idx = v_in - 5000;
+        n = counts[idx]++;
+        *comma = '\0';
+        bench_hidraw_serial(serial, idx);
+
+        if (strcmp(line, serial) || tstamp != 1000 + n || v_out != 4900 ||
+            current != 100 + (n % 50) || max_current != 1800 ||
+            energy != 500 || total_energy != 10 + n)
+            num_wrong++;
+    }
+
+    fclose(fp);
+
+    for (idx = 0; idx < BENCH_HIDRAW_NUM_IDX; idx++) {
+        if (bench_hidraw_is_portpilot(idx) &&
+            counts[idx] < BENCH_HIDRAW_NUM_PKTS)
+            num_wrong += BENCH_HIDRAW_NUM_PKTS - counts[idx];
+    }
+
+    return num_wrong;
+}
+
+static int bench_hidraw_remove_cb(const char *path, const struct stat *st,
+        int type, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+void portpilot_bench_hidraw()
+{
+    struct portpilot_shards shards = {0};
+    struct portpilot_ctx *pp_ctx = calloc(sizeof(struct portpilot_ctx), 1);
+    struct bench_hidraw *bh = calloc(sizeof(struct bench_hidraw), 1);
+    char class_dir[PATH_MAX], out_path[] = "/tmp/portpilot-bench-XXXXXX";
+    int32_t stdout_fd, out_fd;
+    uint32_t i, num_devs, num_wrong;
+    uint64_t ns;
+
+    if (!pp_ctx || !bh || !portpilot_dev_index_init(&(pp_ctx->dev_index))) {
+        fprintf(stderr, "Failed to allocate context\n");
+        exit(EXIT_FAILURE);
+    }
+
+    snprintf(bh->root, sizeof(bh->root), "/tmp/portpilot-bench-XXXXXX");
+    out_fd = mkstemp(out_path);
+
+    if (!mkdtemp(bh->root) || out_fd < 0) {
+        fprintf(stderr, "Failed to create temporary files\n");
+        exit(EXIT_FAILURE);
+    }
+
+    unlink(out_path);
+    bench_hidraw_path(bh->sysfs_root, "%s/sys", bh->root);
+    bench_hidraw_path(bh->dev_root, "%s/dev", bh->root);
+    bench_hidraw_path(class_dir, "%s/class/hidraw", bh->sysfs_root);
+    bench_hidraw_mkdirs(class_dir);
+    bench_hidraw_mkdirs(bh->dev_root);
+
+    for (i = 0; i < BENCH_HIDRAW_NUM_IDX; i++) {
+        bh->fifo_fds[i] = -1;
+
+        if (i != BENCH_HIDRAW_HOTPLUG_IDX)
+            bench_hidraw_create_dev(bh, i);
+    }
+
+    setenv("PORTPILOT_SYSFS_ROOT", bh->sysfs_root, 1);
+    setenv("PORTPILOT_DEV_ROOT", bh->dev_root, 1);
+
+    shards.num_shards = 1;
+    pp_ctx->shards = &shards;
+    pp_ctx->pkts_to_read = BENCH_HIDRAW_NUM_PKTS;
+    pp_ctx->event_loop = backend_event_loop_create();
+    LIST_INIT(&(pp_ctx->dev_head));
+    backend_histogram_reset(&(pp_ctx->attach_latency));
+    bh->event_loop = pp_ctx->event_loop;
+
+    //The line printed when a device is ready is written to stdout
+    stdout_fd = portpilot_bench_stdout_to_null();
+    pp_ctx->sinks[0] = portpilot_sink_create(out_fd, SINK_FORMAT_CSV, 0, NULL);
+    pp_ctx->num_sinks = 1;
+
+    //Devices are added and start reading during the scan
+    ns = portpilot_bench_now_ns();
+
+    if (!pp_ctx->event_loop || !pp_ctx->sinks[0] ||
+        !portpilot_hidraw_create(pp_ctx)) {
+        fprintf(stderr, "Failed to create hidraw backend\n");
+        exit(EXIT_FAILURE);
+    }
+
+    num_devs = pp_ctx->dev_list_len;
+    ns = (portpilot_bench_now_ns() - ns) + bench_hidraw_run(bh);
+
+    portpilot_bench_stdout_restore(stdout_fd);
+    portpilot_bench_report("hidraw/scan-read",
+            BENCH_HIDRAW_NUM_DEVS * BENCH_HIDRAW_NUM_PKTS, ns);
+
+    stdout_fd = portpilot_bench_stdout_to_null();
+    bench_hidraw_create_dev(bh, BENCH_HIDRAW_HOTPLUG_IDX);
+    ns = portpilot_bench_now_ns();
+    bench_hidraw_uevent(bh, pp_ctx->hidraw, "add", BENCH_HIDRAW_HOTPLUG_IDX);
+    ns = (portpilot_bench_now_ns() - ns) + bench_hidraw_run(bh);
+    portpilot_bench_stdout_restore(stdout_fd);
+    portpilot_bench_report("hidraw/hotplug-read", BENCH_HIDRAW_NUM_PKTS, ns);
+
+    if (pp_ctx->dev_list_len == BENCH_HIDRAW_NUM_DEVS + 1)
+        num_devs++;
+
+    //Removal is reported on stderr
+    for (i = 0; i < BENCH_HIDRAW_NUM_IDX; i++) {
+        if (bench_hidraw_is_portpilot(i))
+            bench_hidraw_uevent(bh, pp_ctx->hidraw, "remove", i);
+    }
+
+    portpilot_sink_free(pp_ctx->sinks[0]);
+    num_wrong = bench_hidraw_check(out_fd);
+
+    portpilot_bench_note("hidraw/check", "%u of %u devices found, %u of %u "
+            "samples wrong or missing", num_devs, BENCH_HIDRAW_NUM_DEVS + 1,
+            num_wrong, (BENCH_HIDRAW_NUM_DEVS + 1) * BENCH_HIDRAW_NUM_PKTS);
+
+    if (num_devs != BENCH_HIDRAW_NUM_DEVS + 1 || num_wrong ||
+        pp_ctx->dev_list_len) {
+        fprintf(stderr, "The hidraw backend did not read what was sent\n");
+        exit(EXIT_FAILURE);
+    }
+
+    portpilot_hidraw_free(pp_ctx->hidraw);
+    backend_event_loop_free(pp_ctx->event_loop);
+    portpilot_dev_index_deinit(&(pp_ctx->dev_index));
+    free(pp_ctx);
+
+    for (i = 0; i < BENCH_HIDRAW_NUM_IDX; i++) {
+        if (bh->fifo_fds[i] >= 0)
+            close(bh->fifo_fds[i]);
+    }
+
+    close(out_fd);
+    unsetenv("PORTPILOT_SYSFS_ROOT");
+    unsetenv("PORTPILOT_DEV_ROOT");
+    nftw(bh->root, bench_hidraw_remove_cb, 16, FTW_DEPTH | FTW_PHYS);
+    free(bh);
+}
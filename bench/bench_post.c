@@ -0,0 +1,214 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "portpilot_bench.h"
+#include "backend_event_loop.h"
+#include "backend_histogram.h"
+
+//Throughput is measured by a number of producer threads posting
+//BENCH_POST_TASKS tasks each to a loop running on the benchmark thread, both
+//with tasks allocated by backend_event_loop_post() and tasks owned by the
+//producer. Latency is measured by posting one task at a time to an idle loop
+//and recording the time until the task is run, i.e., it includes the wakeup of
+//the loop
+#define BENCH_POST_TASKS 200000
+#define BENCH_POST_LATENCY_SAMPLES 10000
+
+static const uint8_t bench_post_producers[] = {1, 2, 4};
+
+#define NUM_BENCH_POST_PRODUCERS (sizeof(bench_post_producers) / \
+        sizeof(bench_post_producers[0]))
+
+struct bench_post_ctx {
+    struct backend_event_loop *del;
+    struct backend_histogram latency;
+    atomic_ullong posted_ns;
+    atomic_uint num_run;
+    uint32_t num_tasks;
+    uint8_t prealloc;
+};
+
+struct bench_post_producer {
+    struct bench_post_ctx *ctx;
+    struct backend_task *tasks;
+    pthread_t thread;
+};
+
+static void bench_post_task_cb(void *ptr)
+{
+    struct bench_post_ctx *ctx = ptr;
+
+    if (atomic_fetch_add(&(ctx->num_run), 1) + 1 == ctx->num_tasks)
+        backend_event_loop_stop(ctx->del);
+}
+
+static void* bench_post_producer_run(void *ptr)
+{
+    struct bench_post_producer *producer = ptr;
+    struct bench_post_ctx *ctx = producer->ctx;
+    uint32_t i;
+
+    for (i = 0; i < BENCH_POST_TASKS; i++) {
+        if (ctx->prealloc)
+            backend_event_loop_post_task(ctx->del, &(producer->tasks[i]),
+                    bench_post_task_cb, ctx);
+        else
+            backend_event_loop_post(ctx->del, bench_post_task_cb, ctx);
+    }
+
+    return NULL;
+}
+
+static void bench_post_throughput(uint8_t num_producers, uint8_t prealloc)
+{
+    struct bench_post_ctx ctx = {0};
+    struct bench_post_producer *producers;
+    uint64_t start;
+    uint8_t i;
+    char name[64];
+
+    ctx.del = backend_event_loop_create();
+    ctx.num_tasks = num_producers * BENCH_POST_TASKS;
+    ctx.prealloc = prealloc;
+    producers = calloc(sizeof(struct bench_post_producer), num_producers);
+
+    if (!ctx.del || !producers) {
+        fprintf(stderr, "Failed to create event loop\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_producers; i++) {
+        producers[i].ctx = &ctx;
+
+        if (prealloc) {
+            producers[i].tasks = calloc(sizeof(struct backend_task),
+                    BENCH_POST_TASKS);
+
+            if (!producers[i].tasks) {
+                fprintf(stderr, "Failed to allocate tasks\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    start = portpilot_bench_now_ns();
+
+    for (i = 0; i < num_producers; i++) {
+        if (pthread_create(&(producers[i].thread), NULL,
+                    bench_post_producer_run, &producers[i])) {
+            fprintf(stderr, "Failed to start producer\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    backend_event_loop_run(ctx.del);
+
+    snprintf(name, sizeof(name), "post/%s/%u", prealloc ? "task" : "malloc",
+            num_producers);
+    portpilot_bench_report(name, ctx.num_tasks,
+            portpilot_bench_now_ns() - start);
+
+    for (i = 0; i < num_producers; i++) {
+        pthread_join(producers[i].thread, NULL);
+        free(producers[i].tasks);
+    }
+
+    backend_event_loop_free(ctx.del);
+    free(producers);
+}
+
+static void bench_post_latency_cb(void *ptr)
+{
+    struct bench_post_ctx *ctx = ptr;
+
+    backend_histogram_add(&(ctx->latency),
+            portpilot_bench_now_ns() - atomic_load(&(ctx->posted_ns)));
+
+    if (atomic_fetch_add(&(ctx->num_run), 1) + 1 == ctx->num_tasks)
+        backend_event_loop_stop(ctx->del);
+}
+
+static void* bench_post_latency_run(void *ptr)
+{
+    struct bench_post_ctx *ctx = ptr;
+    struct backend_task task;
+    uint32_t i;
+
+    for (i = 0; i < ctx->num_tasks; i++) {
+        //Give the loop time to go back to sleep
+        usleep(20);
+
+        atomic_store(&(ctx->posted_ns), portpilot_bench_now_ns());
+        backend_event_loop_post_task(ctx->del, &task, bench_post_latency_cb,
+                ctx);
+
+        while (atomic_load(&(ctx->num_run)) == i)
+            sched_yield();
+    }
+
+    return NULL;
+}
+
+static void bench_post_latency()
+{
+    struct bench_post_ctx ctx = {0};
+    pthread_t thread;
+
+    ctx.del = backend_event_loop_create();
+    ctx.num_tasks = BENCH_POST_LATENCY_SAMPLES;
+    backend_histogram_reset(&(ctx.latency));
+
+    if (!ctx.del) {
+        fprintf(stderr, "Failed to create event loop\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pthread_create(&thread, NULL, bench_post_latency_run, &ctx)) {
+        fprintf(stderr, "Failed to start producer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    backend_event_loop_run(ctx.del);
+    pthread_join(thread, NULL);
+
+    portpilot_bench_report("post/latency", ctx.latency.count,
+            ctx.latency.sum);
+    backend_histogram_print(stdout, "post/latency", &(ctx.latency), 1000,
+            "us");
+
+    backend_event_loop_free(ctx.del);
+}
+
+void portpilot_bench_post()
+{
+    uint32_t i;
+
+    for (i = 0; i < NUM_BENCH_POST_PRODUCERS; i++) {
+        bench_post_throughput(bench_post_producers[i], 0);
+        bench_post_throughput(bench_post_producers[i], 1);
+    }
+
+    bench_post_latency();
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "portpilot_bench.h"
+#include "portpilot_logger.h"
+#include "portpilot_decode.h"
+#include "backend_event_loop.h"
+
+//Every shard serves the same number of virtual devices, and every iteration
+//of the loop "completes" a batch of packets for each device. Completions are
+//signalled by an eventfd that is always readable, so the loop never blocks.
+//Packets are decoded and aggregated, and every BENCH_SHARDS_AGG packets are
+//written to the output shared by all shards, like when running with -i
+#define BENCH_SHARDS_DEVS 16
+#define BENCH_SHARDS_BATCH 32
+#define BENCH_SHARDS_AGG 8
+#define BENCH_SHARDS_PKT_LEN 64
+#define BENCH_SHARDS_NUM_PKTS 4096
+#define BENCH_SHARDS_RUN_MS 1000
+
+static const uint8_t bench_shards_counts[] = {1, 2, 4, 8, 16};
+
+#define NUM_BENCH_SHARDS_COUNTS (sizeof(bench_shards_counts) / \
+        sizeof(bench_shards_counts[0]))
+
+struct bench_shard {
+    struct backend_event_loop *del;
+    struct backend_epoll_handle *handle;
+    struct portpilot_data agg_data[BENCH_SHARDS_DEVS];
+    const uint8_t *pkts;
+    FILE *output;
+    uint64_t num_pkts;
+    uint32_t pkt_idx;
+};
+
+static void bench_shards_event_cb(void *ptr, int32_t fd, uint32_t events)
+{
+    struct bench_shard *shard = ptr;
+    struct portpilot_data *pp_data;
+    const struct portpilot_pkt *pp_pkt;
+    uint32_t i, j;
+
+    for (i = 0; i < BENCH_SHARDS_DEVS; i++) {
+        pp_data = &(shard->agg_data[i]);
+
+        for (j = 0; j < BENCH_SHARDS_BATCH; j++) {
+            pp_pkt = (const struct portpilot_pkt*) (shard->pkts +
+                    (shard->pkt_idx * BENCH_SHARDS_PKT_LEN));
+            shard->pkt_idx = (shard->pkt_idx + 1) % BENCH_SHARDS_NUM_PKTS;
+
+            portpilot_decode_pkt(pp_data, pp_pkt);
+
+            if (pp_data->num_readings < BENCH_SHARDS_AGG)
+                continue;
+
+            fprintf(shard->output, "%s,%u,%u,%u,%u,%u,%u,%u\n",
+                "BENCH0000", pp_data->tstamp,
+                pp_data->v_in/pp_data->num_readings,
+                pp_data->v_out/pp_data->num_readings,
+                pp_data->current/pp_data->num_readings,
+                pp_data->max_current,
+                pp_data->energy/pp_data->num_readings,
+                pp_data->total_energy);
+            memset(pp_data, 0, sizeof(struct portpilot_data));
+        }
+    }
+
+    shard->num_pkts += BENCH_SHARDS_DEVS * BENCH_SHARDS_BATCH;
+}
+
+static void bench_shards_stop_cb(void *ptr)
+{
+    backend_event_loop_stop(ptr);
+}
+
+static void* bench_shards_run(void *ptr)
+{
+    struct bench_shard *shard = ptr;
+
+    backend_event_loop_run(shard->del);
+    return NULL;
+}
+
+static void bench_shards_measure(uint8_t num_shards, const uint8_t *pkts,
+        FILE *output)
+{
+    struct bench_shard *shards = calloc(sizeof(struct bench_shard), num_shards);
+    struct backend_timeout_handle *stop_handles[num_shards];
+    pthread_t threads[num_shards];
+    uint64_t stop_time, start, total_pkts = 0;
+    uint8_t i;
+    char name[64];
+
+    if (!shards) {
+        fprintf(stderr, "Failed to allocate shards\n");
+        exit(EXIT_FAILURE);
+    }
+
+    stop_time = backend_event_loop_now() + BENCH_SHARDS_RUN_MS;
+
+    for (i = 0; i < num_shards; i++) {
+        shards[i].del = backend_event_loop_create();
+
+        if (!shards[i].del) {
+            fprintf(stderr, "Failed to allocate event loop\n");
+            exit(EXIT_FAILURE);
+        }
+
+        shards[i].pkts = pkts;
+        shards[i].output = output;
+        shards[i].pkt_idx = (i * 997) % BENCH_SHARDS_NUM_PKTS;
+        shards[i].handle = backend_event_loop_create_epoll_handle(
+                shards[i].del, &shards[i], eventfd(1, EFD_CLOEXEC),
+                bench_shards_event_cb, 0);
+
+        if (!shards[i].handle || shards[i].handle->fd == -1 ||
+            backend_event_loop_update(shards[i].del, EPOLLIN, EPOLL_CTL_ADD,
+                shards[i].handle->fd, shards[i].handle)) {
+            fprintf(stderr, "Failed to add completion eventfd\n");
+            exit(EXIT_FAILURE);
+        }
+
+        stop_handles[i] = backend_event_loop_add_timeout(shards[i].del,
+                stop_time, bench_shards_stop_cb, shards[i].del, 0);
+    }
+
+    start = portpilot_bench_now_ns();
+
+    for (i = 0; i < num_shards; i++) {
+        if (pthread_create(&threads[i], NULL, bench_shards_run, &shards[i])) {
+            fprintf(stderr, "Failed to create thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (i = 0; i < num_shards; i++) {
+        pthread_join(threads[i], NULL);
+        total_pkts += shards[i].num_pkts;
+    }
+
+    snprintf(name, sizeof(name), "shards/%u", num_shards);
+    portpilot_bench_report(name, total_pkts, portpilot_bench_now_ns() - start);
+
+    for (i = 0; i < num_shards; i++) {
+        close(shards[i].handle->fd);
+        backend_event_loop_free_epoll_handle(shards[i].del, shards[i].handle);
+        backend_event_loop_free_timeout(shards[i].del, stop_handles[i]);
+        backend_event_loop_free(shards[i].del);
+    }
+
+    free(shards);
+}
+
+void portpilot_bench_shards()
+{
+    uint8_t *pkts = malloc(BENCH_SHARDS_PKT_LEN * BENCH_SHARDS_NUM_PKTS);
+    FILE *output = fopen("/dev/null", "w");
+    uint32_t i;
+
+    if (!pkts || !output) {
+        fprintf(stderr, "Failed to prepare shard benchmark\n");
+        exit(EXIT_FAILURE);
+    }
+
+    portpilot_bench_fill_pkts(pkts, BENCH_SHARDS_PKT_LEN,
+            BENCH_SHARDS_NUM_PKTS);
+
+    for (i = 0; i < NUM_BENCH_SHARDS_COUNTS; i++)
+        bench_shards_measure(bench_shards_counts[i], pkts, output);
+
+    fclose(output);
+    free(pkts);
+}
@@ -0,0 +1,237 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "portpilot_bench.h"
+#include "portpilot_shm.h"
+#include "portpilot_shm_reader.h"
+
+//Publishing cost of a sample, and a stress test of the seqlocks: one writer
+//thread per device publishes as fast as it can, while BENCH_SHM_NUM_READERS
+//reader threads (each with its own mapping, like separate processes) follow
+//all devices and check every sample they get. All fields of sample n are
+//derived from n, so a torn copy (fields from two different samples) is
+//detected. The benchmark fails if a torn sample is returned
+#define BENCH_SHM_NUM_SAMPLES 10000000
+#define BENCH_SHM_NUM_DEVS 4
+#define BENCH_SHM_NUM_READERS 4
+#define BENCH_SHM_RUN_MS 1000
+#define BENCH_SHM_BATCH 64
+
+struct bench_shm_writer {
+    pthread_t thread;
+    struct portpilot_shm_dev *dev;
+    uint64_t num_samples;
+};
+
+struct bench_shm_reader {
+    pthread_t thread;
+    const char *name;
+    uint64_t num_samples;
+    uint64_t num_lost;
+    uint64_t num_last;
+    uint64_t num_torn;
+};
+
+static atomic_uchar bench_shm_stop;
+
+static void bench_shm_fill(struct portpilot_shm_sample *sample, uint64_t n)
+{
+    sample->host_ns = n;
+    sample->tstamp = (uint32_t) n;
+    sample->v_in = (uint32_t) (n * 7);
+    sample->v_out = (uint32_t) ~n;
+    sample->current = (uint32_t) (n ^ 0x5a5a5a5a);
+    sample->max_current = (uint32_t) (n >> 3);
+    sample->energy = (uint32_t) (n * 13);
+    sample->total_energy = (uint32_t) (n + 1000);
+    sample->__pad = (uint32_t) (n * 31);
+}
+
+static uint8_t bench_shm_check(const struct portpilot_shm_sample *sample)
+{
+    struct portpilot_shm_sample expected;
+
+    bench_shm_fill(&expected, sample->host_ns);
+
+    return !memcmp(sample, &expected, sizeof(expected));
+}
+
+static void* bench_shm_write(void *ptr)
+{
+    struct bench_shm_writer *writer = ptr;
+    struct portpilot_shm_sample sample;
+
+    while (!atomic_load_explicit(&bench_shm_stop, memory_order_relaxed)) {
+        bench_shm_fill(&sample, writer->num_samples++);
+        portpilot_shm_publish(writer->dev, &sample);
+    }
+
+    return NULL;
+}
+
+static void* bench_shm_read(void *ptr)
+{
+    struct bench_shm_reader *reader = ptr;
+    struct portpilot_shm_sample samples[BENCH_SHM_BATCH], last;
+    uint64_t next[BENCH_SHM_NUM_DEVS] = {0}, n;
+    struct portpilot_shm_reader *shm_reader;
+    uint32_t num_samples, idx, i;
+
+    shm_reader = portpilot_shm_reader_open(reader->name);
+
+    if (!shm_reader) {
+        fprintf(stderr, "Failed to open shared memory for reading\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while (!atomic_load_explicit(&bench_shm_stop, memory_order_relaxed)) {
+        for (idx = 0; idx < portpilot_shm_reader_num_devs(shm_reader); idx++) {
+            n = next[idx];
+            num_samples = portpilot_shm_reader_read(shm_reader, idx,
+                    &(next[idx]), samples, BENCH_SHM_BATCH,
+                    &(reader->num_lost));
+
+            //Samples are returned in order, skipping the ones that were lost
+            for (i = 0; i < num_samples; i++) {
+                if (!bench_shm_check(&(samples[i])) || samples[i].host_ns < n)
+                    reader->num_torn++;
+
+                n = samples[i].host_ns + 1;
+            }
+
+            reader->num_samples += num_samples;
+
+            if (portpilot_shm_reader_last(shm_reader, idx, &last)) {
+                reader->num_last++;
+
+                if (!bench_shm_check(&last))
+                    reader->num_torn++;
+            }
+        }
+    }
+
+    portpilot_shm_reader_close(shm_reader);
+
+    return NULL;
+}
+
+void portpilot_bench_shm()
+{
+    struct bench_shm_writer writers[BENCH_SHM_NUM_DEVS];
+    struct bench_shm_reader readers[BENCH_SHM_NUM_READERS];
+    struct portpilot_shm_sample sample;
+    uint64_t start, num_written = 0, num_read = 0, num_lost = 0;
+    uint64_t num_last = 0, num_torn = 0, i;
+    struct portpilot_shm_dev *dev;
+    struct portpilot_shm *shm;
+    uint8_t serial_number[16], path[2] = {1, 1};
+    char name[64];
+
+    snprintf(name, sizeof(name), "/portpilot-bench-%d", getpid());
+    shm = portpilot_shm_create(name);
+
+    if (!shm || !(dev = portpilot_shm_get_dev(shm,
+                    (const uint8_t*) "PP00000000", path, sizeof(path)))) {
+        fprintf(stderr, "Failed to create shared memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    start = portpilot_bench_now_ns();
+
+    for (i = 0; i < BENCH_SHM_NUM_SAMPLES; i++) {
+        bench_shm_fill(&sample, i);
+        portpilot_shm_publish(dev, &sample);
+    }
+
+    portpilot_bench_report("shm/publish", BENCH_SHM_NUM_SAMPLES,
+            portpilot_bench_now_ns() - start);
+
+    memset(writers, 0, sizeof(writers));
+    memset(readers, 0, sizeof(readers));
+    atomic_store(&bench_shm_stop, 0);
+
+    //The device above is reused, so its numbering continues
+    writers[0].dev = dev;
+    writers[0].num_samples = BENCH_SHM_NUM_SAMPLES;
+
+    for (i = 1; i < BENCH_SHM_NUM_DEVS; i++) {
+        snprintf((char*) serial_number, sizeof(serial_number), "PP%08u",
+                (uint32_t) i);
+        writers[i].dev = portpilot_shm_get_dev(shm, serial_number, path,
+                sizeof(path));
+    }
+
+    start = portpilot_bench_now_ns();
+
+    for (i = 0; i < BENCH_SHM_NUM_DEVS; i++) {
+        if (!writers[i].dev || pthread_create(&(writers[i].thread), NULL,
+                    bench_shm_write, &(writers[i]))) {
+            fprintf(stderr, "Failed to start writer\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (i = 0; i < BENCH_SHM_NUM_READERS; i++) {
+        readers[i].name = name;
+
+        if (pthread_create(&(readers[i].thread), NULL, bench_shm_read,
+                    &(readers[i]))) {
+            fprintf(stderr, "Failed to start reader\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    usleep(BENCH_SHM_RUN_MS * 1000);
+    atomic_store(&bench_shm_stop, 1);
+
+    for (i = 0; i < BENCH_SHM_NUM_DEVS; i++) {
+        pthread_join(writers[i].thread, NULL);
+        num_written += writers[i].num_samples;
+    }
+
+    num_written -= BENCH_SHM_NUM_SAMPLES;
+
+    for (i = 0; i < BENCH_SHM_NUM_READERS; i++) {
+        pthread_join(readers[i].thread, NULL);
+        num_read += readers[i].num_samples;
+        num_lost += readers[i].num_lost;
+        num_last += readers[i].num_last;
+        num_torn += readers[i].num_torn;
+    }
+
+    start = portpilot_bench_now_ns() - start;
+    portpilot_bench_report("shm/publish-contended", num_written, start);
+    portpilot_bench_report("shm/read-contended", num_read + num_last, start);
+    portpilot_bench_note("shm/torn", "%llu torn samples in %llu read, %llu "
+            "lost to the writers", (unsigned long long) num_torn,
+            (unsigned long long) (num_read + num_last),
+            (unsigned long long) num_lost);
+
+    portpilot_shm_destroy(shm);
+
+    if (num_torn) {
+        fprintf(stderr, "Shared memory returned torn samples\n");
+        exit(EXIT_FAILURE);
+    }
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/queue.h>
+#include <libusb-1.0/libusb.h>
+
+#include "portpilot_bench.h"
+#include "portpilot_logger.h"
+#include "portpilot_helpers.h"
+#include "portpilot_sim.h"
+#include "portpilot_sink.h"
+#include "backend_event_loop.h"
+
+//Run the logger with an increasing number of simulated devices, each sending
+//BENCH_SIM_RATE packets per second, for BENCH_SIM_DURATION ms. Packets go
+//through the same path as packets from real devices (decode and CSV output,
+//to /dev/null). Reported are the packets handled per second of wall time, which
+//is below num. devices * BENCH_SIM_RATE when the logger can not keep up, and
+//the CPU time per packet
+#define BENCH_SIM_RATE 1000
+#define BENCH_SIM_DURATION 1000
+
+static const uint32_t bench_sim_devs[] = {1, 10, 100, 1000};
+
+#define BENCH_SIM_NUM_RUNS (sizeof(bench_sim_devs) / sizeof(bench_sim_devs[0]))
+
+static void bench_sim_stop_cb(void *ptr)
+{
+    backend_event_loop_stop(ptr);
+}
+
+static void bench_sim_run(uint32_t num_devs)
+{
+    struct portpilot_shards shards = {0};
+    struct portpilot_ctx *pp_ctx = calloc(sizeof(struct portpilot_ctx), 1);
+    struct portpilot_sim_opts opts = {0};
+    struct backend_timeout_handle *stop_handle;
+    struct portpilot_dev *ppd_itr, *ppd_tmp;
+    int32_t stdout_fd;
+    uint64_t start, cpu_start, num_pkts;
+    char name[64];
+
+    if (!pp_ctx || !portpilot_dev_index_init(&(pp_ctx->dev_index))) {
+        fprintf(stderr, "Failed to allocate context\n");
+        exit(EXIT_FAILURE);
+    }
+
+    shards.num_shards = 1;
+    pp_ctx->shards = &shards;
+    pp_ctx->queue_depth = 1;
+    pp_ctx->event_loop = backend_event_loop_create();
+    LIST_INIT(&(pp_ctx->dev_head));
+    backend_histogram_reset(&(pp_ctx->attach_latency));
+
+    opts.num_devs = num_devs;
+    opts.rate = BENCH_SIM_RATE;
+    opts.waveform = SIM_WAVE_SINE;
+
+    //Output (and the line printed when a device is ready) is written to stdout
+    stdout_fd = portpilot_bench_stdout_to_null();
+    pp_ctx->sinks[0] = portpilot_sink_create(STDOUT_FILENO, SINK_FORMAT_CSV,
+            0, NULL);
+    pp_ctx->num_sinks = 1;
+
+    if (!pp_ctx->event_loop || !pp_ctx->sinks[0] ||
+        !portpilot_sim_create(pp_ctx, &opts)) {
+        fprintf(stderr, "Failed to create simulation\n");
+        exit(EXIT_FAILURE);
+    }
+
+    stop_handle = backend_event_loop_add_timeout(pp_ctx->event_loop,
+            backend_event_loop_now() + BENCH_SIM_DURATION, bench_sim_stop_cb,
+            pp_ctx->event_loop, 0);
+
+    if (!stop_handle) {
+        fprintf(stderr, "Failed to add stop timeout\n");
+        exit(EXIT_FAILURE);
+    }
+
+    start = portpilot_bench_now_ns();
+    cpu_start = portpilot_bench_cpu_ns();
+
+    backend_event_loop_run(pp_ctx->event_loop);
+
+    portpilot_sink_free(pp_ctx->sinks[0]);
+    cpu_start = portpilot_bench_cpu_ns() - cpu_start;
+    start = portpilot_bench_now_ns() - start;
+    num_pkts = pp_ctx->sim->num_pkts;
+
+    portpilot_bench_stdout_restore(stdout_fd);
+
+    snprintf(name, sizeof(name), "sim/%u-devices", num_devs);
+    portpilot_bench_report(name, num_pkts, start);
+    snprintf(name, sizeof(name), "sim/%u-devices-cpu", num_devs);
+    portpilot_bench_report(name, num_pkts, cpu_start);
+
+    ppd_itr = pp_ctx->dev_head.lh_first;
+
+    while (ppd_itr != NULL) {
+        ppd_tmp = ppd_itr;
+        ppd_itr = ppd_itr->next_dev.le_next;
+        portpilot_helpers_free_dev(ppd_tmp);
+    }
+
+    portpilot_sim_free(pp_ctx->sim);
+    backend_event_loop_free_timeout(pp_ctx->event_loop, stop_handle);
+    backend_event_loop_free(pp_ctx->event_loop);
+    portpilot_dev_index_deinit(&(pp_ctx->dev_index));
+    free(pp_ctx);
+}
+
+void portpilot_bench_sim()
+{
+    uint32_t i;
+
+    for (i = 0; i < BENCH_SIM_NUM_RUNS; i++)
+        bench_sim_run(bench_sim_devs[i]);
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "portpilot_bench.h"
+#include "backend_event_loop.h"
+
+//How long the periodic timers are left running
+#define BENCH_TIMERS_RUN_MS 1000
+
+static const uint32_t bench_timers_counts[] = {100, 1000, 10000, 50000};
+
+#define NUM_BENCH_TIMERS_COUNTS (sizeof(bench_timers_counts) / \
+        sizeof(bench_timers_counts[0]))
+
+static uint64_t bench_timers_fired;
+
+static void bench_timers_fire_cb(void *ptr)
+{
+    ++bench_timers_fired;
+}
+
+static void bench_timers_stop_cb(void *ptr)
+{
+    backend_event_loop_stop(ptr);
+}
+
+//Arm num_timers timers with random timeouts far in the future, and then remove
+//them again. Timers never fire, so we only measure the cost of the structure
+static void bench_timers_insert(uint32_t num_timers)
+{
+    struct backend_event_loop *del = backend_event_loop_create();
+    struct backend_timeout_handle *handles;
+    uint64_t cur_time = backend_event_loop_now(), start;
+    uint32_t seed = 1, i;
+    char name[64];
+
+    handles = calloc(sizeof(struct backend_timeout_handle), num_timers);
+
+    if (!del || !handles) {
+        fprintf(stderr, "Failed to allocate timers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_timers; i++) {
+        handles[i].timeout_clock = cur_time + 3600000 + (rand_r(&seed) % 60000);
+        handles[i].cb = bench_timers_fire_cb;
+    }
+
+    start = portpilot_bench_now_ns();
+    for (i = 0; i < num_timers; i++)
+        backend_event_loop_insert_timeout(del, &handles[i]);
+    snprintf(name, sizeof(name), "timers/insert/%u", num_timers);
+    portpilot_bench_report(name, num_timers, portpilot_bench_now_ns() - start);
+
+    //Remove in a different order than insert, the first timeouts are the
+    //cheapest to remove
+    start = portpilot_bench_now_ns();
+    for (i = 0; i < num_timers; i++)
+        backend_event_loop_remove_timeout(&handles[(i * 7919) % num_timers]);
+    snprintf(name, sizeof(name), "timers/remove/%u", num_timers);
+    portpilot_bench_report(name, num_timers, portpilot_bench_now_ns() - start);
+
+    backend_event_loop_free(del);
+    free(handles);
+}
+
+//Run num_timers periodic timers with intervals between 1 and 10 ms for
+//BENCH_TIMERS_RUN_MS, and report the CPU time spent per expiry (including
+//rearming the timer)
+static void bench_timers_fire(uint32_t num_timers)
+{
+    struct backend_event_loop *del = backend_event_loop_create();
+    struct backend_timeout_handle *handles, *stop_handle;
+    uint64_t cur_time = backend_event_loop_now(), start;
+    uint32_t i;
+    char name[64];
+
+    handles = calloc(sizeof(struct backend_timeout_handle), num_timers);
+
+    if (!del || !handles) {
+        fprintf(stderr, "Failed to allocate timers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_timers; i++) {
+        handles[i].intvl = 1 + (i % 10);
+        handles[i].timeout_clock = cur_time + (i % handles[i].intvl);
+        handles[i].cb = bench_timers_fire_cb;
+        backend_event_loop_insert_timeout(del, &handles[i]);
+    }
+
+    stop_handle = backend_event_loop_add_timeout(del,
+            cur_time + BENCH_TIMERS_RUN_MS, bench_timers_stop_cb, del, 0);
+
+    if (!stop_handle) {
+        fprintf(stderr, "Failed to add stop timeout\n");
+        exit(EXIT_FAILURE);
+    }
+
+    bench_timers_fired = 0;
+    start = portpilot_bench_cpu_ns();
+    backend_event_loop_run(del);
+    snprintf(name, sizeof(name), "timers/fire/%u", num_timers);
+    portpilot_bench_report(name, bench_timers_fired,
+            portpilot_bench_cpu_ns() - start);
+
+    backend_event_loop_free_timeout(del, stop_handle);
+    backend_event_loop_free(del);
+    free(handles);
+}
+
+//Create and destroy a timeout handle, like we do for per-device timers on
+//hotplug. Compare the pool of the loop with allocating every handle from heap
+static void bench_timers_alloc(uint32_t num_timers)
+{
+    struct backend_event_loop *del = backend_event_loop_create();
+    struct backend_timeout_handle *handle;
+    uint64_t start;
+    uint32_t i;
+    char name[64];
+
+    if (!del) {
+        fprintf(stderr, "Failed to allocate event loop\n");
+        exit(EXIT_FAILURE);
+    }
+
+    start = portpilot_bench_now_ns();
+    for (i = 0; i < num_timers; i++) {
+        handle = backend_event_loop_add_timeout(del, i, bench_timers_fire_cb,
+                NULL, 0);
+        backend_event_loop_free_timeout(del, handle);
+    }
+    snprintf(name, sizeof(name), "timers/alloc-pool/%u", num_timers);
+    portpilot_bench_report(name, num_timers, portpilot_bench_now_ns() - start);
+
+    start = portpilot_bench_now_ns();
+    for (i = 0; i < num_timers; i++) {
+        handle = calloc(sizeof(struct backend_timeout_handle), 1);
+        backend_event_loop_add_timeout_handle(del, handle, i,
+                bench_timers_fire_cb, NULL, 0);
+        backend_event_loop_remove_timeout(handle);
+        free(handle);
+    }
+    snprintf(name, sizeof(name), "timers/alloc-heap/%u", num_timers);
+    portpilot_bench_report(name, num_timers, portpilot_bench_now_ns() - start);
+
+    backend_event_loop_free(del);
+}
+
+void portpilot_bench_timers()
+{
+    uint32_t i;
+
+    for (i = 0; i < NUM_BENCH_TIMERS_COUNTS; i++)
+        bench_timers_insert(bench_timers_counts[i]);
+
+    for (i = 0; i < NUM_BENCH_TIMERS_COUNTS; i++)
+        bench_timers_fire(bench_timers_counts[i]);
+
+    bench_timers_alloc(1000000);
+}
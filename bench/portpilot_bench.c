@@ -0,0 +1,244 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "portpilot_bench.h"
+#include "portpilot_logger.h"
+
+static const struct portpilot_bench benchmarks[] = {
+    {"timers", portpilot_bench_timers},
+    {"shards", portpilot_bench_shards},
+    {"backends", portpilot_bench_backends},
+    {"post", portpilot_bench_post},
+    {"decode", portpilot_bench_decode},
+    {"devices", portpilot_bench_devices},
+    {"format", portpilot_bench_format},
+    {"sim", portpilot_bench_sim},
+    {"binlog", portpilot_bench_binlog},
+    {"codec", portpilot_bench_codec},
+    {"shm", portpilot_bench_shm},
+    {"hidraw", portpilot_bench_hidraw},
+    {"attach", portpilot_bench_attach},
+};
+
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+//Results are written as CSV when machine_readable is set (-m), run is the
+//repetition (-n) currently running
+static uint8_t machine_readable;
+static uint32_t run;
+
+//The benchmarks are linked without portpilot_logger.c. None of them has
+//devices that fail to start reading, so the iteration callback is never needed
+void portpilot_logger_start_itr_cb(struct portpilot_ctx *pp_ctx)
+{
+}
+
+void portpilot_logger_stop_itr_cb(struct portpilot_ctx *pp_ctx)
+{
+}
+
+uint64_t portpilot_bench_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+uint64_t portpilot_bench_cpu_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+void portpilot_bench_fill_pkts(uint8_t *buf, uint32_t pkt_len,
+        uint32_t num_pkts)
+{
+    struct portpilot_pkt *pp_pkt;
+    uint32_t seed = 1, i;
+
+    memset(buf, 0, pkt_len * num_pkts);
+
+    //Voltage hovers around 5V, current varies and can be reported as negative,
+    //and total energy is monotonic
+    for (i = 0; i < num_pkts; i++) {
+        pp_pkt = (struct portpilot_pkt*) (buf + (i * pkt_len));
+        pp_pkt->tstamp = 1000 + (i / 10);
+        pp_pkt->v_in = 5000 + (rand_r(&seed) % 64) - 32;
+        pp_pkt->v_out = 4950 + (rand_r(&seed) % 64) - 32;
+        pp_pkt->current = (rand_r(&seed) % 2000) - 200;
+        pp_pkt->max_current = 1800;
+        pp_pkt->total_energy = 3600 * 1000 + (i * 50);
+        pp_pkt->energy = (pp_pkt->v_out * pp_pkt->current) / 1000;
+    }
+}
+
+void portpilot_bench_report(const char *name, uint64_t ops, uint64_t ns)
+{
+    double ns_per_op = ops ? (double) ns / ops : 0;
+    double ops_per_sec = ns ? (ops * 1e9) / ns : 0;
+
+    if (machine_readable)
+        fprintf(stdout, "%s,%u,%llu,%llu,%.3f,%.1f\n", name, run,
+                (unsigned long long) ops, (unsigned long long) ns, ns_per_op,
+                ops_per_sec);
+    else
+        fprintf(stdout, "%-40s %12llu ops %12.1f ns/op %14.0f ops/s\n", name,
+                (unsigned long long) ops, ns_per_op, ops_per_sec);
+
+    fflush(stdout);
+}
+
+void portpilot_bench_skip(const char *name, const char *reason)
+{
+    //Keep the results parseable
+    if (machine_readable)
+        fprintf(stderr, "%s: %s\n", name, reason);
+    else
+        fprintf(stdout, "%-40s %s\n", name, reason);
+}
+
+void portpilot_bench_note(const char *name, const char *fmt, ...)
+{
+    va_list ap;
+
+    //Keep the results parseable
+    fprintf(machine_readable ? stderr : stdout, "%-40s ", name);
+    va_start(ap, fmt);
+    vfprintf(machine_readable ? stderr : stdout, fmt, ap);
+    va_end(ap);
+    fprintf(machine_readable ? stderr : stdout, "\n");
+}
+
+int32_t portpilot_bench_stdout_to_null()
+{
+    int32_t null_fd, stdout_fd;
+
+    fflush(stdout);
+    null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    stdout_fd = dup(STDOUT_FILENO);
+
+    if (null_fd < 0 || stdout_fd < 0 || dup2(null_fd, STDOUT_FILENO) < 0) {
+        fprintf(stderr, "Failed to redirect stdout\n");
+        exit(EXIT_FAILURE);
+    }
+
+    close(null_fd);
+
+    return stdout_fd;
+}
+
+void portpilot_bench_stdout_restore(int32_t stdout_fd)
+{
+    fflush(stdout);
+    dup2(stdout_fd, STDOUT_FILENO);
+    close(stdout_fd);
+}
+
+static void usage()
+{
+    uint32_t i;
+
+    fprintf(stdout, "Usage: portpilot-bench [-m] [-n runs] [benchmark ...]\n");
+    fprintf(stdout, "Runs all benchmarks if none are given. Available:\n");
+
+    for (i = 0; i < NUM_BENCHMARKS; i++)
+        fprintf(stdout, "\t%s\n", benchmarks[i].name);
+
+    fprintf(stdout, "\t-m: write results as CSV (%s)\n", BENCH_CSV_HEADER);
+    fprintf(stdout, "\t-n: run every benchmark the given number of times "
+            "(default: 1)\n");
+}
+
+static const struct portpilot_bench* find_benchmark(const char *name)
+{
+    uint32_t i;
+
+    for (i = 0; i < NUM_BENCHMARKS; i++) {
+        if (!strcmp(name, benchmarks[i].name))
+            return &benchmarks[i];
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    const struct portpilot_bench *bench;
+    uint32_t i, num_runs = 1;
+    int32_t opt, j;
+
+    while ((opt = getopt(argc, argv, "mn:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            machine_readable = 1;
+            break;
+        case 'n':
+            opt = atoi(optarg);
+
+            if (opt < 1) {
+                fprintf(stderr, "Number of runs must be at least 1\n");
+                exit(EXIT_FAILURE);
+            }
+
+            num_runs = (uint32_t) opt;
+            break;
+        case 'h':
+        default:
+            usage();
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    for (j = optind; j < argc; j++) {
+        if (!find_benchmark(argv[j])) {
+            fprintf(stderr, "Unknown benchmark %s\n", argv[j]);
+            usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (machine_readable)
+        fprintf(stdout, "%s\n", BENCH_CSV_HEADER);
+
+    for (run = 0; run < num_runs; run++) {
+        if (optind == argc) {
+            for (i = 0; i < NUM_BENCHMARKS; i++)
+                benchmarks[i].run();
+
+            continue;
+        }
+
+        for (j = optind; j < argc; j++) {
+            bench = find_benchmark(argv[j]);
+            bench->run();
+        }
+    }
+
+    exit(EXIT_SUCCESS);
+}
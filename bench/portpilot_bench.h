@@ -0,0 +1,105 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef PORTPILOT_BENCH_H
+#define PORTPILOT_BENCH_H
+
+#include <stdint.h>
+
+//Columns of the machine-readable (-m) results. run is the repetition (-n),
+//total_ns the time spent performing ops operations
+#define BENCH_CSV_HEADER "benchmark,run,ops,total_ns,ns_per_op,ops_per_sec"
+
+//A benchmark is a named function that runs one or more measurements and
+//reports each of them through portpilot_bench_report()
+struct portpilot_bench {
+    const char *name;
+    void (*run)();
+};
+
+//Monotonic time and CPU time consumed by the process, both in ns
+uint64_t portpilot_bench_now_ns();
+uint64_t portpilot_bench_cpu_ns();
+
+//Report the result of one measurement. ns is the total time spent performing
+//ops operations
+void portpilot_bench_report(const char *name, uint64_t ops, uint64_t ns);
+
+//Report that a measurement could not be performed, for example because the CPU
+//does not support an instruction set
+void portpilot_bench_skip(const char *name, const char *reason);
+
+//Report something that is not a rate (for example a size), printf-style
+void portpilot_bench_note(const char *name, const char *fmt, ...);
+
+//Send stdout to /dev/null, for measuring code that writes its output there.
+//Returns the fd to pass to portpilot_bench_stdout_restore()
+int32_t portpilot_bench_stdout_to_null();
+void portpilot_bench_stdout_restore(int32_t stdout_fd);
+
+//Fill num_pkts buffers of pkt_len bytes (at least the size of struct
+//portpilot_pkt) with packets that look like what a Portpilot sends
+void portpilot_bench_fill_pkts(uint8_t *buf, uint32_t pkt_len,
+        uint32_t num_pkts);
+
+//Timer insert, remove and expiry in backend_event_loop
+void portpilot_bench_timers();
+
+//Event throughput of the epoll and io_uring backends of the event loop
+void portpilot_bench_backends();
+
+//Packet throughput with an increasing number of event loops/threads
+void portpilot_bench_shards();
+
+//Throughput and wakeup latency of posting tasks to the event loop from other
+//threads
+void portpilot_bench_post();
+
+//Packet throughput of the per-packet and batch (scalar/SIMD) decoders
+void portpilot_bench_decode();
+
+//Attach, lookup and detach cost with thousands of devices
+void portpilot_bench_devices();
+
+//Text and CSV formatting of the output
+void portpilot_bench_format();
+
+//Sustained packet rate and CPU time per packet of the logger with up to 1000
+//simulated devices
+void portpilot_bench_sim();
+
+//Writing the binary log, and reading it back (all of it and a time slice)
+void portpilot_bench_binlog();
+
+//Encoding and decoding of the compressed sample format, and how much smaller
+//it is than CSV and the binary log
+void portpilot_bench_codec();
+
+//Publishing samples in shared memory, and concurrent readers checking that
+//they never get a torn sample
+void portpilot_bench_shm();
+
+//Scan, hotplug and report reading of the hidraw backend against a fake sysfs
+//tree, checking that every report comes out decoded
+void portpilot_bench_hidraw();
+
+//Devices that fail to attach (busy interface, serial number mismatch), checking
+//that they are closed without deadlocking on the libusb events lock and that a
+//stale cached serial number is replaced
+void portpilot_bench_attach();
+
+#endif
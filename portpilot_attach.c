@@ -0,0 +1,317 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libusb-1.0/libusb.h>
+
+#include "portpilot_attach.h"
+#include "portpilot_logger.h"
+#include "portpilot_helpers.h"
+#include "portpilot_worker.h"
+#include "portpilot_dev_cache.h"
+#include "backend_event_loop.h"
+
+//String descriptors are at most 255 bytes
+#define ATTACH_STRING_LEN 255
+#define ATTACH_CTRL_TIMEOUT 1000
+
+static void portpilot_attach_cb(void *ptr);
+static void portpilot_attach_ctrl_cb(struct libusb_transfer *transfer);
+
+static void portpilot_attach_fail(struct portpilot_dev *pp_dev,
+        const char *reason, int32_t retval)
+{
+    if (retval)
+        fprintf(stderr, "Failed to %s: %s\n", reason,
+                libusb_error_name(retval));
+    else
+        fprintf(stderr, "%s\n", reason);
+
+    portpilot_helpers_free_dev(pp_dev);
+}
+
+//Run the next step of the state machine on the next turn of the loop, after
+//the events that are already ready have been handled
+static void portpilot_attach_next_turn(struct portpilot_dev *pp_dev,
+        uint8_t attach_state)
+{
+    pp_dev->attach_state = attach_state;
+    pp_dev->attach_handle->timeout_clock = backend_event_loop_now();
+
+    if (backend_event_loop_insert_timeout(pp_dev->pp_ctx->event_loop,
+                pp_dev->attach_handle))
+        portpilot_attach_fail(pp_dev, "Failed to schedule attach", 0);
+}
+
+static uint8_t portpilot_attach_get_string(struct portpilot_dev *pp_dev,
+        uint8_t desc_idx, uint16_t langid)
+{
+    struct libusb_transfer *transfer = pp_dev->ctrl_transfer;
+    uint8_t *buf;
+
+    if (!transfer) {
+        transfer = libusb_alloc_transfer(0);
+        buf = malloc(LIBUSB_CONTROL_SETUP_SIZE + ATTACH_STRING_LEN);
+
+        if (!transfer || !buf) {
+            libusb_free_transfer(transfer);
+            free(buf);
+            return RETVAL_FAILURE;
+        }
+
+        transfer->buffer = buf;
+        transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+        pp_dev->ctrl_transfer = transfer;
+    }
+
+    libusb_fill_control_setup(transfer->buffer, LIBUSB_ENDPOINT_IN,
+            LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_STRING << 8) | desc_idx,
+            langid, ATTACH_STRING_LEN);
+    libusb_fill_control_transfer(transfer, pp_dev->handle, transfer->buffer,
+            portpilot_attach_ctrl_cb, pp_dev, ATTACH_CTRL_TIMEOUT);
+
+    if (libusb_submit_transfer(transfer))
+        return RETVAL_FAILURE;
+
+    pp_dev->ctrl_pending = 1;
+
+    //The transfer might be the next to time out, a device that never answers
+    //would otherwise keep the attach waiting forever
+    portpilot_helpers_update_usb_timeout(pp_dev->pp_ctx);
+
+    return RETVAL_SUCCESS;
+}
+
+//Same conversion as libusb_get_string_descriptor_ascii(), non-ASCII characters
+//are replaced by '?'
+static void portpilot_attach_parse_string(uint8_t *str, const uint8_t *data,
+        uint16_t len)
+{
+    uint16_t i, j = 0;
+
+    if (data[0] < len)
+        len = data[0];
+
+    for (i = 2; i + 1 < len && j < MAX_USB_STR_LEN; i += 2) {
+        if (data[i + 1] || (data[i] & 0x80))
+            str[j++] = '?';
+        else
+            str[j++] = data[i];
+    }
+
+    str[j] = '\0';
+}
+
+//The serial number has been read, or we have given up on reading it. It is not
+//critical if it is not present, the device is cached anyway so that we do not
+//parse the config descriptor again. A cached device starts out with the cached
+//serial number, which is replaced if another unit is on the port now
+static void portpilot_attach_serial_done(struct portpilot_dev *pp_dev,
+        const uint8_t *serial_number)
+{
+    struct portpilot_ctx *pp_ctx = pp_dev->pp_ctx;
+    struct libusb_device_descriptor desc = {0};
+    struct portpilot_dev_info info = {{0}};
+    uint8_t stale = strcmp((const char*) pp_dev->serial_number,
+            (const char*) serial_number) != 0;
+
+    if (pp_dev->attach_cached && stale)
+        fprintf(stderr, "Cached serial number %s is stale, device is %s\n",
+                pp_dev->serial_number, serial_number);
+
+    strcpy((char*) pp_dev->serial_number, (const char*) serial_number);
+
+    if (!pp_dev->attach_cached || stale) {
+        memcpy(info.serial_number, pp_dev->serial_number,
+                sizeof(info.serial_number));
+        info.max_packet_size = pp_dev->max_packet_size;
+        info.input_endpoint = pp_dev->input_endpoint;
+        info.intf_num = pp_dev->intf_num;
+
+        libusb_get_device_descriptor(pp_dev->device, &desc);
+        portpilot_dev_cache_insert(pp_ctx->shards->dev_cache, pp_dev->path,
+                pp_dev->path_len, &desc, &info);
+    }
+
+    if (pp_ctx->desired_serial &&
+        !portpilot_helpers_cmp_serial(pp_ctx->desired_serial,
+            pp_dev->serial_number)) {
+        portpilot_attach_fail(pp_dev, "Serial number mismatch", 0);
+        return;
+    }
+
+    portpilot_attach_next_turn(pp_dev, ATTACH_STATE_CLAIM);
+}
+
+static void portpilot_attach_ctrl_cb(struct libusb_transfer *transfer)
+{
+    struct portpilot_dev *pp_dev = transfer->user_data;
+    struct portpilot_ctx *pp_ctx = pp_dev->pp_ctx;
+    const uint8_t *data = libusb_control_transfer_get_data(transfer);
+    uint8_t serial_number[MAX_USB_STR_LEN + 1] = {0};
+    uint8_t valid;
+
+    pp_dev->ctrl_pending = 0;
+
+    //Device was removed while we waited for the transfer
+    if (pp_dev->attach_state == ATTACH_STATE_REMOVED) {
+        portpilot_helpers_free_dev(pp_dev);
+        return;
+    }
+
+    //Same as for the read transfers, the device is freed with the context
+    if (pp_ctx->num_cancel) {
+        if (++pp_ctx->num_cancelled == pp_ctx->num_cancel)
+            backend_event_loop_stop(pp_ctx->event_loop);
+        return;
+    }
+
+    valid = transfer->status == LIBUSB_TRANSFER_COMPLETED &&
+        transfer->actual_length >= 2 && data[1] == LIBUSB_DT_STRING;
+
+    if (pp_dev->attach_state == ATTACH_STATE_LANGID) {
+        //Ask for the serial number in the first supported language
+        if (valid && transfer->actual_length >= 4 &&
+            portpilot_attach_get_string(pp_dev, pp_dev->serial_idx,
+                data[2] | (data[3] << 8))) {
+            pp_dev->attach_state = ATTACH_STATE_SERIAL;
+            return;
+        }
+    } else if (valid) {
+        portpilot_attach_parse_string(serial_number, data,
+                transfer->actual_length);
+    }
+
+    if (!serial_number[0])
+        fprintf(stderr, "Failed to get serial number\n");
+
+    portpilot_attach_serial_done(pp_dev, serial_number);
+}
+
+static void portpilot_attach_open(struct portpilot_dev *pp_dev)
+{
+    struct libusb_device_descriptor desc = {0};
+    int32_t retval;
+
+    retval = libusb_open(pp_dev->device, &(pp_dev->handle));
+
+    if (retval) {
+        pp_dev->handle = NULL;
+        portpilot_attach_fail(pp_dev, "open device", retval);
+        return;
+    }
+
+    libusb_get_device_descriptor(pp_dev->device, &desc);
+    pp_dev->serial_idx = desc.iSerialNumber;
+
+    //No device number to extract
+    if (!pp_dev->serial_idx) {
+        fprintf(stderr, "Device serial number missing\n");
+        portpilot_attach_serial_done(pp_dev, (const uint8_t*) "");
+        return;
+    }
+
+    //String descriptor 0 contains the supported languages
+    if (!portpilot_attach_get_string(pp_dev, 0, 0)) {
+        fprintf(stderr, "Failed to request serial number\n");
+        portpilot_attach_serial_done(pp_dev, (const uint8_t*) "");
+        return;
+    }
+
+    pp_dev->attach_state = ATTACH_STATE_LANGID;
+}
+
+static void portpilot_attach_claim(struct portpilot_dev *pp_dev)
+{
+    struct portpilot_ctx *pp_ctx = pp_dev->pp_ctx;
+    uint64_t attach_ns;
+    int32_t retval;
+
+    if (libusb_kernel_driver_active(pp_dev->handle, pp_dev->intf_num) == 1) {
+        retval = libusb_detach_kernel_driver(pp_dev->handle, pp_dev->intf_num);
+
+        if (retval) {
+            portpilot_attach_fail(pp_dev, "detach kernel driver", retval);
+            return;
+        }
+    }
+
+    retval = libusb_claim_interface(pp_dev->handle, pp_dev->intf_num);
+
+    if (retval) {
+        portpilot_attach_fail(pp_dev, "claim interface", retval);
+        return;
+    }
+
+    if (pp_ctx->worker && !portpilot_worker_add_dev(pp_ctx->worker, pp_dev)) {
+        portpilot_attach_fail(pp_dev, "Failed to hand device to worker", 0);
+        return;
+    }
+
+    pp_dev->attach_state = ATTACH_STATE_DONE;
+
+    //Nothing more to attach
+    backend_event_loop_free_timeout(pp_ctx->event_loop, pp_dev->attach_handle);
+    pp_dev->attach_handle = NULL;
+    libusb_unref_device(pp_dev->device);
+    pp_dev->device = NULL;
+
+    if (pp_dev->ctrl_transfer) {
+        libusb_free_transfer(pp_dev->ctrl_transfer);
+        pp_dev->ctrl_transfer = NULL;
+    }
+
+    atomic_fetch_add(&(pp_ctx->shards->num_devs), 1);
+
+    attach_ns = portpilot_helpers_now_ns() - pp_dev->attach_start;
+    backend_histogram_add(&(pp_ctx->attach_latency), attach_ns);
+
+    fprintf(stdout, "Ready to start reading on device %s (attached in %.3f "
+            "ms)\n", pp_dev->serial_number, attach_ns / 1000000.0);
+
+    portpilot_helpers_start_reading_data(pp_dev);
+}
+
+static void portpilot_attach_cb(void *ptr)
+{
+    struct portpilot_dev *pp_dev = ptr;
+
+    if (pp_dev->attach_state == ATTACH_STATE_OPEN)
+        portpilot_attach_open(pp_dev);
+    else if (pp_dev->attach_state == ATTACH_STATE_CLAIM)
+        portpilot_attach_claim(pp_dev);
+}
+
+uint8_t portpilot_attach_start(struct portpilot_dev *pp_dev,
+        struct libusb_device *device, uint8_t cached)
+{
+    pp_dev->attach_handle = backend_event_loop_add_timeout(
+            pp_dev->pp_ctx->event_loop, backend_event_loop_now(),
+            portpilot_attach_cb, pp_dev, 0);
+
+    if (!pp_dev->attach_handle)
+        return RETVAL_FAILURE;
+
+    pp_dev->device = libusb_ref_device(device);
+    pp_dev->attach_start = portpilot_helpers_now_ns();
+    pp_dev->attach_cached = cached;
+    pp_dev->attach_state = ATTACH_STATE_OPEN;
+
+    return RETVAL_SUCCESS;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef PORTPILOT_ATTACH_H
+#define PORTPILOT_ATTACH_H
+
+#include <stdint.h>
+
+struct libusb_device;
+struct portpilot_dev;
+
+//Attaching a device is a state machine driven by the event loop of the shard,
+//so that attaching many devices at once does not stall the devices that are
+//already streaming. The hotplug callback only creates the device
+//(ATTACH_STATE_OPEN), every following step runs from the loop:
+//
+//OPEN: the device is opened on the next turn of the loop. The string
+//descriptors are requested with asynchronous control transfers, first the
+//supported languages (LANGID) and then the serial number (SERIAL). This is also
+//done for cached devices, another unit might be on the port now
+//
+//CLAIM: the kernel driver is detached and the interface claimed on the next
+//turn of the loop. The device is then attached (DONE) and starts reading
+//
+//A device that is removed while a control transfer is in flight is unlinked,
+//but only freed when the transfer has been cancelled (REMOVED)
+enum {
+    ATTACH_STATE_DONE = 0,
+    ATTACH_STATE_OPEN,
+    ATTACH_STATE_LANGID,
+    ATTACH_STATE_SERIAL,
+    ATTACH_STATE_CLAIM,
+    ATTACH_STATE_REMOVED,
+};
+
+//Start attaching pp_dev, which must be fully initialised except for the handle.
+//When cached is set, the serial number of pp_dev comes from the device cache.
+//It is checked against the one read from the device, and the cache entry is
+//replaced if they differ. Returns RETVAL_SUCCESS/RETVAL_FAILURE
+uint8_t portpilot_attach_start(struct portpilot_dev *pp_dev,
+        struct libusb_device *device, uint8_t cached);
+
+#endif
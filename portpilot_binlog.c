@@ -0,0 +1,470 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <libusb-1.0/libusb.h>
+
+#include "portpilot_binlog.h"
+#include "portpilot_logger.h"
+#include "portpilot_helpers.h"
+
+_Static_assert(sizeof(struct portpilot_binlog_hdr) == 32,
+        "binlog header must be 32 bytes");
+_Static_assert(sizeof(struct portpilot_binlog_record) == 40,
+        "binlog record must be 40 bytes");
+_Static_assert(sizeof(struct portpilot_binlog_block) % 8 == 0,
+        "binlog block header must be a multiple of 8 bytes");
+_Static_assert(sizeof(struct portpilot_binlog_index_entry) == 40,
+        "binlog index entry must be 40 bytes");
+
+//Write iov at offset with the I/O thread and wait until it is done. close_fd is
+//set for the last write, the file is then synced (unless the sync policy is
+//none) and closed. Returns RETVAL_SUCCESS/RETVAL_FAILURE
+static uint8_t portpilot_binlog_write_sync(struct portpilot_binlog *binlog,
+        const struct iovec *iov, int32_t iovcnt, uint64_t offset,
+        uint8_t close_fd)
+{
+    struct portpilot_io_req req = {0};
+
+    memcpy(req.iov, iov, iovcnt * sizeof(struct iovec));
+    req.iovcnt = iovcnt;
+    req.fd = binlog->fd;
+    req.offset = offset;
+    req.positioned = 1;
+    req.close_fd = close_fd;
+
+    portpilot_io_submit(binlog->io, &req);
+    portpilot_io_wait(binlog->io, &req);
+
+    return !req.failed;
+}
+
+struct portpilot_binlog* portpilot_binlog_create(const char *path,
+        struct portpilot_io *io)
+{
+    struct portpilot_binlog *binlog;
+    struct portpilot_binlog_hdr hdr = {0};
+    struct timespec mono, real;
+    struct iovec iov;
+
+    binlog = calloc(sizeof(struct portpilot_binlog), 1);
+
+    if (!binlog)
+        return NULL;
+
+    if (pthread_mutex_init(&(binlog->lock), NULL)) {
+        free(binlog);
+        return NULL;
+    }
+
+    binlog->io = io;
+    binlog->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    //The log is synced according to the policy, like the rest of the output
+    if (binlog->fd < 0 || !portpilot_io_add_file(io, binlog->fd, NULL)) {
+        if (binlog->fd >= 0)
+            close(binlog->fd);
+
+        pthread_mutex_destroy(&(binlog->lock));
+        free(binlog);
+        return NULL;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    binlog->realtime_offset = ((real.tv_sec * 1000000000ULL) + real.tv_nsec) -
+        ((mono.tv_sec * 1000000000ULL) + mono.tv_nsec);
+
+    memcpy(hdr.magic, BINLOG_MAGIC, sizeof(hdr.magic));
+    hdr.version = BINLOG_VERSION;
+    hdr.record_size = sizeof(struct portpilot_binlog_record);
+    hdr.block_records = BINLOG_BLOCK_RECORDS;
+    hdr.create_ns = (real.tv_sec * 1000000000ULL) + real.tv_nsec;
+
+    iov.iov_base = &hdr;
+    iov.iov_len = sizeof(hdr);
+
+    if (!portpilot_binlog_write_sync(binlog, &iov, 1, 0, 0)) {
+        //Nothing is written, the file is only closed
+        portpilot_binlog_write_sync(binlog, &iov, 0, 0, 1);
+        pthread_mutex_destroy(&(binlog->lock));
+        free(binlog);
+        return NULL;
+    }
+
+    binlog->offset = sizeof(hdr);
+
+    return binlog;
+}
+
+static int portpilot_binlog_cmp_entry(const void *a, const void *b)
+{
+    const struct portpilot_binlog_index_entry *e1 = a, *e2 = b;
+
+    if (e1->first_ns != e2->first_ns)
+        return e1->first_ns < e2->first_ns ? -1 : 1;
+
+    return e1->offset < e2->offset ? -1 : 1;
+}
+
+uint8_t portpilot_binlog_close(struct portpilot_binlog *binlog)
+{
+    struct portpilot_binlog_trailer trailer = {0};
+    struct iovec iov[2];
+    uint64_t max_last_ns = 0, index_len;
+    uint8_t retval;
+    uint32_t i, j;
+
+    //Blocks that could not be written have no records in the index
+    for (i = 0, j = 0; i < binlog->index_len; i++) {
+        if (binlog->index[i].num_records)
+            binlog->index[j++] = binlog->index[i];
+    }
+
+    binlog->index_len = j;
+
+    //Blocks are indexed in the order they were written, which is not the
+    //order of first_ns when there are multiple devices
+    qsort(binlog->index, binlog->index_len,
+            sizeof(struct portpilot_binlog_index_entry),
+            portpilot_binlog_cmp_entry);
+
+    for (i = 0; i < binlog->index_len; i++) {
+        if (binlog->index[i].last_ns > max_last_ns)
+            max_last_ns = binlog->index[i].last_ns;
+
+        binlog->index[i].max_last_ns = max_last_ns;
+    }
+
+    index_len = binlog->index_len * sizeof(struct portpilot_binlog_index_entry);
+    trailer.index_offset = binlog->offset;
+    trailer.num_entries = binlog->index_len;
+    trailer.magic = BINLOG_INDEX_MAGIC;
+
+    iov[0].iov_base = binlog->index;
+    iov[0].iov_len = index_len;
+    iov[1].iov_base = &trailer;
+    iov[1].iov_len = sizeof(trailer);
+
+    //Every block has its own place in the file, so nothing has been written
+    //after the last one
+    retval = portpilot_binlog_write_sync(binlog, iov, 2, binlog->offset, 1);
+
+    if (binlog->num_errors) {
+        fprintf(stderr, "Failed to write %llu record(s) to binary log\n",
+                (unsigned long long) binlog->num_errors);
+        retval = RETVAL_FAILURE;
+    }
+
+    pthread_mutex_destroy(&(binlog->lock));
+    free(binlog->index);
+    free(binlog->serials);
+    free(binlog);
+
+    return retval;
+}
+
+//Get the serial_id of pp_dev, assigning a new one if the device has not been
+//seen before. Must be called with the lock held. Returns
+//RETVAL_SUCCESS/RETVAL_FAILURE
+static uint8_t portpilot_binlog_get_serial_id(struct portpilot_binlog *binlog,
+        const struct portpilot_dev *pp_dev, uint32_t *serial_id)
+{
+    struct portpilot_binlog_serial *serials, *serial;
+    uint32_t i, serials_size;
+
+    //Only done when a device outputs for the first time
+    for (i = 0; i < binlog->num_serials; i++) {
+        serial = &(binlog->serials[i]);
+
+        if (portpilot_helpers_cmp_dev(serial->serial_number, serial->path,
+                    serial->path_len, pp_dev->serial_number, pp_dev->path,
+                    pp_dev->path_len)) {
+            *serial_id = i;
+            return RETVAL_SUCCESS;
+        }
+    }
+
+    if (binlog->num_serials == binlog->serials_size) {
+        serials_size = binlog->serials_size ? binlog->serials_size * 2 : 16;
+        serials = realloc(binlog->serials, serials_size *
+                sizeof(binlog->serials[0]));
+
+        if (!serials)
+            return RETVAL_FAILURE;
+
+        binlog->serials = serials;
+        binlog->serials_size = serials_size;
+    }
+
+    serial = &(binlog->serials[binlog->num_serials]);
+    memcpy(serial->serial_number, pp_dev->serial_number,
+            sizeof(serial->serial_number));
+    memcpy(serial->path, pp_dev->path, pp_dev->path_len);
+    serial->path_len = pp_dev->path_len;
+    *serial_id = binlog->num_serials++;
+
+    return RETVAL_SUCCESS;
+}
+
+//Wait until the I/O thread is done with block (if it has been handed to it),
+//so that the block can be filled again. The records of a block that could not
+//be written are taken out of the index
+static void portpilot_binlog_reap(struct portpilot_binlog_writer *writer,
+        struct portpilot_binlog_pending *block)
+{
+    struct portpilot_binlog *binlog = writer->binlog;
+
+    writer->wait_ns += portpilot_io_wait(binlog->io, &(block->req));
+
+    if (block->req.failed) {
+        pthread_mutex_lock(&(binlog->lock));
+        binlog->index[block->index_idx].num_records = 0;
+        binlog->num_records -= block->hdr.num_records;
+        binlog->num_errors += block->hdr.num_records;
+        pthread_mutex_unlock(&(binlog->lock));
+        block->req.failed = 0;
+    }
+
+    block->hdr.num_records = 0;
+}
+
+//Give the block being filled its place in the file and index it, hand it to
+//the I/O thread and move on to the next block of the slot. Only the offset is
+//taken under lock, the block is written without it
+static void portpilot_binlog_write_block(struct portpilot_binlog_writer *writer,
+        struct portpilot_binlog_slot *slot)
+{
+    struct portpilot_binlog *binlog = writer->binlog;
+    struct portpilot_binlog_pending *block = &(slot->blocks[slot->cur]);
+    struct portpilot_binlog_index_entry *entry;
+    uint32_t index_size;
+    uint64_t offset;
+
+    pthread_mutex_lock(&(binlog->lock));
+
+    if (binlog->index_len == binlog->index_size) {
+        index_size = binlog->index_size ? binlog->index_size * 2 : 1024;
+        entry = realloc(binlog->index, index_size *
+                sizeof(struct portpilot_binlog_index_entry));
+
+        if (!entry) {
+            binlog->num_errors += block->hdr.num_records;
+            pthread_mutex_unlock(&(binlog->lock));
+            block->hdr.num_records = 0;
+            return;
+        }
+
+        binlog->index = entry;
+        binlog->index_size = index_size;
+    }
+
+    block->index_idx = binlog->index_len;
+    offset = binlog->offset;
+
+    entry = &(binlog->index[binlog->index_len++]);
+    entry->offset = offset;
+    entry->first_ns = block->hdr.first_ns;
+    entry->last_ns = block->hdr.last_ns;
+    entry->max_last_ns = 0;
+    entry->serial_id = block->hdr.serial_id;
+    entry->num_records = block->hdr.num_records;
+
+    binlog->offset += sizeof(block->hdr) + (block->hdr.num_records *
+            sizeof(struct portpilot_binlog_record));
+    binlog->num_records += block->hdr.num_records;
+
+    pthread_mutex_unlock(&(binlog->lock));
+
+    block->req.iov[0].iov_base = &(block->hdr);
+    block->req.iov[0].iov_len = sizeof(block->hdr);
+    block->req.iov[1].iov_base = block->records;
+    block->req.iov[1].iov_len = block->hdr.num_records *
+        sizeof(struct portpilot_binlog_record);
+    block->req.iovcnt = 2;
+    block->req.fd = binlog->fd;
+    block->req.offset = offset;
+    block->req.positioned = 1;
+    portpilot_io_submit(binlog->io, &(block->req));
+
+    //Wait for the next block to be written, if it has not been already
+    slot->cur = (slot->cur + 1) % BINLOG_NUM_BUFS;
+    portpilot_binlog_reap(writer, &(slot->blocks[slot->cur]));
+}
+
+struct portpilot_binlog_writer* portpilot_binlog_writer_create(
+        struct portpilot_binlog *binlog)
+{
+    struct portpilot_binlog_writer *writer;
+
+    writer = calloc(sizeof(struct portpilot_binlog_writer), 1);
+
+    if (!writer)
+        return NULL;
+
+    writer->binlog = binlog;
+
+    return writer;
+}
+
+void portpilot_binlog_writer_free(struct portpilot_binlog_writer *writer)
+{
+    uint32_t i, j;
+
+    portpilot_binlog_writer_flush(writer, 1);
+
+    //The I/O thread might still be writing blocks
+    for (i = 0; i < writer->num_slots; i++) {
+        for (j = 0; j < BINLOG_NUM_BUFS; j++)
+            portpilot_binlog_reap(writer, &(writer->slots[i]->blocks[j]));
+
+        free(writer->slots[i]);
+    }
+
+    free(writer->slots);
+    free(writer);
+}
+
+//Find the slot of a device that has not output anything yet. Returns 0 on
+//failure
+static uint32_t portpilot_binlog_get_slot(
+        struct portpilot_binlog_writer *writer,
+        const struct portpilot_dev *pp_dev)
+{
+    struct portpilot_binlog *binlog = writer->binlog;
+    struct portpilot_binlog_slot *slot, **slots;
+    struct portpilot_binlog_pending *block;
+    uint32_t i, slots_size, serial_id;
+    uint8_t retval;
+
+    pthread_mutex_lock(&(binlog->lock));
+    retval = portpilot_binlog_get_serial_id(binlog, pp_dev, &serial_id);
+    pthread_mutex_unlock(&(binlog->lock));
+
+    if (!retval)
+        return 0;
+
+    for (i = 0; i < writer->num_slots; i++) {
+        if (writer->slots[i]->blocks[0].hdr.serial_id == serial_id)
+            return i + 1;
+    }
+
+    if (writer->num_slots == writer->slots_size) {
+        slots_size = writer->slots_size ? writer->slots_size * 2 : 16;
+        slots = realloc(writer->slots, slots_size *
+                sizeof(struct portpilot_binlog_slot*));
+
+        if (!slots)
+            return 0;
+
+        writer->slots = slots;
+        writer->slots_size = slots_size;
+    }
+
+    slot = calloc(sizeof(struct portpilot_binlog_slot), 1);
+
+    if (!slot)
+        return 0;
+
+    for (i = 0; i < BINLOG_NUM_BUFS; i++) {
+        block = &(slot->blocks[i]);
+        block->hdr.magic = BINLOG_BLOCK_MAGIC;
+        block->hdr.serial_id = serial_id;
+        memcpy(block->hdr.serial_number, pp_dev->serial_number,
+                sizeof(block->hdr.serial_number));
+
+        //Not handed to the I/O thread yet
+        block->req.done = 1;
+    }
+
+    writer->slots[writer->num_slots++] = slot;
+
+    return writer->num_slots;
+}
+
+void portpilot_binlog_write(struct portpilot_binlog_writer *writer,
+        struct portpilot_dev *pp_dev, const struct portpilot_data *pp_data)
+{
+    struct portpilot_binlog_pending *block;
+    struct portpilot_binlog_record *record;
+    struct portpilot_binlog_slot *slot;
+    uint64_t host_ns;
+
+    if (!pp_dev->binlog_slot &&
+        !(pp_dev->binlog_slot = portpilot_binlog_get_slot(writer, pp_dev))) {
+        pthread_mutex_lock(&(writer->binlog->lock));
+        ++writer->binlog->num_errors;
+        pthread_mutex_unlock(&(writer->binlog->lock));
+        return;
+    }
+
+    slot = writer->slots[pp_dev->binlog_slot - 1];
+    block = &(slot->blocks[slot->cur]);
+    host_ns = pp_data->host_ns + writer->binlog->realtime_offset;
+
+    if (!block->hdr.num_records) {
+        block->hdr.first_ns = host_ns;
+        block->opened_ns = pp_data->host_ns;
+    }
+
+    record = &(block->records[block->hdr.num_records++]);
+    record->host_ns = host_ns;
+    record->serial_id = block->hdr.serial_id;
+    record->tstamp = pp_data->tstamp;
+    record->v_in = pp_data->v_in;
+    record->v_out = pp_data->v_out;
+    record->energy = pp_data->energy;
+    record->total_energy = pp_data->total_energy;
+    record->current = pp_data->current;
+    record->max_current = pp_data->max_current;
+    record->num_readings = pp_data->num_readings;
+    record->__pad = 0;
+
+    block->hdr.last_ns = host_ns;
+
+    if (block->hdr.num_records == BINLOG_BLOCK_RECORDS)
+        portpilot_binlog_write_block(writer, slot);
+}
+
+void portpilot_binlog_writer_flush(struct portpilot_binlog_writer *writer,
+        uint8_t force)
+{
+    struct portpilot_binlog_pending *block;
+    struct portpilot_binlog_slot *slot;
+    uint64_t oldest_ns = 0;
+    uint32_t i;
+
+    if (!force)
+        oldest_ns = portpilot_helpers_now_ns() -
+            (BINLOG_BLOCK_MAX_AGE * 1000000ULL);
+
+    for (i = 0; i < writer->num_slots; i++) {
+        slot = writer->slots[i];
+        block = &(slot->blocks[slot->cur]);
+
+        if (block->hdr.num_records &&
+            (force || block->opened_ns <= oldest_ns))
+            portpilot_binlog_write_block(writer, slot);
+    }
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef PORTPILOT_BINLOG_H
+#define PORTPILOT_BINLOG_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "portpilot_logger.h"
+#include "portpilot_io.h"
+
+//Binary log (-b). The file starts with a header, followed by blocks of
+//fixed-width records and ends with a sparse index of the blocks. All integers
+//are in host byte order, so a log is only meant to be read on a machine with
+//the same endianness as the one that wrote it. Every block contains records of
+//a single device, in the order they were received. A block is written when it
+//holds BINLOG_BLOCK_RECORDS records, when its first record is older than
+//BINLOG_BLOCK_MAX_AGE ms, or when the logger exits. A device fills one of
+//BINLOG_NUM_BUFS blocks while the I/O thread writes the others
+#define BINLOG_MAGIC "PPBINLOG"
+#define BINLOG_VERSION 1
+#define BINLOG_BLOCK_MAGIC 0x4b4c4250
+#define BINLOG_INDEX_MAGIC 0x58444950
+#define BINLOG_BLOCK_RECORDS 256
+#define BINLOG_BLOCK_MAX_AGE 10000
+#define BINLOG_NUM_BUFS 2
+
+struct portpilot_data;
+struct portpilot_dev;
+
+struct portpilot_binlog_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t block_records;
+    uint32_t __pad;
+    //When (realtime ns) the log was created
+    uint64_t create_ns;
+};
+
+//One portpilot_data (not averaged). host_ns is when (realtime ns) the transfer
+//completed, tstamp is the timestamp (seconds) reported by the device. Devices
+//are identified by serial_id, which maps to the serial number stored in the
+//header of every block. Devices without a serial number get a serial_id per
+//bus/port path
+struct portpilot_binlog_record {
+    uint64_t host_ns;
+    uint32_t serial_id;
+    uint32_t tstamp;
+    uint32_t v_in;
+    uint32_t v_out;
+    uint32_t energy;
+    uint32_t total_energy;
+    uint16_t current;
+    uint16_t max_current;
+    uint16_t num_readings;
+    uint16_t __pad;
+};
+
+//Header of a block, followed by num_records records. first_ns/last_ns are the
+//host_ns of the first/last record
+struct portpilot_binlog_block {
+    uint32_t magic;
+    uint32_t serial_id;
+    uint32_t num_records;
+    uint32_t __pad;
+    uint64_t first_ns;
+    uint64_t last_ns;
+    uint8_t serial_number[MAX_USB_STR_LEN + 1];
+};
+
+//The index has one entry per block, sorted on first_ns. max_last_ns is the
+//largest last_ns of this and all previous entries, so that the entries that
+//can contain records in a time range are found with two binary searches
+struct portpilot_binlog_index_entry {
+    uint64_t offset;
+    uint64_t first_ns;
+    uint64_t last_ns;
+    uint64_t max_last_ns;
+    uint32_t serial_id;
+    uint32_t num_records;
+};
+
+//Last bytes of the file. A log without a trailer (the logger was killed) is
+//still readable, the reader then rebuilds the index from the blocks
+struct portpilot_binlog_trailer {
+    uint64_t index_offset;
+    uint32_t num_entries;
+    uint32_t magic;
+};
+
+//A device that has been assigned a serial_id. path is only used to tell apart
+//devices without a serial number
+struct portpilot_binlog_serial {
+    uint8_t serial_number[MAX_USB_STR_LEN + 1];
+    uint8_t path[USB_MAX_PATH];
+    uint8_t path_len;
+};
+
+//The log file is shared by all shards. A block is given its place in the file
+//and indexed under lock, it is then written by the I/O thread (so -y applies to
+//the log too). The devices that have been assigned a serial_id (index in
+//serials) are kept here too, so that a device has the same id in all shards.
+//realtime_offset converts the monotonic timestamps of the logger to realtime
+struct portpilot_binlog {
+    pthread_mutex_t lock;
+    struct portpilot_io *io;
+    struct portpilot_binlog_index_entry *index;
+    struct portpilot_binlog_serial *serials;
+    uint64_t offset;
+    uint64_t realtime_offset;
+    uint64_t num_records;
+    uint64_t num_errors;
+    uint32_t index_len;
+    uint32_t index_size;
+    uint32_t num_serials;
+    uint32_t serials_size;
+    int32_t fd;
+};
+
+//A block of a device, opened_ns is when (monotonic ns) the first record was
+//added. req writes the block, index_idx is its entry in the index
+struct portpilot_binlog_pending {
+    struct portpilot_binlog_block hdr;
+    struct portpilot_binlog_record records[BINLOG_BLOCK_RECORDS];
+    struct portpilot_io_req req;
+    uint64_t opened_ns;
+    uint32_t index_idx;
+};
+
+//The blocks of a device, cur is the one being filled
+struct portpilot_binlog_slot {
+    struct portpilot_binlog_pending blocks[BINLOG_NUM_BUFS];
+    uint8_t cur;
+};
+
+//Every shard has a writer, only used by the thread that outputs. A device
+//keeps its slot (index + 1 in slots) in binlog_slot. Slots are not freed when
+//a device is removed, a device that comes back gets its old slot. wait_ns is
+//the time spent waiting for a block to be written before it could be reused
+struct portpilot_binlog_writer {
+    struct portpilot_binlog *binlog;
+    struct portpilot_binlog_slot **slots;
+    uint64_t wait_ns;
+    uint32_t num_slots;
+    uint32_t slots_size;
+};
+
+//Create (truncate) the log file and write its header. The file is written by
+//io. Returns NULL on failure
+struct portpilot_binlog* portpilot_binlog_create(const char *path,
+        struct portpilot_io *io);
+
+//Write the index and trailer, close the file and free the log. All writers
+//must have been freed, io must still be running. Returns
+//RETVAL_SUCCESS/RETVAL_FAILURE
+uint8_t portpilot_binlog_close(struct portpilot_binlog *binlog);
+
+//Create a writer appending to binlog. Returns NULL on failure
+struct portpilot_binlog_writer* portpilot_binlog_writer_create(
+        struct portpilot_binlog *binlog);
+
+//Write all pending blocks, wait for them to be written and free the writer
+void portpilot_binlog_writer_free(struct portpilot_binlog_writer *writer);
+
+//Add a record of pp_data to the block of pp_dev, the block is written when it
+//is full
+void portpilot_binlog_write(struct portpilot_binlog_writer *writer,
+        struct portpilot_dev *pp_dev, const struct portpilot_data *pp_data);
+
+//Write the pending blocks that are older than BINLOG_BLOCK_MAX_AGE, or all
+//pending blocks if force is set
+void portpilot_binlog_writer_flush(struct portpilot_binlog_writer *writer,
+        uint8_t force);
+
+#endif
@@ -0,0 +1,397 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "portpilot_binlog_reader.h"
+#include "portpilot_logger.h"
+
+//Position in the records of one block, used when merging blocks
+struct binlog_cursor {
+    const struct portpilot_binlog_block *block;
+    const struct portpilot_binlog_record *record;
+    uint32_t left;
+};
+
+static int portpilot_binlog_reader_cmp_entry(const void *a, const void *b)
+{
+    const struct portpilot_binlog_index_entry *e1 = a, *e2 = b;
+
+    if (e1->first_ns != e2->first_ns)
+        return e1->first_ns < e2->first_ns ? -1 : 1;
+
+    return e1->offset < e2->offset ? -1 : 1;
+}
+
+static uint8_t portpilot_binlog_reader_use_trailer(
+        struct portpilot_binlog_map *map)
+{
+    const struct portpilot_binlog_trailer *trailer;
+    uint64_t index_len;
+
+    if (map->len < sizeof(struct portpilot_binlog_hdr) +
+            sizeof(struct portpilot_binlog_trailer))
+        return RETVAL_FAILURE;
+
+    trailer = (const struct portpilot_binlog_trailer*)
+        (map->base + map->len - sizeof(struct portpilot_binlog_trailer));
+    index_len = trailer->num_entries *
+        (uint64_t) sizeof(struct portpilot_binlog_index_entry);
+
+    if (trailer->magic != BINLOG_INDEX_MAGIC ||
+        trailer->index_offset < sizeof(struct portpilot_binlog_hdr) ||
+        trailer->index_offset + index_len +
+            sizeof(struct portpilot_binlog_trailer) != map->len)
+        return RETVAL_FAILURE;
+
+    map->index = (const struct portpilot_binlog_index_entry*)
+        (map->base + trailer->index_offset);
+    map->num_entries = trailer->num_entries;
+
+    return RETVAL_SUCCESS;
+}
+
+//Walk the blocks from the start of the file and index them, used when the log
+//has no trailer
+static uint8_t portpilot_binlog_reader_rebuild(struct portpilot_binlog_map *map)
+{
+    const struct portpilot_binlog_block *block;
+    struct portpilot_binlog_index_entry *entry;
+    uint64_t offset = sizeof(struct portpilot_binlog_hdr), block_len;
+    uint64_t max_last_ns = 0;
+    uint32_t size = 0, i;
+
+    while (offset + sizeof(struct portpilot_binlog_block) <= map->len) {
+        block = (const struct portpilot_binlog_block*) (map->base + offset);
+        block_len = sizeof(struct portpilot_binlog_block) + block->num_records *
+            (uint64_t) sizeof(struct portpilot_binlog_record);
+
+        if (block->magic != BINLOG_BLOCK_MAGIC || !block->num_records ||
+            block->num_records > map->hdr->block_records ||
+            offset + block_len > map->len)
+            break;
+
+        if (map->num_entries == size) {
+            size = size ? size * 2 : 1024;
+            entry = realloc(map->rebuilt, size *
+                    sizeof(struct portpilot_binlog_index_entry));
+
+            if (!entry)
+                return RETVAL_FAILURE;
+
+            map->rebuilt = entry;
+        }
+
+        entry = &(map->rebuilt[map->num_entries++]);
+        entry->offset = offset;
+        entry->first_ns = block->first_ns;
+        entry->last_ns = block->last_ns;
+        entry->serial_id = block->serial_id;
+        entry->num_records = block->num_records;
+
+        offset += block_len;
+    }
+
+    if (map->num_entries)
+        qsort(map->rebuilt, map->num_entries,
+                sizeof(struct portpilot_binlog_index_entry),
+                portpilot_binlog_reader_cmp_entry);
+
+    for (i = 0; i < map->num_entries; i++) {
+        if (map->rebuilt[i].last_ns > max_last_ns)
+            max_last_ns = map->rebuilt[i].last_ns;
+
+        map->rebuilt[i].max_last_ns = max_last_ns;
+    }
+
+    map->index = map->rebuilt;
+
+    return RETVAL_SUCCESS;
+}
+
+struct portpilot_binlog_map* portpilot_binlog_map_open(const char *path)
+{
+    struct portpilot_binlog_map *map;
+    struct stat st;
+    void *base;
+    int32_t fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) ||
+        st.st_size < (off_t) sizeof(struct portpilot_binlog_hdr)) {
+        close(fd);
+        return NULL;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED)
+        return NULL;
+
+    map = calloc(sizeof(struct portpilot_binlog_map), 1);
+
+    if (!map) {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+
+    map->base = base;
+    map->len = st.st_size;
+    map->hdr = base;
+
+    if (memcmp(map->hdr->magic, BINLOG_MAGIC, sizeof(map->hdr->magic)) ||
+        map->hdr->version != BINLOG_VERSION ||
+        map->hdr->record_size != sizeof(struct portpilot_binlog_record) ||
+        (!portpilot_binlog_reader_use_trailer(map) &&
+         !portpilot_binlog_reader_rebuild(map))) {
+        portpilot_binlog_map_close(map);
+        return NULL;
+    }
+
+    //Records are read in order
+    madvise(base, map->len, MADV_SEQUENTIAL);
+
+    return map;
+}
+
+void portpilot_binlog_map_close(struct portpilot_binlog_map *map)
+{
+    munmap((void*) map->base, map->len);
+    free(map->rebuilt);
+    free(map);
+}
+
+const struct portpilot_binlog_block* portpilot_binlog_map_block(
+        const struct portpilot_binlog_map *map,
+        const struct portpilot_binlog_index_entry *entry)
+{
+    const struct portpilot_binlog_block *block;
+
+    if (entry->offset < sizeof(struct portpilot_binlog_hdr) ||
+        entry->offset % 8 ||
+        entry->offset + sizeof(struct portpilot_binlog_block) > map->len)
+        return NULL;
+
+    block = (const struct portpilot_binlog_block*) (map->base + entry->offset);
+
+    if (block->magic != BINLOG_BLOCK_MAGIC ||
+        block->num_records != entry->num_records ||
+        entry->offset + sizeof(struct portpilot_binlog_block) +
+            block->num_records * (uint64_t)
+            sizeof(struct portpilot_binlog_record) > map->len)
+        return NULL;
+
+    return block;
+}
+
+void portpilot_binlog_map_find(const struct portpilot_binlog_map *map,
+        uint64_t from_ns, uint64_t to_ns, uint32_t *first, uint32_t *last)
+{
+    uint32_t lo = 0, hi = map->num_entries, mid;
+
+    //max_last_ns is increasing, every entry before the first one with a
+    //max_last_ns >= from_ns ends before the range
+    while (lo < hi) {
+        mid = lo + ((hi - lo) / 2);
+
+        if (map->index[mid].max_last_ns < from_ns)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *first = lo;
+    hi = map->num_entries;
+
+    //Entries are sorted on first_ns, every entry from the first one with a
+    //first_ns > to_ns starts after the range
+    while (lo < hi) {
+        mid = lo + ((hi - lo) / 2);
+
+        if (map->index[mid].first_ns <= to_ns)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *last = lo;
+}
+
+static inline uint8_t binlog_cursor_less(const struct binlog_cursor *c1,
+        const struct binlog_cursor *c2)
+{
+    return c1->record->host_ns < c2->record->host_ns;
+}
+
+static void portpilot_binlog_reader_sift_down(struct binlog_cursor *heap,
+        uint32_t heap_len)
+{
+    struct binlog_cursor tmp;
+    uint32_t i = 0, child;
+
+    while ((child = (2 * i) + 1) < heap_len) {
+        if (child + 1 < heap_len && binlog_cursor_less(&heap[child + 1],
+                    &heap[child]))
+            child++;
+
+        if (!binlog_cursor_less(&heap[child], &heap[i]))
+            break;
+
+        tmp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = tmp;
+        i = child;
+    }
+}
+
+static void portpilot_binlog_reader_sift_up(struct binlog_cursor *heap,
+        uint32_t i)
+{
+    struct binlog_cursor tmp;
+    uint32_t parent;
+
+    while (i) {
+        parent = (i - 1) / 2;
+
+        if (!binlog_cursor_less(&heap[i], &heap[parent]))
+            break;
+
+        tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+//Set up a cursor at the first record of block with a host_ns >= from_ns.
+//Returns RETVAL_FAILURE if there is no such record
+static uint8_t portpilot_binlog_reader_seek(struct binlog_cursor *cursor,
+        const struct portpilot_binlog_block *block, uint64_t from_ns)
+{
+    const struct portpilot_binlog_record *records =
+        (const struct portpilot_binlog_record*) (block + 1);
+    uint32_t lo = 0, hi = block->num_records, mid;
+
+    //The records of a block are in the order they were received
+    while (lo < hi) {
+        mid = lo + ((hi - lo) / 2);
+
+        if (records[mid].host_ns < from_ns)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == block->num_records)
+        return RETVAL_FAILURE;
+
+    cursor->block = block;
+    cursor->record = &records[lo];
+    cursor->left = block->num_records - lo;
+
+    return RETVAL_SUCCESS;
+}
+
+int64_t portpilot_binlog_map_foreach(const struct portpilot_binlog_map *map,
+        uint64_t from_ns, uint64_t to_ns, const char *serial_number,
+        portpilot_binlog_record_cb cb, void *ptr)
+{
+    const struct portpilot_binlog_index_entry *entry;
+    const struct portpilot_binlog_block *block;
+    struct binlog_cursor *heap = NULL, *tmp, *top;
+    uint32_t first, last, heap_len = 0, heap_size = 0;
+    int64_t num_records = 0;
+
+    portpilot_binlog_map_find(map, from_ns, to_ns, &first, &last);
+
+    //The blocks are merged on host_ns. A block is only added to the heap once
+    //the records before it have been passed on, so the heap is only as large
+    //as the number of blocks that overlap in time
+    while (first < last || heap_len) {
+        if (first < last && (!heap_len ||
+                    map->index[first].first_ns <= heap->record->host_ns)) {
+            entry = &(map->index[first++]);
+
+            if (entry->last_ns < from_ns)
+                continue;
+
+            block = portpilot_binlog_map_block(map, entry);
+
+            if (!block) {
+                free(heap);
+                return -1;
+            }
+
+            if (serial_number && strcmp((const char*) block->serial_number,
+                        serial_number))
+                continue;
+
+            if (heap_len == heap_size) {
+                heap_size = heap_size ? heap_size * 2 : 64;
+                tmp = realloc(heap, heap_size * sizeof(struct binlog_cursor));
+
+                if (!tmp) {
+                    free(heap);
+                    return -1;
+                }
+
+                heap = tmp;
+            }
+
+            if (portpilot_binlog_reader_seek(&heap[heap_len], block, from_ns))
+                portpilot_binlog_reader_sift_up(heap, heap_len++);
+
+            continue;
+        }
+
+        top = heap;
+
+        //Every record after this one in the block is outside the range too
+        if (top->record->host_ns > to_ns) {
+            heap[0] = heap[--heap_len];
+            portpilot_binlog_reader_sift_down(heap, heap_len);
+            continue;
+        }
+
+        cb(ptr, top->block->serial_number, top->record);
+        ++num_records;
+
+        if (--top->left) {
+            top->record++;
+        } else {
+            heap[0] = heap[--heap_len];
+        }
+
+        portpilot_binlog_reader_sift_down(heap, heap_len);
+    }
+
+    free(heap);
+
+    return num_records;
+}
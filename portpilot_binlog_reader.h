@@ -0,0 +1,68 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef PORTPILOT_BINLOG_READER_H
+#define PORTPILOT_BINLOG_READER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "portpilot_binlog.h"
+
+//A binary log (see portpilot_binlog.h) mapped into memory. index points into
+//the mapping, unless the log has no trailer and the index had to be rebuilt by
+//walking the blocks (rebuilt is set then). Blocks that are truncated (the
+//logger was killed while writing) are ignored
+struct portpilot_binlog_map {
+    const uint8_t *base;
+    const struct portpilot_binlog_hdr *hdr;
+    const struct portpilot_binlog_index_entry *index;
+    struct portpilot_binlog_index_entry *rebuilt;
+    size_t len;
+    uint32_t num_entries;
+};
+
+//Called for every record in a range. serial_number is the serial number of the
+//device that the record belongs to
+typedef void (*portpilot_binlog_record_cb)(void *ptr,
+        const uint8_t *serial_number,
+        const struct portpilot_binlog_record *record);
+
+//Map the log in path and validate its header. Returns NULL on failure
+struct portpilot_binlog_map* portpilot_binlog_map_open(const char *path);
+
+void portpilot_binlog_map_close(struct portpilot_binlog_map *map);
+
+//Get the block of an index entry, the records follow the block header
+const struct portpilot_binlog_block* portpilot_binlog_map_block(
+        const struct portpilot_binlog_map *map,
+        const struct portpilot_binlog_index_entry *entry);
+
+//Find the index entries [*first, *last) that can contain records with a
+//host_ns in [from_ns, to_ns]. Blocks of different devices overlap in time, so
+//an entry in the range can still be outside of it
+void portpilot_binlog_map_find(const struct portpilot_binlog_map *map,
+        uint64_t from_ns, uint64_t to_ns, uint32_t *first, uint32_t *last);
+
+//Call cb for every record with a host_ns in [from_ns, to_ns], in the order of
+//host_ns. If serial_number is not NULL, only the records of that device are
+//passed on. Returns the number of records passed to cb, or -1 on failure
+int64_t portpilot_binlog_map_foreach(const struct portpilot_binlog_map *map,
+        uint64_t from_ns, uint64_t to_ns, const char *serial_number,
+        portpilot_binlog_record_cb cb, void *ptr);
+
+#endif
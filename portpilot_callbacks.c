@@ -15,18 +15,20 @@
  * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
  */
 
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
 #include <unistd.h>
+#include <sys/signalfd.h>
 #include <libusb-1.0/libusb.h>
 
 #include "portpilot_callbacks.h"
 #include "portpilot_logger.h"
 #include "backend_event_loop.h"
 #include "portpilot_helpers.h"
-#include "backend_event_loop.h"
+#include "portpilot_dev_cache.h"
 
 void portpilot_cb_libusb_fd_add(int fd, short events, void *data)
 {
@@ -41,27 +43,19 @@ void portpilot_cb_libusb_fd_add(int fd, short events, void *data)
 
 void portpilot_cb_libusb_fd_remove(int fd, void *data)
 {
-    //Closing a file descriptor causes it to be removed from epoll-set, this is
-    //all we have to do here
+    struct portpilot_ctx *ctx = data;
+
+    //Closing a file descriptor causes it to be removed from epoll-set, but the
+    //event loop keeps track of the number of fds to size its event batch
+    backend_event_loop_update(ctx->event_loop, 0, EPOLL_CTL_DEL, fd, NULL);
     close(fd);
 }
 
 void portpilot_cb_itr_cb(void *ptr)
 {
     struct portpilot_ctx *pp_ctx = ptr;
-    struct timeval tv = {0 ,0};
     struct portpilot_dev *ppd_itr = pp_ctx->dev_head.lh_first;
 
-    //Run libusb timers
-    libusb_unlock_events(NULL);
-    libusb_handle_events_timeout_completed(NULL, &tv, NULL);
-    libusb_lock_events(NULL);
-
-    //Check if we should stop loop, in case more than one device was connected
-    //and one is disconnected after all the others have finished receiving
-    //packets
-    portpilot_helpers_stop_loop(pp_ctx);
-
     if (!pp_ctx->num_itr_req)
         return;
 
@@ -72,6 +66,21 @@ void portpilot_cb_itr_cb(void *ptr)
 
         ppd_itr = ppd_itr->next_dev.le_next;
     }
+
+    //Retry again in a second if the loop is idle. The timeout is one-shot, so
+    //that it can be removed from here when the last device is restarted
+    if (pp_ctx->num_itr_req &&
+        pp_ctx->itr_timeout_handle->heap_idx == TIMEOUT_HEAP_IDX_NONE) {
+        pp_ctx->itr_timeout_handle->timeout_clock =
+            backend_event_loop_now() + 1000;
+        backend_event_loop_insert_timeout(pp_ctx->event_loop,
+                pp_ctx->itr_timeout_handle);
+    }
+}
+
+void portpilot_cb_usb_timeout_cb(void *ptr)
+{
+    portpilot_helpers_handle_usb_events(ptr);
 }
 
 void portpilot_cb_output_cb(void *ptr)
@@ -90,6 +99,22 @@ void portpilot_cb_output_cb(void *ptr)
     }
 }
 
+void portpilot_cb_trace_cb(void *ptr)
+{
+    struct portpilot_ctx *pp_ctx = ptr;
+    struct portpilot_dev *ppd_itr = pp_ctx->dev_head.lh_first;
+
+    while (ppd_itr != NULL) {
+        portpilot_helpers_print_trace(ppd_itr);
+        ppd_itr = ppd_itr->next_dev.le_next;
+    }
+}
+
+void portpilot_cb_flush_cb(void *ptr)
+{
+    portpilot_helpers_flush_output(ptr);
+}
+
 void portpilot_cb_cancel_cb(void *ptr)
 {
     struct portpilot_ctx *pp_ctx = ptr;
@@ -98,14 +123,59 @@ void portpilot_cb_cancel_cb(void *ptr)
 
 void portpilot_cb_event_cb(void *ptr, int32_t fd, uint32_t events)
 {
-    struct timeval tv = {0 ,0};
+    //The thread running the loop holds the events lock
+    portpilot_helpers_handle_usb_events(ptr);
+}
+
+void portpilot_cb_wake_cb(void *ptr, int32_t fd, uint32_t events)
+{
+    struct portpilot_ctx *pp_ctx = ptr;
+    uint64_t val;
+
+    uint32_t dump_gen;
+
+    if (read(fd, &val, sizeof(val)) < 0)
+        return;
+
+    dump_gen = atomic_load(&(pp_ctx->shards->dump_gen));
+
+    if (pp_ctx->dump_gen != dump_gen) {
+        pp_ctx->dump_gen = dump_gen;
+        portpilot_helpers_print_stats(pp_ctx);
+    }
+
+    portpilot_helpers_stop_loop(pp_ctx);
+}
+
+void portpilot_cb_signal_cb(void *ptr, int32_t fd, uint32_t events)
+{
+    struct portpilot_ctx *pp_ctx = ptr;
+    struct portpilot_shards *shards = pp_ctx->shards;
+    struct signalfd_siginfo info;
+    uint64_t val = 1;
+    uint8_t i;
+
+    if (read(fd, &info, sizeof(info)) != sizeof(info))
+        return;
+
+    if (info.ssi_signo == SIGINT || info.ssi_signo == SIGTERM) {
+        portpilot_helpers_stop_all(pp_ctx);
+        return;
+    }
+
+    pp_ctx->dump_gen = atomic_fetch_add(&(shards->dump_gen), 1) + 1;
+    portpilot_helpers_print_stats(pp_ctx);
+
+    for (i = 0; i < shards->num_shards; i++) {
+        if (i == pp_ctx->shard_idx)
+            continue;
 
-    libusb_unlock_events(NULL);
-    libusb_handle_events_timeout_completed(NULL, &tv, NULL);
-    libusb_lock_events(NULL);
+        if (write(shards->wake_fds[i], &val, sizeof(val)) < 0)
+            fprintf(stderr, "Failed to wake up shard %u\n", i);
+    }
 }
 
-static void portpilot_cb_handle_event_left(struct portpilot_ctx *pp_ctx,
+void portpilot_cb_handle_event_left(struct portpilot_ctx *pp_ctx,
         struct portpilot_dev *pp_dev)
 {
     if (pp_dev->serial_number)
@@ -115,28 +185,37 @@ static void portpilot_cb_handle_event_left(struct portpilot_ctx *pp_ctx,
         fprintf(stderr, "Will remove device\n");
 
     portpilot_helpers_free_dev(pp_dev);
+
+    //The remaining devices might all be done reading
+    portpilot_helpers_stop_loop(pp_ctx);
 }
 
 static void portpilot_cb_handle_event_added(libusb_device *device,
         struct portpilot_ctx *pp_ctx, uint8_t *dev_path, uint8_t dev_path_len)
 {
-    uint8_t conf_desc_idx, input_endpoint, intf_num;
-    uint16_t max_packet_size;
+    uint8_t conf_desc_idx;
     int32_t retval = 0, intf_desc_idx;
     struct libusb_device_descriptor desc = {0};
     struct libusb_config_descriptor *conf_desc = NULL;
     const struct libusb_interface_descriptor *intf_desc;
+    struct portpilot_dev_info info = {{0}};
+
+    libusb_get_device_descriptor(device, &desc);
 
-    //If no desired serial number is provided, user has indicated he or she is
-    //interested in all portpilots connected. So no need to check for serial
-    //etc.
-    if (pp_ctx->desired_serial &&
-            !portpilot_helpers_cmp_serial(pp_ctx->desired_serial, device)) {
-        fprintf(stderr, "Serial number mismatch\n");
+    //The config descriptor of a device we have seen before (for example one
+    //that has re-enumerated) is not parsed again. Every Portpilot has the same
+    //device descriptor, so another unit might have been plugged into the port.
+    //The cached serial number can therefore not be trusted, it is read (and
+    //checked against -d) once the device has been opened
+    if (portpilot_dev_cache_lookup(pp_ctx->shards->dev_cache, dev_path,
+                dev_path_len, &desc, &info)) {
+        ++pp_ctx->num_cache_hits;
+        portpilot_helpers_create_dev(device, pp_ctx, &info, 1, dev_path,
+                dev_path_len);
         return;
     }
 
-    libusb_get_device_descriptor(device, &desc);
+    ++pp_ctx->num_cache_misses;
     libusb_get_active_config_descriptor(device, &conf_desc);
 
     if (!conf_desc) {
@@ -156,11 +235,11 @@ static void portpilot_cb_handle_event_added(libusb_device *device,
 
     intf_desc = &(conf_desc->interface[conf_desc_idx].
             altsetting[intf_desc_idx]);
-    intf_num = intf_desc->bInterfaceNumber;
+    info.intf_num = intf_desc->bInterfaceNumber;
 
     //Get the endpoint for the interface we will communicate with
-    retval = portpilot_helpers_get_input_info(intf_desc, &input_endpoint,
-            &max_packet_size);
+    retval = portpilot_helpers_get_input_info(intf_desc, &(info.input_endpoint),
+            &(info.max_packet_size));
 
     if (!retval) {
         fprintf(stderr, "Failed to get input endpoint info\n");
@@ -170,8 +249,9 @@ static void portpilot_cb_handle_event_added(libusb_device *device,
 
     libusb_free_config_descriptor(conf_desc);
 
-    portpilot_helpers_create_dev(device, pp_ctx, max_packet_size,
-            input_endpoint, intf_num, dev_path, dev_path_len);
+    //The serial number is read (and checked) once the device has been opened
+    portpilot_helpers_create_dev(device, pp_ctx, &info, 0, dev_path,
+            dev_path_len);
 }
 
 int portpilot_cb_libusb_cb(libusb_context *ctx, libusb_device *device,
@@ -184,10 +264,16 @@ int portpilot_cb_libusb_cb(libusb_context *ctx, libusb_device *device,
     uint8_t dev_path_len;
 
     //Path is used both on add and remove, so read it already here
-    dev_path[0] = libusb_get_port_number(device);
+    dev_path[0] = libusb_get_bus_number(device);
     retval = libusb_get_port_numbers(device, dev_path + 1, 7);
     dev_path_len = retval + 1;
 
+    //Every shard sees every device, but only the shard the path maps to
+    //handles it
+    if (portpilot_helpers_get_shard(dev_path, dev_path_len,
+                pp_ctx->shards->num_shards) != pp_ctx->shard_idx)
+        return 0;
+
     pp_dev = portpilot_helpers_find_dev(pp_ctx, dev_path, dev_path_len);
 
     if ((event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT && !pp_dev) ||
@@ -209,11 +295,17 @@ void portpilot_cb_read_cb(struct libusb_transfer *transfer)
 {
     struct portpilot_dev *pp_dev = transfer->user_data;
     struct portpilot_ctx *pp_ctx = pp_dev->pp_ctx;
-    struct portpilot_pkt *pp_pkt = (struct portpilot_pkt*) transfer->buffer;
-    struct portpilot_data pp_data = {0};
-    struct portpilot_data *data_ptr = pp_dev->agg_data ?
-        pp_dev->agg_data : &pp_data;
-    uint8_t i;
+
+    portpilot_helpers_transfer_done(pp_dev, transfer);
+
+    //We only get here with num_cancel set if we have cancelled the transfers of
+    //the device. Transfers that completed or failed before the cancel took
+    //effect are also pending, so count them no matter the status
+    if (pp_ctx->num_cancel) {
+        if (++pp_ctx->num_cancelled == pp_ctx->num_cancel)
+            backend_event_loop_stop(pp_ctx->event_loop);
+        return;
+    }
 
     switch (transfer->status) {
     case LIBUSB_TRANSFER_COMPLETED:
@@ -221,13 +313,7 @@ void portpilot_cb_read_cb(struct libusb_transfer *transfer)
     case LIBUSB_TRANSFER_ERROR:
     case LIBUSB_TRANSFER_TIMED_OUT:
         fprintf(stderr, "Previous transfer failed/timed out, retransmit\n");
-        libusb_submit_transfer(transfer);
-        return;
-    case LIBUSB_TRANSFER_CANCELLED:
-        //We only get here if we have cancelled device, thus, we don't need any
-        //additional guards
-        if (++pp_ctx->num_cancelled == pp_ctx->num_cancel)
-            backend_event_loop_stop(pp_ctx->event_loop);
+        portpilot_helpers_submit_transfer(pp_dev, transfer);
         return;
     default:
         //So far I have only seen this on disconnect, fail silently and then we
@@ -235,48 +321,27 @@ void portpilot_cb_read_cb(struct libusb_transfer *transfer)
         return;
     }
 
+    //No transfer was queued while this one was completed and handed to us, so
+    //the device might have had data we did not ask for
+    if (!pp_dev->in_flight)
+        ++pp_ctx->num_queue_dry;
+
+    //With more than one transfer queued, transfers can complete after we have
+    //read the requested number of packets. Don't resubmit them
+    if (pp_ctx->pkts_to_read && !pp_dev->agg_data &&
+        pp_dev->num_pkts >= pp_ctx->pkts_to_read)
+        return;
+
     //We sometimes see replies that are 0 length, ignore those and just
     //re-submit transfer
     if (!transfer->actual_length) {
-        libusb_submit_transfer(transfer);
+        portpilot_helpers_submit_transfer(pp_dev, transfer);
         return;
     }
 
-    if (pp_ctx->verbose) {
-        for (i = 0; i < transfer->actual_length - 1; i++)
-            fprintf(stdout, "%x:", transfer->buffer[i]);
-        fprintf(stdout, "%x\n", transfer->buffer[i]);
-    }
-   
-    //We ignore the direction of the V, A and use absolute values to get a
-    //correct sum
-    data_ptr->tstamp = pp_pkt->tstamp;
-    data_ptr->v_in += pp_pkt->v_in >= 0 ? pp_pkt->v_in :
-        (pp_pkt->v_in * -1);
-    data_ptr->v_out += pp_pkt->v_out >= 0 ? pp_pkt->v_out :
-        (pp_pkt->v_out * -1);
-    data_ptr->current += pp_pkt->current >= 0 ? pp_pkt->current :
-        (pp_pkt->current * -1);
-    data_ptr->max_current = pp_pkt->max_current >= 0 ? pp_pkt->max_current :
-        (pp_pkt->max_current * -1);
-    data_ptr->energy += pp_pkt->energy >= 0 ? pp_pkt->energy :
-        (pp_pkt->energy * -1);
-    data_ptr->total_energy = pp_pkt->total_energy >= 0 ?
-        pp_pkt->total_energy / 3600 :
-        (pp_pkt->total_energy * -1) / 3600;
-    data_ptr->num_readings++;
-
-    //If we output aggregated data, then the timeout callback is responsible for
-    //the output, stopping the loop etc.
-    if (pp_dev->agg_data) {
-        libusb_submit_transfer(transfer);
-        return;
-    }
-
-    portpilot_helpers_output_data(pp_dev, data_ptr);
-
-    //Only submit transfer if we have not exceeded packet limit
-    if (!portpilot_helpers_inc_num_pkts(pp_dev)) {
-        libusb_submit_transfer(transfer);
-    }
+    //Completion time of the transfer is the reference for all latencies. Only
+    //submit transfer if we have not exceeded packet limit
+    if (portpilot_helpers_process_pkt(pp_dev, transfer->buffer,
+                transfer->actual_length, portpilot_helpers_now_ns()))
+        portpilot_helpers_submit_transfer(pp_dev, transfer);
 }
@@ -18,18 +18,38 @@
 #ifndef PORTPILOT_CALLBACKS
 #define PORTPILOT_CALLBACKS
 
+struct portpilot_ctx;
+struct portpilot_dev;
+
 //libusb callbacks for updating event loop
 void portpilot_cb_libusb_fd_add(int fd, short events, void *data);
 void portpilot_cb_libusb_fd_remove(int fd, void *data);
 
-//our maintenance callback. Called once every second (lazy libusb timeout
-//handling) or on every iteration (device has failed to start sending)
+//our maintenance callback. Called on every iteration, and at least once every
+//second, while a device has failed to start sending
 void portpilot_cb_itr_cb(void *ptr);
 
+//called when the next libusb timeout expires. Only used when libusb can not
+//handle timeouts through its pollfds
+void portpilot_cb_usb_timeout_cb(void *ptr);
+
 //"default" eventloop callback, called when there is activity on monitored file
 //descriptors
 void portpilot_cb_event_cb(void *ptr, int32_t fd, uint32_t events);
 
+//called when another shard wants this shard to check if it should stop or dump
+//its statistics
+void portpilot_cb_wake_cb(void *ptr, int32_t fd, uint32_t events);
+
+//called when SIGUSR1 is received (on the signalfd of the first shard). Dumps
+//the statistics of this shard and asks the other shards to do the same. On
+//SIGINT/SIGTERM, all shards are stopped instead
+void portpilot_cb_signal_cb(void *ptr, int32_t fd, uint32_t events);
+
+//remove a device that has been disconnected
+void portpilot_cb_handle_event_left(struct portpilot_ctx *pp_ctx,
+        struct portpilot_dev *pp_dev);
+
 //libusb hotplug callback (device added/removed)
 int portpilot_cb_libusb_cb(libusb_context *ctx, libusb_device *device,
                           libusb_hotplug_event event, void *user_data);
@@ -41,6 +61,14 @@ void portpilot_cb_read_cb(struct libusb_transfer *transfer);
 //of the data received since last time
 void portpilot_cb_output_cb(void *ptr);
 
+//trace callback, prints the latency summary of every device when tracing with
+//an interval
+void portpilot_cb_trace_cb(void *ptr);
+
+//flush callback, writes what is buffered in the output sinks (at least every
+//SINK_FLUSH_INTVL ms)
+void portpilot_cb_flush_cb(void *ptr);
+
 //callback used when cancels are not finished on time. Will just stop event loop
 void portpilot_cb_cancel_cb(void *ptr);
 
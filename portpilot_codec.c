@@ -0,0 +1,349 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "portpilot_codec.h"
+#include "portpilot_logger.h"
+
+uint8_t portpilot_codec_init(struct portpilot_codec *codec)
+{
+    struct timespec mono, real;
+
+    memset(codec, 0, sizeof(struct portpilot_codec));
+
+    if (backend_hash_init(&(codec->index), 64))
+        return RETVAL_FAILURE;
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    codec->realtime_offset = ((real.tv_sec * 1000000000ULL) + real.tv_nsec) -
+        ((mono.tv_sec * 1000000000ULL) + mono.tv_nsec);
+
+    return RETVAL_SUCCESS;
+}
+
+void portpilot_codec_deinit(struct portpilot_codec *codec)
+{
+    uint32_t i;
+
+    for (i = 0; i < codec->num_devs; i++)
+        free(codec->devs[i]);
+
+    free(codec->devs);
+    backend_hash_deinit(&(codec->index));
+}
+
+uint8_t portpilot_codec_reset(struct portpilot_codec *codec)
+{
+    portpilot_codec_deinit(codec);
+
+    return portpilot_codec_init(codec);
+}
+
+static struct portpilot_codec_dev* portpilot_codec_add_dev(
+        struct portpilot_codec *codec, const uint8_t *serial_number,
+        size_t serial_len)
+{
+    struct portpilot_codec_dev *dev, **devs;
+    uint32_t devs_size;
+
+    if (codec->num_devs == codec->devs_size) {
+        devs_size = codec->devs_size ? codec->devs_size * 2 : 16;
+        devs = realloc(codec->devs, devs_size *
+                sizeof(struct portpilot_codec_dev*));
+
+        if (!devs)
+            return NULL;
+
+        codec->devs = devs;
+        codec->devs_size = devs_size;
+    }
+
+    dev = calloc(sizeof(struct portpilot_codec_dev), 1);
+
+    if (!dev)
+        return NULL;
+
+    memcpy(dev->serial_number, serial_number, serial_len);
+    dev->id = codec->num_devs;
+    codec->devs[codec->num_devs++] = dev;
+
+    return dev;
+}
+
+//Append the zigzag varint of delta to p and set the bit of field in mask if
+//the field changed
+#define CODEC_PUT_DELTA(p, mask, field, delta) do { \
+    if (delta) { \
+        *(mask) |= 1 << (field); \
+        p = portpilot_codec_put_varint(p, CODEC_ZIGZAG(delta)); \
+    } \
+} while (0)
+
+uint32_t portpilot_codec_encode(struct portpilot_codec *codec, uint8_t *buf,
+        const uint8_t *serial_number, const struct portpilot_data *pp_data)
+{
+    struct portpilot_codec_dev *dev = NULL;
+    struct backend_hash_node *node;
+    size_t serial_len = strnlen((const char*) serial_number, MAX_USB_STR_LEN);
+    uint32_t hash = backend_hash_bytes(serial_number, serial_len);
+    uint8_t *p = buf, *mask;
+    uint64_t host_us;
+    int64_t step;
+
+    for (node = backend_hash_first(&(codec->index), hash); node;
+            node = backend_hash_next(node)) {
+        dev = BACKEND_HASH_ENTRY(node, struct portpilot_codec_dev, node);
+
+        if (!strcmp((const char*) dev->serial_number,
+                    (const char*) serial_number))
+            break;
+    }
+
+    if (!node) {
+        dev = portpilot_codec_add_dev(codec, serial_number, serial_len);
+
+        if (!dev)
+            return 0;
+
+        backend_hash_insert(&(codec->index), &(dev->node), hash);
+
+        p = portpilot_codec_put_varint(p, 0);
+        p = portpilot_codec_put_varint(p, dev->id);
+        p = portpilot_codec_put_varint(p, serial_len);
+        memcpy(p, serial_number, serial_len);
+        p += serial_len;
+    }
+
+    p = portpilot_codec_put_varint(p, dev->id + 1);
+    mask = p++;
+    *mask = 0;
+
+    host_us = (pp_data->host_ns + codec->realtime_offset) / 1000;
+    step = (int64_t) (host_us - dev->host_us);
+    p = portpilot_codec_put_varint(p, CODEC_ZIGZAG(step - dev->host_step));
+    dev->host_us = host_us;
+    dev->host_step = step;
+
+    step = (int64_t) pp_data->tstamp - dev->tstamp;
+    CODEC_PUT_DELTA(p, mask, CODEC_FIELD_TSTAMP, step - dev->tstamp_step);
+    dev->tstamp = pp_data->tstamp;
+    dev->tstamp_step = step;
+
+    CODEC_PUT_DELTA(p, mask, CODEC_FIELD_V_IN,
+            (int64_t) pp_data->v_in - dev->v_in);
+    CODEC_PUT_DELTA(p, mask, CODEC_FIELD_V_OUT,
+            (int64_t) pp_data->v_out - dev->v_out);
+    CODEC_PUT_DELTA(p, mask, CODEC_FIELD_CURRENT,
+            (int64_t) pp_data->current - dev->current);
+    CODEC_PUT_DELTA(p, mask, CODEC_FIELD_MAX_CURRENT,
+            (int64_t) pp_data->max_current - dev->max_current);
+    CODEC_PUT_DELTA(p, mask, CODEC_FIELD_ENERGY,
+            (int64_t) pp_data->energy - dev->energy);
+    CODEC_PUT_DELTA(p, mask, CODEC_FIELD_TOTAL_ENERGY,
+            (int64_t) pp_data->total_energy - dev->total_energy);
+    CODEC_PUT_DELTA(p, mask, CODEC_FIELD_NUM_READINGS,
+            (int64_t) pp_data->num_readings - dev->num_readings);
+
+    dev->v_in = pp_data->v_in;
+    dev->v_out = pp_data->v_out;
+    dev->current = pp_data->current;
+    dev->max_current = pp_data->max_current;
+    dev->energy = pp_data->energy;
+    dev->total_energy = pp_data->total_energy;
+    dev->num_readings = pp_data->num_readings;
+
+    return p - buf;
+}
+
+//Read the zigzag varint of a delta if the bit of field is set in mask, 0
+//otherwise. Jumps to the truncated label if buf ends
+#define CODEC_GET_DELTA(p, end, mask, field, delta) do { \
+    uint64_t __val = 0; \
+    if (((mask) & (1 << (field))) && \
+        !(p = portpilot_codec_get_varint(p, end, &__val))) \
+        goto truncated; \
+    delta = CODEC_UNZIGZAG(__val); \
+} while (0)
+
+uint32_t portpilot_codec_decode(struct portpilot_codec *codec,
+        const uint8_t *buf, size_t len, const uint8_t **serial_number,
+        struct portpilot_data *pp_data)
+{
+    const uint8_t *p = buf, *end = buf + len;
+    struct portpilot_codec_dev *dev;
+    uint64_t id, serial_len;
+    int64_t delta;
+    uint8_t mask;
+
+    if (!(p = portpilot_codec_get_varint(p, end, &id)))
+        return 0;
+
+    //Device definition, ids are assigned in order
+    if (!id) {
+        if (!(p = portpilot_codec_get_varint(p, end, &id)) ||
+            !(p = portpilot_codec_get_varint(p, end, &serial_len)) ||
+            id != codec->num_devs || serial_len > MAX_USB_STR_LEN ||
+            (size_t) (end - p) < serial_len ||
+            !portpilot_codec_add_dev(codec, p, serial_len))
+            return 0;
+
+        p += serial_len;
+
+        if (!(p = portpilot_codec_get_varint(p, end, &id)))
+            return 0;
+    }
+
+    if (!id || id > codec->num_devs || p == end)
+        return 0;
+
+    dev = codec->devs[id - 1];
+    mask = *p++;
+
+    CODEC_GET_DELTA(p, end, 1, 0, delta);
+    dev->host_step += delta;
+    dev->host_us += dev->host_step;
+
+    CODEC_GET_DELTA(p, end, mask, CODEC_FIELD_TSTAMP, delta);
+    dev->tstamp_step += delta;
+    dev->tstamp += dev->tstamp_step;
+
+    CODEC_GET_DELTA(p, end, mask, CODEC_FIELD_V_IN, delta);
+    dev->v_in += delta;
+    CODEC_GET_DELTA(p, end, mask, CODEC_FIELD_V_OUT, delta);
+    dev->v_out += delta;
+    CODEC_GET_DELTA(p, end, mask, CODEC_FIELD_CURRENT, delta);
+    dev->current += delta;
+    CODEC_GET_DELTA(p, end, mask, CODEC_FIELD_MAX_CURRENT, delta);
+    dev->max_current += delta;
+    CODEC_GET_DELTA(p, end, mask, CODEC_FIELD_ENERGY, delta);
+    dev->energy += delta;
+    CODEC_GET_DELTA(p, end, mask, CODEC_FIELD_TOTAL_ENERGY, delta);
+    dev->total_energy += delta;
+    CODEC_GET_DELTA(p, end, mask, CODEC_FIELD_NUM_READINGS, delta);
+    dev->num_readings += delta;
+
+    pp_data->host_ns = dev->host_us * 1000;
+    pp_data->tstamp = dev->tstamp;
+    pp_data->v_in = dev->v_in;
+    pp_data->v_out = dev->v_out;
+    pp_data->energy = dev->energy;
+    pp_data->total_energy = dev->total_energy;
+    pp_data->current = dev->current;
+    pp_data->max_current = dev->max_current;
+    pp_data->num_readings = dev->num_readings;
+    *serial_number = dev->serial_number;
+
+    return p - buf;
+
+truncated:
+    return 0;
+}
+
+int64_t portpilot_codec_decode_stream(const uint8_t *buf, size_t len,
+        portpilot_codec_sample_cb cb, void *ptr, uint8_t *truncated)
+{
+    const uint8_t *p = buf + strlen(CODEC_MAGIC), *end = buf + len, *frame_end;
+    struct portpilot_codec *codecs = NULL, *tmp;
+    const uint8_t *serial_number;
+    struct portpilot_data pp_data;
+    uint64_t stream, frame_len;
+    uint32_t num_codecs = 0, consumed, i;
+    int64_t num_samples = 0;
+
+    *truncated = 0;
+
+    if (len < strlen(CODEC_MAGIC) || memcmp(buf, CODEC_MAGIC,
+                strlen(CODEC_MAGIC)))
+        return -1;
+
+    while (p < end) {
+        if (!(p = portpilot_codec_get_varint(p, end, &stream)) ||
+            !(p = portpilot_codec_get_varint(p, end, &frame_len)) ||
+            frame_len > (uint64_t) (end - p)) {
+            *truncated = 1;
+            break;
+        }
+
+        frame_end = p + frame_len;
+
+        //Streams are shard indexes, so there are only a few of them
+        if ((stream >> 1) >= num_codecs) {
+            if ((stream >> 1) > UINT8_MAX) {
+                num_samples = -1;
+                break;
+            }
+
+            tmp = realloc(codecs, ((stream >> 1) + 1) *
+                    sizeof(struct portpilot_codec));
+
+            if (!tmp) {
+                num_samples = -1;
+                break;
+            }
+
+            codecs = tmp;
+
+            for (i = num_codecs; i <= (stream >> 1); i++)
+                memset(&codecs[i], 0, sizeof(struct portpilot_codec));
+
+            num_codecs = (stream >> 1) + 1;
+        }
+
+        //The first frame of a stream always starts over
+        if ((stream & 1) && !portpilot_codec_reset(&codecs[stream >> 1])) {
+            num_samples = -1;
+            break;
+        }
+
+        //A stream that has not started over has no codec state yet
+        if (!codecs[stream >> 1].index.buckets) {
+            num_samples = -1;
+            break;
+        }
+
+        while (p < frame_end) {
+            consumed = portpilot_codec_decode(&codecs[stream >> 1], p,
+                    frame_end - p, &serial_number, &pp_data);
+
+            if (!consumed)
+                break;
+
+            cb(ptr, serial_number, &pp_data);
+            ++num_samples;
+            p += consumed;
+        }
+
+        if (p != frame_end) {
+            num_samples = -1;
+            break;
+        }
+    }
+
+    for (i = 0; i < num_codecs; i++) {
+        if (codecs[i].index.buckets)
+            portpilot_codec_deinit(&codecs[i]);
+    }
+
+    free(codecs);
+
+    return num_samples;
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef PORTPILOT_CODEC_H
+#define PORTPILOT_CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "backend_hash.h"
+#include "portpilot_logger.h"
+
+//Compressed sample stream (-z). Consecutive samples of a device barely change,
+//so every field is stored as the zigzag-encoded varint of its difference to
+//the previous sample of the same device. Host time (us) and the device
+//timestamp increase by a nearly constant step, they are stored as the
+//difference between consecutive differences (delta-of-delta). A sample starts
+//with a varint of its device id + 1 and a byte with a bit per field that
+//changed (CODEC_FIELD_*), followed by the host time and the fields that
+//changed. The first sample of a device is preceded by its definition: a 0
+//varint, the id and the length and bytes of the serial number. All varints
+//are little-endian base 128
+#define CODEC_MAGIC "PPDELTA1"
+
+//Max. number of bytes of an encoded sample, including the definition of its
+//device
+#define CODEC_MAX_LEN 384
+
+enum {
+    CODEC_FIELD_TSTAMP = 0,
+    CODEC_FIELD_V_IN,
+    CODEC_FIELD_V_OUT,
+    CODEC_FIELD_CURRENT,
+    CODEC_FIELD_MAX_CURRENT,
+    CODEC_FIELD_ENERGY,
+    CODEC_FIELD_TOTAL_ENERGY,
+    CODEC_FIELD_NUM_READINGS,
+};
+
+//The previous sample of one device (host_us is realtime), and the previous
+//steps of the fields that are stored as delta-of-delta
+struct portpilot_codec_dev {
+    struct backend_hash_node node;
+    uint64_t host_us;
+    int64_t host_step;
+    int64_t tstamp_step;
+    uint32_t tstamp;
+    uint32_t v_in;
+    uint32_t v_out;
+    uint32_t energy;
+    uint32_t total_energy;
+    uint16_t current;
+    uint16_t max_current;
+    uint16_t num_readings;
+    uint32_t id;
+    uint8_t serial_number[MAX_USB_STR_LEN + 1];
+};
+
+//State of one encoder or decoder. Devices are indexed on serial number (only
+//used when encoding) and on id (devs). realtime_offset converts the monotonic
+//timestamps of the logger to realtime
+struct portpilot_codec {
+    struct backend_hash index;
+    struct portpilot_codec_dev **devs;
+    uint64_t realtime_offset;
+    uint32_t num_devs;
+    uint32_t devs_size;
+};
+
+#define CODEC_ZIGZAG(val) ((((uint64_t) (val)) << 1) ^ \
+        (uint64_t) (((int64_t) (val)) >> 63))
+#define CODEC_UNZIGZAG(val) ((int64_t) (((val) >> 1) ^ -((val) & 1)))
+
+//Write val as a varint to p, which must have room for 10 bytes. Returns the
+//position after the varint
+static inline uint8_t* portpilot_codec_put_varint(uint8_t *p, uint64_t val)
+{
+    while (val >= 0x80) {
+        *p++ = (uint8_t) val | 0x80;
+        val >>= 7;
+    }
+
+    *p++ = (uint8_t) val;
+
+    return p;
+}
+
+//Read a varint from p. Returns the position after the varint, or NULL if the
+//varint does not end before end
+static inline const uint8_t* portpilot_codec_get_varint(const uint8_t *p,
+        const uint8_t *end, uint64_t *val)
+{
+    uint8_t shift = 0;
+
+    *val = 0;
+
+    while (p < end && shift < 64) {
+        *val |= ((uint64_t) (*p & 0x7f)) << shift;
+
+        if (!(*p++ & 0x80))
+            return p;
+
+        shift += 7;
+    }
+
+    return NULL;
+}
+
+//Called for every sample decoded from a stream
+typedef void (*portpilot_codec_sample_cb)(void *ptr,
+        const uint8_t *serial_number, const struct portpilot_data *pp_data);
+
+//Initialize a codec in place. Returns RETVAL_SUCCESS/RETVAL_FAILURE
+uint8_t portpilot_codec_init(struct portpilot_codec *codec);
+
+//Free the devices of the codec
+void portpilot_codec_deinit(struct portpilot_codec *codec);
+
+//Forget all devices, used when the encoder and decoder have to start over
+//(for example when encoded samples were lost). Returns
+//RETVAL_SUCCESS/RETVAL_FAILURE
+uint8_t portpilot_codec_reset(struct portpilot_codec *codec);
+
+//Encode pp_data (from the device with the given serial number) into buf, which
+//must have room for at least CODEC_MAX_LEN bytes. Returns the number of bytes
+//written, 0 if the device could not be added
+uint32_t portpilot_codec_encode(struct portpilot_codec *codec, uint8_t *buf,
+        const uint8_t *serial_number, const struct portpilot_data *pp_data);
+
+//Decode the next sample in buf into pp_data (host_ns is realtime, with us
+//resolution), and point serial_number to the serial number of its device.
+//Returns the number of bytes consumed, 0 if buf is truncated or invalid. The
+//codec has to be reset before it can be used again after a failure
+uint32_t portpilot_codec_decode(struct portpilot_codec *codec,
+        const uint8_t *buf, size_t len, const uint8_t **serial_number,
+        struct portpilot_data *pp_data);
+
+//Decode a file written by sinks with SINK_FORMAT_DELTA (see portpilot_sink.h),
+//starting with CODEC_MAGIC, and call cb for every sample. The samples of a
+//stream are in order, the streams are interleaved frame by frame. A truncated
+//last frame (the logger was killed) is ignored, and *truncated is set. Returns
+//the number of samples, or -1 if the file is invalid
+int64_t portpilot_codec_decode_stream(const uint8_t *buf, size_t len,
+        portpilot_codec_sample_cb cb, void *ptr, uint8_t *truncated);
+
+#endif
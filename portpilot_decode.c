@@ -0,0 +1,261 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "portpilot_decode.h"
+#include "portpilot_logger.h"
+
+void portpilot_decode_pkt(struct portpilot_data *pp_data,
+        const struct portpilot_pkt *pp_pkt)
+{
+    //We ignore the direction of the V, A and use absolute values to get a
+    //correct sum
+    pp_data->tstamp = pp_pkt->tstamp;
+    pp_data->v_in += pp_pkt->v_in >= 0 ? pp_pkt->v_in :
+        (pp_pkt->v_in * -1);
+    pp_data->v_out += pp_pkt->v_out >= 0 ? pp_pkt->v_out :
+        (pp_pkt->v_out * -1);
+    pp_data->current += pp_pkt->current >= 0 ? pp_pkt->current :
+        (pp_pkt->current * -1);
+    pp_data->max_current = pp_pkt->max_current >= 0 ? pp_pkt->max_current :
+        (pp_pkt->max_current * -1);
+    pp_data->energy += pp_pkt->energy >= 0 ? pp_pkt->energy :
+        (pp_pkt->energy * -1);
+    pp_data->total_energy = pp_pkt->total_energy >= 0 ?
+        pp_pkt->total_energy / 3600 :
+        (pp_pkt->total_energy * -1) / 3600;
+    pp_data->num_readings++;
+}
+
+//The batch decoders sum the absolute values of v_in, v_out, current and energy
+//in 32 bit lanes. All sums end up in fields of 32 bits or less, so summing
+//with wrap-around gives the same result as the scalar path. The fields where
+//only the last packet counts are decoded separately
+#define PKT_OFF_V_IN 5
+#define PKT_OFF_ENERGY 23
+
+typedef void(*portpilot_decode_sum_cb)(const uint8_t *pkts, uint32_t stride,
+        uint32_t num_pkts, uint32_t sums[4]);
+
+//Read the four 16 bit fields v_in, v_out, current and energy of a packet as
+//one 64 bit word. v_in, v_out and current are consecutive and followed by
+//max_current, which is replaced by energy
+static inline uint64_t portpilot_decode_gather(const uint8_t *pkt)
+{
+    uint64_t word;
+    uint16_t energy;
+
+    memcpy(&word, pkt + PKT_OFF_V_IN, sizeof(word));
+    memcpy(&energy, pkt + PKT_OFF_ENERGY, sizeof(energy));
+
+    return (word & 0x0000FFFFFFFFFFFFULL) | ((uint64_t) energy << 48);
+}
+
+static void portpilot_decode_sum_scalar(const uint8_t *pkts, uint32_t stride,
+        uint32_t num_pkts, uint32_t sums[4])
+{
+    const struct portpilot_pkt *pp_pkt;
+    int32_t val;
+    uint32_t i;
+
+    for (i = 0; i < num_pkts; i++) {
+        pp_pkt = (const struct portpilot_pkt*) (pkts + (i * stride));
+
+        val = pp_pkt->v_in;
+        sums[0] += val >= 0 ? val : -val;
+        val = pp_pkt->v_out;
+        sums[1] += val >= 0 ? val : -val;
+        val = pp_pkt->current;
+        sums[2] += val >= 0 ? val : -val;
+        val = pp_pkt->energy;
+        sums[3] += val >= 0 ? val : -val;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//Two packets per iteration. The 16 bit fields are sign-extended to 32 bit
+//before abs, so that -32768 becomes 32768
+__attribute__((target("sse2")))
+static void portpilot_decode_sum_sse2(const uint8_t *pkts, uint32_t stride,
+        uint32_t num_pkts, uint32_t sums[4])
+{
+    __m128i acc = _mm_setzero_si128(), fields, lo, hi, sign;
+    uint32_t i, tail[4] = {0};
+
+    for (i = 0; i + 2 <= num_pkts; i += 2) {
+        fields = _mm_set_epi64x(
+                portpilot_decode_gather(pkts + ((i + 1) * stride)),
+                portpilot_decode_gather(pkts + (i * stride)));
+
+        lo = _mm_srai_epi32(_mm_unpacklo_epi16(fields, fields), 16);
+        hi = _mm_srai_epi32(_mm_unpackhi_epi16(fields, fields), 16);
+
+        sign = _mm_srai_epi32(lo, 31);
+        lo = _mm_sub_epi32(_mm_xor_si128(lo, sign), sign);
+        sign = _mm_srai_epi32(hi, 31);
+        hi = _mm_sub_epi32(_mm_xor_si128(hi, sign), sign);
+
+        acc = _mm_add_epi32(acc, _mm_add_epi32(lo, hi));
+    }
+
+    portpilot_decode_sum_scalar(pkts + (i * stride), stride, num_pkts - i,
+            tail);
+    acc = _mm_add_epi32(acc, _mm_loadu_si128((const __m128i*) tail));
+    acc = _mm_add_epi32(acc, _mm_loadu_si128((const __m128i*) sums));
+    _mm_storeu_si128((__m128i*) sums, acc);
+}
+
+//Four packets per iteration, otherwise the same as the SSE2 version
+__attribute__((target("avx2")))
+static void portpilot_decode_sum_avx2(const uint8_t *pkts, uint32_t stride,
+        uint32_t num_pkts, uint32_t sums[4])
+{
+    __m256i acc = _mm256_setzero_si256(), fields, lo, hi;
+    __m128i sum;
+    uint32_t i, tail[4] = {0};
+
+    for (i = 0; i + 4 <= num_pkts; i += 4) {
+        fields = _mm256_set_epi64x(
+                portpilot_decode_gather(pkts + ((i + 3) * stride)),
+                portpilot_decode_gather(pkts + ((i + 2) * stride)),
+                portpilot_decode_gather(pkts + ((i + 1) * stride)),
+                portpilot_decode_gather(pkts + (i * stride)));
+
+        lo = _mm256_abs_epi32(_mm256_cvtepi16_epi32(
+                    _mm256_castsi256_si128(fields)));
+        hi = _mm256_abs_epi32(_mm256_cvtepi16_epi32(
+                    _mm256_extracti128_si256(fields, 1)));
+
+        acc = _mm256_add_epi32(acc, _mm256_add_epi32(lo, hi));
+    }
+
+    //Every 128 bit half holds the four sums of two packets
+    sum = _mm_add_epi32(_mm256_castsi256_si128(acc),
+            _mm256_extracti128_si256(acc, 1));
+
+    portpilot_decode_sum_scalar(pkts + (i * stride), stride, num_pkts - i,
+            tail);
+    sum = _mm_add_epi32(sum, _mm_loadu_si128((const __m128i*) tail));
+    sum = _mm_add_epi32(sum, _mm_loadu_si128((const __m128i*) sums));
+    _mm_storeu_si128((__m128i*) sums, sum);
+}
+#endif
+
+static portpilot_decode_sum_cb portpilot_decode_get_sum(uint8_t type)
+{
+    switch (type) {
+    case PORTPILOT_DECODE_SCALAR:
+        return portpilot_decode_sum_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    case PORTPILOT_DECODE_SSE2:
+        if (__builtin_cpu_supports("sse2"))
+            return portpilot_decode_sum_sse2;
+        break;
+    case PORTPILOT_DECODE_AVX2:
+        if (__builtin_cpu_supports("avx2"))
+            return portpilot_decode_sum_avx2;
+        break;
+#endif
+    default:
+        break;
+    }
+
+    return NULL;
+}
+
+static void portpilot_decode_batch_sum(portpilot_decode_sum_cb sum_cb,
+        struct portpilot_data *pp_data, const uint8_t *pkts, uint32_t stride,
+        uint32_t num_pkts)
+{
+    const struct portpilot_pkt *last_pkt;
+    uint32_t sums[4] = {0};
+
+    if (!num_pkts)
+        return;
+
+    sum_cb(pkts, stride, num_pkts, sums);
+
+    pp_data->v_in += sums[0];
+    pp_data->v_out += sums[1];
+    pp_data->current += sums[2];
+    pp_data->energy += sums[3];
+
+    //Let the scalar path handle the fields where the last packet wins
+    last_pkt = (const struct portpilot_pkt*) (pkts +
+            ((num_pkts - 1) * stride));
+    pp_data->tstamp = last_pkt->tstamp;
+    pp_data->max_current = last_pkt->max_current >= 0 ?
+        last_pkt->max_current : (last_pkt->max_current * -1);
+    pp_data->total_energy = last_pkt->total_energy >= 0 ?
+        last_pkt->total_energy / 3600 :
+        (last_pkt->total_energy * -1) / 3600;
+    pp_data->num_readings += num_pkts;
+}
+
+int32_t portpilot_decode_batch_type(uint8_t type,
+        struct portpilot_data *pp_data, const uint8_t *pkts, uint32_t stride,
+        uint32_t num_pkts)
+{
+    portpilot_decode_sum_cb sum_cb = portpilot_decode_get_sum(type);
+
+    if (!sum_cb)
+        return -1;
+
+    portpilot_decode_batch_sum(sum_cb, pp_data, pkts, stride, num_pkts);
+    return 0;
+}
+
+void portpilot_decode_batch(struct portpilot_data *pp_data,
+        const uint8_t *pkts, uint32_t stride, uint32_t num_pkts)
+{
+    //Picked once, the CPU does not change. Workers can race on the first
+    //call, but they will all pick the same implementation
+    static _Atomic(portpilot_decode_sum_cb) best_sum;
+    portpilot_decode_sum_cb sum_cb = atomic_load_explicit(&best_sum,
+            memory_order_relaxed);
+    int8_t type;
+
+    if (!sum_cb) {
+        for (type = PORTPILOT_DECODE_MAX - 1; !sum_cb; type--)
+            sum_cb = portpilot_decode_get_sum(type);
+
+        atomic_store_explicit(&best_sum, sum_cb, memory_order_relaxed);
+    }
+
+    portpilot_decode_batch_sum(sum_cb, pp_data, pkts, stride, num_pkts);
+}
+
+const char* portpilot_decode_type_name(uint8_t type)
+{
+    switch (type) {
+    case PORTPILOT_DECODE_SCALAR:
+        return "scalar";
+    case PORTPILOT_DECODE_SSE2:
+        return "sse2";
+    case PORTPILOT_DECODE_AVX2:
+        return "avx2";
+    default:
+        return "unknown";
+    }
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef PORTPILOT_DECODE_H
+#define PORTPILOT_DECODE_H
+
+#include <stdint.h>
+
+struct portpilot_data;
+struct portpilot_pkt;
+
+//Implementations of the batch decoder. SSE2 and AVX2 are only available on
+//x86, and only used when supported by the CPU
+enum {
+    PORTPILOT_DECODE_SCALAR = 0,
+    PORTPILOT_DECODE_SSE2,
+    PORTPILOT_DECODE_AVX2,
+    PORTPILOT_DECODE_MAX
+};
+
+//Decode one packet received from a Portpilot and add it to the aggregate in
+//pp_data. V, A and W are summed as absolute values, while timestamp, max.
+//current and total energy are taken from the last packet
+void portpilot_decode_pkt(struct portpilot_data *pp_data,
+        const struct portpilot_pkt *pp_pkt);
+
+//Decode num_pkts raw packets and add them to the aggregate in pp_data. Packet i
+//starts at pkts + (i * stride), so packets can be stored back-to-back (stride
+//is sizeof(struct portpilot_pkt)) or in larger records. The result is the same,
+//bit for bit, as calling portpilot_decode_pkt() for every packet in order.
+//Uses the best implementation supported by the CPU
+void portpilot_decode_batch(struct portpilot_data *pp_data,
+        const uint8_t *pkts, uint32_t stride, uint32_t num_pkts);
+
+//Same as portpilot_decode_batch(), but with a given implementation. Returns
+//-1 if the implementation is not supported by the CPU, 0 otherwise
+int32_t portpilot_decode_batch_type(uint8_t type,
+        struct portpilot_data *pp_data, const uint8_t *pkts, uint32_t stride,
+        uint32_t num_pkts);
+
+//Name of a batch decoder implementation
+const char* portpilot_decode_type_name(uint8_t type);
+
+#endif
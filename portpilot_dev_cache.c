@@ -0,0 +1,299 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "portpilot_dev_cache.h"
+
+//Max. length of the hex-encoded fields of an entry in the cache file
+#define DEV_CACHE_HEX_LEN (sizeof(struct libusb_device_descriptor) * 2)
+
+//Initial number of buckets in the index, it grows with the number of entries
+#define DEV_CACHE_INIT_SIZE 64
+
+static void portpilot_dev_cache_to_hex(char *hex, const uint8_t *buf,
+        size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        sprintf(hex + (i * 2), "%02x", buf[i]);
+}
+
+static uint8_t portpilot_dev_cache_from_hex(uint8_t *buf, size_t len,
+        const char *hex)
+{
+    size_t i;
+    unsigned int val;
+
+    if (strlen(hex) != len * 2)
+        return RETVAL_FAILURE;
+
+    for (i = 0; i < len; i++) {
+        if (sscanf(hex + (i * 2), "%2x", &val) != 1)
+            return RETVAL_FAILURE;
+
+        buf[i] = (uint8_t) val;
+    }
+
+    return RETVAL_SUCCESS;
+}
+
+//Must be called with the lock held. There is at most one entry per path
+static struct portpilot_dev_cache_entry* portpilot_dev_cache_find(
+        struct portpilot_dev_cache *cache, const uint8_t *path,
+        uint8_t path_len)
+{
+    struct backend_hash_node *node;
+    struct portpilot_dev_cache_entry *entry;
+
+    for (node = backend_hash_first(&(cache->index),
+                backend_hash_bytes(path, path_len));
+            node != NULL; node = backend_hash_next(node)) {
+        entry = BACKEND_HASH_ENTRY(node, struct portpilot_dev_cache_entry,
+                node);
+
+        if (entry->path_len == path_len && !memcmp(entry->path, path, path_len))
+            return entry;
+    }
+
+    return NULL;
+}
+
+//Must be called with the lock held. A new entry for a path replaces the old
+//one, there can only be one device on a port
+static uint8_t portpilot_dev_cache_add(struct portpilot_dev_cache *cache,
+        const uint8_t *path, uint8_t path_len,
+        const struct libusb_device_descriptor *desc,
+        const struct portpilot_dev_info *info)
+{
+    struct portpilot_dev_cache_entry *entry = portpilot_dev_cache_find(cache,
+            path, path_len);
+
+    if (!entry) {
+        entry = calloc(sizeof(struct portpilot_dev_cache_entry), 1);
+
+        if (!entry)
+            return RETVAL_FAILURE;
+
+        memcpy(entry->path, path, path_len);
+        entry->path_len = path_len;
+        LIST_INSERT_HEAD(&(cache->entry_head), entry, next_entry);
+        backend_hash_insert(&(cache->index), &(entry->node),
+                backend_hash_bytes(path, path_len));
+        ++cache->num_entries;
+    }
+
+    entry->desc = *desc;
+    entry->info = *info;
+
+    return RETVAL_SUCCESS;
+}
+
+static void portpilot_dev_cache_load(struct portpilot_dev_cache *cache)
+{
+    FILE *fp = fopen(cache->file, "r");
+    char line[DEV_CACHE_HEX_LEN + MAX_USB_STR_LEN + 64];
+    char path_hex[DEV_CACHE_HEX_LEN + 1], desc_hex[DEV_CACHE_HEX_LEN + 1];
+    struct libusb_device_descriptor desc;
+    struct portpilot_dev_info info;
+    uint8_t path[USB_MAX_PATH];
+    size_t path_len, serial_len;
+    int32_t serial_offset;
+
+    //No cache has been written yet
+    if (!fp)
+        return;
+
+    while (fgets(line, sizeof(line), fp)) {
+        memset(&info, 0, sizeof(info));
+        serial_offset = -1;
+
+        if (sscanf(line, "%16s %36s %hhu %hhu %hu %n", path_hex, desc_hex,
+                    &(info.intf_num), &(info.input_endpoint),
+                    &(info.max_packet_size), &serial_offset) != 5 ||
+            serial_offset < 0)
+            continue;
+
+        path_len = strlen(path_hex) / 2;
+
+        if (!path_len || path_len > USB_MAX_PATH ||
+            !portpilot_dev_cache_from_hex(path, path_len, path_hex) ||
+            !portpilot_dev_cache_from_hex((uint8_t*) &desc, sizeof(desc),
+                desc_hex))
+            continue;
+
+        serial_len = strcspn(line + serial_offset, "\n");
+
+        if (serial_len > MAX_USB_STR_LEN)
+            continue;
+
+        memcpy(info.serial_number, line + serial_offset, serial_len);
+
+        if (!portpilot_dev_cache_add(cache, path, path_len, &desc, &info))
+            break;
+    }
+
+    fclose(fp);
+}
+
+struct portpilot_dev_cache* portpilot_dev_cache_create(const char *file)
+{
+    struct portpilot_dev_cache *cache = calloc(
+            sizeof(struct portpilot_dev_cache), 1);
+
+    if (!cache)
+        return NULL;
+
+    if (backend_hash_init(&(cache->index), DEV_CACHE_INIT_SIZE)) {
+        free(cache);
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&(cache->lock), NULL)) {
+        backend_hash_deinit(&(cache->index));
+        free(cache);
+        return NULL;
+    }
+
+    LIST_INIT(&(cache->entry_head));
+    cache->file = file;
+
+    if (cache->file)
+        portpilot_dev_cache_load(cache);
+
+    return cache;
+}
+
+void portpilot_dev_cache_free(struct portpilot_dev_cache *cache)
+{
+    struct portpilot_dev_cache_entry *entry = cache->entry_head.lh_first, *tmp;
+
+    while (entry != NULL) {
+        tmp = entry;
+        entry = entry->next_entry.le_next;
+        free(tmp);
+    }
+
+    backend_hash_deinit(&(cache->index));
+    pthread_mutex_destroy(&(cache->lock));
+    free(cache);
+}
+
+uint8_t portpilot_dev_cache_lookup(struct portpilot_dev_cache *cache,
+        const uint8_t *path, uint8_t path_len,
+        const struct libusb_device_descriptor *desc,
+        struct portpilot_dev_info *info)
+{
+    struct portpilot_dev_cache_entry *entry;
+
+    pthread_mutex_lock(&(cache->lock));
+
+    entry = portpilot_dev_cache_find(cache, path, path_len);
+
+    //Another device has been connected to the port
+    if (entry && memcmp(&(entry->desc), desc, sizeof(*desc)))
+        entry = NULL;
+
+    if (entry)
+        *info = entry->info;
+
+    pthread_mutex_unlock(&(cache->lock));
+
+    return entry ? RETVAL_SUCCESS : RETVAL_FAILURE;
+}
+
+uint8_t portpilot_dev_cache_insert(struct portpilot_dev_cache *cache,
+        const uint8_t *path, uint8_t path_len,
+        const struct libusb_device_descriptor *desc,
+        const struct portpilot_dev_info *info)
+{
+    uint8_t retval;
+
+    pthread_mutex_lock(&(cache->lock));
+
+    retval = portpilot_dev_cache_add(cache, path, path_len, desc, info);
+
+    if (retval)
+        cache->dirty = 1;
+
+    pthread_mutex_unlock(&(cache->lock));
+
+    return retval;
+}
+
+uint8_t portpilot_dev_cache_save(struct portpilot_dev_cache *cache)
+{
+    struct portpilot_dev_cache_entry *entry;
+    char path_hex[DEV_CACHE_HEX_LEN + 1], desc_hex[DEV_CACHE_HEX_LEN + 1];
+    char tmp_file[PATH_MAX];
+    FILE *fp;
+    uint8_t retval = RETVAL_SUCCESS;
+
+    if (!cache->file || !cache->dirty)
+        return RETVAL_SUCCESS;
+
+    if (snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", cache->file) >=
+            (int) sizeof(tmp_file))
+        return RETVAL_FAILURE;
+
+    fp = fopen(tmp_file, "w");
+
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s\n", tmp_file);
+        return RETVAL_FAILURE;
+    }
+
+    pthread_mutex_lock(&(cache->lock));
+
+    for (entry = cache->entry_head.lh_first; entry != NULL;
+            entry = entry->next_entry.le_next) {
+        //Would break the line-based format
+        if (strchr((const char*) entry->info.serial_number, '\n'))
+            continue;
+
+        portpilot_dev_cache_to_hex(path_hex, entry->path, entry->path_len);
+        portpilot_dev_cache_to_hex(desc_hex, (const uint8_t*) &(entry->desc),
+                sizeof(entry->desc));
+
+        if (fprintf(fp, "%s %s %u %u %u %s\n", path_hex, desc_hex,
+                    entry->info.intf_num, entry->info.input_endpoint,
+                    entry->info.max_packet_size,
+                    entry->info.serial_number) < 0) {
+            retval = RETVAL_FAILURE;
+            break;
+        }
+    }
+
+    if (retval)
+        cache->dirty = 0;
+
+    pthread_mutex_unlock(&(cache->lock));
+
+    if (fclose(fp) || !retval || rename(tmp_file, cache->file)) {
+        fprintf(stderr, "Failed to write device cache to %s\n", cache->file);
+        unlink(tmp_file);
+        cache->dirty = 1;
+        return RETVAL_FAILURE;
+    }
+
+    return RETVAL_SUCCESS;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef PORTPILOT_DEV_CACHE_H
+#define PORTPILOT_DEV_CACHE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include <libusb-1.0/libusb.h>
+
+#include "backend_hash.h"
+#include "portpilot_logger.h"
+
+//What we need to know about a device before it can be opened and read from. An
+//empty serial_number means that the device does not report a serial number
+struct portpilot_dev_info {
+    uint8_t serial_number[MAX_USB_STR_LEN + 1];
+    uint16_t max_packet_size;
+    uint8_t input_endpoint;
+    uint8_t intf_num;
+};
+
+//A device is identified by its bus/port path and device descriptor. A
+//re-enumerated device (same port, same descriptor) has the same config, so its
+//config descriptor does not have to be parsed again. All Portpilots have the
+//same descriptor, so the serial number is still read when the device is opened
+//and replaces a stale one. Entries are indexed on path (node)
+struct portpilot_dev_cache_entry {
+    struct libusb_device_descriptor desc;
+    struct portpilot_dev_info info;
+    struct backend_hash_node node;
+    LIST_ENTRY(portpilot_dev_cache_entry) next_entry;
+    uint8_t path[USB_MAX_PATH];
+    uint8_t path_len;
+};
+
+//The cache is shared by all shards (attach is rare compared to reading, so a
+//mutex is good enough). When file is set, the cache is loaded from file on
+//creation and written back by portpilot_dev_cache_save() if it has changed
+struct portpilot_dev_cache {
+    pthread_mutex_t lock;
+    LIST_HEAD(dev_cache_list, portpilot_dev_cache_entry) entry_head;
+    struct backend_hash index;
+    const char *file;
+    uint32_t num_entries;
+    uint8_t dirty;
+};
+
+//Create the cache and, if file is not NULL, load the entries stored in file. A
+//missing file is not an error. Returns NULL on failure
+struct portpilot_dev_cache* portpilot_dev_cache_create(const char *file);
+
+//Free the cache and all entries, without saving it
+void portpilot_dev_cache_free(struct portpilot_dev_cache *cache);
+
+//Copy the info of the device with the given path and descriptor into info.
+//Returns RETVAL_SUCCESS if the device is cached, RETVAL_FAILURE otherwise
+uint8_t portpilot_dev_cache_lookup(struct portpilot_dev_cache *cache,
+        const uint8_t *path, uint8_t path_len,
+        const struct libusb_device_descriptor *desc,
+        struct portpilot_dev_info *info);
+
+//Insert or update the entry of the device with the given path and descriptor
+uint8_t portpilot_dev_cache_insert(struct portpilot_dev_cache *cache,
+        const uint8_t *path, uint8_t path_len,
+        const struct libusb_device_descriptor *desc,
+        const struct portpilot_dev_info *info);
+
+//Write the cache to its file, if any and if it has changed. The file is
+//replaced atomically (written to a temporary file that is renamed). The format
+//contains the raw device descriptor and is only meant to be read on the machine
+//that wrote it
+uint8_t portpilot_dev_cache_save(struct portpilot_dev_cache *cache);
+#endif
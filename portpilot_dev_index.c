@@ -0,0 +1,70 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <string.h>
+
+#include "portpilot_dev_index.h"
+#include "portpilot_logger.h"
+
+//Initial number of buckets, the table grows with the number of devices
+#define DEV_INDEX_INIT_SIZE 64
+
+uint8_t portpilot_dev_index_init(struct portpilot_dev_index *index)
+{
+    if (backend_hash_init(&(index->path), DEV_INDEX_INIT_SIZE))
+        return RETVAL_FAILURE;
+
+    return RETVAL_SUCCESS;
+}
+
+void portpilot_dev_index_deinit(struct portpilot_dev_index *index)
+{
+    backend_hash_deinit(&(index->path));
+}
+
+void portpilot_dev_index_add(struct portpilot_dev_index *index,
+        struct portpilot_dev *pp_dev)
+{
+    backend_hash_insert(&(index->path), &(pp_dev->path_node),
+            backend_hash_bytes(pp_dev->path, pp_dev->path_len));
+}
+
+void portpilot_dev_index_remove(struct portpilot_dev_index *index,
+        struct portpilot_dev *pp_dev)
+{
+    backend_hash_remove(&(index->path), &(pp_dev->path_node));
+}
+
+struct portpilot_dev* portpilot_dev_index_find_path(
+        const struct portpilot_dev_index *index, const uint8_t *path,
+        uint8_t path_len)
+{
+    struct backend_hash_node *node;
+    struct portpilot_dev *pp_dev;
+
+    for (node = backend_hash_first(&(index->path),
+                backend_hash_bytes(path, path_len));
+            node != NULL; node = backend_hash_next(node)) {
+        pp_dev = BACKEND_HASH_ENTRY(node, struct portpilot_dev, path_node);
+
+        if (pp_dev->path_len == path_len &&
+            !memcmp(pp_dev->path, path, path_len))
+            return pp_dev;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef PORTPILOT_DEV_INDEX_H
+#define PORTPILOT_DEV_INDEX_H
+
+#include <stdint.h>
+
+#include "backend_hash.h"
+
+struct portpilot_dev;
+
+//Index of the devices of a shard, so that a device can be found by its
+//bus/port path (on every hotplug event) without walking the device list
+struct portpilot_dev_index {
+    struct backend_hash path;
+};
+
+//Initialize the index. Returns RETVAL_SUCCESS/RETVAL_FAILURE
+uint8_t portpilot_dev_index_init(struct portpilot_dev_index *index);
+
+//Release the index, the devices are not touched
+void portpilot_dev_index_deinit(struct portpilot_dev_index *index);
+
+//Add a device to the index. The path of the device must be set and can not
+//change while the device is indexed
+void portpilot_dev_index_add(struct portpilot_dev_index *index,
+        struct portpilot_dev *pp_dev);
+
+//Remove a device from the index
+void portpilot_dev_index_remove(struct portpilot_dev_index *index,
+        struct portpilot_dev *pp_dev);
+
+//Find the device with the given path, or NULL
+struct portpilot_dev* portpilot_dev_index_find_path(
+        const struct portpilot_dev_index *index, const uint8_t *path,
+        uint8_t path_len);
+
+#endif
@@ -0,0 +1,287 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+//Export (a time range of) a binary log written with -b, or compressed samples
+//written with -z, to CSV. Or print a summary of the file
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "portpilot_binlog_reader.h"
+#include "portpilot_codec.h"
+#include "portpilot_logger.h"
+#include "portpilot_sink.h"
+
+#define EXPORT_CSV_DESCRIPTION "Host time (s), Dev. serial, Device time (s), " \
+                               "VBus in (mV), VBus out (mV), Current (mA), " \
+                               "Max current (mA), Energy (mW), " \
+                               "Total energy (mWh)"
+
+//What to export. The binary log reader filters on time and serial number
+//itself, the samples of a compressed file are filtered here. When summary is
+//set, samples are only counted
+struct portpilot_export {
+    const char *serial_number;
+    uint64_t from_ns;
+    uint64_t to_ns;
+    uint64_t num_samples;
+    uint64_t first_ns;
+    uint64_t last_ns;
+    uint8_t summary;
+};
+
+static void portpilot_export_sample(const uint8_t *serial_number,
+        const struct portpilot_data *pp_data)
+{
+    char buf[SINK_MAX_LINE + 32];
+    uint32_t len;
+
+    len = snprintf(buf, 32, "%llu.%09llu,",
+            (unsigned long long) (pp_data->host_ns / 1000000000ULL),
+            (unsigned long long) (pp_data->host_ns % 1000000000ULL));
+    len += portpilot_sink_format_csv(buf + len, serial_number, pp_data);
+
+    fwrite(buf, 1, len, stdout);
+}
+
+static void portpilot_export_record(void *ptr, const uint8_t *serial_number,
+        const struct portpilot_binlog_record *record)
+{
+    struct portpilot_data pp_data;
+
+    pp_data.host_ns = record->host_ns;
+    pp_data.tstamp = record->tstamp;
+    pp_data.v_in = record->v_in;
+    pp_data.v_out = record->v_out;
+    pp_data.energy = record->energy;
+    pp_data.total_energy = record->total_energy;
+    pp_data.current = record->current;
+    pp_data.max_current = record->max_current;
+    pp_data.num_readings = record->num_readings;
+
+    portpilot_export_sample(serial_number, &pp_data);
+}
+
+static void portpilot_export_delta_sample(void *ptr,
+        const uint8_t *serial_number, const struct portpilot_data *pp_data)
+{
+    struct portpilot_export *exp = ptr;
+
+    if (pp_data->host_ns < exp->from_ns || pp_data->host_ns > exp->to_ns ||
+        (exp->serial_number && strcmp((const char*) serial_number,
+                                      exp->serial_number)))
+        return;
+
+    if (!exp->num_samples++ || pp_data->host_ns < exp->first_ns)
+        exp->first_ns = pp_data->host_ns;
+
+    if (pp_data->host_ns > exp->last_ns)
+        exp->last_ns = pp_data->host_ns;
+
+    if (!exp->summary)
+        portpilot_export_sample(serial_number, pp_data);
+}
+
+static void portpilot_export_binlog_summary(
+        const struct portpilot_binlog_map *map)
+{
+    const struct portpilot_binlog_index_entry *entry;
+    uint64_t num_records = 0, first_ns = UINT64_MAX, last_ns = 0;
+    uint32_t i, num_serials = 0;
+
+    for (i = 0; i < map->num_entries; i++) {
+        entry = &(map->index[i]);
+        num_records += entry->num_records;
+
+        if (entry->first_ns < first_ns)
+            first_ns = entry->first_ns;
+
+        if (entry->last_ns > last_ns)
+            last_ns = entry->last_ns;
+
+        if (entry->serial_id >= num_serials)
+            num_serials = entry->serial_id + 1;
+    }
+
+    fprintf(stdout, "Blocks: %u%s\n", map->num_entries,
+            map->rebuilt ? " (no index, log was not closed)" : "");
+    fprintf(stdout, "Records: %llu\n", (unsigned long long) num_records);
+    fprintf(stdout, "Devices: %u\n", num_serials);
+
+    if (num_records)
+        fprintf(stdout, "Time: %.3f - %.3f\n", first_ns / 1000000000.0,
+                last_ns / 1000000000.0);
+}
+
+static uint8_t portpilot_export_binlog(const char *path,
+        const struct portpilot_export *exp)
+{
+    struct portpilot_binlog_map *map;
+    int64_t num_records = 0;
+
+    map = portpilot_binlog_map_open(path);
+
+    if (!map) {
+        fprintf(stderr, "Failed to open binary log %s\n", path);
+        return RETVAL_FAILURE;
+    }
+
+    if (exp->summary)
+        portpilot_export_binlog_summary(map);
+    else
+        num_records = portpilot_binlog_map_foreach(map, exp->from_ns,
+                exp->to_ns, exp->serial_number, portpilot_export_record,
+                NULL);
+
+    portpilot_binlog_map_close(map);
+
+    return num_records >= 0;
+}
+
+static uint8_t portpilot_export_delta(const char *path,
+        struct portpilot_export *exp)
+{
+    struct stat st;
+    int64_t num_samples;
+    uint8_t truncated;
+    int32_t fd;
+    void *buf;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 || fstat(fd, &st) || (buf = mmap(NULL, st.st_size, PROT_READ,
+                    MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "Failed to open compressed file %s\n", path);
+
+        if (fd >= 0)
+            close(fd);
+
+        return RETVAL_FAILURE;
+    }
+
+    close(fd);
+    madvise(buf, st.st_size, MADV_SEQUENTIAL);
+
+    num_samples = portpilot_codec_decode_stream(buf, st.st_size,
+            portpilot_export_delta_sample, exp, &truncated);
+    munmap(buf, st.st_size);
+
+    if (num_samples < 0) {
+        fprintf(stderr, "Compressed file %s is invalid\n", path);
+        return RETVAL_FAILURE;
+    }
+
+    if (truncated)
+        fprintf(stderr, "Compressed file %s is truncated, the last samples "
+                "are missing\n", path);
+
+    if (!exp->summary)
+        return RETVAL_SUCCESS;
+
+    fprintf(stdout, "Samples: %llu\n", (unsigned long long) exp->num_samples);
+    fprintf(stdout, "Bytes: %llu (%.2f per sample)\n",
+            (unsigned long long) st.st_size, num_samples ?
+            (double) st.st_size / num_samples : 0);
+
+    if (exp->num_samples)
+        fprintf(stdout, "Time: %.3f - %.3f\n", exp->first_ns / 1000000000.0,
+                exp->last_ns / 1000000000.0);
+
+    return RETVAL_SUCCESS;
+}
+
+static void usage()
+{
+    fprintf(stdout, "Usage: portpilot-export [options] file\n");
+    fprintf(stdout, "Supported parameters:\n");
+    fprintf(stdout, "\t-s: export records from this time (seconds since the "
+            "epoch, default: first record)\n");
+    fprintf(stdout, "\t-e: export records up to this time (seconds since the "
+            "epoch, default: last record)\n");
+    fprintf(stdout, "\t-d: only export the records of device with this "
+            "serial number\n");
+    fprintf(stdout, "\t-i: print a summary of the file instead of exporting\n");
+    fprintf(stdout, "\t-h: this menu\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct portpilot_export exp = {0};
+    char magic[8] = {0};
+    uint8_t retval;
+    int32_t opt;
+    FILE *file;
+
+    exp.to_ns = UINT64_MAX;
+
+    while ((opt = getopt(argc, argv, "s:e:d:ih")) != -1) {
+        switch (opt) {
+        case 's':
+            exp.from_ns = (uint64_t) (strtod(optarg, NULL) * 1000000000.0);
+            break;
+        case 'e':
+            exp.to_ns = (uint64_t) (strtod(optarg, NULL) * 1000000000.0);
+            break;
+        case 'd':
+            exp.serial_number = optarg;
+            break;
+        case 'i':
+            exp.summary = 1;
+            break;
+        case 'h':
+        default:
+            usage();
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    //Both formats start with an 8 byte magic
+    file = fopen(argv[optind], "r");
+
+    if (!file || fread(magic, 1, sizeof(magic), file) != sizeof(magic)) {
+        fprintf(stderr, "Failed to read %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    fclose(file);
+
+    if (!exp.summary)
+        fprintf(stdout, EXPORT_CSV_DESCRIPTION "\n");
+
+    if (!memcmp(magic, CODEC_MAGIC, sizeof(magic)))
+        retval = portpilot_export_delta(argv[optind], &exp);
+    else
+        retval = portpilot_export_binlog(argv[optind], &exp);
+
+    if (!retval || fflush(stdout)) {
+        fprintf(stderr, "Failed to export %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    exit(EXIT_SUCCESS);
+}
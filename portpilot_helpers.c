@@ -18,50 +18,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
 #include <libusb-1.0/libusb.h>
 
 #include "portpilot_helpers.h"
 #include "portpilot_logger.h"
 #include "portpilot_callbacks.h"
+#include "portpilot_worker.h"
+#include "portpilot_ring.h"
+#include "portpilot_dev_cache.h"
+#include "portpilot_attach.h"
+#include "portpilot_hidraw.h"
+#include "portpilot_sim.h"
+#include "portpilot_sink.h"
+#include "portpilot_binlog.h"
+#include "portpilot_shm.h"
+#include "portpilot_io.h"
+#include "portpilot_decode.h"
 #include "backend_event_loop.h"
 
-static uint8_t portpilot_helpers_get_serial_num(libusb_device *device,
-        unsigned char *serial_buf, uint8_t serial_buf_len)
-{
-    struct libusb_device_descriptor desc = {0};
-    struct libusb_device_handle *handle;
-    int32_t retval;
-
-    libusb_get_device_descriptor(device, &desc);
-
-    //No device number to extract
-    if (!desc.iSerialNumber) {
-        fprintf(stderr, "Device serial number missing\n");
-        return RETVAL_FAILURE;
-    }
-
-    retval = libusb_open(device, &handle);
-
-    if (retval) {
-        fprintf(stderr, "Failed to open device: %s\n",
-                libusb_error_name(retval));
-        return RETVAL_FAILURE;
-    }
-
-    retval = libusb_get_string_descriptor_ascii(handle,
-            desc.iSerialNumber, serial_buf, serial_buf_len);
-
-    if (retval < 0) {
-        fprintf(stderr, "Failed to get serial number: %s\n",
-                libusb_error_name(retval));
-        libusb_close(handle);
-        return RETVAL_FAILURE;
-    }
-
-    libusb_close(handle);
-    return RETVAL_SUCCESS;
-}
-
 //Get the indexes of the first HID interface. It is this interface we use to
 //communicate with the Portpilot
 uint8_t portpilot_helpers_get_hid_idx(const struct libusb_config_descriptor *conf_desc,
@@ -116,38 +92,88 @@ uint8_t portpilot_helpers_get_input_info(const struct libusb_interface_descripto
 
 void portpilot_helpers_free_dev(struct portpilot_dev *pp_dev)
 {
-    libusb_release_interface(pp_dev->handle, pp_dev->intf_num);
-    libusb_close(pp_dev->handle);
+    uint8_t i;
+
+    //A device removed while attaching has already been unlinked
+    if (pp_dev->attach_state != ATTACH_STATE_REMOVED) {
+        if (pp_dev->read_state == READ_STATE_FAILED_START &&
+            pp_dev->pp_ctx->num_itr_req)
+            portpilot_logger_stop_itr_cb(pp_dev->pp_ctx);
+
+        if (pp_dev->attach_state == ATTACH_STATE_DONE)
+            atomic_fetch_sub(&(pp_dev->pp_ctx->shards->num_devs), 1);
+
+        --pp_dev->pp_ctx->dev_list_len;
+        LIST_REMOVE(pp_dev, next_dev);
+        portpilot_dev_index_remove(&(pp_dev->pp_ctx->dev_index), pp_dev);
+    }
+
+    if (pp_dev->attach_handle) {
+        backend_event_loop_free_timeout(pp_dev->pp_ctx->event_loop,
+                pp_dev->attach_handle);
+        pp_dev->attach_handle = NULL;
+    }
+
+    //The callback of the control transfer frees the device once the transfer
+    //has been cancelled
+    if (pp_dev->ctrl_pending) {
+        pp_dev->attach_state = ATTACH_STATE_REMOVED;
+        libusb_cancel_transfer(pp_dev->ctrl_transfer);
+        return;
+    }
+
+    if (pp_dev->ctrl_transfer)
+        libusb_free_transfer(pp_dev->ctrl_transfer);
+
+    if (pp_dev->device)
+        libusb_unref_device(pp_dev->device);
+
+    if (pp_dev->handle) {
+        libusb_release_interface(pp_dev->handle, pp_dev->intf_num);
+
+        //libusb_close() takes the events lock when it is not called from an
+        //event handler, which is the case when attaching fails in a timeout
+        if (pp_dev->pp_ctx->usb_events_locked)
+            libusb_unlock_events(pp_dev->pp_ctx->usb_ctx);
+
+        libusb_close(pp_dev->handle);
+
+        if (pp_dev->pp_ctx->usb_events_locked)
+            libusb_lock_events(pp_dev->pp_ctx->usb_ctx);
+    }
+
+    if (pp_dev->fd_handle)
+        portpilot_hidraw_close_dev(pp_dev);
 
-    //It seems that if a device is disconnected, transfer fails before device is
+    //It seems that if a device is disconnected, transfers fail before device is
     //removed, so we clean up memory correctly. In the context case, we make
-    //sure that transfer is not active before calling free_dev
-    if (pp_dev->transfer)
-        libusb_free_transfer(pp_dev->transfer);
+    //sure that no transfer is active before calling free_dev
+    for (i = 0; i < MAX_QUEUE_DEPTH; i++) {
+        if (pp_dev->transfers[i])
+            libusb_free_transfer(pp_dev->transfers[i]);
+    }
 
-    if (pp_dev->agg_data)
-        free(pp_dev->agg_data);
+    //The worker might still have packets from the device to process. It also
+    //owns the trace
+    if (pp_dev->ring) {
+        portpilot_worker_remove_dev(pp_dev->pp_ctx->worker, pp_dev);
+        return;
+    }
 
-    --pp_dev->pp_ctx->dev_list_len;
-    LIST_REMOVE(pp_dev, next_dev);
-    free(pp_dev);
+    if (pp_dev->trace && pp_dev->attach_state == ATTACH_STATE_DONE)
+        portpilot_helpers_print_trace(pp_dev);
+
+    portpilot_helpers_release_dev(pp_dev);
 }
 
-uint8_t portpilot_helpers_create_dev(libusb_device *device,
-        struct portpilot_ctx *pp_ctx, uint16_t max_packet_size,
-        uint8_t input_endpoint, uint8_t intf_num, uint8_t *dev_path,
-        uint8_t dev_path_len)
+struct portpilot_dev* portpilot_helpers_alloc_dev(struct portpilot_ctx *pp_ctx,
+        const uint8_t *dev_path, uint8_t dev_path_len)
 {
-    int32_t retval;
-    struct portpilot_dev *pp_dev = NULL;
-
-    //TODO: Split into new function?
-    //All info is ready, time to create struc, open device and add to list
-    pp_dev = calloc(sizeof(struct portpilot_dev), 1);
+    struct portpilot_dev *pp_dev = calloc(sizeof(struct portpilot_dev), 1);
 
     if (!pp_dev) {
         fprintf(stderr, "Failed to allocate memory for PortPilot device\n");
-        return RETVAL_FAILURE;
+        return NULL;
     }
 
     if (pp_ctx->output_interval) {
@@ -155,118 +181,252 @@ uint8_t portpilot_helpers_create_dev(libusb_device *device,
 
         if (!pp_dev->agg_data) {
             fprintf(stderr, "Failed to allocate memory for agg. data\n");
-            return RETVAL_FAILURE;
+            free(pp_dev);
+            return NULL;
         }
     }
 
-    pp_dev->max_packet_size = max_packet_size;
-    pp_dev->input_endpoint = input_endpoint;
-    pp_dev->intf_num = intf_num;
-
-    retval = libusb_open(device, &(pp_dev->handle));
-
-    if (retval) {
-        fprintf(stderr, "Failed to open device: %s\n",
-                libusb_error_name(retval));
-        free(pp_dev);
-        return RETVAL_FAILURE;
-    }
+    if (pp_ctx->trace) {
+        pp_dev->trace = calloc(sizeof(struct portpilot_trace), 1);
 
-    if (libusb_kernel_driver_active(pp_dev->handle, intf_num) == 1) {
-        retval = libusb_detach_kernel_driver(pp_dev->handle, intf_num);
-
-        if (retval) {
-            fprintf(stderr, "Failed to detach kernel driver: %s\n",
-                    libusb_error_name(retval));
-            libusb_close(pp_dev->handle);
+        if (!pp_dev->trace) {
+            fprintf(stderr, "Failed to allocate memory for trace\n");
+            free(pp_dev->agg_data);
             free(pp_dev);
-            return RETVAL_FAILURE;
+            return NULL;
         }
-    }
-
-    retval = libusb_claim_interface(pp_dev->handle, intf_num);
 
-    if (retval) {
-        fprintf(stderr, "Failed to claim interface: %s\n",
-                libusb_error_name(retval));
-        libusb_close(pp_dev->handle);
-        free(pp_dev);
-        return RETVAL_FAILURE;
+        backend_histogram_reset(&(pp_dev->trace->latency));
+        backend_histogram_reset(&(pp_dev->trace->gap));
     }
 
-    //Try to read serial number from device. It is not critical if it is not
-    //present, the check for matching a desired serial has been done by the time
-    //we get here
-    portpilot_helpers_get_serial_num(device, pp_dev->serial_number,
-            MAX_USB_STR_LEN);
-
     memcpy(pp_dev->path, dev_path, dev_path_len);
     pp_dev->path_len = dev_path_len;
 
     pp_dev->pp_ctx = pp_ctx;
-    LIST_INSERT_HEAD(&(pp_dev->pp_ctx->dev_head), pp_dev, next_dev);
+
+    return pp_dev;
+}
+
+void portpilot_helpers_release_dev(struct portpilot_dev *pp_dev)
+{
+    free(pp_dev->trace);
+    free(pp_dev->agg_data);
+    free(pp_dev);
+}
+
+void portpilot_helpers_link_dev(struct portpilot_dev *pp_dev)
+{
+    struct portpilot_ctx *pp_ctx = pp_dev->pp_ctx;
+
+    LIST_INSERT_HEAD(&(pp_ctx->dev_head), pp_dev, next_dev);
+    portpilot_dev_index_add(&(pp_ctx->dev_index), pp_dev);
     ++pp_ctx->dev_list_len;
+}
 
-    fprintf(stdout, "Ready to start reading on device %s\n",
-            pp_dev->serial_number);
+uint8_t portpilot_helpers_add_dev(struct portpilot_dev *pp_dev)
+{
+    struct portpilot_ctx *pp_ctx = pp_dev->pp_ctx;
+    uint64_t attach_ns;
+
+    if (pp_ctx->worker && !portpilot_worker_add_dev(pp_ctx->worker, pp_dev)) {
+        fprintf(stderr, "Failed to hand device to worker\n");
+        portpilot_helpers_release_dev(pp_dev);
+        return RETVAL_FAILURE;
+    }
+
+    pp_dev->attach_state = ATTACH_STATE_DONE;
+    portpilot_helpers_link_dev(pp_dev);
+    atomic_fetch_add(&(pp_ctx->shards->num_devs), 1);
+
+    attach_ns = portpilot_helpers_now_ns() - pp_dev->attach_start;
+    backend_histogram_add(&(pp_ctx->attach_latency), attach_ns);
+
+    fprintf(stdout, "Ready to start reading on device %s (attached in %.3f "
+            "ms)\n", pp_dev->serial_number, attach_ns / 1000000.0);
 
     portpilot_helpers_start_reading_data(pp_dev);
 
     return RETVAL_SUCCESS;
 }
 
+uint8_t portpilot_helpers_create_dev(libusb_device *device,
+        struct portpilot_ctx *pp_ctx, const struct portpilot_dev_info *info,
+        uint8_t cached, uint8_t *dev_path, uint8_t dev_path_len)
+{
+    struct portpilot_dev *pp_dev;
+
+    //All info is ready, time to create struct and add to list. The device is
+    //opened and claimed by the attach state machine
+    pp_dev = portpilot_helpers_alloc_dev(pp_ctx, dev_path, dev_path_len);
+
+    if (!pp_dev)
+        return RETVAL_FAILURE;
+
+    pp_dev->max_packet_size = info->max_packet_size;
+    pp_dev->input_endpoint = info->input_endpoint;
+    pp_dev->intf_num = info->intf_num;
+    memcpy(pp_dev->serial_number, info->serial_number,
+            sizeof(pp_dev->serial_number));
+
+    if (!portpilot_attach_start(pp_dev, device, cached)) {
+        fprintf(stderr, "Failed to start attaching device\n");
+        portpilot_helpers_release_dev(pp_dev);
+        return RETVAL_FAILURE;
+    }
+
+    portpilot_helpers_link_dev(pp_dev);
+
+    return RETVAL_SUCCESS;
+}
+
 static void portpilot_set_read_start_failed(struct portpilot_dev *pp_dev)
 {
     portpilot_logger_start_itr_cb(pp_dev->pp_ctx);
     pp_dev->read_state = READ_STATE_FAILED_START; 
 }
 
-void portpilot_helpers_start_reading_data(struct portpilot_dev *pp_dev)
+//Submit transfer idx of pp_dev, allocating the transfer and its buffer the
+//first time
+static int32_t portpilot_helpers_submit_idx(struct portpilot_dev *pp_dev,
+        uint8_t idx)
 {
+    struct libusb_transfer *transfer = pp_dev->transfers[idx];
+    uint8_t *read_buf;
     int32_t retval;
 
-    if (!pp_dev->read_buf)
-        pp_dev->read_buf = calloc(pp_dev->max_packet_size, 1);
+    if (!transfer) {
+        transfer = libusb_alloc_transfer(0);
+        read_buf = calloc(pp_dev->max_packet_size, 1);
 
-    //Failed to allocate buffer, must indicate to loop
-    if (!pp_dev->read_buf) {
-        fprintf(stderr, "Failed to allocate read buffer\n");
+        if (!transfer || !read_buf) {
+            fprintf(stderr, "Failed to allocate libusb transfer\n");
+            libusb_free_transfer(transfer);
+            free(read_buf);
+            return LIBUSB_ERROR_NO_MEM;
+        }
 
-        if (pp_dev->read_state != READ_STATE_FAILED_START)
-            portpilot_set_read_start_failed(pp_dev);
+        libusb_fill_interrupt_transfer(transfer, pp_dev->handle,
+                pp_dev->input_endpoint, read_buf, pp_dev->max_packet_size,
+                portpilot_cb_read_cb, pp_dev, 5000);
+        transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+        pp_dev->transfers[idx] = transfer;
+    }
+
+    retval = libusb_submit_transfer(transfer);
+
+    //Don't consider an already transfered transfer a failure. This should not
+    //really happen now, but it could be that we want to do something smart wrt
+    //caching and so on later
+    if (retval && retval != LIBUSB_ERROR_BUSY)
+        return retval;
+
+    pp_dev->in_flight |= 1 << idx;
+    return 0;
+}
 
+static uint8_t portpilot_helpers_transfer_idx(struct portpilot_dev *pp_dev,
+        struct libusb_transfer *transfer)
+{
+    uint8_t i = 0;
+
+    //transfer always belongs to pp_dev
+    while (pp_dev->transfers[i] != transfer)
+        ++i;
+
+    return i;
+}
+
+void portpilot_helpers_transfer_done(struct portpilot_dev *pp_dev,
+        struct libusb_transfer *transfer)
+{
+    pp_dev->in_flight &= ~(1 << portpilot_helpers_transfer_idx(pp_dev,
+                transfer));
+}
+
+void portpilot_helpers_submit_transfer(struct portpilot_dev *pp_dev,
+        struct libusb_transfer *transfer)
+{
+    if (!portpilot_helpers_submit_idx(pp_dev,
+                portpilot_helpers_transfer_idx(pp_dev, transfer)))
         return;
+
+    //Let the iteration callback resubmit it
+    fprintf(stderr, "Failed to resubmit transfer\n");
+
+    if (pp_dev->read_state != READ_STATE_FAILED_START)
+        portpilot_set_read_start_failed(pp_dev);
+}
+
+uint8_t portpilot_helpers_cancel_transfers(struct portpilot_dev *pp_dev)
+{
+    uint8_t i, pending = 0;
+
+    for (i = 0; i < MAX_QUEUE_DEPTH; i++) {
+        if (!(pp_dev->in_flight & (1 << i)))
+            continue;
+
+        //Transfer has already completed
+        if (libusb_cancel_transfer(pp_dev->transfers[i]) ==
+                LIBUSB_ERROR_NOT_FOUND)
+            pp_dev->in_flight &= ~(1 << i);
+        else
+            ++pending;
     }
 
-    if (!pp_dev->transfer) {
-        pp_dev->transfer = libusb_alloc_transfer(0);
-        pp_dev->transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+    //Device is still being attached
+    if (pp_dev->ctrl_pending) {
+        if (libusb_cancel_transfer(pp_dev->ctrl_transfer) ==
+                LIBUSB_ERROR_NOT_FOUND)
+            pp_dev->ctrl_pending = 0;
+        else
+            ++pending;
     }
 
-    if (!pp_dev->transfer) {
-        fprintf(stderr, "Failed to allocate libusb transfer\n");
+    return pending;
+}
 
-        if (pp_dev->read_state != READ_STATE_FAILED_START)
-            portpilot_set_read_start_failed(pp_dev);
+void portpilot_helpers_start_reading_data(struct portpilot_dev *pp_dev)
+{
+    uint8_t i;
 
+    //Simulated devices read as long as they are plugged in
+    if (pp_dev->pp_ctx->sim) {
+        pp_dev->read_state = READ_STATE_RUNNING;
         return;
     }
 
-    libusb_fill_interrupt_transfer(pp_dev->transfer, pp_dev->handle,
-            pp_dev->input_endpoint, (unsigned char*) pp_dev->read_buf,
-            pp_dev->max_packet_size, portpilot_cb_read_cb, pp_dev, 5000);
+    if (pp_dev->pp_ctx->hidraw) {
+        if (!portpilot_hidraw_start_reading(pp_dev)) {
+            if (pp_dev->read_state != READ_STATE_FAILED_START)
+                portpilot_set_read_start_failed(pp_dev);
+            return;
+        }
 
-    retval = libusb_submit_transfer(pp_dev->transfer);
+        if (pp_dev->read_state == READ_STATE_FAILED_START)
+            portpilot_logger_stop_itr_cb(pp_dev->pp_ctx);
 
-    //Don't consider an already transfered transfer a failure. This should not
-    //really happen now, but it could be that we want to do something smart wrt
-    //caching and so on later
-    if (retval && retval != LIBUSB_ERROR_BUSY) {
+        pp_dev->read_state = READ_STATE_RUNNING;
+        return;
+    }
+
+    //Submit every transfer of the ring that is not already queued
+    for (i = 0; i < pp_dev->pp_ctx->queue_depth; i++) {
+        if (pp_dev->in_flight & (1 << i))
+            continue;
+
+        if (portpilot_helpers_submit_idx(pp_dev, i))
+            break;
+    }
+
+    if (i < pp_dev->pp_ctx->queue_depth) {
         fprintf(stderr, "Failed to submit transfer\n");
 
         if (pp_dev->read_state != READ_STATE_FAILED_START)
             portpilot_set_read_start_failed(pp_dev);
 
+        //Some transfers might have been submitted
+        portpilot_helpers_update_usb_timeout(pp_dev->pp_ctx);
         return;
     }
 
@@ -274,17 +434,62 @@ void portpilot_helpers_start_reading_data(struct portpilot_dev *pp_dev)
         portpilot_logger_stop_itr_cb(pp_dev->pp_ctx);
 
     pp_dev->read_state = READ_STATE_RUNNING;
+
+    //The transfers might be the next to time out
+    portpilot_helpers_update_usb_timeout(pp_dev->pp_ctx);
+}
+
+void portpilot_helpers_update_usb_timeout(struct portpilot_ctx *pp_ctx)
+{
+    struct timeval tv;
+
+    if (pp_ctx->usb_timerfd ||
+        libusb_get_next_timeout(pp_ctx->usb_ctx, &tv) != 1) {
+        backend_event_loop_remove_timeout(pp_ctx->usb_timeout_handle);
+        return;
+    }
+
+    //Round up, firing early would just cause another wakeup
+    pp_ctx->usb_timeout_handle->timeout_clock = backend_event_loop_now() +
+        (tv.tv_sec * 1000) + ((tv.tv_usec + 999) / 1000);
+    backend_event_loop_insert_timeout(pp_ctx->event_loop,
+            pp_ctx->usb_timeout_handle);
+}
+
+void portpilot_helpers_lock_usb_events(struct portpilot_ctx *pp_ctx)
+{
+    if (!pp_ctx->usb_ctx)
+        return;
+
+    libusb_lock_events(pp_ctx->usb_ctx);
+    pp_ctx->usb_events_locked = 1;
+}
+
+void portpilot_helpers_unlock_usb_events(struct portpilot_ctx *pp_ctx)
+{
+    if (!pp_ctx->usb_ctx)
+        return;
+
+    pp_ctx->usb_events_locked = 0;
+    libusb_unlock_events(pp_ctx->usb_ctx);
+}
+
+void portpilot_helpers_handle_usb_events(struct portpilot_ctx *pp_ctx)
+{
+    struct timeval tv = {0 ,0};
+
+    //libusb knows that callbacks run from here are inside event handling
+    pp_ctx->usb_events_locked = 0;
+    libusb_handle_events_locked(pp_ctx->usb_ctx, &tv);
+    pp_ctx->usb_events_locked = 1;
+
+    portpilot_helpers_update_usb_timeout(pp_ctx);
 }
 
 uint8_t portpilot_helpers_cmp_serial(const char *desired_serial,
-        libusb_device *device)
+        const uint8_t *dev_serial_number)
 {
     size_t desired_serial_len = strlen(desired_serial);
-    uint8_t dev_serial_number[MAX_USB_STR_LEN + 1] = {0};
-
-    if (!portpilot_helpers_get_serial_num(device, dev_serial_number,
-                MAX_USB_STR_LEN))
-        return RETVAL_FAILURE;
 
     if (strlen((const char*) dev_serial_number) == desired_serial_len &&
         !strncmp((const char*) dev_serial_number, desired_serial,
@@ -294,41 +499,65 @@ uint8_t portpilot_helpers_cmp_serial(const char *desired_serial,
         return RETVAL_FAILURE;
 }
 
+uint8_t portpilot_helpers_cmp_dev(const uint8_t *serial_number,
+        const uint8_t *path, uint8_t path_len,
+        const uint8_t *other_serial_number, const uint8_t *other_path,
+        uint8_t other_path_len)
+{
+    if (strcmp((const char*) serial_number, (const char*) other_serial_number))
+        return RETVAL_FAILURE;
+
+    if (serial_number[0])
+        return RETVAL_SUCCESS;
+
+    if (path_len == other_path_len && !memcmp(path, other_path, path_len))
+        return RETVAL_SUCCESS;
+    else
+        return RETVAL_FAILURE;
+}
+
 struct portpilot_dev* portpilot_helpers_find_dev(
         const struct portpilot_ctx *pp_ctx, const uint8_t *dev_path,
         uint8_t dev_path_len)
 {
-    struct portpilot_dev *ppd_itr = pp_ctx->dev_head.lh_first;
-
-    while (ppd_itr != NULL) {
-        if (ppd_itr->path_len == dev_path_len &&
-            !memcmp(ppd_itr->path, dev_path, dev_path_len))
-            return ppd_itr;
+    return portpilot_dev_index_find_path(&(pp_ctx->dev_index), dev_path,
+            dev_path_len);
+}
 
-        ppd_itr = ppd_itr->next_dev.le_next;
-    }
+uint8_t portpilot_helpers_get_shard(const uint8_t *dev_path,
+        uint8_t dev_path_len, uint8_t num_shards)
+{
+    if (num_shards < 2)
+        return 0;
 
-    return NULL;
+    //Hashed, so that devices on neighbouring ports are spread over the shards
+    return backend_hash_bytes(dev_path, dev_path_len) % num_shards;
 }
 
-uint8_t portpilot_helpers_free_ctx(struct portpilot_ctx *pp_ctx, uint8_t force)
+uint32_t portpilot_helpers_free_ctx(struct portpilot_ctx *pp_ctx, uint8_t force)
 {
     struct portpilot_dev *ppd_itr = pp_ctx->dev_head.lh_first, *ppd_tmp;
-    uint8_t failed_cancels = 0;
+    uint32_t failed_cancels = 0;
+    uint8_t pending, i;
 
     while (ppd_itr != NULL) {
         ppd_tmp = ppd_itr;
         ppd_itr = ppd_itr->next_dev.le_next;
 
-        //We are only allowed to free memory if transfer is cancelled, so check
-        //for this and indicate to loop if we need to wait for cancelled
-        //transfers
-        if (force || (ppd_tmp->transfer &&
-                libusb_cancel_transfer(ppd_tmp->transfer) ==
-                LIBUSB_ERROR_NOT_FOUND)) {
+        //We are only allowed to free memory if all transfers are cancelled, so
+        //check for this and indicate to loop if we need to wait for cancelled
+        //transfers. Every transfer that is still pending completes once
+        if (force) {
+            portpilot_helpers_free_dev(ppd_tmp);
+            continue;
+        }
+
+        pending = portpilot_helpers_cancel_transfers(ppd_tmp);
+
+        if (!pending) {
             portpilot_helpers_free_dev(ppd_tmp);
         } else {
-            ++pp_ctx->num_cancel;
+            pp_ctx->num_cancel += pending;
             ++failed_cancels;
         }
     }
@@ -336,12 +565,56 @@ uint8_t portpilot_helpers_free_ctx(struct portpilot_ctx *pp_ctx, uint8_t force)
     if (failed_cancels)
         return failed_cancels;
 
+    //Devices have been handed back to the worker, it will free them before
+    //it stops
+    if (pp_ctx->worker)
+        portpilot_worker_stop(pp_ctx->worker);
+
     if (pp_ctx->output_timeout_handle)
-        free(pp_ctx->output_timeout_handle);
+        backend_event_loop_free_timeout(pp_ctx->event_loop,
+                pp_ctx->output_timeout_handle);
+
+    if (pp_ctx->trace_timeout_handle)
+        backend_event_loop_free_timeout(pp_ctx->event_loop,
+                pp_ctx->trace_timeout_handle);
+
+    if (pp_ctx->flush_timeout_handle)
+        backend_event_loop_free_timeout(pp_ctx->event_loop,
+                pp_ctx->flush_timeout_handle);
+
+    //The worker has stopped, so everything it has output is in the sinks
+    for (i = 0; i < pp_ctx->num_sinks; i++)
+        portpilot_sink_free(pp_ctx->sinks[i]);
 
-    free(pp_ctx->itr_timeout_handle);
-    free(pp_ctx->libusb_handle);
-    free(pp_ctx->event_loop);
+    if (pp_ctx->binlog_writer)
+        portpilot_binlog_writer_free(pp_ctx->binlog_writer);
+
+    backend_event_loop_free_timeout(pp_ctx->event_loop,
+            pp_ctx->itr_timeout_handle);
+
+    if (pp_ctx->usb_timeout_handle)
+        backend_event_loop_free_timeout(pp_ctx->event_loop,
+                pp_ctx->usb_timeout_handle);
+
+    if (pp_ctx->libusb_handle)
+        backend_event_loop_free_epoll_handle(pp_ctx->event_loop,
+                pp_ctx->libusb_handle);
+
+    if (pp_ctx->hidraw)
+        portpilot_hidraw_free(pp_ctx->hidraw);
+
+    if (pp_ctx->sim)
+        portpilot_sim_free(pp_ctx->sim);
+
+    backend_event_loop_free_epoll_handle(pp_ctx->event_loop,
+            pp_ctx->wake_handle);
+
+    if (pp_ctx->sig_handle)
+        backend_event_loop_free_epoll_handle(pp_ctx->event_loop,
+                pp_ctx->sig_handle);
+
+    backend_event_loop_free(pp_ctx->event_loop);
+    portpilot_dev_index_deinit(&(pp_ctx->dev_index));
     free(pp_ctx);
 
     return failed_cancels;
@@ -349,53 +622,263 @@ uint8_t portpilot_helpers_free_ctx(struct portpilot_ctx *pp_ctx, uint8_t force)
 
 void portpilot_helpers_stop_loop(struct portpilot_ctx *pp_ctx)
 {
+    struct portpilot_shards *shards = pp_ctx->shards;
+    uint32_t num_devs = atomic_load(&(shards->num_devs));
+
+    //Another shard has already decided that we are done
+    if (atomic_load(&(shards->all_done))) {
+        backend_event_loop_stop(pp_ctx->event_loop);
+        return;
+    }
+
     //TODO: Consider how to handle removal of devices when we are going to read
     //a specified number of packets
-    if (pp_ctx->dev_list_len && pp_ctx->num_done_read == pp_ctx->dev_list_len)
-        backend_event_loop_stop(pp_ctx->event_loop);
+    if (!num_devs || atomic_load(&(shards->num_done_read)) != num_devs)
+        return;
+
+    portpilot_helpers_stop_all(pp_ctx);
+}
+
+void portpilot_helpers_stop_all(struct portpilot_ctx *pp_ctx)
+{
+    struct portpilot_shards *shards = pp_ctx->shards;
+    uint64_t val = 1;
+    uint8_t i;
+
+    backend_event_loop_stop(pp_ctx->event_loop);
+
+    //Only the first shard to decide that we are done wakes the others
+    if (atomic_exchange(&(shards->all_done), 1))
+        return;
+
+    for (i = 0; i < shards->num_shards; i++) {
+        if (i == pp_ctx->shard_idx)
+            continue;
+
+        if (write(shards->wake_fds[i], &val, sizeof(val)) < 0)
+            fprintf(stderr, "Failed to wake up shard %u\n", i);
+    }
+}
+
+uint64_t portpilot_helpers_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+void portpilot_helpers_trace_completion(struct portpilot_dev *pp_dev,
+        uint64_t host_ns)
+{
+    struct portpilot_trace *trace = pp_dev->trace;
+
+    if (!trace)
+        return;
+
+    if (trace->last_completion && host_ns > trace->last_completion)
+        backend_histogram_add(&(trace->gap),
+                host_ns - trace->last_completion);
+
+    trace->last_completion = host_ns;
+}
+
+void portpilot_helpers_print_trace(const struct portpilot_dev *pp_dev)
+{
+    char name[MAX_USB_STR_LEN + 32];
+
+    flockfile(stderr);
+    snprintf(name, sizeof(name), "Device %s completion-to-write",
+            pp_dev->serial_number);
+    backend_histogram_print(stderr, name, &(pp_dev->trace->latency), 1000,
+            "us");
+    snprintf(name, sizeof(name), "Device %s completion gap",
+            pp_dev->serial_number);
+    backend_histogram_print(stderr, name, &(pp_dev->trace->gap), 1000, "us");
+    funlockfile(stderr);
+}
+
+void portpilot_helpers_print_pkt(const uint8_t *buf, uint16_t len)
+{
+    uint16_t i;
+
+    if (!len)
+        return;
+
+    for (i = 0; i < len - 1; i++)
+        fprintf(stdout, "%x:", buf[i]);
+    fprintf(stdout, "%x\n", buf[i]);
 }
 
 void portpilot_helpers_output_data(struct portpilot_dev *pp_dev,
         struct portpilot_data *pp_data)
 {
     struct portpilot_ctx *pp_ctx = pp_dev->pp_ctx;
-    const uint8_t *serial_number = pp_dev->serial_number ?
-        pp_dev->serial_number : (const uint8_t *) "";
-
-    if (pp_ctx->csv_output) 
-        fprintf(stdout, "%s,%u,%u,%u,%u,%u,%u,%u\n",
-            serial_number,
-            pp_data->tstamp,
-            pp_data->v_in/pp_data->num_readings,
-            pp_data->v_out/pp_data->num_readings,
-            pp_data->current/pp_data->num_readings,
-            pp_data->max_current,
-            pp_data->energy/pp_data->num_readings,
-            pp_data->total_energy);
-    else
-        fprintf(stdout, "Serial %s, tstamp %usec, v_in %umV, v_out %u mV"
-            ", current %umA, max. current %umA, energy %umW"
-            ", total energy %umWh\n",
-            serial_number,
-            pp_data->tstamp,
-            pp_data->v_in/pp_data->num_readings,
-            pp_data->v_out/pp_data->num_readings,
-            pp_data->current/pp_data->num_readings,
-            pp_data->max_current,
-            pp_data->energy/pp_data->num_readings,
-            pp_data->total_energy);
-
-    //TODO: Consider how to handle errors when writing to file
-    if (pp_ctx->output_file)
-        fprintf(stdout, "%s,%u,%u,%u,%u,%u,%u,%u\n",
-            serial_number,
-            pp_data->tstamp,
-            pp_data->v_in/pp_data->num_readings,
-            pp_data->v_out/pp_data->num_readings,
-            pp_data->current/pp_data->num_readings,
-            pp_data->max_current,
-            pp_data->energy/pp_data->num_readings,
-            pp_data->total_energy);
+    uint8_t i;
+
+    //Live readers do not have to wait for the sinks to be flushed, so they get
+    //the sample right away
+    if (pp_ctx->shm)
+        portpilot_shm_write(pp_ctx->shm, pp_dev, pp_data);
+
+    for (i = 0; i < pp_ctx->num_sinks; i++)
+        portpilot_sink_write(pp_ctx->sinks[i], pp_dev->serial_number, pp_data);
+
+    if (pp_ctx->binlog_writer)
+        portpilot_binlog_write(pp_ctx->binlog_writer, pp_dev, pp_data);
+
+    if (pp_dev->trace)
+        backend_histogram_add(&(pp_dev->trace->latency),
+                portpilot_helpers_now_ns() - pp_data->host_ns);
+}
+
+void portpilot_helpers_flush_output(struct portpilot_ctx *pp_ctx)
+{
+    uint8_t i;
+
+    for (i = 0; i < pp_ctx->num_sinks; i++)
+        portpilot_sink_flush(pp_ctx->sinks[i]);
+
+    if (pp_ctx->binlog_writer)
+        portpilot_binlog_writer_flush(pp_ctx->binlog_writer, 0);
+}
+
+static void portpilot_helpers_print_worker_stats(
+        const struct portpilot_ctx *pp_ctx)
+{
+    struct portpilot_worker *worker = pp_ctx->worker;
+    uint64_t num_pkts = atomic_load(&(worker->num_pkts));
+    uint64_t num_batches = atomic_load(&(worker->num_batches));
+
+    fprintf(stderr, "Worker: %llu packets in %llu batches (%.2f pkts/batch), "
+            "max. ring occupancy %u/%u, max. delay %.3f ms, %llu packets "
+            "dropped (ring full)\n",
+            (unsigned long long) num_pkts,
+            (unsigned long long) num_batches,
+            num_batches ? (double) num_pkts / num_batches : 0,
+            atomic_load(&(worker->max_occupancy)), PORTPILOT_RING_SIZE,
+            atomic_load(&(worker->max_delay)) / 1e6,
+            (unsigned long long) pp_ctx->num_ring_overflow);
+}
+
+void portpilot_helpers_print_stats(struct portpilot_ctx *pp_ctx)
+{
+    const struct backend_event_loop_stats *stats = &(pp_ctx->event_loop->stats);
+    const struct portpilot_sink *sink;
+    uint8_t i;
+
+    //Shards can dump at the same time, keep the output of one shard together
+    flockfile(stderr);
+
+    if (pp_ctx->shards->num_shards > 1)
+        fprintf(stderr, "Shard %u (%u devices):\n", pp_ctx->shard_idx,
+                pp_ctx->dev_list_len);
+
+    fprintf(stderr, "Event loop: %llu wakeups (%llu without events), "
+            "%llu events, %.2f events/wakeup, max. %u events/wakeup, "
+            "%llu full batches (batch size %u, %u fds), %llu posted tasks\n",
+            (unsigned long long) stats->wakeups,
+            (unsigned long long) stats->empty_wakeups,
+            (unsigned long long) stats->events,
+            stats->wakeups ? (double) stats->events / stats->wakeups : 0,
+            stats->max_events,
+            (unsigned long long) stats->full_batches,
+            pp_ctx->event_loop->events_size,
+            pp_ctx->event_loop->num_fds,
+            (unsigned long long) stats->tasks);
+    fprintf(stderr, "Handle pools: %u/%u timeouts, %u/%u epoll handles "
+            "(in use/high-water)\n",
+            pp_ctx->event_loop->timeout_pool.in_use,
+            pp_ctx->event_loop->timeout_pool.high_water,
+            pp_ctx->event_loop->epoll_pool.in_use,
+            pp_ctx->event_loop->epoll_pool.high_water);
+    fprintf(stderr, "Transfers: queue depth %u, queue ran dry %llu times\n",
+            pp_ctx->queue_depth, (unsigned long long) pp_ctx->num_queue_dry);
+    fprintf(stderr, "Device cache: %u hits, %u misses\n",
+            pp_ctx->num_cache_hits, pp_ctx->num_cache_misses);
+    backend_histogram_print(stderr, "Attach", &(pp_ctx->attach_latency),
+            1000, "us");
+
+    if (pp_ctx->worker)
+        portpilot_helpers_print_worker_stats(pp_ctx);
+
+    if (pp_ctx->sim)
+        fprintf(stderr, "Simulation: %u devices, %llu packets generated, %llu "
+                "skipped (behind rate)\n", pp_ctx->sim->num_devs,
+                (unsigned long long) pp_ctx->sim->num_pkts,
+                (unsigned long long) pp_ctx->sim->num_skipped);
+
+    //Written by the thread that outputs, so the numbers can be slightly behind
+    for (i = 0; i < pp_ctx->num_sinks; i++) {
+        sink = pp_ctx->sinks[i];
+        fprintf(stderr, "Output %u: %llu lines, %llu bytes, %llu flushes, "
+                "%llu buffer swaps, %.3f ms waiting for the writer, %llu "
+                "errors\n", i, (unsigned long long) sink->num_lines,
+                (unsigned long long) sink->num_bytes,
+                (unsigned long long) sink->num_flushes,
+                (unsigned long long) sink->num_swaps,
+                sink->wait_ns / 1000000.0,
+                (unsigned long long) sink->num_errors);
+    }
+
+    if (pp_ctx->binlog_writer)
+        fprintf(stderr, "Binary log: %.3f ms waiting for the writer\n",
+                pp_ctx->binlog_writer->wait_ns / 1000000.0);
+
+    //The I/O thread is shared by all shards
+    if (!pp_ctx->shard_idx && pp_ctx->shards->io)
+        portpilot_io_print_stats(pp_ctx->shards->io);
+
+    if (!pp_ctx->shard_idx && pp_ctx->shm)
+        portpilot_shm_print_stats(pp_ctx->shm);
+
+    backend_event_loop_print_instr(pp_ctx->event_loop, stderr);
+
+    funlockfile(stderr);
+}
+
+uint8_t portpilot_helpers_process_pkt(struct portpilot_dev *pp_dev,
+        const uint8_t *buf, uint16_t len, uint64_t host_ns)
+{
+    struct portpilot_ctx *pp_ctx = pp_dev->pp_ctx;
+    struct portpilot_data pp_data = {0};
+    struct portpilot_data *data_ptr = pp_dev->agg_data ?
+        pp_dev->agg_data : &pp_data;
+
+    //Leave the rest to the worker and get the device reading again as soon as
+    //possible. A packet that was dropped has not been read, so it does not
+    //count towards -r
+    if (pp_ctx->worker) {
+        if (!portpilot_worker_enqueue(pp_ctx->worker, pp_dev, buf, len,
+                    host_ns) ||
+            pp_dev->agg_data || !portpilot_helpers_inc_num_pkts(pp_dev))
+            return RETVAL_SUCCESS;
+
+        return RETVAL_FAILURE;
+    }
+
+    if (pp_ctx->verbose)
+        portpilot_helpers_print_pkt(buf, len);
+
+    portpilot_helpers_trace_completion(pp_dev, host_ns);
+
+    //Aggregated data is as old as its first sample
+    if (!data_ptr->num_readings)
+        data_ptr->host_ns = host_ns;
+
+    portpilot_decode_pkt(data_ptr, (const struct portpilot_pkt*) buf);
+
+    //If we output aggregated data, then the timeout callback is responsible for
+    //the output, stopping the loop etc.
+    if (pp_dev->agg_data)
+        return RETVAL_SUCCESS;
+
+    portpilot_helpers_output_data(pp_dev, data_ptr);
+
+    if (portpilot_helpers_inc_num_pkts(pp_dev))
+        return RETVAL_FAILURE;
+
+    return RETVAL_SUCCESS;
 }
 
 uint8_t portpilot_helpers_inc_num_pkts(struct portpilot_dev *pp_dev)
@@ -405,6 +888,7 @@ uint8_t portpilot_helpers_inc_num_pkts(struct portpilot_dev *pp_dev)
     if (pp_dev->pp_ctx->pkts_to_read &&
             pp_dev->num_pkts == pp_dev->pp_ctx->pkts_to_read) {
         pp_dev->pp_ctx->num_done_read++;
+        atomic_fetch_add(&(pp_dev->pp_ctx->shards->num_done_read), 1);
         portpilot_helpers_stop_loop(pp_dev->pp_ctx);
         return RETVAL_SUCCESS;
     }
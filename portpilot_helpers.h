@@ -25,6 +25,7 @@ struct libusb_interface_descriptor;
 struct portpilot_ctx;
 struct portpilot_dev;
 struct portpilot_data;
+struct portpilot_dev_info;
 
 //Get index of HID device we will communicate with
 uint8_t portpilot_helpers_get_hid_idx(const struct libusb_config_descriptor *conf_desc,
@@ -34,22 +35,79 @@ uint8_t portpilot_helpers_get_hid_idx(const struct libusb_config_descriptor *con
 uint8_t portpilot_helpers_get_input_info(const struct libusb_interface_descriptor *intf_desc,
         uint8_t *input_endpoint, uint16_t *max_packet_size);
 
-//Allocate memory for the portpilot_dev pointer, open USB device, etc.
+//Allocate and initialise a device (except for how to read from it) for the
+//given bus/port path. Returns NULL on failure
+struct portpilot_dev* portpilot_helpers_alloc_dev(struct portpilot_ctx *pp_ctx,
+        const uint8_t *dev_path, uint8_t dev_path_len);
+
+//Release a device allocated by portpilot_helpers_alloc_dev() that has not been
+//linked
+void portpilot_helpers_release_dev(struct portpilot_dev *pp_dev);
+
+//Add a device to the device list and index of its context
+void portpilot_helpers_link_dev(struct portpilot_dev *pp_dev);
+
+//Add a device that needs no attaching (hidraw and simulated devices), i.e.,
+//hand it to the worker, link it and start reading. The device is released on
+//failure. Returns RETVAL_SUCCESS/RETVAL_FAILURE
+uint8_t portpilot_helpers_add_dev(struct portpilot_dev *pp_dev);
+
+//Allocate memory for the portpilot_dev pointer, add it to the device list and
+//start attaching it (see portpilot_attach.h). The serial number is read from
+//the device while attaching. Unless info was found in the device cache (cached
+//is set), the device is added to the cache, otherwise the entry is updated if
+//the serial number has changed
 uint8_t portpilot_helpers_create_dev(libusb_device *device,
-        struct portpilot_ctx *pp_ctx, uint16_t max_packet_size,
-        uint8_t input_endpoint, uint8_t intf_num, uint8_t *dev_path,
-        uint8_t dev_path_len);
+        struct portpilot_ctx *pp_ctx, const struct portpilot_dev_info *info,
+        uint8_t cached, uint8_t *dev_path, uint8_t dev_path_len);
 
-//Prepare and submit the first transfer to device
+//Prepare and submit the transfers of device (the ones not already submitted)
 void portpilot_helpers_start_reading_data(struct portpilot_dev *pp_dev);
 
+//Mark transfer of pp_dev as no longer in flight, must be called first thing
+//when a transfer completes
+void portpilot_helpers_transfer_done(struct portpilot_dev *pp_dev,
+        struct libusb_transfer *transfer);
+
+//Resubmit a completed transfer of pp_dev. If this fails, the iteration
+//callback will try again
+void portpilot_helpers_submit_transfer(struct portpilot_dev *pp_dev,
+        struct libusb_transfer *transfer);
+
+//Cancel all transfers of pp_dev that are in flight. Returns the number of
+//transfers that will complete (with a cancelled status) later
+uint8_t portpilot_helpers_cancel_transfers(struct portpilot_dev *pp_dev);
+
+//Arm the libusb timeout handle of the context with the next libusb timeout, or
+//disarm it if there is none (or libusb handles timeouts using a timerfd). Must
+//be called when transfers have been submitted or libusb events handled
+void portpilot_helpers_update_usb_timeout(struct portpilot_ctx *pp_ctx);
+
+//The thread running the loop is the only one handling libusb events, so it
+//holds the events lock for as long as the loop runs. Both are no-ops when the
+//context does not use libusb
+void portpilot_helpers_lock_usb_events(struct portpilot_ctx *pp_ctx);
+void portpilot_helpers_unlock_usb_events(struct portpilot_ctx *pp_ctx);
+
+//Handle the libusb events that are ready and re-arm the libusb timeout. Must be
+//called with the events lock held
+void portpilot_helpers_handle_usb_events(struct portpilot_ctx *pp_ctx);
+
 //Free memory allocate to one device
 void portpilot_helpers_free_dev(struct portpilot_dev *pp_dev);
 
-//Extract serial number from usb device (if present) and compare with desired
+//Compare the serial number of a device (empty if not present) with desired
 //serial. Return SUCCESS/FAILURE
 uint8_t portpilot_helpers_cmp_serial(const char *desired_serial,
-        libusb_device *device);
+        const uint8_t *dev_serial_number);
+
+//Compare two device identities. Devices are identified by serial number, a
+//device without one (no iSerialNumber, or a hidraw device without HID_UNIQ) is
+//identified by its bus/port path instead. Return SUCCESS if they are the same
+uint8_t portpilot_helpers_cmp_dev(const uint8_t *serial_number,
+        const uint8_t *path, uint8_t path_len,
+        const uint8_t *other_serial_number, const uint8_t *other_path,
+        uint8_t other_path_len);
 
 //Check if a device with the matching pat/path_len exists in device list,
 //returns or NULL
@@ -57,18 +115,55 @@ struct portpilot_dev* portpilot_helpers_find_dev(
         const struct portpilot_ctx *pp_ctx, const uint8_t *dev_path,
         uint8_t dev_path_len);
 
+//Get the shard that the device with the given bus/port path belongs to
+uint8_t portpilot_helpers_get_shard(const uint8_t *dev_path,
+        uint8_t dev_path_len, uint8_t num_shards);
+
 //Free all memory occupied by one context (including devie list)
-uint8_t portpilot_helpers_free_ctx(struct portpilot_ctx *pp_ctx, uint8_t force);
+uint32_t portpilot_helpers_free_ctx(struct portpilot_ctx *pp_ctx,
+        uint8_t force);
 
-//Check if all devices are done with receiving the required number of packets
-//and stop loop if so
+//Check if all devices (in all shards) are done with receiving the required
+//number of packets and stop loop if so. The other shards are woken up, so that
+//they can stop their loops too
 void portpilot_helpers_stop_loop(struct portpilot_ctx *pp_ctx);
 
+//Stop the loops of all shards, for example when SIGINT/SIGTERM is received
+void portpilot_helpers_stop_all(struct portpilot_ctx *pp_ctx);
+
 //output the data store in pp_data, according to rules specified in the context
-//that pp_dev belongs to
+//that pp_dev belongs to. The data is formatted into the sinks of the context
 void portpilot_helpers_output_data(struct portpilot_dev *pp_dev,
         struct portpilot_data *pp_data);
 
+//write what is buffered in the sinks of the context. Must be called by the
+//thread that outputs
+void portpilot_helpers_flush_output(struct portpilot_ctx *pp_ctx);
+
+//monotonic time in ns, used to timestamp packets
+uint64_t portpilot_helpers_now_ns();
+
+//record that a transfer of pp_dev completed at host_ns. Does nothing unless
+//latency tracing is enabled
+void portpilot_helpers_trace_completion(struct portpilot_dev *pp_dev,
+        uint64_t host_ns);
+
+//write the latency summary of pp_dev to stderr
+void portpilot_helpers_print_trace(const struct portpilot_dev *pp_dev);
+
+//print the raw bytes of a packet (verbose mode)
+void portpilot_helpers_print_pkt(const uint8_t *buf, uint16_t len);
+
+//write statistics collected while running to stderr. Instrumentation of the
+//event loop is reset, so that the next dump covers a new interval
+void portpilot_helpers_print_stats(struct portpilot_ctx *pp_ctx);
+
+//decode and output (or hand to the worker) a packet received from pp_dev at
+//host_ns. Used by both the libusb and hidraw backends. Returns RETVAL_FAILURE
+//when the device has read the requested number of packets
+uint8_t portpilot_helpers_process_pkt(struct portpilot_dev *pp_dev,
+        const uint8_t *buf, uint16_t len, uint64_t host_ns);
+
 //increase number of packets received counter and potentially stop event loop
 uint8_t portpilot_helpers_inc_num_pkts(struct portpilot_dev *pp_dev);
 #endif
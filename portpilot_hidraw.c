@@ -0,0 +1,530 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <libusb-1.0/libusb.h>
+
+#include "portpilot_hidraw.h"
+#include "portpilot_logger.h"
+#include "portpilot_helpers.h"
+#include "portpilot_callbacks.h"
+#include "backend_event_loop.h"
+
+//Retired handles are no longer registered with the loop, but an event for them
+//might still be in the batch that is being processed
+static void portpilot_hidraw_retired_cb(void *ptr, int32_t fd, uint32_t events)
+{
+}
+
+static void portpilot_hidraw_retire_cb(void *ptr)
+{
+    struct portpilot_hidraw *hidraw = ptr;
+    uint32_t i;
+
+    for (i = 0; i < hidraw->num_retired; i++)
+        backend_event_loop_free_epoll_handle(hidraw->pp_ctx->event_loop,
+                hidraw->retired[i]);
+
+    hidraw->num_retired = 0;
+}
+
+static void portpilot_hidraw_retire(struct portpilot_hidraw *hidraw,
+        struct backend_epoll_handle *handle)
+{
+    struct backend_epoll_handle **retired;
+    uint32_t retired_size;
+
+    handle->cb = portpilot_hidraw_retired_cb;
+    handle->data = NULL;
+    handle->fd = -1;
+
+    if (hidraw->num_retired == hidraw->retired_size) {
+        retired_size = hidraw->retired_size ? hidraw->retired_size * 2 : 8;
+        retired = realloc(hidraw->retired,
+                retired_size * sizeof(struct backend_epoll_handle*));
+
+        //The handle is released together with the pool of the loop
+        if (!retired) {
+            fprintf(stderr, "Failed to retire hidraw handle\n");
+            return;
+        }
+
+        hidraw->retired = retired;
+        hidraw->retired_size = retired_size;
+    }
+
+    hidraw->retired[hidraw->num_retired++] = handle;
+
+    //Timeouts run before the next batch of events is fetched
+    if (hidraw->retire_timeout_handle->heap_idx == TIMEOUT_HEAP_IDX_NONE) {
+        hidraw->retire_timeout_handle->timeout_clock = backend_event_loop_now();
+        backend_event_loop_insert_timeout(hidraw->pp_ctx->event_loop,
+                hidraw->retire_timeout_handle);
+    }
+}
+
+//The bus/port path of a device is part of its sysfs path, as the name of the
+//USB interface the HID device belongs to
+//(<bus>-<port>[.<port>]*:<conf>.<intf>). Returns RETVAL_SUCCESS if the path was
+//found
+static uint8_t portpilot_hidraw_parse_path(const char *sysfs_path,
+        uint8_t *dev_path, uint8_t *dev_path_len)
+{
+    const char *comp = sysfs_path;
+    unsigned long val;
+    uint8_t len;
+    char *end;
+
+    while (comp) {
+        if (*comp == '/')
+            comp++;
+
+        val = strtoul(comp, &end, 10);
+
+        if (end == comp || *end != '-') {
+            comp = strchr(comp, '/');
+            continue;
+        }
+
+        dev_path[0] = (uint8_t) val;
+        len = 1;
+
+        while (len < USB_MAX_PATH) {
+            comp = end + 1;
+            val = strtoul(comp, &end, 10);
+
+            if (end == comp)
+                break;
+
+            dev_path[len++] = (uint8_t) val;
+
+            if (*end == ':') {
+                *dev_path_len = len;
+                return RETVAL_SUCCESS;
+            }
+
+            if (*end != '.')
+                break;
+        }
+
+        comp = strchr(comp, '/');
+    }
+
+    return RETVAL_FAILURE;
+}
+
+static void portpilot_hidraw_get_path(const char *sysfs_path,
+        uint32_t hidraw_idx, uint8_t *dev_path, uint8_t *dev_path_len)
+{
+    if (portpilot_hidraw_parse_path(sysfs_path, dev_path, dev_path_len))
+        return;
+
+    //Not a USB device, the hidraw index is unique while the device exists
+    dev_path[0] = 0;
+    dev_path[1] = hidraw_idx & 0xFF;
+    dev_path[2] = (hidraw_idx >> 8) & 0xFF;
+    *dev_path_len = 3;
+}
+
+static void portpilot_hidraw_read_cb(void *ptr, int32_t fd, uint32_t events)
+{
+    struct portpilot_dev *pp_dev = ptr;
+    struct portpilot_ctx *pp_ctx = pp_dev->pp_ctx;
+    uint8_t buf[HIDRAW_REPORT_LEN];
+    ssize_t numbytes;
+
+    //hidraw returns one report per read(), so keep reading until the node is
+    //drained
+    while (1) {
+        numbytes = read(fd, buf, sizeof(buf));
+
+        if (numbytes < 0 && errno == EINTR)
+            continue;
+
+        if (numbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+
+        if (numbytes <= 0)
+            break;
+
+        //Short reports are decoded as if the rest was 0
+        if (numbytes < sizeof(buf))
+            memset(buf + numbytes, 0, sizeof(buf) - numbytes);
+
+        //Once the device has read the requested number of packets, we stop
+        //polling the node (it is closed when the device is freed)
+        if (!portpilot_helpers_process_pkt(pp_dev, buf, (uint16_t) numbytes,
+                    portpilot_helpers_now_ns())) {
+            backend_event_loop_update(pp_ctx->event_loop, 0, EPOLL_CTL_DEL,
+                    fd, NULL);
+            return;
+        }
+    }
+
+    //The device is gone, this is typically seen before the uevent
+    portpilot_cb_handle_event_left(pp_ctx, pp_dev);
+}
+
+static void portpilot_hidraw_add_dev(struct portpilot_hidraw *hidraw,
+        const char *sysfs_dir, uint32_t hidraw_idx)
+{
+    struct portpilot_ctx *pp_ctx = hidraw->pp_ctx;
+    struct portpilot_dev *pp_dev;
+    char uevent_file[PATH_MAX], line[512];
+    char serial_number[MAX_USB_STR_LEN+1] = {0};
+    uint32_t bus = 0, vid = 0, pid = 0;
+    uint8_t dev_path[USB_MAX_PATH], dev_path_len;
+    FILE *fp;
+
+    snprintf(uevent_file, sizeof(uevent_file), "%s/device/uevent", sysfs_dir);
+    fp = fopen(uevent_file, "re");
+
+    if (!fp)
+        return;
+
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+
+        if (!strncmp(line, "HID_ID=", 7))
+            sscanf(line + 7, "%x:%x:%x", &bus, &vid, &pid);
+        else if (!strncmp(line, "HID_UNIQ=", 9))
+            strncpy(serial_number, line + 9, MAX_USB_STR_LEN);
+    }
+
+    fclose(fp);
+
+    if (vid != PORTPILOT_VID || pid != PORTPILOT_PID)
+        return;
+
+    portpilot_hidraw_get_path(sysfs_dir, hidraw_idx, dev_path, &dev_path_len);
+
+    //Every shard sees every device, but only the shard the path maps to
+    //handles it
+    if (portpilot_helpers_get_shard(dev_path, dev_path_len,
+                pp_ctx->shards->num_shards) != pp_ctx->shard_idx ||
+        portpilot_helpers_find_dev(pp_ctx, dev_path, dev_path_len))
+        return;
+
+    if (pp_ctx->desired_serial &&
+        !portpilot_helpers_cmp_serial(pp_ctx->desired_serial,
+            (const uint8_t*) serial_number)) {
+        fprintf(stderr, "Serial number mismatch\n");
+        return;
+    }
+
+    pp_dev = portpilot_helpers_alloc_dev(pp_ctx, dev_path, dev_path_len);
+
+    if (!pp_dev)
+        return;
+
+    memcpy(pp_dev->serial_number, serial_number, sizeof(serial_number));
+    pp_dev->max_packet_size = HIDRAW_REPORT_LEN;
+    pp_dev->hidraw_idx = hidraw_idx;
+    pp_dev->attach_start = portpilot_helpers_now_ns();
+
+    //Nothing to attach, the kernel driver owns the device
+    portpilot_helpers_add_dev(pp_dev);
+}
+
+static void portpilot_hidraw_remove_dev(struct portpilot_hidraw *hidraw,
+        const char *devpath, uint32_t hidraw_idx)
+{
+    struct portpilot_ctx *pp_ctx = hidraw->pp_ctx;
+    struct portpilot_dev *pp_dev;
+    uint8_t dev_path[USB_MAX_PATH], dev_path_len;
+
+    portpilot_hidraw_get_path(devpath, hidraw_idx, dev_path, &dev_path_len);
+    pp_dev = portpilot_helpers_find_dev(pp_ctx, dev_path, dev_path_len);
+
+    //The device might already be gone (read failed), or belong to a different
+    //interface of the same USB device
+    if (pp_dev && pp_dev->hidraw_idx == hidraw_idx)
+        portpilot_cb_handle_event_left(pp_ctx, pp_dev);
+}
+
+void portpilot_hidraw_handle_uevent(struct portpilot_hidraw *hidraw,
+        const char *buf, size_t len)
+{
+    const char *action = NULL, *devpath = NULL, *subsystem = NULL;
+    const char *devname = NULL, *itr = buf, *end = buf + len;
+    char sysfs_dir[PATH_MAX];
+    uint32_t hidraw_idx;
+
+    while (itr < end) {
+        if (!strncmp(itr, "ACTION=", 7))
+            action = itr + 7;
+        else if (!strncmp(itr, "DEVPATH=", 8))
+            devpath = itr + 8;
+        else if (!strncmp(itr, "SUBSYSTEM=", 10))
+            subsystem = itr + 10;
+        else if (!strncmp(itr, "DEVNAME=", 8))
+            devname = itr + 8;
+
+        itr += strlen(itr) + 1;
+    }
+
+    if (!action || !devpath || !subsystem || !devname ||
+        strcmp(subsystem, "hidraw") ||
+        sscanf(devname, "hidraw%u", &hidraw_idx) != 1)
+        return;
+
+    if (!strcmp(action, "add")) {
+        snprintf(sysfs_dir, sizeof(sysfs_dir), "%s%s", hidraw->sysfs_root,
+                devpath);
+        portpilot_hidraw_add_dev(hidraw, sysfs_dir, hidraw_idx);
+    } else if (!strcmp(action, "remove")) {
+        portpilot_hidraw_remove_dev(hidraw, devpath, hidraw_idx);
+    }
+}
+
+static void portpilot_hidraw_uevent_cb(void *ptr, int32_t fd, uint32_t events)
+{
+    struct portpilot_hidraw *hidraw = ptr;
+    struct sockaddr_nl addr;
+    socklen_t addr_len;
+    char buf[4096];
+    ssize_t numbytes;
+
+    while (1) {
+        addr_len = sizeof(addr);
+        numbytes = recvfrom(fd, buf, sizeof(buf) - 1, 0,
+                (struct sockaddr*) &addr, &addr_len);
+
+        if (numbytes < 0 && errno == EINTR)
+            continue;
+
+        //ENOBUFS means that events were lost, nothing we can do about that
+        if (numbytes < 0 && errno == ENOBUFS)
+            continue;
+
+        if (numbytes <= 0)
+            return;
+
+        //Only trust the kernel
+        if (addr.nl_pid)
+            continue;
+
+        buf[numbytes] = '\0';
+        portpilot_hidraw_handle_uevent(hidraw, buf, numbytes);
+    }
+}
+
+static int32_t portpilot_hidraw_open_uevent()
+{
+    struct sockaddr_nl addr = {0};
+    int32_t fd;
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+            NETLINK_KOBJECT_UEVENT);
+
+    if (fd < 0)
+        return -1;
+
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;
+
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void portpilot_hidraw_scan(struct portpilot_hidraw *hidraw)
+{
+    char class_dir[PATH_MAX], entry_path[PATH_MAX], sysfs_dir[PATH_MAX];
+    struct dirent *entry;
+    uint32_t hidraw_idx;
+    DIR *dir;
+
+    snprintf(class_dir, sizeof(class_dir), "%s/class/hidraw",
+            hidraw->sysfs_root);
+    dir = opendir(class_dir);
+
+    if (!dir) {
+        fprintf(stderr, "Failed to open %s\n", class_dir);
+        return;
+    }
+
+    while ((entry = readdir(dir))) {
+        if (sscanf(entry->d_name, "hidraw%u", &hidraw_idx) != 1)
+            continue;
+
+        //The entries are links into the device tree, which contains the path
+        if (snprintf(entry_path, sizeof(entry_path), "%s/%s", class_dir,
+                    entry->d_name) >= sizeof(entry_path) ||
+            !realpath(entry_path, sysfs_dir))
+            continue;
+
+        portpilot_hidraw_add_dev(hidraw, sysfs_dir, hidraw_idx);
+    }
+
+    closedir(dir);
+}
+
+struct portpilot_hidraw* portpilot_hidraw_create(struct portpilot_ctx *pp_ctx)
+{
+    struct portpilot_hidraw *hidraw = calloc(sizeof(struct portpilot_hidraw),
+            1);
+    int32_t fd;
+
+    if (!hidraw)
+        return NULL;
+
+    hidraw->pp_ctx = pp_ctx;
+    hidraw->sysfs_root = getenv("PORTPILOT_SYSFS_ROOT");
+    hidraw->dev_root = getenv("PORTPILOT_DEV_ROOT");
+
+    if (!hidraw->sysfs_root)
+        hidraw->sysfs_root = HIDRAW_SYSFS_ROOT;
+
+    if (!hidraw->dev_root)
+        hidraw->dev_root = HIDRAW_DEV_ROOT;
+
+    hidraw->retire_timeout_handle = backend_event_loop_add_timeout(
+            pp_ctx->event_loop, backend_event_loop_now(),
+            portpilot_hidraw_retire_cb, hidraw, 0);
+
+    if (!hidraw->retire_timeout_handle) {
+        free(hidraw);
+        return NULL;
+    }
+
+    backend_event_loop_remove_timeout(hidraw->retire_timeout_handle);
+
+    //We can still read from the devices that are already connected
+    fd = portpilot_hidraw_open_uevent();
+
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open uevent socket, hotplug is disabled\n");
+    } else {
+        hidraw->uevent_handle = backend_event_loop_create_epoll_handle(
+                pp_ctx->event_loop, hidraw, fd, portpilot_hidraw_uevent_cb, 0);
+
+        if (!hidraw->uevent_handle ||
+            backend_event_loop_update(pp_ctx->event_loop, EPOLLIN,
+                EPOLL_CTL_ADD, fd, hidraw->uevent_handle)) {
+            fprintf(stderr, "Failed to add uevent handle\n");
+            close(fd);
+
+            if (hidraw->uevent_handle)
+                backend_event_loop_free_epoll_handle(pp_ctx->event_loop,
+                        hidraw->uevent_handle);
+
+            backend_event_loop_free_timeout(pp_ctx->event_loop,
+                    hidraw->retire_timeout_handle);
+            free(hidraw);
+            return NULL;
+        }
+    }
+
+    //Devices start reading as they are added, which requires the backend
+    pp_ctx->hidraw = hidraw;
+    portpilot_hidraw_scan(hidraw);
+
+    return hidraw;
+}
+
+void portpilot_hidraw_free(struct portpilot_hidraw *hidraw)
+{
+    struct backend_event_loop *event_loop = hidraw->pp_ctx->event_loop;
+
+    portpilot_hidraw_retire_cb(hidraw);
+    free(hidraw->retired);
+
+    backend_event_loop_free_timeout(event_loop, hidraw->retire_timeout_handle);
+
+    if (hidraw->uevent_handle) {
+        backend_event_loop_update(event_loop, 0, EPOLL_CTL_DEL,
+                hidraw->uevent_handle->fd, NULL);
+        close(hidraw->uevent_handle->fd);
+        backend_event_loop_free_epoll_handle(event_loop,
+                hidraw->uevent_handle);
+    }
+
+    free(hidraw);
+}
+
+uint8_t portpilot_hidraw_start_reading(struct portpilot_dev *pp_dev)
+{
+    struct portpilot_ctx *pp_ctx = pp_dev->pp_ctx;
+    char dev_file[PATH_MAX];
+    int32_t fd;
+
+    if (pp_dev->fd_handle)
+        return RETVAL_SUCCESS;
+
+    snprintf(dev_file, sizeof(dev_file), "%s/hidraw%u",
+            pp_ctx->hidraw->dev_root, pp_dev->hidraw_idx);
+    fd = open(dev_file, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+    //The node might not have been created (or given the right permissions)
+    //yet when a device is added, the iteration callback will try again
+    if (fd < 0) {
+        if (errno != ENOENT && errno != EACCES)
+            fprintf(stderr, "Failed to open %s: %s\n", dev_file,
+                    strerror(errno));
+
+        return RETVAL_FAILURE;
+    }
+
+    pp_dev->fd_handle = backend_event_loop_create_epoll_handle(
+            pp_ctx->event_loop, pp_dev, fd, portpilot_hidraw_read_cb, 0);
+
+    if (!pp_dev->fd_handle) {
+        close(fd);
+        return RETVAL_FAILURE;
+    }
+
+    if (backend_event_loop_update(pp_ctx->event_loop, EPOLLIN, EPOLL_CTL_ADD,
+                fd, pp_dev->fd_handle)) {
+        close(fd);
+        backend_event_loop_free_epoll_handle(pp_ctx->event_loop,
+                pp_dev->fd_handle);
+        pp_dev->fd_handle = NULL;
+        return RETVAL_FAILURE;
+    }
+
+    return RETVAL_SUCCESS;
+}
+
+void portpilot_hidraw_close_dev(struct portpilot_dev *pp_dev)
+{
+    struct portpilot_ctx *pp_ctx = pp_dev->pp_ctx;
+    struct backend_epoll_handle *handle = pp_dev->fd_handle;
+
+    pp_dev->fd_handle = NULL;
+
+    //Fails if we already stopped polling, which is fine
+    backend_event_loop_update(pp_ctx->event_loop, 0, EPOLL_CTL_DEL, handle->fd,
+            NULL);
+    close(handle->fd);
+
+    portpilot_hidraw_retire(pp_ctx->hidraw, handle);
+}
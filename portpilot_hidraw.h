@@ -0,0 +1,82 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef PORTPILOT_HIDRAW_H
+#define PORTPILOT_HIDRAW_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Size of the buffer a report is read into, the Portpilot sends 64 byte reports
+#define HIDRAW_REPORT_LEN 64
+
+//Where to look for devices, can be overridden by the environment variables
+//PORTPILOT_SYSFS_ROOT and PORTPILOT_DEV_ROOT (for example to test against a
+//fake sysfs tree, with pipes instead of hidraw devices)
+#define HIDRAW_SYSFS_ROOT "/sys"
+#define HIDRAW_DEV_ROOT "/dev"
+
+struct backend_epoll_handle;
+struct backend_timeout_handle;
+struct portpilot_ctx;
+struct portpilot_dev;
+
+//The hidraw backend (-H) reads reports from /dev/hidrawN through the event loop
+//of the shard, without libusb. Portpilots are found by scanning sysfs (the HID
+//device of every hidraw node tells us vendor, product and serial number) and
+//hotplug events are received from a netlink uevent socket (uevent_handle, NULL
+//if the socket could not be created). The bus/port path of a device is parsed
+//from its sysfs path, so that devices map to the same shard and cache entries
+//as with libusb.
+//
+//The epoll handle of a device removed while the loop runs can still be part of
+//the current batch of events. Such handles are retired, i.e., they are
+//neutralised and only returned to the pool by retire_timeout_handle on the next
+//iteration
+struct portpilot_hidraw {
+    struct portpilot_ctx *pp_ctx;
+    struct backend_epoll_handle *uevent_handle;
+    struct backend_timeout_handle *retire_timeout_handle;
+    struct backend_epoll_handle **retired;
+    uint32_t num_retired;
+    uint32_t retired_size;
+    const char *sysfs_root;
+    const char *dev_root;
+};
+
+//Create the hidraw backend of pp_ctx and add the Portpilots that are already
+//connected. Returns NULL on failure
+struct portpilot_hidraw* portpilot_hidraw_create(struct portpilot_ctx *pp_ctx);
+
+//Free the backend. The devices must already have been freed
+void portpilot_hidraw_free(struct portpilot_hidraw *hidraw);
+
+//Handle a uevent as received from the netlink socket. A uevent is a header
+//(<action>@<devpath>) followed by KEY=value pairs, all zero-terminated. Also
+//used to feed hotplug events to a fake sysfs tree, as only the kernel can send
+//to the socket
+void portpilot_hidraw_handle_uevent(struct portpilot_hidraw *hidraw,
+        const char *buf, size_t len);
+
+//Open the hidraw node of pp_dev and start reading from it. Returns
+//RETVAL_SUCCESS/RETVAL_FAILURE
+uint8_t portpilot_hidraw_start_reading(struct portpilot_dev *pp_dev);
+
+//Stop reading from and close the hidraw node of pp_dev
+void portpilot_hidraw_close_dev(struct portpilot_dev *pp_dev);
+
+#endif
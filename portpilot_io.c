@@ -0,0 +1,434 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "portpilot_io.h"
+#include "portpilot_logger.h"
+#include "portpilot_rotate.h"
+
+static uint64_t portpilot_io_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+uint8_t portpilot_io_parse(const char *arg, struct portpilot_io_opts *opts)
+{
+    char *end;
+
+    memset(opts, 0, sizeof(struct portpilot_io_opts));
+
+    if (!strcmp(arg, "none"))
+        return RETVAL_SUCCESS;
+
+    if (!strncmp(arg, "time,", strlen("time,"))) {
+        opts->sync_policy = IO_SYNC_TIME;
+        arg += strlen("time,");
+    } else if (!strncmp(arg, "bytes,", strlen("bytes,"))) {
+        opts->sync_policy = IO_SYNC_BYTES;
+        arg += strlen("bytes,");
+    } else {
+        return RETVAL_FAILURE;
+    }
+
+    opts->sync_intvl = strtoull(arg, &end, 10);
+
+    if (end == arg || *end || !opts->sync_intvl)
+        return RETVAL_FAILURE;
+
+    //Seconds are compared to the monotonic clock in ns
+    if (opts->sync_policy == IO_SYNC_TIME)
+        opts->sync_intvl *= 1000000000ULL;
+
+    return RETVAL_SUCCESS;
+}
+
+static struct portpilot_io_file* portpilot_io_get_file(struct portpilot_io *io,
+        int32_t fd)
+{
+    uint8_t i;
+
+    for (i = 0; i < io->num_files; i++) {
+        if (io->files[i].fd == fd)
+            return &(io->files[i]);
+    }
+
+    return NULL;
+}
+
+static void portpilot_io_sync(struct portpilot_io *io,
+        struct portpilot_io_file *file, uint64_t now)
+{
+    //Not all files can be synced (for example pipes), that is not an error
+    if (fdatasync(file->fd) && errno != EINVAL && errno != EROFS)
+        atomic_fetch_add(&(io->num_errors), 1);
+    else
+        atomic_fetch_add(&(io->num_syncs), 1);
+
+    file->dirty_bytes = 0;
+    file->last_sync_ns = now;
+}
+
+//Sync the files that are due according to the policy (all files that have been
+//written to if force is set). Returns when (monotonic ns) the next file is due
+//with the time policy, 0 if no file has to be synced later
+static uint64_t portpilot_io_sync_files(struct portpilot_io *io, uint8_t force)
+{
+    struct portpilot_io_file *file;
+    uint64_t now = portpilot_io_now_ns(), next = 0, due;
+    uint8_t i;
+
+    if (io->opts.sync_policy == IO_SYNC_NONE)
+        return 0;
+
+    for (i = 0; i < io->num_files; i++) {
+        file = &(io->files[i]);
+
+        if (!file->dirty_bytes)
+            continue;
+
+        if (force ||
+            (io->opts.sync_policy == IO_SYNC_BYTES &&
+             file->dirty_bytes >= io->opts.sync_intvl) ||
+            (io->opts.sync_policy == IO_SYNC_TIME &&
+             now - file->last_sync_ns >= io->opts.sync_intvl)) {
+            portpilot_io_sync(io, file, now);
+            continue;
+        }
+
+        due = file->last_sync_ns + io->opts.sync_intvl;
+
+        if (io->opts.sync_policy == IO_SYNC_TIME && (!next || due < next))
+            next = due;
+    }
+
+    return next;
+}
+
+//Write all of the request. Returns RETVAL_SUCCESS/RETVAL_FAILURE
+static uint8_t portpilot_io_write(struct portpilot_io *io,
+        struct portpilot_io_req *req)
+{
+    struct portpilot_io_file *file = portpilot_io_get_file(io, req->fd);
+    struct iovec *iov = req->iov;
+    int32_t iovcnt = req->iovcnt;
+    uint8_t retval = RETVAL_SUCCESS;
+    uint64_t len = 0, written = 0;
+    ssize_t numbytes;
+    int32_t i;
+
+    if (file && file->rotate) {
+        for (i = 0; i < iovcnt; i++)
+            len += iov[i].iov_len;
+
+        //The finished segment is synced like the rest of the output, it will
+        //not be written to again
+        if (portpilot_rotate_due(file->rotate, len)) {
+            if (io->opts.sync_policy != IO_SYNC_NONE && file->dirty_bytes)
+                portpilot_io_sync(io, file, portpilot_io_now_ns());
+
+            portpilot_rotate_next(file->rotate);
+        }
+    }
+
+    while (iovcnt) {
+        if (req->positioned)
+            numbytes = pwritev(req->fd, iov, iovcnt, req->offset + written);
+        else
+            numbytes = writev(req->fd, iov, iovcnt);
+
+        if (numbytes < 0) {
+            if (errno == EINTR)
+                continue;
+
+            retval = RETVAL_FAILURE;
+            break;
+        }
+
+        atomic_fetch_add(&(io->num_bytes), numbytes);
+        written += numbytes;
+
+        if (file)
+            file->dirty_bytes += numbytes;
+
+        //Partial write, skip what has been written
+        while (iovcnt && (size_t) numbytes >= iov->iov_len) {
+            numbytes -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt) {
+            iov->iov_base = (char*) iov->iov_base + numbytes;
+            iov->iov_len -= numbytes;
+        }
+    }
+
+    if (file && file->rotate)
+        portpilot_rotate_written(file->rotate, written, req->first_ns,
+                req->last_ns);
+
+    return retval;
+}
+
+//Sync (unless the policy is none), forget and close the file of fd. Returns
+//RETVAL_SUCCESS/RETVAL_FAILURE
+static uint8_t portpilot_io_close(struct portpilot_io *io, int32_t fd)
+{
+    struct portpilot_io_file *file = portpilot_io_get_file(io, fd);
+
+    if (file) {
+        if (io->opts.sync_policy != IO_SYNC_NONE && file->dirty_bytes)
+            portpilot_io_sync(io, file, portpilot_io_now_ns());
+
+        //Files are only added under lock, so they are only moved under lock
+        pthread_mutex_lock(&(io->lock));
+        *file = io->files[--io->num_files];
+        pthread_mutex_unlock(&(io->lock));
+    }
+
+    return !close(fd);
+}
+
+static void portpilot_io_handle_req(struct portpilot_io *io,
+        struct portpilot_io_req *req)
+{
+    struct portpilot_io_stream *stream = req->stream;
+
+    //Data written after what was lost would be garbage
+    if (stream && !req->restart && atomic_load(&(stream->broken))) {
+        atomic_fetch_add(&(io->num_dropped), 1);
+        req->failed = 1;
+        return;
+    }
+
+    atomic_fetch_add(&(io->num_writes), 1);
+    req->failed = !portpilot_io_write(io, req);
+
+    if (req->close_fd && !portpilot_io_close(io, req->fd))
+        req->failed = 1;
+
+    if (req->failed)
+        atomic_fetch_add(&(io->num_errors), 1);
+
+    if (stream)
+        atomic_store(&(stream->broken), req->failed);
+}
+
+static void* portpilot_io_run(void *ptr)
+{
+    struct portpilot_io *io = ptr;
+    struct portpilot_io_req *req;
+    struct timespec ts;
+    uint64_t next_sync = 0;
+
+    pthread_mutex_lock(&(io->lock));
+
+    while (1) {
+        req = STAILQ_FIRST(&(io->req_head));
+
+        if (req) {
+            STAILQ_REMOVE_HEAD(&(io->req_head), next);
+            pthread_mutex_unlock(&(io->lock));
+
+            portpilot_io_handle_req(io, req);
+            next_sync = portpilot_io_sync_files(io, 0);
+
+            pthread_mutex_lock(&(io->lock));
+            req->done = 1;
+            pthread_cond_broadcast(&(io->done_cond));
+            continue;
+        }
+
+        //The queue is empty, so everything has been written
+        if (io->stop)
+            break;
+
+        if (!next_sync) {
+            pthread_cond_wait(&(io->req_cond), &(io->lock));
+            continue;
+        }
+
+        ts.tv_sec = next_sync / 1000000000ULL;
+        ts.tv_nsec = next_sync % 1000000000ULL;
+
+        if (pthread_cond_timedwait(&(io->req_cond), &(io->lock), &ts) ==
+                ETIMEDOUT) {
+            pthread_mutex_unlock(&(io->lock));
+            next_sync = portpilot_io_sync_files(io, 0);
+            pthread_mutex_lock(&(io->lock));
+        }
+    }
+
+    pthread_mutex_unlock(&(io->lock));
+    portpilot_io_sync_files(io, 1);
+
+    return NULL;
+}
+
+struct portpilot_io* portpilot_io_create(const struct portpilot_io_opts *opts)
+{
+    struct portpilot_io *io;
+    pthread_condattr_t attr;
+
+    io = calloc(sizeof(struct portpilot_io), 1);
+
+    if (!io)
+        return NULL;
+
+    io->opts = *opts;
+    STAILQ_INIT(&(io->req_head));
+
+    //Sync deadlines are monotonic
+    if (pthread_condattr_init(&attr))
+        goto free_io;
+
+    if (pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) ||
+        pthread_mutex_init(&(io->lock), NULL))
+        goto free_attr;
+
+    if (pthread_cond_init(&(io->req_cond), &attr))
+        goto free_lock;
+
+    if (pthread_cond_init(&(io->done_cond), NULL))
+        goto free_req_cond;
+
+    if (pthread_create(&(io->thread), NULL, portpilot_io_run, io))
+        goto free_done_cond;
+
+    pthread_condattr_destroy(&attr);
+
+    return io;
+
+free_done_cond:
+    pthread_cond_destroy(&(io->done_cond));
+free_req_cond:
+    pthread_cond_destroy(&(io->req_cond));
+free_lock:
+    pthread_mutex_destroy(&(io->lock));
+free_attr:
+    pthread_condattr_destroy(&attr);
+free_io:
+    free(io);
+    return NULL;
+}
+
+uint8_t portpilot_io_add_file(struct portpilot_io *io, int32_t fd,
+        struct portpilot_rotate *rotate)
+{
+    uint8_t retval = RETVAL_FAILURE;
+
+    pthread_mutex_lock(&(io->lock));
+
+    if (portpilot_io_get_file(io, fd)) {
+        retval = RETVAL_SUCCESS;
+    } else if (io->num_files < IO_MAX_FILES) {
+        io->files[io->num_files].fd = fd;
+        io->files[io->num_files].rotate = rotate;
+        io->files[io->num_files].dirty_bytes = 0;
+        io->files[io->num_files].last_sync_ns = portpilot_io_now_ns();
+        io->num_files++;
+        retval = RETVAL_SUCCESS;
+    }
+
+    pthread_mutex_unlock(&(io->lock));
+
+    return retval;
+}
+
+void portpilot_io_stop(struct portpilot_io *io)
+{
+    pthread_mutex_lock(&(io->lock));
+    io->stop = 1;
+    pthread_cond_signal(&(io->req_cond));
+    pthread_mutex_unlock(&(io->lock));
+
+    pthread_join(io->thread, NULL);
+
+    pthread_cond_destroy(&(io->done_cond));
+    pthread_cond_destroy(&(io->req_cond));
+    pthread_mutex_destroy(&(io->lock));
+    free(io);
+}
+
+void portpilot_io_submit(struct portpilot_io *io, struct portpilot_io_req *req)
+{
+    req->done = 0;
+    req->failed = 0;
+
+    pthread_mutex_lock(&(io->lock));
+    STAILQ_INSERT_TAIL(&(io->req_head), req, next);
+    pthread_cond_signal(&(io->req_cond));
+    pthread_mutex_unlock(&(io->lock));
+}
+
+uint64_t portpilot_io_wait(struct portpilot_io *io,
+        struct portpilot_io_req *req)
+{
+    uint64_t start;
+
+    pthread_mutex_lock(&(io->lock));
+
+    if (req->done) {
+        pthread_mutex_unlock(&(io->lock));
+        return 0;
+    }
+
+    start = portpilot_io_now_ns();
+
+    while (!req->done)
+        pthread_cond_wait(&(io->done_cond), &(io->lock));
+
+    pthread_mutex_unlock(&(io->lock));
+
+    return portpilot_io_now_ns() - start;
+}
+
+void portpilot_io_print_stats(struct portpilot_io *io)
+{
+    const struct portpilot_rotate *rotate;
+    uint8_t i;
+
+    fprintf(stderr, "I/O thread: %llu writes, %llu bytes, %llu syncs, %llu "
+            "errors, %llu dropped\n",
+            (unsigned long long) atomic_load(&(io->num_writes)),
+            (unsigned long long) atomic_load(&(io->num_bytes)),
+            (unsigned long long) atomic_load(&(io->num_syncs)),
+            (unsigned long long) atomic_load(&(io->num_errors)),
+            (unsigned long long) atomic_load(&(io->num_dropped)));
+
+    for (i = 0; i < io->num_files; i++) {
+        rotate = io->files[i].rotate;
+
+        if (!rotate)
+            continue;
+
+        fprintf(stderr, "Rotating %s: %llu rotations, %llu errors\n",
+                rotate->path,
+                (unsigned long long) atomic_load(&(rotate->num_rotations)),
+                (unsigned long long) atomic_load(&(rotate->num_errors)));
+    }
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef PORTPILOT_IO_H
+#define PORTPILOT_IO_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+struct portpilot_rotate;
+
+//Max. number of iovecs of a request, and of files with their own durability
+//state
+#define IO_MAX_IOV 16
+#define IO_MAX_FILES 8
+
+//Durability policy (-y): never sync, sync files every N seconds or every N
+//bytes written to them. Files are synced with fdatasync()
+enum {
+    IO_SYNC_NONE = 0,
+    IO_SYNC_TIME,
+    IO_SYNC_BYTES,
+};
+
+struct portpilot_io_opts {
+    uint64_t sync_intvl;
+    uint8_t sync_policy;
+};
+
+//When the data of a stream depends on what was written before (like the
+//compressed format), the stream is broken after a failed write. The I/O thread
+//then drops the requests of the stream until one that restarts it, the owner
+//of the stream checks broken to know when to start over
+struct portpilot_io_stream {
+    atomic_uchar broken;
+};
+
+//A write to fd, of the data described by iov. done is set by the I/O thread
+//when the request has been handled (failed is set if the write failed), the
+//data can then be reused. stream and restart are only used with streams.
+//first_ns/last_ns is when the first and last sample in the data were received
+//(monotonic, 0 if unknown), used to describe the segments of rotated files. If
+//positioned is set, the data is written at offset instead of at the current
+//position of fd. close_fd is set on the last request for fd, the I/O thread
+//then syncs the file (unless the policy is none), forgets it and closes fd
+struct portpilot_io_req {
+    STAILQ_ENTRY(portpilot_io_req) next;
+    struct portpilot_io_stream *stream;
+    struct iovec iov[IO_MAX_IOV];
+    uint64_t first_ns;
+    uint64_t last_ns;
+    uint64_t offset;
+    int32_t iovcnt;
+    int32_t fd;
+    uint8_t restart;
+    uint8_t positioned;
+    uint8_t close_fd;
+    uint8_t done;
+    uint8_t failed;
+};
+
+//What the I/O thread knows about a file. Only files that have been added are
+//synced. rotate is set when the file is written as segments (-R), the I/O
+//thread then starts a new segment when it is time to
+struct portpilot_io_file {
+    struct portpilot_rotate *rotate;
+    uint64_t dirty_bytes;
+    uint64_t last_sync_ns;
+    int32_t fd;
+};
+
+//One I/O thread writes the output of all shards, so that a slow disk (or a
+//sync) does not stall the event loops. Requests are queued under lock and
+//handled in order. The counters are written by the I/O thread, but can be read
+//by any thread
+struct portpilot_io {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    //Signalled when a request is queued or the thread should stop
+    pthread_cond_t req_cond;
+    //Signalled when a request is done
+    pthread_cond_t done_cond;
+    STAILQ_HEAD(io_req_list, portpilot_io_req) req_head;
+    struct portpilot_io_file files[IO_MAX_FILES];
+    struct portpilot_io_opts opts;
+    atomic_ullong num_writes;
+    atomic_ullong num_bytes;
+    atomic_ullong num_syncs;
+    atomic_ullong num_errors;
+    atomic_ullong num_dropped;
+    uint8_t num_files;
+    uint8_t stop;
+};
+
+//Parse a durability policy: none, time,N or bytes,N. Returns
+//RETVAL_SUCCESS/RETVAL_FAILURE
+uint8_t portpilot_io_parse(const char *arg, struct portpilot_io_opts *opts);
+
+//Create the I/O thread. Returns NULL on failure
+struct portpilot_io* portpilot_io_create(const struct portpilot_io_opts *opts);
+
+//Add a file that is synced according to the durability policy, and rotated by
+//rotate (if not NULL, fd must then be the fd of rotate). Must be called before
+//any request for fd is submitted. Returns RETVAL_SUCCESS/RETVAL_FAILURE
+uint8_t portpilot_io_add_file(struct portpilot_io *io, int32_t fd,
+        struct portpilot_rotate *rotate);
+
+//Write all queued requests, sync the files that have been written to since
+//they were last synced (unless the policy is none), stop the thread and free
+//io. Nothing can be submitted after this has been called
+void portpilot_io_stop(struct portpilot_io *io);
+
+//Queue req, which must not be in use
+void portpilot_io_submit(struct portpilot_io *io, struct portpilot_io_req *req);
+
+//Wait until req is done. Returns the time (ns) spent waiting
+uint64_t portpilot_io_wait(struct portpilot_io *io,
+        struct portpilot_io_req *req);
+
+//Write statistics of the I/O thread to stderr
+void portpilot_io_print_stats(struct portpilot_io *io);
+
+#endif
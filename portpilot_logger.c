@@ -22,17 +22,37 @@
 #include <sys/epoll.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
 
 #include "portpilot_logger.h"
 #include "portpilot_callbacks.h"
 #include "portpilot_helpers.h"
+#include "portpilot_worker.h"
+#include "portpilot_dev_cache.h"
+#include "portpilot_hidraw.h"
+#include "portpilot_sim.h"
+#include "portpilot_sink.h"
+#include "portpilot_binlog.h"
+#include "portpilot_codec.h"
+#include "portpilot_rotate.h"
+#include "portpilot_shm.h"
 #include "backend_event_loop.h"
 
 void portpilot_logger_start_itr_cb(struct portpilot_ctx *pp_ctx)
 {
-    if (!pp_ctx->num_itr_req)
+    if (!pp_ctx->num_itr_req) {
         pp_ctx->event_loop->itr_cb = portpilot_cb_itr_cb;
 
+        //Make sure we retry even if the loop is idle
+        pp_ctx->itr_timeout_handle->timeout_clock =
+            backend_event_loop_now() + 1000;
+        backend_event_loop_insert_timeout(pp_ctx->event_loop,
+                pp_ctx->itr_timeout_handle);
+    }
+
     ++pp_ctx->num_itr_req;
 }
 
@@ -40,60 +60,171 @@ void portpilot_logger_stop_itr_cb(struct portpilot_ctx *pp_ctx)
 {
     --pp_ctx->num_itr_req;
 
-    if (!pp_ctx->num_itr_req)
+    if (!pp_ctx->num_itr_req) {
         pp_ctx->event_loop->itr_cb = NULL;
+        backend_event_loop_remove_timeout(pp_ctx->itr_timeout_handle);
+    }
 }
 
 static uint8_t portpilot_configure(struct portpilot_ctx *ppc,
-        uint16_t output_interval)
+        const struct portpilot_opts *opts)
 {
     const struct libusb_pollfd **libusb_fds;
     const struct libusb_pollfd *libusb_fd;
     int32_t i = 0;
-    struct timeval tv;
     uint64_t cur_time;
 
-    ppc->event_loop = backend_event_loop_create();
-    
+    ppc->event_loop = backend_event_loop_create_type(opts->loop_type);
+
+    if (!ppc->event_loop && opts->loop_type != BACKEND_TYPE_EPOLL) {
+        fprintf(stderr, "Event loop type not supported, falling back to "
+                "epoll\n");
+        ppc->event_loop = backend_event_loop_create();
+    }
+
     if (!ppc->event_loop) {
         fprintf(stderr, "Failed to allocate event loop\n");
         return RETVAL_FAILURE;
     }
 
-    gettimeofday(&tv, NULL);
-    cur_time = (tv.tv_sec * 1e3) + (tv.tv_usec / 1e3);
+    backend_event_loop_set_edge_triggered(ppc->event_loop,
+            opts->edge_triggered);
+
+    cur_time = backend_event_loop_now();
+
+    //In worker mode, the worker outputs aggregated data. It has to exist
+    //before we register for hotplug events below
+    if (opts->use_worker) {
+        ppc->worker = portpilot_worker_create(ppc, opts->output_interval,
+                opts->trace_interval);
+
+        if (!ppc->worker) {
+            fprintf(stderr, "Failed to create worker\n");
+            return RETVAL_FAILURE;
+        }
+    }
 
-    if (output_interval) {
+    if (opts->output_interval && !ppc->worker) {
         ppc->output_timeout_handle = backend_event_loop_add_timeout(
-                ppc->event_loop, cur_time + output_interval,
-                portpilot_cb_output_cb, ppc, output_interval);
+                ppc->event_loop, cur_time + opts->output_interval,
+                portpilot_cb_output_cb, ppc, opts->output_interval);
 
         if (!ppc->output_timeout_handle) {
             fprintf(stderr, "Failed to add output timeout handle\n");
             exit(EXIT_FAILURE);
         }
+    }
 
+    if (opts->output_interval)
         ppc->output_interval = 1;
+
+    //The worker flushes the output it writes itself
+    if (!ppc->worker) {
+        ppc->flush_timeout_handle = backend_event_loop_add_timeout(
+                ppc->event_loop, cur_time + SINK_FLUSH_INTVL,
+                portpilot_cb_flush_cb, ppc, SINK_FLUSH_INTVL);
+
+        if (!ppc->flush_timeout_handle) {
+            fprintf(stderr, "Failed to add flush timeout handle\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    //The worker prints the latency summaries of its devices
+    if (opts->trace_interval && !ppc->worker) {
+        ppc->trace_timeout_handle = backend_event_loop_add_timeout(
+                ppc->event_loop, cur_time + opts->trace_interval,
+                portpilot_cb_trace_cb, ppc, opts->trace_interval);
+
+        if (!ppc->trace_timeout_handle) {
+            fprintf(stderr, "Failed to add trace timeout handle\n");
+            exit(EXIT_FAILURE);
+        }
     }
 
+    //The iteration timeout is only armed while there are devices that have
+    //failed to start reading
     ppc->itr_timeout_handle = backend_event_loop_add_timeout(ppc->event_loop,
-            cur_time + 1000, portpilot_cb_itr_cb, ppc, 1000);
+            cur_time + 1000, portpilot_cb_itr_cb, ppc, 0);
         
     if (!ppc->itr_timeout_handle) {
+        fprintf(stderr, "Failed to add iteration timer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    backend_event_loop_remove_timeout(ppc->itr_timeout_handle);
+
+    ppc->wake_handle = backend_event_loop_create_epoll_handle(ppc->event_loop,
+            ppc, ppc->shards->wake_fds[ppc->shard_idx], portpilot_cb_wake_cb,
+            0);
+
+    if (!ppc->wake_handle ||
+        backend_event_loop_update(ppc->event_loop, EPOLLIN, EPOLL_CTL_ADD,
+            ppc->wake_handle->fd, ppc->wake_handle)) {
+        fprintf(stderr, "Failed to add wake handle\n");
+        return RETVAL_FAILURE;
+    }
+
+    //SIGUSR1 is handled by the first shard, which forwards it to the others
+    if (ppc->shard_idx == 0) {
+        ppc->sig_handle = backend_event_loop_create_epoll_handle(
+                ppc->event_loop, ppc, ppc->shards->sig_fd,
+                portpilot_cb_signal_cb, 0);
+
+        if (!ppc->sig_handle ||
+            backend_event_loop_update(ppc->event_loop, EPOLLIN, EPOLL_CTL_ADD,
+                ppc->sig_handle->fd, ppc->sig_handle)) {
+            fprintf(stderr, "Failed to add signal handle\n");
+            return RETVAL_FAILURE;
+        }
+    }
+
+    //Simulated devices are generated by timeouts of the loop
+    if (opts->sim.num_devs) {
+        ppc->sim = portpilot_sim_create(ppc, &(opts->sim));
+
+        if (!ppc->sim) {
+            fprintf(stderr, "Failed to create simulated devices\n");
+            return RETVAL_FAILURE;
+        }
+
+        return RETVAL_SUCCESS;
+    }
+
+    //The hidraw backend finds devices and reads from them without libusb
+    if (opts->use_hidraw) {
+        ppc->hidraw = portpilot_hidraw_create(ppc);
+
+        if (!ppc->hidraw) {
+            fprintf(stderr, "Failed to create hidraw backend\n");
+            return RETVAL_FAILURE;
+        }
+
+        return RETVAL_SUCCESS;
+    }
+
+    //Armed with the next libusb timeout, unless libusb handles timeouts itself
+    //using a timerfd that is part of its pollfds
+    ppc->usb_timeout_handle = backend_event_loop_add_timeout(ppc->event_loop,
+            backend_event_loop_now(), portpilot_cb_usb_timeout_cb, ppc, 0);
+
+    if (!ppc->usb_timeout_handle) {
         fprintf(stderr, "Failed to add libusb timeout timer\n");
         exit(EXIT_FAILURE);
     }
 
-    libusb_fds = libusb_get_pollfds(NULL);
+    ppc->usb_timerfd = libusb_pollfds_handle_timeouts(ppc->usb_ctx);
+    portpilot_helpers_update_usb_timeout(ppc);
+
+    libusb_fds = libusb_get_pollfds(ppc->usb_ctx);
 
     if (!libusb_fds) {
         fprintf(stderr, "Failed to get libusb fds\n");
         return RETVAL_FAILURE;
     }
 
-    //TODO: Add callback
-    ppc->libusb_handle = backend_create_epoll_handle(ppc, 0,
-                portpilot_cb_event_cb, 1);   
+    ppc->libusb_handle = backend_event_loop_create_epoll_handle(
+            ppc->event_loop, ppc, 0, portpilot_cb_event_cb, 1);
 
     if (!ppc->libusb_handle) {
         fprintf(stderr, "Failed to create libusb handle\n");
@@ -113,12 +244,12 @@ static uint8_t portpilot_configure(struct portpilot_ctx *ppc,
 
     free(libusb_fds);
 
-    libusb_set_pollfd_notifiers(NULL,
+    libusb_set_pollfd_notifiers(ppc->usb_ctx,
                                 portpilot_cb_libusb_fd_add,
                                 portpilot_cb_libusb_fd_remove,
                                 ppc);
 
-    libusb_hotplug_register_callback(NULL,
+    libusb_hotplug_register_callback(ppc->usb_ctx,
                                      LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
                                      LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
                                      LIBUSB_HOTPLUG_ENUMERATE,
@@ -128,19 +259,33 @@ static uint8_t portpilot_configure(struct portpilot_ctx *ppc,
                                      portpilot_cb_libusb_cb,
                                      ppc, NULL);
 
-    libusb_lock_events(NULL);
+    return RETVAL_SUCCESS;
+}
+
+static uint8_t portpilot_add_sink(struct portpilot_ctx *ppc, int32_t fd,
+        uint8_t format)
+{
+    struct portpilot_sink *sink;
+
+    if (ppc->num_sinks == MAX_SINKS)
+        return RETVAL_FAILURE;
+
+    sink = portpilot_sink_create(fd, format, ppc->shard_idx, ppc->shards->io);
+
+    if (!sink)
+        return RETVAL_FAILURE;
+
+    ppc->sinks[ppc->num_sinks++] = sink;
 
     return RETVAL_SUCCESS;
 }
 
-static uint8_t portpilot_start(uint32_t num_pkts, const char *serial_number,
-        uint8_t verbose, uint8_t csv_output, FILE *output_file,
-        uint16_t output_interval)
+static struct portpilot_ctx* portpilot_create_ctx(
+        const struct portpilot_opts *opts, struct portpilot_shards *shards,
+        uint8_t shard_idx)
 {
     struct portpilot_ctx *ppc;
     int retval;
-    struct timeval tv;
-    uint64_t cur_time;
 
     ppc = calloc(sizeof(struct portpilot_ctx), 1);
 
@@ -149,38 +294,103 @@ static uint8_t portpilot_start(uint32_t num_pkts, const char *serial_number,
         exit(EXIT_FAILURE);
     }
 
-    ppc->pkts_to_read = num_pkts;
-    ppc->desired_serial = serial_number;
-    ppc->verbose = verbose;
-    ppc->csv_output = csv_output;
-    ppc->output_file = output_file;
+    ppc->pkts_to_read = opts->pkts_to_read;
+    ppc->desired_serial = opts->desired_serial;
+    ppc->verbose = opts->verbose;
+    ppc->print_stats = opts->print_stats;
+    ppc->queue_depth = opts->queue_depth;
+    ppc->trace = opts->trace;
+    ppc->shards = shards;
+    ppc->shard_idx = shard_idx;
 
     LIST_INIT(&ppc->dev_head);
 
-    //Global libusb initsialisation
-    retval = libusb_init(NULL);
+    if (!portpilot_dev_index_init(&(ppc->dev_index))) {
+        fprintf(stderr, "Failed to allocate device index\n");
+        exit(EXIT_FAILURE);
+    }
+
+    backend_histogram_reset(&(ppc->attach_latency));
+
+    //The console gets the format that was asked for, the file (-f) always gets
+    //CSV and the compressed file (-z) the delta format. Every shard has its own
+    //sinks, the shards are told apart in the compressed file by shard index
+    if (!portpilot_add_sink(ppc, STDOUT_FILENO, opts->csv_output ?
+                SINK_FORMAT_CSV : SINK_FORMAT_TEXT) ||
+        (opts->output_file && !portpilot_add_sink(ppc,
+            fileno(opts->output_file), SINK_FORMAT_CSV)) ||
+        (opts->output_rotate && !portpilot_add_sink(ppc,
+            opts->output_rotate->fd, SINK_FORMAT_CSV)) ||
+        (opts->delta_file && !portpilot_add_sink(ppc,
+            fileno(opts->delta_file), SINK_FORMAT_DELTA))) {
+        fprintf(stderr, "Failed to allocate output sinks\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ppc->shm = shards->shm;
+
+    if (shards->binlog &&
+        !(ppc->binlog_writer =
+            portpilot_binlog_writer_create(shards->binlog))) {
+        fprintf(stderr, "Failed to allocate binary log writer\n");
+        exit(EXIT_FAILURE);
+    }
 
-    if (retval) {
+    //Every shard has its own libusb context, so that the shards share no state
+    //inside libusb
+    if (!opts->use_hidraw && !opts->sim.num_devs &&
+        (retval = libusb_init(&(ppc->usb_ctx)))) {
         fprintf(stderr, "libusb failed with error %s\n",
                 libusb_error_name(retval));
         exit(EXIT_FAILURE);
     }
 
-    if (!portpilot_configure(ppc, output_interval)) {
+    if (!portpilot_configure(ppc, opts)) {
         fprintf(stderr, "Failed to configure struct\n");
         exit(EXIT_FAILURE);
     }
-    
+
+    return ppc;
+}
+
+//Run the event loop of one shard until we are done and clean up. Returns
+//RETVAL_SUCCESS/RETVAL_FAILURE cast to a pointer, so that it can be used as a
+//thread function
+static void* portpilot_run_shard(void *ptr)
+{
+    struct portpilot_ctx *ppc = ptr;
+    struct libusb_context *usb_ctx = ppc->usb_ctx;
+    uintptr_t retval;
+    uint64_t cur_time;
+
+    portpilot_helpers_lock_usb_events(ppc);
     backend_event_loop_run(ppc->event_loop);
 
+    //libusb_close() takes the events lock when it is not called from an event
+    //handler, and the devices are closed below
+    portpilot_helpers_unlock_usb_events(ppc);
+
     if (ppc->event_loop->stop)
         retval = RETVAL_SUCCESS;
     else
         retval = RETVAL_FAILURE;
 
+    if (ppc->print_stats)
+        portpilot_helpers_print_stats(ppc);
+
+    //Make sure that a late wakeup does not stop the loop below before the
+    //transfers are cancelled
+    backend_event_loop_update(ppc->event_loop, 0, EPOLL_CTL_DEL,
+            ppc->wake_handle->fd, NULL);
+
+    if (ppc->sig_handle)
+        backend_event_loop_update(ppc->event_loop, 0, EPOLL_CTL_DEL,
+                ppc->sig_handle->fd, NULL);
+
     if (!retval || !portpilot_helpers_free_ctx(ppc, 0)) {
-        libusb_exit(NULL);
-        return (uint8_t) retval;
+        if (usb_ctx)
+            libusb_exit(usb_ctx);
+        return (void*) retval;
     }
 
     //Restart event loop in order to wait for cancelled transfers
@@ -190,24 +400,166 @@ static uint8_t portpilot_start(uint32_t num_pkts, const char *serial_number,
     if (ppc->output_timeout_handle)
         backend_event_loop_remove_timeout(ppc->output_timeout_handle);
 
+    if (ppc->trace_timeout_handle)
+        backend_event_loop_remove_timeout(ppc->trace_timeout_handle);
+
     //Need an upper bound on how long to wait for transfers to be cancelled
-    gettimeofday(&tv, NULL);
-    cur_time = (tv.tv_sec * 1e3) + (tv.tv_usec / 1e3);
+    cur_time = backend_event_loop_now();
 
-    //Recycle timeout handle, no need to create another handle as they are all
-    //active
+    //Recycle the iteration timeout handle. No devices should be restarted
+    //while we wait, as that would remove the cancel timeout again
+    ppc->event_loop->itr_cb = NULL;
+    ppc->num_itr_req = 0;
     ppc->itr_timeout_handle->cb = portpilot_cb_cancel_cb;
     ppc->itr_timeout_handle->timeout_clock = cur_time + 500;
     ppc->itr_timeout_handle->intvl = 0;
 
     backend_event_loop_insert_timeout(ppc->event_loop, ppc->itr_timeout_handle);
 
+    portpilot_helpers_lock_usb_events(ppc);
     backend_event_loop_run(ppc->event_loop);
+    portpilot_helpers_unlock_usb_events(ppc);
 
     portpilot_helpers_free_ctx(ppc, 1);
-    libusb_exit(NULL);
 
-    return (uint8_t) retval;
+    if (usb_ctx)
+        libusb_exit(usb_ctx);
+
+    return (void*) retval;
+}
+
+static uint8_t portpilot_start(const struct portpilot_opts *opts)
+{
+    struct portpilot_shards *shards;
+    pthread_t threads[MAX_SHARDS];
+    uint8_t i, retval = RETVAL_SUCCESS;
+    void *shard_retval;
+    sigset_t sig_mask;
+
+    shards = calloc(sizeof(struct portpilot_shards), 1);
+
+    if (shards) {
+        shards->ctxs = calloc(sizeof(struct portpilot_ctx*), opts->num_shards);
+        shards->wake_fds = calloc(sizeof(int32_t), opts->num_shards);
+    }
+
+    if (!shards || !shards->ctxs || !shards->wake_fds) {
+        fprintf(stderr, "Failed to allocate memory for shards\n");
+        exit(EXIT_FAILURE);
+    }
+
+    shards->num_shards = opts->num_shards;
+    shards->dev_cache = portpilot_dev_cache_create(opts->cache_file);
+
+    if (!shards->dev_cache) {
+        fprintf(stderr, "Failed to create device cache\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts->shm_name &&
+        !(shards->shm = portpilot_shm_create(opts->shm_name))) {
+        fprintf(stderr, "Failed to create shared memory %s\n", opts->shm_name);
+        exit(EXIT_FAILURE);
+    }
+
+    //SIGUSR1 dumps statistics, while SIGINT/SIGTERM stop all shards so that
+    //all output is written. They are blocked before any thread is started, so
+    //that they are only delivered through the signalfd
+    sigemptyset(&sig_mask);
+    sigaddset(&sig_mask, SIGUSR1);
+    sigaddset(&sig_mask, SIGINT);
+    sigaddset(&sig_mask, SIGTERM);
+
+    if (pthread_sigmask(SIG_BLOCK, &sig_mask, NULL) ||
+        (shards->sig_fd = signalfd(-1, &sig_mask,
+            SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+        fprintf(stderr, "Failed to create signalfd\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //The sinks of all shards hand their buffers to the I/O thread, which
+    //writes them and syncs the files according to the sync policy
+    shards->io = portpilot_io_create(&(opts->io));
+
+    if (!shards->io ||
+        !portpilot_io_add_file(shards->io, STDOUT_FILENO, NULL) ||
+        (opts->output_file &&
+         !portpilot_io_add_file(shards->io, fileno(opts->output_file),
+             NULL)) ||
+        (opts->output_rotate &&
+         !portpilot_io_add_file(shards->io, opts->output_rotate->fd,
+             opts->output_rotate)) ||
+        (opts->delta_file &&
+         !portpilot_io_add_file(shards->io, fileno(opts->delta_file),
+             NULL))) {
+        fprintf(stderr, "Failed to start I/O thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //The blocks of the binary log are written by the I/O thread too
+    if (opts->binlog_file &&
+        !(shards->binlog = portpilot_binlog_create(opts->binlog_file,
+                shards->io))) {
+        fprintf(stderr, "Failed to create binary log %s\n", opts->binlog_file);
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < shards->num_shards; i++) {
+        shards->wake_fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        if (shards->wake_fds[i] == -1) {
+            fprintf(stderr, "Failed to create eventfd for shard\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    //Contexts are configured before any thread is started, so initial
+    //enumeration of devices happens on this thread
+    for (i = 0; i < shards->num_shards; i++)
+        shards->ctxs[i] = portpilot_create_ctx(opts, shards, i);
+
+    for (i = 1; i < shards->num_shards; i++) {
+        if (pthread_create(&threads[i], NULL, portpilot_run_shard,
+                    shards->ctxs[i])) {
+            fprintf(stderr, "Failed to start thread for shard %u\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    //The first shard runs on the main thread
+    if (!portpilot_run_shard(shards->ctxs[0]))
+        retval = RETVAL_FAILURE;
+
+    for (i = 1; i < shards->num_shards; i++) {
+        pthread_join(threads[i], &shard_retval);
+
+        if (!shard_retval)
+            retval = RETVAL_FAILURE;
+    }
+
+    for (i = 0; i < shards->num_shards; i++)
+        close(shards->wake_fds[i]);
+
+    close(shards->sig_fd);
+
+    //All writers were freed together with the contexts. The index is written by
+    //the I/O thread, so it is stopped after the log is closed
+    if (shards->binlog && !portpilot_binlog_close(shards->binlog))
+        retval = RETVAL_FAILURE;
+
+    //The sinks were freed too, so there is nothing more to write
+    portpilot_io_stop(shards->io);
+
+    if (shards->shm)
+        portpilot_shm_destroy(shards->shm);
+
+    portpilot_dev_cache_save(shards->dev_cache);
+    portpilot_dev_cache_free(shards->dev_cache);
+    free(shards->wake_fds);
+    free(shards->ctxs);
+    free(shards);
+
+    return retval;
 }
 
 static void usage()
@@ -220,37 +572,147 @@ static void usage()
     fprintf(stdout, "\t-v: verbose (print raw USB message)\n");
     fprintf(stdout, "\t-c: print csv to console (no units appended\n");
     fprintf(stdout, "\t-f: write csv to file with specified filename\n");
+    fprintf(stdout, "\t-z: write compressed samples (read with "
+            "portpilot-export) to file with specified filename\n");
+    fprintf(stdout, "\t-b: write a binary log (read with portpilot-export) "
+            "to file with specified filename\n");
+    fprintf(stdout, "\t-R: write the -f file as segments, rotated by "
+            "size,N[,keep] (N bytes, K/M/G suffix allowed) or time,N[,keep] "
+            "(every N seconds), only keeping the last keep segments\n");
+    fprintf(stdout, "\t-y: when to sync output files to disk, none "
+            "(default), time,N (every N seconds) or bytes,N (every N bytes "
+            "written)\n");
+    fprintf(stdout, "\t-m: publish the latest samples of every device in "
+            "POSIX shared memory with the specified name (read with the "
+            "portpilot-shm-reader library)\n");
+    fprintf(stdout, "\t-e: register file descriptors edge-triggered\n");
+    fprintf(stdout, "\t-s: print statistics to stderr on exit (or when "
+            "receiving SIGUSR1)\n");
+    fprintf(stdout, "\t-j: number of event loops/threads to distribute "
+            "devices over (default: 1, max: %u)\n", MAX_SHARDS);
+    fprintf(stdout, "\t-q: number of transfers to keep queued per device "
+            "(default: 1, max: %u)\n", MAX_QUEUE_DEPTH);
+    fprintf(stdout, "\t-w: decode and output packets in a worker thread "
+            "(one per event loop)\n");
+    fprintf(stdout, "\t-l: trace completion-to-write latency per device and "
+            "print a summary to stderr every X ms (0: only when the device is "
+            "removed)\n");
+    fprintf(stdout, "\t-k: keep what is learnt about attached devices "
+            "(serial number, endpoint, ...) in the specified file\n");
+    fprintf(stdout, "\t-H: read from /dev/hidraw* instead of using libusb\n");
+    fprintf(stdout, "\t-S: simulate devices instead of reading from real "
+            "ones, N[,rate[,waveform[,churn]]]: N devices sending rate packets "
+            "per second (default: %u) with the current following waveform "
+            "(const, sine (default), square or ramp), one device is unplugged "
+            "and replugged every churn ms (default: never)\n",
+            SIM_DEFAULT_RATE);
+    fprintf(stdout, "\t-u: use io_uring instead of epoll in the event loop\n");
     fprintf(stdout, "\t-h: this menu\n");
 }
 
 int main(int argc, char *argv[])
 {
     int32_t opt = 0;
-    uint32_t num_pkts = 0;
-    const char *serial_number = NULL, *output_filename = NULL;
-    uint8_t verbose = 0, csv_output = 0;
-    uint16_t output_interval = 0;
-    FILE *output_file = NULL;
+    const char *output_filename = NULL, *delta_filename = NULL;
+    struct portpilot_opts opts = {0};
+
+    opts.num_shards = 1;
+    opts.queue_depth = 1;
 
-    while ((opt = getopt(argc, argv, "r:i:d:f:cvh")) != -1) {
+    while ((opt = getopt(argc, argv,
+                    "r:i:d:f:z:b:y:R:m:j:q:l:k:S:cvesuwHh")) != -1) {
         switch (opt) {
         case 'r':
-            num_pkts = (uint32_t) atoi(optarg);
+            opts.pkts_to_read = (uint32_t) atoi(optarg);
             break;
         case 'i':
-            output_interval = (uint16_t) atoi(optarg);
+            opts.output_interval = (uint16_t) atoi(optarg);
+            break;
+        case 'l':
+            opts.trace = 1;
+            opts.trace_interval = (uint32_t) atoi(optarg);
             break;
         case 'd':
-            serial_number = optarg;
+            opts.desired_serial = optarg;
+            break;
+        case 'k':
+            opts.cache_file = optarg;
             break;
         case 'f':
             output_filename = optarg;
             break;
+        case 'z':
+            delta_filename = optarg;
+            break;
+        case 'b':
+            opts.binlog_file = optarg;
+            break;
+        case 'm':
+            opts.shm_name = optarg;
+            break;
+        case 'R':
+            if (!portpilot_rotate_parse(optarg, &(opts.rotate))) {
+                fprintf(stderr, "Invalid rotation %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+
+            break;
+        case 'y':
+            if (!portpilot_io_parse(optarg, &(opts.io))) {
+                fprintf(stderr, "Invalid sync policy %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+
+            break;
+        case 'j':
+            opt = atoi(optarg);
+
+            if (opt < 1 || opt > MAX_SHARDS) {
+                fprintf(stderr, "Number of shards must be between 1 and %u\n",
+                        MAX_SHARDS);
+                exit(EXIT_FAILURE);
+            }
+
+            opts.num_shards = (uint8_t) opt;
+            break;
+        case 'q':
+            opt = atoi(optarg);
+
+            if (opt < 1 || opt > MAX_QUEUE_DEPTH) {
+                fprintf(stderr, "Queue depth must be between 1 and %u\n",
+                        MAX_QUEUE_DEPTH);
+                exit(EXIT_FAILURE);
+            }
+
+            opts.queue_depth = (uint8_t) opt;
+            break;
         case 'c':
-            csv_output = 1;
+            opts.csv_output = 1;
             break;
         case 'v':
-            verbose = 1;
+            opts.verbose = 1;
+            break;
+        case 'e':
+            opts.edge_triggered = 1;
+            break;
+        case 's':
+            opts.print_stats = 1;
+            break;
+        case 'u':
+            opts.loop_type = BACKEND_TYPE_IO_URING;
+            break;
+        case 'w':
+            opts.use_worker = 1;
+            break;
+        case 'H':
+            opts.use_hidraw = 1;
+            break;
+        case 'S':
+            if (!portpilot_sim_parse(optarg, &(opts.sim))) {
+                fprintf(stderr, "Invalid simulation %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+
             break;
         case 'h':
         default:
@@ -259,26 +721,72 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (output_filename) {
-        output_file = fopen(output_filename, "w");
+    //io_uring polls are level-triggered (see backend_uring.c)
+    if (opts.edge_triggered && opts.loop_type == BACKEND_TYPE_IO_URING) {
+        fprintf(stderr, "Edge-triggered mode (-e) is not supported with "
+                "io_uring (-u)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts.use_hidraw && opts.sim.num_devs) {
+        fprintf(stderr, "Simulated devices can not be combined with hidraw\n");
+        exit(EXIT_FAILURE);
+    }
 
-        if (!output_file) {
+    if ((opts.rotate.max_bytes || opts.rotate.period_ns) && !output_filename) {
+        fprintf(stderr, "Rotation requires an output file (-f)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //Every segment starts with the descriptive row
+    if (opts.rotate.max_bytes || opts.rotate.period_ns) {
+        opts.output_rotate = portpilot_rotate_open(output_filename,
+                &(opts.rotate), CSV_DESCRIPTION "\n");
+
+        if (!opts.output_rotate) {
+            fprintf(stderr, "Failed to open desired output file\n");
+            exit(EXIT_FAILURE);
+        }
+    } else if (output_filename) {
+        opts.output_file = fopen(output_filename, "w");
+
+        if (!opts.output_file) {
             fprintf(stderr, "Failed to open desired output file\n");
             exit(EXIT_FAILURE);
         }
     }
 
-    if (output_file && fprintf(output_file, CSV_DESCRIPTION) < 0) {
+    //The sinks write to the file descriptor, so the header has to be flushed
+    if (opts.output_file &&
+        (fprintf(opts.output_file, CSV_DESCRIPTION "\n") < 0 ||
+         fflush(opts.output_file))) {
         fprintf(stderr, "Could not write descriptive row to CSV\n");
-        fclose(output_file);
+        fclose(opts.output_file);
         exit(EXIT_FAILURE);
     }
 
-    opt = portpilot_start(num_pkts, serial_number, verbose, csv_output,
-            output_file, output_interval);
+    if (delta_filename) {
+        opts.delta_file = fopen(delta_filename, "w");
+
+        if (!opts.delta_file ||
+            fwrite(CODEC_MAGIC, 1, strlen(CODEC_MAGIC), opts.delta_file) !=
+                strlen(CODEC_MAGIC) ||
+            fflush(opts.delta_file)) {
+            fprintf(stderr, "Failed to open desired compressed output file\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    opt = portpilot_start(&opts);
+
+    if (opts.output_file)
+        fclose(opts.output_file);
+
+    if (opts.output_rotate)
+        portpilot_rotate_close(opts.output_rotate);
 
-    if (output_file)
-        fclose(output_file);
+    if (opts.delta_file)
+        fclose(opts.delta_file);
 
     if (opt)
         exit(EXIT_SUCCESS);
@@ -28,21 +28,54 @@
 
 #define USB_MAX_PATH 8 //(bus + port numbers (max. 7))
 
+#define MAX_SHARDS 64
+
+//Max. number of interrupt transfers that can be queued per device (-q)
+#define MAX_QUEUE_DEPTH 16
+
+//Max. number of output sinks per context (console, file, ...)
+#define MAX_SINKS 4
+
 #define CSV_DESCRIPTION "Dev. serial, VBus in (mV), VBus out (mV), " \
                         "Current (mA), Max current (mA), Energy (mW), " \
                         "Total energy (mWh)"
 
+#include <stdio.h>
 #include <stdint.h>
+#include <stdatomic.h>
 #include <sys/queue.h>
 
+#include "backend_task_queue.h"
+#include "backend_histogram.h"
+#include "backend_hash.h"
+#include "portpilot_dev_index.h"
+#include "portpilot_sim.h"
+#include "portpilot_io.h"
+#include "portpilot_rotate.h"
+
 struct backend_event_loop;
 struct backend_epoll_handle;
 struct backend_timeout_handle;
+struct libusb_context;
+struct libusb_device;
 struct libusb_device_handle;
 struct libusb_transfer;
+struct portpilot_binlog;
+struct portpilot_binlog_writer;
 struct portpilot_ctx;
+struct portpilot_dev_cache;
+struct portpilot_hidraw;
+struct portpilot_ring;
+struct portpilot_shm;
+struct portpilot_shm_dev;
+struct portpilot_sim;
+struct portpilot_sink;
+struct portpilot_worker;
 
+//host_ns is when (monotonic ns) the transfer with the first packet in the
+//aggregate completed
 struct portpilot_data {
+    uint64_t host_ns;
     uint32_t tstamp;
     uint32_t v_in;
     uint32_t v_out;
@@ -53,19 +86,49 @@ struct portpilot_data {
     uint16_t num_readings;
 };
 
+//Latency tracing (-l) of one device, all values are ns. latency is the time
+//from a transfer completed until its data was written. For aggregated output,
+//this is the latency of the oldest packet in the aggregate. gap is the time
+//between consecutive completions
+struct portpilot_trace {
+    struct backend_histogram latency;
+    struct backend_histogram gap;
+    uint64_t last_completion;
+};
+
 enum {
     READ_STATE_OK = 0,
     READ_STATE_FAILED_START,
     READ_STATE_RUNNING,
 };
 
+//Every device has queue_depth (of the context) transfers, each with its own
+//buffer. All transfers are submitted when reading starts and resubmitted when
+//they complete, so the endpoint has transfers queued while we process a packet.
+//Bit i of in_flight is set while transfers[i] is submitted. ring,
+//next_worker_dev and the tasks are only used in worker mode. path_node links
+//the device into the device index of the context. The attach_*
+//fields, device and ctrl_transfer are used while the device is attached (see
+//portpilot_attach.h), attach_start is when (ns) the device arrived. With the
+//hidraw backend, the device is read through fd_handle (/dev/hidraw<hidraw_idx>)
+//and none of the libusb fields are used. binlog_slot is the slot of the device
+//in the binary log writer of the context (0 until the device has output),
+//shm_dev is where the device is in shared memory (NULL until it has output)
 struct portpilot_dev {
     struct portpilot_ctx *pp_ctx;
+    struct libusb_device *device;
     struct libusb_device_handle *handle;
-    struct libusb_transfer *transfer;
+    struct libusb_transfer *ctrl_transfer;
+    struct backend_timeout_handle *attach_handle;
+    struct libusb_transfer *transfers[MAX_QUEUE_DEPTH];
     struct portpilot_data *agg_data;
-    struct uint8_t *read_buf;
+    struct portpilot_ring *ring;
+    struct portpilot_trace *trace;
     LIST_ENTRY(portpilot_dev) next_dev;
+    LIST_ENTRY(portpilot_dev) next_worker_dev;
+    struct backend_hash_node path_node;
+    struct backend_task add_task;
+    struct backend_task remove_task;
     uint8_t serial_number[MAX_USB_STR_LEN+1];
     uint16_t max_packet_size;
     uint8_t input_endpoint;
@@ -73,26 +136,133 @@ struct portpilot_dev {
     uint8_t read_state;
     uint8_t intf_num;
     uint32_t num_pkts;
+    uint16_t in_flight;
     uint8_t path[USB_MAX_PATH];
+    uint64_t attach_start;
+    uint8_t attach_state;
+    uint8_t attach_cached;
+    uint8_t ctrl_pending;
+    uint8_t serial_idx;
+    struct backend_epoll_handle *fd_handle;
+    uint32_t hidraw_idx;
+    uint32_t binlog_slot;
+    struct portpilot_shm_dev *shm_dev;
+};
+
+//Options given on the command line, shared by all shards
+struct portpilot_opts {
+    const char *desired_serial;
+    const char *cache_file;
+    const char *binlog_file;
+    const char *shm_name;
+    FILE *output_file;
+    FILE *delta_file;
+    //Replaces output_file when the CSV file is rotated (-R)
+    struct portpilot_rotate *output_rotate;
+    uint32_t pkts_to_read;
+    uint32_t trace_interval;
+    uint16_t output_interval;
+    uint8_t verbose;
+    uint8_t csv_output;
+    uint8_t edge_triggered;
+    uint8_t print_stats;
+    uint8_t num_shards;
+    uint8_t loop_type;
+    uint8_t queue_depth;
+    uint8_t use_worker;
+    uint8_t trace;
+    uint8_t use_hidraw;
+    struct portpilot_sim_opts sim;
+    struct portpilot_io_opts io;
+    struct portpilot_rotate_opts rotate;
+};
+
+//Devices are distributed over num_shards contexts, each with its own event
+//loop, libusb context and thread. The device counters are shared, so that we
+//can stop when all devices (in all shards) have read the requested number of
+//packets. The shard that detects this sets all_done and wakes up the other
+//shards by writing to their wake_fd (an eventfd). The wake_fds are also used to
+//ask the other shards to dump their statistics when SIGUSR1 is received (on the
+//sig_fd handled by the first shard), a shard dumps when its dump_gen differs
+//from the shared one. SIGINT and SIGTERM (also on sig_fd) make all shards stop
+//like when all devices are done, so that all output is written before we exit.
+//The cache of what we know about the devices we have seen is shared too, so
+//that it does not matter which shard a device is assigned to
+struct portpilot_shards {
+    struct portpilot_ctx **ctxs;
+    struct portpilot_dev_cache *dev_cache;
+    //Only set when writing a binary log (-b)
+    struct portpilot_binlog *binlog;
+    //Writes the output of the sinks of all shards
+    struct portpilot_io *io;
+    //Only set when publishing samples in shared memory (-m)
+    struct portpilot_shm *shm;
+    int32_t *wake_fds;
+    int32_t sig_fd;
+    atomic_uint dump_gen;
+    atomic_uint num_devs;
+    atomic_uint num_done_read;
+    atomic_uchar all_done;
+    uint8_t num_shards;
 };
 
 struct portpilot_ctx {
     struct backend_event_loop *event_loop;
+    struct libusb_context *usb_ctx;
+    struct portpilot_shards *shards;
     struct backend_epoll_handle *libusb_handle;
+    struct backend_epoll_handle *wake_handle;
+    struct backend_epoll_handle *sig_handle;
     struct backend_timeout_handle *itr_timeout_handle;
+    struct backend_timeout_handle *usb_timeout_handle;
     struct backend_timeout_handle *output_timeout_handle;
+    struct backend_timeout_handle *trace_timeout_handle;
+    struct backend_timeout_handle *flush_timeout_handle;
+    struct portpilot_worker *worker;
+    //Only set when using the hidraw backend, usb_ctx is NULL then
+    struct portpilot_hidraw *hidraw;
+    //Only set when simulating devices (-S), usb_ctx is NULL then
+    struct portpilot_sim *sim;
     LIST_HEAD(dev_list, portpilot_dev) dev_head;
+    struct portpilot_dev_index dev_index;
     const char *desired_serial;
-    FILE *output_file;
+    //Output is formatted into every sink. The sinks are only used by the
+    //thread that outputs, i.e., the worker in worker mode
+    struct portpilot_sink *sinks[MAX_SINKS];
+    //Only set when writing a binary log, used like the sinks
+    struct portpilot_binlog_writer *binlog_writer;
+    //Shared by all shards, NULL unless publishing in shared memory
+    struct portpilot_shm *shm;
     uint32_t pkts_to_read;
+    uint32_t dump_gen;
+    //Number of completed transfers that left a device without any queued
+    //transfers
+    uint64_t num_queue_dry;
+    //Number of packets dropped because the ring of a device was full
+    uint64_t num_ring_overflow;
+    //Number of attached devices that were/were not found in the device cache
+    uint32_t num_cache_hits;
+    uint32_t num_cache_misses;
+    //Time (ns) from a device arrived until it started reading
+    struct backend_histogram attach_latency;
+    //Device counters, the number of pending cancels can be up to
+    //MAX_QUEUE_DEPTH per device
+    uint32_t num_done_read;
+    uint32_t dev_list_len;
+    uint32_t num_itr_req;
+    uint32_t num_cancel;
+    uint32_t num_cancelled;
     uint8_t output_interval;
-    uint8_t num_done_read;
-    uint8_t dev_list_len;
-    uint8_t num_itr_req;
     uint8_t verbose;
-    uint8_t csv_output;
-    uint8_t num_cancel;
-    uint8_t num_cancelled;
+    uint8_t num_sinks;
+    uint8_t queue_depth;
+    uint8_t print_stats;
+    uint8_t shard_idx;
+    uint8_t usb_timerfd;
+    //Set while the thread running the loop holds the libusb events lock outside
+    //of libusb event handling, see portpilot_helpers_lock_usb_events()
+    uint8_t usb_events_locked;
+    uint8_t trace;
 };
 
 struct portpilot_pkt {
@@ -113,7 +283,7 @@ struct portpilot_pkt {
     uint16_t __pad3;
     //mW
     int16_t energy;
-}__attribute((packed))__;
+} __attribute__((packed));
 
 //Functions for updating the reference counter and starting/stopping the
 //iteration callback (we only want to run it on every iteration when device
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdlib.h>
+
+#include "portpilot_ring.h"
+
+struct portpilot_ring* portpilot_ring_create()
+{
+    struct portpilot_ring *ring = aligned_alloc(64,
+            sizeof(struct portpilot_ring));
+
+    if (!ring)
+        return NULL;
+
+    atomic_init(&(ring->head), 0);
+    atomic_init(&(ring->tail), 0);
+    ring->tail_cache = 0;
+
+    return ring;
+}
+
+void portpilot_ring_free(struct portpilot_ring *ring)
+{
+    free(ring);
+}
+
+struct portpilot_ring_entry* portpilot_ring_reserve(
+        struct portpilot_ring *ring)
+{
+    uint32_t head = atomic_load_explicit(&(ring->head), memory_order_relaxed);
+
+    if (head - ring->tail_cache == PORTPILOT_RING_SIZE) {
+        ring->tail_cache = atomic_load_explicit(&(ring->tail),
+                memory_order_acquire);
+
+        if (head - ring->tail_cache == PORTPILOT_RING_SIZE)
+            return NULL;
+    }
+
+    return &(ring->entries[head & (PORTPILOT_RING_SIZE - 1)]);
+}
+
+void portpilot_ring_commit(struct portpilot_ring *ring)
+{
+    uint32_t head = atomic_load_explicit(&(ring->head), memory_order_relaxed);
+
+    atomic_store_explicit(&(ring->head), head + 1, memory_order_release);
+}
+
+uint32_t portpilot_ring_available(struct portpilot_ring *ring)
+{
+    //The consumer reads in batches, so always look at the real head. Otherwise
+    //a batch could miss entries committed before the consumer was notified
+    return atomic_load_explicit(&(ring->head), memory_order_acquire) -
+        atomic_load_explicit(&(ring->tail), memory_order_relaxed);
+}
+
+const struct portpilot_ring_entry* portpilot_ring_entry(
+        struct portpilot_ring *ring, uint32_t idx)
+{
+    uint32_t tail = atomic_load_explicit(&(ring->tail), memory_order_relaxed);
+
+    return &(ring->entries[(tail + idx) & (PORTPILOT_RING_SIZE - 1)]);
+}
+
+void portpilot_ring_release(struct portpilot_ring *ring, uint32_t num_entries)
+{
+    uint32_t tail = atomic_load_explicit(&(ring->tail), memory_order_relaxed);
+
+    atomic_store_explicit(&(ring->tail), tail + num_entries,
+            memory_order_release);
+}
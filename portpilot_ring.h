@@ -0,0 +1,75 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef PORTPILOT_RING_H
+#define PORTPILOT_RING_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+//Number of entries in a ring, must be a power of two
+#define PORTPILOT_RING_SIZE 1024
+
+//Max. number of bytes of a packet stored in an entry. Portpilot packets are
+//shorter, longer packets are truncated
+#define PORTPILOT_RING_PKT_LEN 64
+
+//A raw packet as received from the device, together with when (monotonic ns)
+//the transfer was completed
+struct portpilot_ring_entry {
+    uint64_t host_ns;
+    uint16_t len;
+    uint8_t pkt[PORTPILOT_RING_PKT_LEN];
+};
+
+//Single-producer/single-consumer ring of packets. head is only written by the
+//producer and tail only by the consumer, and they are kept on separate cache
+//lines. The producer caches tail, so that the consumer's cache line is only
+//read when the ring looks full. The indexes are free-running and masked on
+//access
+struct portpilot_ring {
+    _Alignas(64) atomic_uint head;
+    uint32_t tail_cache;
+    _Alignas(64) atomic_uint tail;
+    _Alignas(64) struct portpilot_ring_entry entries[PORTPILOT_RING_SIZE];
+};
+
+//Allocate and initialize an empty ring, returns NULL on failure
+struct portpilot_ring* portpilot_ring_create();
+
+void portpilot_ring_free(struct portpilot_ring *ring);
+
+//Producer: get the next free entry, or NULL if the ring is full. The entry is
+//not visible to the consumer before portpilot_ring_commit() is called
+struct portpilot_ring_entry* portpilot_ring_reserve(
+        struct portpilot_ring *ring);
+
+//Producer: publish the entry returned by the last portpilot_ring_reserve()
+void portpilot_ring_commit(struct portpilot_ring *ring);
+
+//Consumer: number of entries ready to be read. The entries are read with
+//portpilot_ring_entry() and released in one go with portpilot_ring_release()
+uint32_t portpilot_ring_available(struct portpilot_ring *ring);
+
+//Consumer: get ready entry number idx, counted from the oldest entry
+const struct portpilot_ring_entry* portpilot_ring_entry(
+        struct portpilot_ring *ring, uint32_t idx);
+
+//Consumer: hand the num_entries oldest entries back to the producer
+void portpilot_ring_release(struct portpilot_ring *ring, uint32_t num_entries);
+
+#endif
@@ -0,0 +1,447 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "portpilot_rotate.h"
+#include "portpilot_logger.h"
+
+//Room for the longest suffix of a file name, a sequence number (up to 20
+//digits) or the manifest, plus ".tmp"
+#define ROTATE_SUFFIX_LEN 32
+
+static uint64_t portpilot_rotate_realtime_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+uint8_t portpilot_rotate_parse(const char *arg,
+        struct portpilot_rotate_opts *opts)
+{
+    uint64_t val;
+    uint8_t by_size;
+    char *end;
+
+    memset(opts, 0, sizeof(struct portpilot_rotate_opts));
+
+    if (!strncmp(arg, "size,", strlen("size,"))) {
+        by_size = 1;
+        arg += strlen("size,");
+    } else if (!strncmp(arg, "time,", strlen("time,"))) {
+        by_size = 0;
+        arg += strlen("time,");
+    } else {
+        return RETVAL_FAILURE;
+    }
+
+    val = strtoull(arg, &end, 10);
+
+    if (end == arg || !val)
+        return RETVAL_FAILURE;
+
+    if (by_size) {
+        switch (*end) {
+        case 'G':
+            val *= 1024;
+            //fall through
+        case 'M':
+            val *= 1024;
+            //fall through
+        case 'K':
+            val *= 1024;
+            end++;
+            break;
+        }
+
+        opts->max_bytes = val;
+    } else {
+        opts->period_ns = val * 1000000000ULL;
+    }
+
+    if (!*end)
+        return RETVAL_SUCCESS;
+
+    if (*end != ',')
+        return RETVAL_FAILURE;
+
+    arg = end + 1;
+    opts->keep = (uint32_t) strtoul(arg, &end, 10);
+
+    if (end == arg || *end)
+        return RETVAL_FAILURE;
+
+    return RETVAL_SUCCESS;
+}
+
+static const char* portpilot_rotate_seg_name(struct portpilot_rotate *rotate,
+        uint64_t seq, const char *suffix)
+{
+    snprintf(rotate->name, strlen(rotate->path) + ROTATE_SUFFIX_LEN,
+            "%s.%0*llu%s", rotate->path, ROTATE_SEQ_DIGITS,
+            (unsigned long long) seq, suffix);
+
+    return rotate->name;
+}
+
+static const char* portpilot_rotate_manifest_name(
+        struct portpilot_rotate *rotate, const char *suffix)
+{
+    snprintf(rotate->name, strlen(rotate->path) + ROTATE_SUFFIX_LEN,
+            "%s" ROTATE_MANIFEST_SUFFIX "%s", rotate->path, suffix);
+
+    return rotate->name;
+}
+
+static struct portpilot_rotate_seg* portpilot_rotate_add_seg(
+        struct portpilot_rotate *rotate, uint64_t seq)
+{
+    struct portpilot_rotate_seg *segs, *seg;
+    uint32_t max_segs;
+
+    if (rotate->num_segs == rotate->max_segs) {
+        max_segs = rotate->max_segs ? rotate->max_segs * 2 : 16;
+        segs = realloc(rotate->segs,
+                max_segs * sizeof(struct portpilot_rotate_seg));
+
+        if (!segs)
+            return NULL;
+
+        rotate->segs = segs;
+        rotate->max_segs = max_segs;
+    }
+
+    seg = &(rotate->segs[rotate->num_segs++]);
+    memset(seg, 0, sizeof(struct portpilot_rotate_seg));
+    seg->seq = seq;
+
+    return seg;
+}
+
+//Read the segments of an earlier run from the manifest, if there is one
+static uint8_t portpilot_rotate_load(struct portpilot_rotate *rotate)
+{
+    unsigned long long seq, first_s, first_ns, last_s, last_ns, num_bytes;
+    struct portpilot_rotate_seg *seg;
+    char line[512];
+    FILE *manifest;
+
+    manifest = fopen(portpilot_rotate_manifest_name(rotate, ""), "r");
+
+    if (!manifest)
+        return RETVAL_SUCCESS;
+
+    while (fgets(line, sizeof(line), manifest)) {
+        if (sscanf(line, "%llu,%*[^,],%llu.%llu,%llu.%llu,%llu", &seq,
+                    &first_s, &first_ns, &last_s, &last_ns, &num_bytes) != 6)
+            continue;
+
+        if (!(seg = portpilot_rotate_add_seg(rotate, seq))) {
+            fclose(manifest);
+            return RETVAL_FAILURE;
+        }
+
+        seg->first_ns = (first_s * 1000000000ULL) + first_ns;
+        seg->last_ns = (last_s * 1000000000ULL) + last_ns;
+        seg->num_bytes = num_bytes;
+    }
+
+    fclose(manifest);
+
+    return RETVAL_SUCCESS;
+}
+
+//Write the manifest to a temporary file and rename it, so that a reader always
+//sees a complete manifest
+static uint8_t portpilot_rotate_save(struct portpilot_rotate *rotate)
+{
+    const char *base = strrchr(rotate->path, '/');
+    const struct portpilot_rotate_seg *seg;
+    uint8_t retval = RETVAL_SUCCESS;
+    char *tmp_name;
+    FILE *manifest;
+    uint32_t i;
+
+    base = base ? base + 1 : rotate->path;
+    tmp_name = strdup(portpilot_rotate_manifest_name(rotate, ".tmp"));
+
+    if (!tmp_name || !(manifest = fopen(tmp_name, "w"))) {
+        free(tmp_name);
+        return RETVAL_FAILURE;
+    }
+
+    fprintf(manifest, ROTATE_MANIFEST_DESCRIPTION "\n");
+
+    for (i = 0; i < rotate->num_segs; i++) {
+        seg = &(rotate->segs[i]);
+        fprintf(manifest, "%llu,%s.%0*llu,%llu.%09llu,%llu.%09llu,%llu\n",
+                (unsigned long long) seg->seq, base, ROTATE_SEQ_DIGITS,
+                (unsigned long long) seg->seq,
+                (unsigned long long) (seg->first_ns / 1000000000ULL),
+                (unsigned long long) (seg->first_ns % 1000000000ULL),
+                (unsigned long long) (seg->last_ns / 1000000000ULL),
+                (unsigned long long) (seg->last_ns % 1000000000ULL),
+                (unsigned long long) seg->num_bytes);
+    }
+
+    if (fflush(manifest) || fdatasync(fileno(manifest)))
+        retval = RETVAL_FAILURE;
+
+    if (fclose(manifest) ||
+        rename(tmp_name, portpilot_rotate_manifest_name(rotate, "")))
+        retval = RETVAL_FAILURE;
+
+    free(tmp_name);
+
+    return retval;
+}
+
+//Create segment seq with the header written and prealloc bytes allocated.
+//Returns the fd, or -1 on failure
+static int32_t portpilot_rotate_create_seg(struct portpilot_rotate *rotate,
+        uint64_t seq, uint64_t prealloc)
+{
+    char *tmp_name;
+    int32_t fd;
+
+    tmp_name = strdup(portpilot_rotate_seg_name(rotate, seq, ".tmp"));
+
+    if (!tmp_name)
+        return -1;
+
+    fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd == -1) {
+        free(tmp_name);
+        return -1;
+    }
+
+    if (write(fd, rotate->hdr, rotate->hdr_len) != (ssize_t) rotate->hdr_len)
+        goto error;
+
+    //Allocate the blocks up front, so that the segment is not fragmented and
+    //the file system does not have to allocate on every write. The size is
+    //kept, so the segment only appears to grow as it is written. Not all file
+    //systems support this, which is fine
+    if (prealloc > rotate->hdr_len)
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, prealloc);
+
+    if (rename(tmp_name, portpilot_rotate_seg_name(rotate, seq, "")))
+        goto error;
+
+    free(tmp_name);
+
+    return fd;
+
+error:
+    close(fd);
+    unlink(tmp_name);
+    free(tmp_name);
+    return -1;
+}
+
+static void portpilot_rotate_set_deadline(struct portpilot_rotate *rotate)
+{
+    uint64_t now;
+
+    if (!rotate->opts.period_ns)
+        return;
+
+    now = portpilot_rotate_realtime_ns();
+    rotate->deadline_ns = ((now / rotate->opts.period_ns) + 1) *
+        rotate->opts.period_ns;
+}
+
+struct portpilot_rotate* portpilot_rotate_open(const char *path,
+        const struct portpilot_rotate_opts *opts, const char *hdr)
+{
+    struct portpilot_rotate *rotate;
+    struct timespec mono, real;
+
+    rotate = calloc(sizeof(struct portpilot_rotate), 1);
+
+    if (!rotate)
+        return NULL;
+
+    rotate->opts = *opts;
+    rotate->hdr = hdr;
+    rotate->hdr_len = strlen(hdr);
+    rotate->fd = -1;
+    rotate->path = strdup(path);
+    rotate->name = malloc(strlen(path) + ROTATE_SUFFIX_LEN);
+
+    //Samples are timestamped with the monotonic clock, the manifest uses
+    //realtime so that it can be compared to wall-clock time
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    rotate->realtime_offset = ((real.tv_sec * 1000000000ULL) + real.tv_nsec) -
+        ((mono.tv_sec * 1000000000ULL) + mono.tv_nsec);
+
+    if (!rotate->path || !rotate->name || !portpilot_rotate_load(rotate) ||
+        !portpilot_rotate_next(rotate)) {
+        free(rotate->segs);
+        free(rotate->name);
+        free(rotate->path);
+        free(rotate);
+        return NULL;
+    }
+
+    return rotate;
+}
+
+uint8_t portpilot_rotate_due(struct portpilot_rotate *rotate, uint64_t len)
+{
+    const struct portpilot_rotate_seg *seg =
+        &(rotate->segs[rotate->num_segs - 1]);
+    uint64_t now;
+
+    if (rotate->opts.period_ns) {
+        now = portpilot_rotate_realtime_ns();
+
+        if (now >= rotate->deadline_ns) {
+            if (seg->num_bytes > rotate->hdr_len)
+                return RETVAL_SUCCESS;
+
+            //Nothing was written during the period, so the current segment
+            //belongs to the next one
+            portpilot_rotate_set_deadline(rotate);
+        }
+    }
+
+    return seg->num_bytes > rotate->hdr_len && rotate->opts.max_bytes &&
+        seg->num_bytes + len > rotate->opts.max_bytes;
+}
+
+uint8_t portpilot_rotate_next(struct portpilot_rotate *rotate)
+{
+    struct portpilot_rotate_seg *seg = NULL;
+    uint64_t seq = 1, prealloc = rotate->opts.max_bytes;
+    int32_t fd;
+
+    if (rotate->num_segs) {
+        seg = &(rotate->segs[rotate->num_segs - 1]);
+        seq = seg->seq + 1;
+
+        //With time-based rotation, the next segment is probably about as large
+        //as the current one
+        if (!prealloc && rotate->fd != -1)
+            prealloc = seg->num_bytes;
+    }
+
+    fd = portpilot_rotate_create_seg(rotate, seq, prealloc);
+
+    if (fd == -1) {
+        atomic_fetch_add(&(rotate->num_errors), 1);
+        return RETVAL_FAILURE;
+    }
+
+    if (rotate->fd == -1) {
+        rotate->fd = fd;
+    } else {
+        //Release the space that was preallocated but not used, and make the
+        //new segment the current one. The segment is not closed until fd has
+        //been replaced, so the writer always has a valid fd
+        if (ftruncate(rotate->fd, seg->num_bytes))
+            atomic_fetch_add(&(rotate->num_errors), 1);
+
+        if (dup3(fd, rotate->fd, O_CLOEXEC) == -1) {
+            close(fd);
+            unlink(portpilot_rotate_seg_name(rotate, seq, ""));
+            atomic_fetch_add(&(rotate->num_errors), 1);
+            return RETVAL_FAILURE;
+        }
+
+        close(fd);
+        atomic_fetch_add(&(rotate->num_rotations), 1);
+    }
+
+    if (!(seg = portpilot_rotate_add_seg(rotate, seq))) {
+        atomic_fetch_add(&(rotate->num_errors), 1);
+        return RETVAL_FAILURE;
+    }
+
+    seg->num_bytes = rotate->hdr_len;
+    portpilot_rotate_set_deadline(rotate);
+
+    //The current segment is always kept
+    while (rotate->opts.keep && rotate->num_segs > rotate->opts.keep) {
+        if (unlink(portpilot_rotate_seg_name(rotate, rotate->segs[0].seq, ""))
+                && errno != ENOENT)
+            atomic_fetch_add(&(rotate->num_errors), 1);
+
+        memmove(rotate->segs, rotate->segs + 1,
+                (rotate->num_segs - 1) * sizeof(struct portpilot_rotate_seg));
+        --rotate->num_segs;
+    }
+
+    if (!portpilot_rotate_save(rotate))
+        atomic_fetch_add(&(rotate->num_errors), 1);
+
+    return RETVAL_SUCCESS;
+}
+
+void portpilot_rotate_written(struct portpilot_rotate *rotate, uint64_t len,
+        uint64_t first_ns, uint64_t last_ns)
+{
+    struct portpilot_rotate_seg *seg = &(rotate->segs[rotate->num_segs - 1]);
+
+    seg->num_bytes += len;
+
+    if (first_ns) {
+        first_ns += rotate->realtime_offset;
+
+        if (!seg->first_ns || first_ns < seg->first_ns)
+            seg->first_ns = first_ns;
+    }
+
+    if (last_ns) {
+        last_ns += rotate->realtime_offset;
+
+        if (last_ns > seg->last_ns)
+            seg->last_ns = last_ns;
+    }
+}
+
+void portpilot_rotate_close(struct portpilot_rotate *rotate)
+{
+    const struct portpilot_rotate_seg *seg =
+        &(rotate->segs[rotate->num_segs - 1]);
+
+    if (ftruncate(rotate->fd, seg->num_bytes))
+        fprintf(stderr, "Failed to release space of %s\n",
+                portpilot_rotate_seg_name(rotate, seg->seq, ""));
+
+    close(rotate->fd);
+
+    if (!portpilot_rotate_save(rotate))
+        fprintf(stderr, "Failed to write manifest of %s\n", rotate->path);
+
+    free(rotate->segs);
+    free(rotate->name);
+    free(rotate->path);
+    free(rotate);
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef PORTPILOT_ROTATE_H
+#define PORTPILOT_ROTATE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+//Segments of a rotated file (-R) are named <path>.<seq>, with seq zero-padded
+//to ROTATE_SEQ_DIGITS digits. The manifest <path>.manifest lists the segments
+//that are kept, with the host time (realtime) of their first and last sample
+#define ROTATE_SEQ_DIGITS 6
+#define ROTATE_MANIFEST_SUFFIX ".manifest"
+#define ROTATE_MANIFEST_DESCRIPTION "Segment, File, First host time (s), " \
+    "Last host time (s), Bytes"
+
+//Rotate when a segment would grow beyond max_bytes, or when a wall-clock
+//period of period_ns (aligned to the epoch, so one hour starts on the hour)
+//is over. At most keep segments are kept (0 keeps all)
+struct portpilot_rotate_opts {
+    uint64_t max_bytes;
+    uint64_t period_ns;
+    uint32_t keep;
+};
+
+//first_ns/last_ns are 0 until the segment holds a sample
+struct portpilot_rotate_seg {
+    uint64_t seq;
+    uint64_t first_ns;
+    uint64_t last_ns;
+    uint64_t num_bytes;
+};
+
+//A file that is written as a sequence of segments. The file is written through
+//fd, which always refers to the current segment: a new segment is prepared
+//(header written and preallocated) under a temporary name, renamed into place
+//and then moved to fd with dup2(). A writer thus never sees a missing or
+//half-created segment, and does not have to know that the file rotates. segs
+//are the segments that are kept, oldest first, the last one is the current.
+//Everything except fd and the counters must only be used by the thread that
+//writes
+struct portpilot_rotate {
+    struct portpilot_rotate_opts opts;
+    struct portpilot_rotate_seg *segs;
+    char *path;
+    char *name;
+    const char *hdr;
+    uint64_t realtime_offset;
+    uint64_t deadline_ns;
+    atomic_ullong num_rotations;
+    atomic_ullong num_errors;
+    uint32_t num_segs;
+    uint32_t max_segs;
+    uint32_t hdr_len;
+    int32_t fd;
+};
+
+//Parse size,N[,keep] (N bytes, with an optional K/M/G suffix) or
+//time,N[,keep] (N seconds). Returns RETVAL_SUCCESS/RETVAL_FAILURE
+uint8_t portpilot_rotate_parse(const char *arg,
+        struct portpilot_rotate_opts *opts);
+
+//Open the first segment of path, every segment starts with hdr (which must
+//outlive the rotate). If path has a manifest (the logger was restarted), the
+//segments in it are kept and numbering continues after them. Returns NULL on
+//failure
+struct portpilot_rotate* portpilot_rotate_open(const char *path,
+        const struct portpilot_rotate_opts *opts, const char *hdr);
+
+//Check if a new segment should be started before writing len bytes. A segment
+//that holds no samples is never rotated
+uint8_t portpilot_rotate_due(struct portpilot_rotate *rotate, uint64_t len);
+
+//Start a new segment, finish the current one (its preallocated space is
+//released), update the manifest and remove segments that are no longer kept.
+//If the new segment can not be created, writing continues in the current one.
+//Returns RETVAL_SUCCESS/RETVAL_FAILURE
+uint8_t portpilot_rotate_next(struct portpilot_rotate *rotate);
+
+//Account for len bytes written to the current segment, holding samples
+//received (monotonic host time) from first_ns to last_ns (0 if unknown)
+void portpilot_rotate_written(struct portpilot_rotate *rotate, uint64_t len,
+        uint64_t first_ns, uint64_t last_ns);
+
+//Finish the current segment, write the final manifest and free rotate
+void portpilot_rotate_close(struct portpilot_rotate *rotate);
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <libusb-1.0/libusb.h>
+
+#include "portpilot_shm.h"
+#include "portpilot_logger.h"
+#include "portpilot_helpers.h"
+
+_Static_assert(SHM_SERIAL_LEN == MAX_USB_STR_LEN + 1,
+        "a serial number must fit in a device");
+_Static_assert(SHM_PATH_LEN == USB_MAX_PATH, "a path must fit in a device");
+_Static_assert((SHM_RING_LEN & (SHM_RING_LEN - 1)) == 0,
+        "the ring length must be a power of two");
+
+static inline uint32_t portpilot_shm_avg(uint32_t sum, uint16_t num_readings)
+{
+    return num_readings > 1 ? sum / num_readings : sum;
+}
+
+struct portpilot_shm* portpilot_shm_create(const char *name)
+{
+    struct portpilot_shm *shm;
+    struct timespec mono, real;
+    int32_t fd;
+
+    shm = calloc(sizeof(struct portpilot_shm), 1);
+
+    if (!shm)
+        return NULL;
+
+    shm->name = strdup(name);
+
+    if (!shm->name || pthread_mutex_init(&(shm->lock), NULL)) {
+        free(shm->name);
+        free(shm);
+        return NULL;
+    }
+
+    //A segment left behind by an earlier run is replaced, readers that still
+    //have it mapped keep the old one
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+
+    if (fd == -1)
+        goto error;
+
+    if (ftruncate(fd, SHM_SIZE)) {
+        close(fd);
+        goto unlink;
+    }
+
+    shm->hdr = mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (shm->hdr == MAP_FAILED)
+        goto unlink;
+
+    //Samples are timestamped with the monotonic clock, readers compare with
+    //wall-clock time
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    shm->realtime_offset = ((real.tv_sec * 1000000000ULL) + real.tv_nsec) -
+        ((mono.tv_sec * 1000000000ULL) + mono.tv_nsec);
+
+    //The segment is zeroed by ftruncate(), the magic is written last so that
+    //a reader never sees a valid header with the rest missing
+    shm->hdr->version = SHM_VERSION;
+    shm->hdr->max_devs = SHM_MAX_DEVS;
+    shm->hdr->ring_len = SHM_RING_LEN;
+    shm->hdr->dev_size = sizeof(struct portpilot_shm_dev);
+    shm->hdr->create_ns = (real.tv_sec * 1000000000ULL) + real.tv_nsec;
+    shm->hdr->pid = getpid();
+    atomic_thread_fence(memory_order_release);
+    memcpy(shm->hdr->magic, SHM_MAGIC, sizeof(shm->hdr->magic));
+
+    return shm;
+
+unlink:
+    shm_unlink(name);
+error:
+    pthread_mutex_destroy(&(shm->lock));
+    free(shm->name);
+    free(shm);
+    return NULL;
+}
+
+void portpilot_shm_destroy(struct portpilot_shm *shm)
+{
+    munmap(shm->hdr, SHM_SIZE);
+    shm_unlink(shm->name);
+    pthread_mutex_destroy(&(shm->lock));
+    free(shm->name);
+    free(shm);
+}
+
+struct portpilot_shm_dev* portpilot_shm_get_dev(struct portpilot_shm *shm,
+        const uint8_t *serial_number, const uint8_t *path, uint8_t path_len)
+{
+    struct portpilot_shm_dev *dev;
+    uint32_t num_devs, i;
+
+    pthread_mutex_lock(&(shm->lock));
+
+    num_devs = atomic_load(&(shm->hdr->num_devs));
+
+    for (i = 0; i < num_devs; i++) {
+        dev = portpilot_shm_dev_at(shm->hdr, i);
+
+        //Known device, for example one that was plugged back in. Devices
+        //without a serial number never share a ring, every ring must have a
+        //single writer
+        if (portpilot_helpers_cmp_dev(dev->serial_number, dev->path,
+                    dev->path_len, serial_number, path, path_len)) {
+            pthread_mutex_unlock(&(shm->lock));
+            return dev;
+        }
+    }
+
+    if (num_devs == SHM_MAX_DEVS) {
+        pthread_mutex_unlock(&(shm->lock));
+        return NULL;
+    }
+
+    dev = portpilot_shm_dev_at(shm->hdr, num_devs);
+    strncpy((char*) dev->serial_number, (const char*) serial_number,
+            SHM_SERIAL_LEN - 1);
+    memcpy(dev->path, path, path_len);
+    dev->path_len = path_len;
+
+    //Publishes the serial number and path
+    atomic_store_explicit(&(shm->hdr->num_devs), num_devs + 1,
+            memory_order_release);
+    pthread_mutex_unlock(&(shm->lock));
+
+    return dev;
+}
+
+void portpilot_shm_publish(struct portpilot_shm_dev *dev,
+        const struct portpilot_shm_sample *sample)
+{
+    uint64_t n = atomic_load_explicit(&(dev->head), memory_order_relaxed);
+    struct portpilot_shm_entry *entry = &(dev->ring[n & (SHM_RING_LEN - 1)]);
+
+    //Readers of the previous sample in this entry see the odd seq (or a
+    //different one after copying) and discard what they read
+    atomic_store_explicit(&(entry->seq), (2 * n) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    entry->sample = *sample;
+    atomic_store_explicit(&(entry->seq), (2 * n) + 2, memory_order_release);
+    atomic_store_explicit(&(dev->head), n + 1, memory_order_release);
+}
+
+void portpilot_shm_write(struct portpilot_shm *shm,
+        struct portpilot_dev *pp_dev, const struct portpilot_data *pp_data)
+{
+    struct portpilot_shm_sample sample = {0};
+
+    if (!pp_dev->shm_dev &&
+        !(pp_dev->shm_dev = portpilot_shm_get_dev(shm,
+                pp_dev->serial_number, pp_dev->path, pp_dev->path_len))) {
+        atomic_fetch_add(&(shm->num_full), 1);
+        return;
+    }
+
+    sample.host_ns = pp_data->host_ns + shm->realtime_offset;
+    sample.tstamp = pp_data->tstamp;
+    sample.v_in = portpilot_shm_avg(pp_data->v_in,
+            pp_data->num_readings);
+    sample.v_out = portpilot_shm_avg(pp_data->v_out,
+            pp_data->num_readings);
+    sample.current = portpilot_shm_avg(pp_data->current,
+            pp_data->num_readings);
+    sample.max_current = pp_data->max_current;
+    sample.energy = portpilot_shm_avg(pp_data->energy,
+            pp_data->num_readings);
+    sample.total_energy = pp_data->total_energy;
+
+    portpilot_shm_publish(pp_dev->shm_dev, &sample);
+}
+
+void portpilot_shm_print_stats(struct portpilot_shm *shm)
+{
+    fprintf(stderr, "Shared memory %s: %u devices, %llu samples not published "
+            "(no room for device)\n", shm->name,
+            atomic_load(&(shm->hdr->num_devs)),
+            (unsigned long long) atomic_load(&(shm->num_full)));
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef PORTPILOT_SHM_H
+#define PORTPILOT_SHM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+//Live samples in POSIX shared memory (-m). The segment starts with a header,
+//followed by SHM_MAX_DEVS devices. Every device has a ring of the last
+//SHM_RING_LEN samples. Devices are identified by serial number, or by bus/port
+//path if they have none, and keep their place in the segment when they are
+//unplugged, so a reader can cache where a device is. The layout only uses
+//fixed-width types in host byte order, so it can be read by any process on the
+//same machine, see portpilot_shm_reader.h
+#define SHM_MAGIC "PPSHMRNG"
+#define SHM_VERSION 2
+#define SHM_MAX_DEVS 256
+#define SHM_RING_LEN 256
+#define SHM_SERIAL_LEN 256
+#define SHM_PATH_LEN 8
+
+//A sample as output (averaged over num_readings when aggregating with -i).
+//host_ns is when (realtime ns) the first packet of the sample was received
+struct portpilot_shm_sample {
+    uint64_t host_ns;
+    uint32_t tstamp;
+    uint32_t v_in;
+    uint32_t v_out;
+    uint32_t current;
+    uint32_t max_current;
+    uint32_t energy;
+    uint32_t total_energy;
+    uint32_t __pad;
+};
+
+//Sample number n (counted from 0 for every device) is stored in entry n %
+//SHM_RING_LEN. seq is a seqlock: 2n + 1 while the sample is being written,
+//2n + 2 when it is complete. A reader that reads the same seq before and after
+//copying the sample has sample n, anything else means that the copy might be
+//torn and must be discarded. The writer never waits for readers
+struct portpilot_shm_entry {
+    atomic_ullong seq;
+    struct portpilot_shm_sample sample;
+};
+
+//head is the number of samples written. The serial number and path (bus number
+//followed by port numbers) are set before the device is counted in num_devs of
+//the header and never change after that. Every device has a single writer
+struct portpilot_shm_dev {
+    uint8_t serial_number[SHM_SERIAL_LEN];
+    atomic_ullong head;
+    uint8_t path[SHM_PATH_LEN];
+    uint8_t path_len;
+    uint8_t __pad[47];
+    struct portpilot_shm_entry ring[SHM_RING_LEN];
+};
+
+struct portpilot_shm_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t max_devs;
+    uint32_t ring_len;
+    uint32_t dev_size;
+    //When (realtime ns) the segment was created, and by which process
+    uint64_t create_ns;
+    uint32_t pid;
+    atomic_uint num_devs;
+    uint8_t __pad[24];
+};
+
+_Static_assert(sizeof(struct portpilot_shm_hdr) == 64,
+        "the header must fill a cache line");
+_Static_assert(sizeof(struct portpilot_shm_dev) % 64 == 0,
+        "devices must start on a cache line");
+
+static inline struct portpilot_shm_dev* portpilot_shm_dev_at(
+        const struct portpilot_shm_hdr *hdr, uint32_t idx)
+{
+    return (struct portpilot_shm_dev*) ((uint8_t*) hdr +
+            sizeof(struct portpilot_shm_hdr) +
+            (idx * sizeof(struct portpilot_shm_dev)));
+}
+
+#define SHM_SIZE (sizeof(struct portpilot_shm_hdr) + \
+        (SHM_MAX_DEVS * sizeof(struct portpilot_shm_dev)))
+
+struct portpilot_data;
+struct portpilot_dev;
+
+//The segment as created by the logger, shared by all shards. lock serializes
+//adding devices, publishing samples is lock-free. num_full counts the samples
+//that were not published because the segment had no room for their device
+struct portpilot_shm {
+    struct portpilot_shm_hdr *hdr;
+    char *name;
+    pthread_mutex_t lock;
+    uint64_t realtime_offset;
+    atomic_ullong num_full;
+};
+
+//Create (or replace) the shared memory segment name. Returns NULL on failure
+struct portpilot_shm* portpilot_shm_create(const char *name);
+
+//Unmap and remove the segment. Readers that have it mapped can still read the
+//last samples
+void portpilot_shm_destroy(struct portpilot_shm *shm);
+
+//Get the device with serial_number (or path/path_len if the serial number is
+//empty), adding it to the segment if it is not there. Returns NULL if the
+//segment is full
+struct portpilot_shm_dev* portpilot_shm_get_dev(struct portpilot_shm *shm,
+        const uint8_t *serial_number, const uint8_t *path, uint8_t path_len);
+
+//Publish a sample of dev. Must only be called by the writer of dev
+void portpilot_shm_publish(struct portpilot_shm_dev *dev,
+        const struct portpilot_shm_sample *sample);
+
+//Publish pp_data, received from pp_dev. Must be called by the thread that
+//outputs
+void portpilot_shm_write(struct portpilot_shm *shm,
+        struct portpilot_dev *pp_dev, const struct portpilot_data *pp_data);
+
+//Write statistics to stderr
+void portpilot_shm_print_stats(struct portpilot_shm *shm);
+
+#endif
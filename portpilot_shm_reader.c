@@ -0,0 +1,167 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "portpilot_shm_reader.h"
+
+//Same as in portpilot_logger.h, which readers do not include
+#define RETVAL_SUCCESS 1
+#define RETVAL_FAILURE 0
+
+struct portpilot_shm_reader* portpilot_shm_reader_open(const char *name)
+{
+    struct portpilot_shm_reader *reader;
+    const struct portpilot_shm_hdr *hdr;
+    struct stat st;
+    int32_t fd;
+
+    fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+
+    if (fd == -1)
+        return NULL;
+
+    if (fstat(fd, &st) || (size_t) st.st_size < SHM_SIZE) {
+        close(fd);
+        return NULL;
+    }
+
+    hdr = mmap(NULL, SHM_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (hdr == MAP_FAILED)
+        return NULL;
+
+    //The magic is written last by the logger
+    if (memcmp(hdr->magic, SHM_MAGIC, sizeof(hdr->magic)) ||
+        hdr->version != SHM_VERSION || hdr->max_devs != SHM_MAX_DEVS ||
+        hdr->ring_len != SHM_RING_LEN ||
+        hdr->dev_size != sizeof(struct portpilot_shm_dev)) {
+        munmap((void*) hdr, SHM_SIZE);
+        return NULL;
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+
+    reader = calloc(sizeof(struct portpilot_shm_reader), 1);
+
+    if (!reader) {
+        munmap((void*) hdr, SHM_SIZE);
+        return NULL;
+    }
+
+    reader->hdr = hdr;
+
+    return reader;
+}
+
+void portpilot_shm_reader_close(struct portpilot_shm_reader *reader)
+{
+    munmap((void*) reader->hdr, SHM_SIZE);
+    free(reader);
+}
+
+uint32_t portpilot_shm_reader_num_devs(
+        const struct portpilot_shm_reader *reader)
+{
+    //Acquire pairs with the logger publishing the serial number
+    return atomic_load_explicit(&(reader->hdr->num_devs),
+            memory_order_acquire);
+}
+
+const uint8_t* portpilot_shm_reader_serial(
+        const struct portpilot_shm_reader *reader, uint32_t idx)
+{
+    return portpilot_shm_dev_at(reader->hdr, idx)->serial_number;
+}
+
+const uint8_t* portpilot_shm_reader_path(
+        const struct portpilot_shm_reader *reader, uint32_t idx,
+        uint8_t *path_len)
+{
+    const struct portpilot_shm_dev *dev = portpilot_shm_dev_at(reader->hdr,
+            idx);
+
+    *path_len = dev->path_len;
+    return dev->path;
+}
+
+//Copy sample n of dev, if it is in the ring and not being written
+static uint8_t portpilot_shm_reader_get(struct portpilot_shm_dev *dev,
+        uint64_t n, struct portpilot_shm_sample *sample)
+{
+    struct portpilot_shm_entry *entry = &(dev->ring[n & (SHM_RING_LEN - 1)]);
+    uint64_t seq = (2 * n) + 2;
+
+    if (atomic_load_explicit(&(entry->seq), memory_order_acquire) != seq)
+        return RETVAL_FAILURE;
+
+    *sample = entry->sample;
+    atomic_thread_fence(memory_order_acquire);
+
+    return atomic_load_explicit(&(entry->seq), memory_order_relaxed) == seq;
+}
+
+uint8_t portpilot_shm_reader_last(const struct portpilot_shm_reader *reader,
+        uint32_t idx, struct portpilot_shm_sample *sample)
+{
+    struct portpilot_shm_dev *dev = portpilot_shm_dev_at(reader->hdr, idx);
+    uint64_t head = atomic_load_explicit(&(dev->head), memory_order_acquire);
+
+    if (!head)
+        return RETVAL_FAILURE;
+
+    return portpilot_shm_reader_get(dev, head - 1, sample);
+}
+
+uint32_t portpilot_shm_reader_read(const struct portpilot_shm_reader *reader,
+        uint32_t idx, uint64_t *next, struct portpilot_shm_sample *samples,
+        uint32_t max, uint64_t *lost)
+{
+    struct portpilot_shm_dev *dev = portpilot_shm_dev_at(reader->hdr, idx);
+    uint64_t head = atomic_load_explicit(&(dev->head), memory_order_acquire);
+    uint64_t n = *next, num_lost = 0;
+    uint32_t num_samples = 0;
+
+    //The entry of the oldest sample in the ring can already be in the process
+    //of being overwritten by sample head
+    if (head >= SHM_RING_LEN && n < head - SHM_RING_LEN + 1) {
+        num_lost += head - SHM_RING_LEN + 1 - n;
+        n = head - SHM_RING_LEN + 1;
+    }
+
+    for (; n < head && num_samples < max; n++) {
+        if (portpilot_shm_reader_get(dev, n, &(samples[num_samples])))
+            num_samples++;
+        else
+            num_lost++;
+    }
+
+    *next = n;
+
+    if (lost)
+        *lost += num_lost;
+
+    return num_samples;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef PORTPILOT_SHM_READER_H
+#define PORTPILOT_SHM_READER_H
+
+#include <stdint.h>
+
+#include "portpilot_shm.h"
+
+//The live samples of a logger (see portpilot_shm.h), mapped read-only. Reading
+//never blocks the logger or makes it do a syscall, and a reader only waits for
+//the logger if it asks for a sample that is being written at that moment (the
+//read fails and can be retried). Samples are copied out of the rings, a copy
+//that might be torn is never returned. Any number of readers (threads or
+//processes) can read at the same time
+struct portpilot_shm_reader {
+    const struct portpilot_shm_hdr *hdr;
+};
+
+//Map the segment name (as given to the logger with -m) and validate its header.
+//Returns NULL on failure
+struct portpilot_shm_reader* portpilot_shm_reader_open(const char *name);
+
+void portpilot_shm_reader_close(struct portpilot_shm_reader *reader);
+
+//Number of devices in the segment, devices are never removed
+uint32_t portpilot_shm_reader_num_devs(
+        const struct portpilot_shm_reader *reader);
+
+//Serial number (zero-terminated) of device idx
+const uint8_t* portpilot_shm_reader_serial(
+        const struct portpilot_shm_reader *reader, uint32_t idx);
+
+//Bus/port path of device idx, path_len is set to its length. Devices without a
+//serial number are told apart by their path
+const uint8_t* portpilot_shm_reader_path(
+        const struct portpilot_shm_reader *reader, uint32_t idx,
+        uint8_t *path_len);
+
+//Copy the most recent sample of device idx. Returns RETVAL_SUCCESS, or
+//RETVAL_FAILURE if the device has no samples or the sample was overwritten
+//while being copied
+uint8_t portpilot_shm_reader_last(const struct portpilot_shm_reader *reader,
+        uint32_t idx, struct portpilot_shm_sample *sample);
+
+//Copy up to max samples of device idx, starting at sample number *next (0 for
+//the first sample of the device). *next is set to the number of the sample
+//after the last one copied, so that calling again continues where this call
+//stopped. Samples that were overwritten before they could be copied are
+//skipped and added to *lost (if not NULL). Returns the number of samples
+//copied
+uint32_t portpilot_shm_reader_read(const struct portpilot_shm_reader *reader,
+        uint32_t idx, uint64_t *next, struct portpilot_shm_sample *samples,
+        uint32_t max, uint64_t *lost);
+
+#endif
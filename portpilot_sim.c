@@ -0,0 +1,317 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <libusb-1.0/libusb.h>
+
+#include "portpilot_sim.h"
+#include "portpilot_logger.h"
+#include "portpilot_helpers.h"
+#include "portpilot_callbacks.h"
+#include "backend_event_loop.h"
+
+static const char *sim_waveforms[] = {"const", "sine", "square", "ramp"};
+
+#define SIM_NUM_WAVEFORMS (sizeof(sim_waveforms) / sizeof(sim_waveforms[0]))
+
+uint8_t portpilot_sim_parse(const char *spec, struct portpilot_sim_opts *opts)
+{
+    size_t len;
+    char *end;
+    uint8_t i;
+
+    memset(opts, 0, sizeof(struct portpilot_sim_opts));
+    opts->rate = SIM_DEFAULT_RATE;
+    opts->waveform = SIM_WAVE_SINE;
+
+    opts->num_devs = strtoul(spec, &end, 10);
+
+    if (end == spec || !opts->num_devs || opts->num_devs > SIM_MAX_DEVS)
+        return RETVAL_FAILURE;
+
+    if (*end != ',')
+        return *end ? RETVAL_FAILURE : RETVAL_SUCCESS;
+
+    spec = end + 1;
+    opts->rate = strtoul(spec, &end, 10);
+
+    if (end == spec || !opts->rate || opts->rate > 1000000)
+        return RETVAL_FAILURE;
+
+    if (*end != ',')
+        return *end ? RETVAL_FAILURE : RETVAL_SUCCESS;
+
+    spec = end + 1;
+    len = strcspn(spec, ",");
+
+    for (i = 0; i < SIM_NUM_WAVEFORMS; i++) {
+        if (strlen(sim_waveforms[i]) == len &&
+            !strncmp(spec, sim_waveforms[i], len))
+            break;
+    }
+
+    if (i == SIM_NUM_WAVEFORMS)
+        return RETVAL_FAILURE;
+
+    opts->waveform = i;
+
+    if (spec[len] != ',')
+        return RETVAL_SUCCESS;
+
+    spec += len + 1;
+    opts->churn_intvl = strtoul(spec, &end, 10);
+
+    if (end == spec || *end)
+        return RETVAL_FAILURE;
+
+    return RETVAL_SUCCESS;
+}
+
+static void portpilot_sim_path(uint32_t idx, uint8_t *dev_path)
+{
+    dev_path[0] = SIM_BUS;
+    dev_path[1] = (idx >> 8) & 0xFF;
+    dev_path[2] = idx & 0xFF;
+}
+
+//Value of the waveform (between -1 and 1) t seconds after the device booted.
+//The period is one second and devices are out of phase, so that they do not
+//all peak at the same time
+static double portpilot_sim_wave(const struct portpilot_sim *sim,
+        const struct portpilot_sim_dev *sim_dev, double t)
+{
+    double phase = t + (sim_dev->idx * 0.1);
+
+    phase -= floor(phase);
+
+    switch (sim->waveform) {
+    case SIM_WAVE_SINE:
+        return sin(2 * M_PI * phase);
+    case SIM_WAVE_SQUARE:
+        return phase < 0.5 ? 1 : -1;
+    case SIM_WAVE_RAMP:
+        return (2 * phase) - 1;
+    default:
+        return 0;
+    }
+}
+
+//Fill pp_pkt with what the device sends at next_ns. The current is 500 mA +-
+//400 mA according to the waveform, and the output voltage drops with the
+//current like over a cable
+static void portpilot_sim_fill_pkt(struct portpilot_sim *sim,
+        struct portpilot_sim_dev *sim_dev, struct portpilot_pkt *pp_pkt)
+{
+    double t = (sim_dev->next_ns - sim_dev->boot_ns) / 1000000000.0;
+    int16_t noise = (rand_r(&(sim->seed)) % 21) - 10;
+    int16_t current = 500 + (int16_t) (400 * portpilot_sim_wave(sim, sim_dev,
+                t)) + noise;
+
+    if (current > sim_dev->max_current)
+        sim_dev->max_current = current;
+
+    memset(pp_pkt, 0, sizeof(struct portpilot_pkt));
+    pp_pkt->tstamp = (uint32_t) t;
+    pp_pkt->v_in = 5000 + noise;
+    pp_pkt->v_out = pp_pkt->v_in - (current / 20);
+    pp_pkt->current = current;
+    pp_pkt->max_current = sim_dev->max_current;
+    pp_pkt->energy = (pp_pkt->v_out * current) / 1000;
+
+    //mW * ns is pJ, total energy is reported in mWs
+    sim_dev->energy_nj += (pp_pkt->energy * sim->intvl_ns) / 1000;
+    pp_pkt->total_energy = (int32_t) (sim_dev->energy_nj / 1000000);
+}
+
+static void portpilot_sim_plug(struct portpilot_sim *sim,
+        struct portpilot_sim_dev *sim_dev)
+{
+    struct portpilot_ctx *pp_ctx = sim->pp_ctx;
+    struct portpilot_dev *pp_dev;
+    uint8_t dev_path[USB_MAX_PATH];
+    uint8_t serial_number[MAX_USB_STR_LEN+1] = {0};
+
+    snprintf((char*) serial_number, sizeof(serial_number), "SIM%05u",
+            sim_dev->idx);
+
+    if (pp_ctx->desired_serial &&
+        !portpilot_helpers_cmp_serial(pp_ctx->desired_serial, serial_number))
+        return;
+
+    portpilot_sim_path(sim_dev->idx, dev_path);
+    pp_dev = portpilot_helpers_alloc_dev(pp_ctx, dev_path, 3);
+
+    if (!pp_dev)
+        return;
+
+    memcpy(pp_dev->serial_number, serial_number, sizeof(serial_number));
+    pp_dev->max_packet_size = sizeof(struct portpilot_pkt);
+    pp_dev->attach_start = portpilot_helpers_now_ns();
+
+    //The device boots when plugged in. Its first packet is sent at a random
+    //point of the first interval, so that devices are not in lockstep
+    sim_dev->boot_ns = pp_dev->attach_start;
+    sim_dev->next_ns = sim_dev->boot_ns + (rand_r(&(sim->seed)) %
+            sim->intvl_ns);
+    sim_dev->energy_nj = 0;
+    sim_dev->max_current = 0;
+    sim_dev->done = 0;
+
+    if (portpilot_helpers_add_dev(pp_dev))
+        sim_dev->pp_dev = pp_dev;
+}
+
+static void portpilot_sim_tick_cb(void *ptr)
+{
+    struct portpilot_sim *sim = ptr;
+    struct portpilot_sim_dev *sim_dev;
+    struct portpilot_pkt pp_pkt;
+    uint64_t now_ns = portpilot_helpers_now_ns(), num_skipped;
+    uint32_t i;
+
+    for (i = 0; i < sim->num_devs; i++) {
+        sim_dev = &(sim->devs[i]);
+
+        if (!sim_dev->pp_dev || sim_dev->done)
+            continue;
+
+        //We have not been able to keep up with the rate
+        if (now_ns > sim_dev->next_ns + SIM_MAX_BACKLOG) {
+            num_skipped = (now_ns - sim_dev->next_ns) / sim->intvl_ns;
+            sim_dev->next_ns += num_skipped * sim->intvl_ns;
+            sim->num_skipped += num_skipped;
+        }
+
+        //The packets that are due are fed to the logger like they would be
+        //by the read callback of a real device
+        while (sim_dev->next_ns <= now_ns) {
+            portpilot_sim_fill_pkt(sim, sim_dev, &pp_pkt);
+            ++sim->num_pkts;
+
+            if (!portpilot_helpers_process_pkt(sim_dev->pp_dev,
+                        (const uint8_t*) &pp_pkt, sizeof(pp_pkt),
+                        sim_dev->next_ns)) {
+                sim_dev->done = 1;
+                break;
+            }
+
+            sim_dev->next_ns += sim->intvl_ns;
+        }
+    }
+}
+
+static void portpilot_sim_churn_cb(void *ptr)
+{
+    struct portpilot_sim *sim = ptr;
+    struct portpilot_sim_dev *sim_dev;
+
+    if (!sim->num_devs)
+        return;
+
+    if (sim->away) {
+        portpilot_sim_plug(sim, sim->away);
+        sim->away = NULL;
+    }
+
+    sim_dev = &(sim->devs[rand_r(&(sim->seed)) % sim->num_devs]);
+
+    if (!sim_dev->pp_dev)
+        return;
+
+    portpilot_cb_handle_event_left(sim->pp_ctx, sim_dev->pp_dev);
+    sim_dev->pp_dev = NULL;
+    sim->away = sim_dev;
+}
+
+struct portpilot_sim* portpilot_sim_create(struct portpilot_ctx *pp_ctx,
+        const struct portpilot_sim_opts *opts)
+{
+    struct portpilot_sim *sim = calloc(sizeof(struct portpilot_sim), 1);
+    uint64_t cur_time = backend_event_loop_now();
+    uint8_t dev_path[USB_MAX_PATH];
+    uint32_t i;
+
+    if (!sim)
+        return NULL;
+
+    sim->pp_ctx = pp_ctx;
+    sim->intvl_ns = 1000000000ULL / opts->rate;
+    sim->waveform = opts->waveform;
+    sim->seed = pp_ctx->shard_idx + 1;
+    sim->devs = calloc(sizeof(struct portpilot_sim_dev), opts->num_devs);
+
+    if (!sim->devs) {
+        portpilot_sim_free(sim);
+        return NULL;
+    }
+
+    sim->tick_handle = backend_event_loop_add_timeout(pp_ctx->event_loop,
+            cur_time + SIM_TICK_INTVL, portpilot_sim_tick_cb, sim,
+            SIM_TICK_INTVL);
+
+    if (!sim->tick_handle) {
+        portpilot_sim_free(sim);
+        return NULL;
+    }
+
+    if (opts->churn_intvl) {
+        sim->churn_handle = backend_event_loop_add_timeout(pp_ctx->event_loop,
+                cur_time + opts->churn_intvl, portpilot_sim_churn_cb, sim,
+                opts->churn_intvl);
+
+        if (!sim->churn_handle) {
+            portpilot_sim_free(sim);
+            return NULL;
+        }
+    }
+
+    //Devices start reading as they are plugged in, which requires the
+    //simulation
+    pp_ctx->sim = sim;
+
+    //Like real devices, every shard only handles the devices that map to it
+    for (i = 0; i < opts->num_devs; i++) {
+        portpilot_sim_path(i, dev_path);
+
+        if (portpilot_helpers_get_shard(dev_path, 3,
+                    pp_ctx->shards->num_shards) != pp_ctx->shard_idx)
+            continue;
+
+        sim->devs[sim->num_devs].idx = i;
+        portpilot_sim_plug(sim, &(sim->devs[sim->num_devs++]));
+    }
+
+    return sim;
+}
+
+void portpilot_sim_free(struct portpilot_sim *sim)
+{
+    if (sim->tick_handle)
+        backend_event_loop_free_timeout(sim->pp_ctx->event_loop,
+                sim->tick_handle);
+
+    if (sim->churn_handle)
+        backend_event_loop_free_timeout(sim->pp_ctx->event_loop,
+                sim->churn_handle);
+
+    free(sim->devs);
+    free(sim);
+}
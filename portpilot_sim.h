@@ -0,0 +1,102 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef PORTPILOT_SIM_H
+#define PORTPILOT_SIM_H
+
+#include <stdint.h>
+
+//Default number of packets a simulated device sends per second
+#define SIM_DEFAULT_RATE 100
+
+//How often (ms) the packets that are due are generated
+#define SIM_TICK_INTVL 1
+
+//A device that is more than this far (ns) behind its rate skips the packets it
+//is behind, instead of catching up with a burst
+#define SIM_MAX_BACKLOG 1000000000ULL
+
+//The bus/port path of a simulated device is {SIM_BUS, idx >> 8, idx & 0xFF}.
+//No real USB bus is numbered 0
+#define SIM_BUS 0
+#define SIM_MAX_DEVS 0xFFFF
+
+struct backend_timeout_handle;
+struct portpilot_ctx;
+struct portpilot_dev;
+
+//Shape of the current drawn by a simulated device. Voltage and energy follow
+//from the current
+enum {
+    SIM_WAVE_CONST = 0,
+    SIM_WAVE_SINE,
+    SIM_WAVE_SQUARE,
+    SIM_WAVE_RAMP,
+};
+
+//Parsed from the -S option, N[,rate[,waveform[,churn]]]. churn_intvl is the
+//time (ms) between simulated hotplug events, 0 disables hotplug
+struct portpilot_sim_opts {
+    uint32_t num_devs;
+    uint32_t rate;
+    uint32_t churn_intvl;
+    uint8_t waveform;
+};
+
+//next_ns is when the next packet of the device is due, boot_ns when the device
+//arrived (the timestamp of a packet is seconds since the device booted).
+//pp_dev is NULL while the device is unplugged
+struct portpilot_sim_dev {
+    struct portpilot_dev *pp_dev;
+    uint64_t next_ns;
+    uint64_t boot_ns;
+    uint64_t energy_nj;
+    uint32_t idx;
+    int16_t max_current;
+    uint8_t done;
+};
+
+//The simulated devices that belong to one shard. Packets are generated by
+//tick_handle and fed through portpilot_helpers_process_pkt(), just like
+//packets read from real devices. Every churn_intvl ms, churn_handle plugs back
+//the device that was unplugged last time (away) and unplugs a random one
+struct portpilot_sim {
+    struct portpilot_ctx *pp_ctx;
+    struct backend_timeout_handle *tick_handle;
+    struct backend_timeout_handle *churn_handle;
+    struct portpilot_sim_dev *devs;
+    struct portpilot_sim_dev *away;
+    uint64_t intvl_ns;
+    uint64_t num_pkts;
+    uint64_t num_skipped;
+    uint32_t num_devs;
+    uint32_t seed;
+    uint8_t waveform;
+};
+
+//Parse the -S option into opts. Returns RETVAL_SUCCESS/RETVAL_FAILURE
+uint8_t portpilot_sim_parse(const char *spec, struct portpilot_sim_opts *opts);
+
+//Create the simulated devices (the ones that map to the shard of pp_ctx) and
+//start generating packets. Returns NULL on failure
+struct portpilot_sim* portpilot_sim_create(struct portpilot_ctx *pp_ctx,
+        const struct portpilot_sim_opts *opts);
+
+//Stop the simulation. The devices must already have been freed
+void portpilot_sim_free(struct portpilot_sim *sim);
+
+#endif
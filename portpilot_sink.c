@@ -0,0 +1,406 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "portpilot_sink.h"
+#include "portpilot_codec.h"
+#include "portpilot_logger.h"
+
+_Static_assert(CODEC_MAX_LEN <= SINK_MAX_LINE,
+        "an encoded sample must fit in a line");
+_Static_assert(SINK_NUM_CHUNKS + 1 <= IO_MAX_IOV,
+        "a buffer and its frame header must fit in an I/O request");
+
+//Two digits at a time, so that formatting a number needs half the divisions
+static const char sink_digits[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+#define SINK_APPEND_STR(p, str) do { \
+    memcpy(p, str, sizeof(str) - 1); \
+    p += sizeof(str) - 1; \
+} while (0)
+
+//Write val in decimal to buf, returns the position after the last digit
+static inline char* portpilot_sink_u32(char *buf, uint32_t val)
+{
+    char tmp[10], *p = tmp + sizeof(tmp);
+    const char *d;
+    uint32_t len;
+
+    while (val >= 100) {
+        d = sink_digits + ((val % 100) * 2);
+        val /= 100;
+        *--p = d[1];
+        *--p = d[0];
+    }
+
+    if (val >= 10) {
+        d = sink_digits + (val * 2);
+        *--p = d[1];
+        *--p = d[0];
+    } else {
+        *--p = '0' + val;
+    }
+
+    len = tmp + sizeof(tmp) - p;
+    memcpy(buf, p, len);
+
+    return buf + len;
+}
+
+static inline char* portpilot_sink_serial(char *buf,
+        const uint8_t *serial_number)
+{
+    size_t len = strnlen((const char*) serial_number, MAX_USB_STR_LEN);
+
+    memcpy(buf, serial_number, len);
+
+    return buf + len;
+}
+
+//Most lines are single readings, which do not need to be divided
+static inline uint32_t portpilot_sink_avg(uint32_t sum, uint16_t num_readings)
+{
+    return num_readings > 1 ? sum / num_readings : sum;
+}
+
+uint32_t portpilot_sink_format_text(char *buf, const uint8_t *serial_number,
+        const struct portpilot_data *pp_data)
+{
+    char *p = buf;
+
+    SINK_APPEND_STR(p, "Serial ");
+    p = portpilot_sink_serial(p, serial_number);
+    SINK_APPEND_STR(p, ", tstamp ");
+    p = portpilot_sink_u32(p, pp_data->tstamp);
+    SINK_APPEND_STR(p, "sec, v_in ");
+    p = portpilot_sink_u32(p, portpilot_sink_avg(pp_data->v_in,
+                pp_data->num_readings));
+    SINK_APPEND_STR(p, "mV, v_out ");
+    p = portpilot_sink_u32(p, portpilot_sink_avg(pp_data->v_out,
+                pp_data->num_readings));
+    SINK_APPEND_STR(p, " mV, current ");
+    p = portpilot_sink_u32(p, portpilot_sink_avg(pp_data->current,
+                pp_data->num_readings));
+    SINK_APPEND_STR(p, "mA, max. current ");
+    p = portpilot_sink_u32(p, pp_data->max_current);
+    SINK_APPEND_STR(p, "mA, energy ");
+    p = portpilot_sink_u32(p, portpilot_sink_avg(pp_data->energy,
+                pp_data->num_readings));
+    SINK_APPEND_STR(p, "mW, total energy ");
+    p = portpilot_sink_u32(p, pp_data->total_energy);
+    SINK_APPEND_STR(p, "mWh\n");
+
+    return p - buf;
+}
+
+uint32_t portpilot_sink_format_csv(char *buf, const uint8_t *serial_number,
+        const struct portpilot_data *pp_data)
+{
+    char *p = buf;
+
+    p = portpilot_sink_serial(p, serial_number);
+    *p++ = ',';
+    p = portpilot_sink_u32(p, pp_data->tstamp);
+    *p++ = ',';
+    p = portpilot_sink_u32(p, portpilot_sink_avg(pp_data->v_in,
+                pp_data->num_readings));
+    *p++ = ',';
+    p = portpilot_sink_u32(p, portpilot_sink_avg(pp_data->v_out,
+                pp_data->num_readings));
+    *p++ = ',';
+    p = portpilot_sink_u32(p, portpilot_sink_avg(pp_data->current,
+                pp_data->num_readings));
+    *p++ = ',';
+    p = portpilot_sink_u32(p, pp_data->max_current);
+    *p++ = ',';
+    p = portpilot_sink_u32(p, portpilot_sink_avg(pp_data->energy,
+                pp_data->num_readings));
+    *p++ = ',';
+    p = portpilot_sink_u32(p, pp_data->total_energy);
+    *p++ = '\n';
+
+    return p - buf;
+}
+
+static void portpilot_sink_reset(struct portpilot_sink *sink)
+{
+    uint8_t i;
+
+    sink->buf = sink->bufs + (sink->cur_buf * SINK_NUM_CHUNKS *
+            SINK_CHUNK_SIZE);
+
+    for (i = 0; i < SINK_NUM_CHUNKS; i++) {
+        sink->iov[i].iov_base = sink->buf + (i * SINK_CHUNK_SIZE);
+        sink->iov[i].iov_len = 0;
+    }
+
+    sink->first_ns = 0;
+    sink->last_ns = 0;
+    sink->cur_chunk = 0;
+}
+
+struct portpilot_sink* portpilot_sink_create(int32_t fd, uint8_t format,
+        uint32_t stream_id, struct portpilot_io *io)
+{
+    struct portpilot_sink *sink = calloc(sizeof(struct portpilot_sink), 1);
+    uint8_t i;
+
+    if (!sink)
+        return NULL;
+
+    //Only one buffer is needed when the sink writes itself
+    sink->bufs = malloc((io ? SINK_NUM_BUFS : 1) * SINK_NUM_CHUNKS *
+            SINK_CHUNK_SIZE);
+
+    if (!sink->bufs) {
+        free(sink);
+        return NULL;
+    }
+
+    if (format == SINK_FORMAT_DELTA) {
+        sink->codec = malloc(sizeof(struct portpilot_codec));
+
+        if (!sink->codec || !portpilot_codec_init(sink->codec)) {
+            free(sink->codec);
+            free(sink->bufs);
+            free(sink);
+            return NULL;
+        }
+
+        sink->codec_reset = 1;
+    }
+
+    //No buffer has been handed to the I/O thread yet
+    for (i = 0; i < SINK_NUM_BUFS; i++)
+        sink->reqs[i].done = 1;
+
+    atomic_init(&(sink->stream.broken), 0);
+    sink->io = io;
+    sink->fd = fd;
+    sink->format = format;
+    sink->stream_id = stream_id;
+    portpilot_sink_reset(sink);
+
+    return sink;
+}
+
+void portpilot_sink_free(struct portpilot_sink *sink)
+{
+    uint8_t i;
+
+    portpilot_sink_flush(sink);
+
+    //The I/O thread might still be writing from the buffers
+    for (i = 0; sink->io && i < SINK_NUM_BUFS; i++)
+        portpilot_io_wait(sink->io, &(sink->reqs[i]));
+
+    if (sink->codec) {
+        portpilot_codec_deinit(sink->codec);
+        free(sink->codec);
+    }
+
+    free(sink->bufs);
+    free(sink);
+}
+
+void portpilot_sink_write(struct portpilot_sink *sink,
+        const uint8_t *serial_number, const struct portpilot_data *pp_data)
+{
+    struct iovec *iov = &(sink->iov[sink->cur_chunk]);
+    char *buf;
+    uint32_t len;
+
+    if (SINK_CHUNK_SIZE - iov->iov_len < SINK_MAX_LINE) {
+        if (sink->cur_chunk == SINK_NUM_CHUNKS - 1)
+            portpilot_sink_flush(sink);
+        else
+            ++sink->cur_chunk;
+
+        iov = &(sink->iov[sink->cur_chunk]);
+    }
+
+    buf = (char*) iov->iov_base + iov->iov_len;
+
+    if (sink->format == SINK_FORMAT_DELTA)
+        len = portpilot_codec_encode(sink->codec, (uint8_t*) buf,
+                serial_number, pp_data);
+    else if (sink->format == SINK_FORMAT_CSV)
+        len = portpilot_sink_format_csv(buf, serial_number, pp_data);
+    else
+        len = portpilot_sink_format_text(buf, serial_number, pp_data);
+
+    if (!sink->first_ns)
+        sink->first_ns = pp_data->host_ns;
+
+    sink->last_ns = pp_data->host_ns;
+    iov->iov_len += len;
+    ++sink->num_lines;
+    sink->num_bytes += len;
+}
+
+//Describe the chunks of the current buffer in iov, behind the header of a
+//frame (see SINK_FORMAT_DELTA) for the compressed format. Returns the number of
+//iovecs
+static int32_t portpilot_sink_fill_iov(struct portpilot_sink *sink,
+        struct iovec *iov)
+{
+    uint8_t *frame_hdr = sink->frame_hdrs[sink->cur_buf], *p;
+    uint64_t len = 0;
+    uint8_t i;
+
+    if (sink->format != SINK_FORMAT_DELTA) {
+        memcpy(iov, sink->iov, (sink->cur_chunk + 1) * sizeof(struct iovec));
+        return sink->cur_chunk + 1;
+    }
+
+    for (i = 0; i <= sink->cur_chunk; i++) {
+        iov[i + 1] = sink->iov[i];
+        len += sink->iov[i].iov_len;
+    }
+
+    p = portpilot_codec_put_varint(frame_hdr,
+            (((uint64_t) sink->stream_id) << 1) | sink->codec_reset);
+    p = portpilot_codec_put_varint(p, len);
+
+    iov[0].iov_base = frame_hdr;
+    iov[0].iov_len = p - frame_hdr;
+
+    return sink->cur_chunk + 2;
+}
+
+//Hand the current buffer to the I/O thread and swap to the next one
+static uint8_t portpilot_sink_submit(struct portpilot_sink *sink)
+{
+    struct portpilot_io_req *req = &(sink->reqs[sink->cur_buf]);
+
+    //A buffer that was written earlier failed. What is in the current buffer
+    //depends on what was lost, so it is dropped and the stream starts over
+    if (sink->codec && !sink->codec_reset &&
+        atomic_load(&(sink->stream.broken))) {
+        ++sink->num_errors;
+        portpilot_codec_reset(sink->codec);
+        sink->codec_reset = 1;
+        portpilot_sink_reset(sink);
+        return RETVAL_FAILURE;
+    }
+
+    req->iovcnt = portpilot_sink_fill_iov(sink, req->iov);
+    req->fd = sink->fd;
+    req->first_ns = sink->first_ns;
+    req->last_ns = sink->last_ns;
+
+    if (sink->codec) {
+        req->stream = &(sink->stream);
+        req->restart = sink->codec_reset;
+        sink->codec_reset = 0;
+    }
+
+    portpilot_io_submit(sink->io, req);
+    ++sink->num_flushes;
+    ++sink->num_swaps;
+
+    //Wait for the next buffer to be written, if it has not been already
+    sink->cur_buf = (sink->cur_buf + 1) % SINK_NUM_BUFS;
+    req = &(sink->reqs[sink->cur_buf]);
+    sink->wait_ns += portpilot_io_wait(sink->io, req);
+
+    if (req->failed)
+        ++sink->num_errors;
+
+    req->failed = 0;
+    portpilot_sink_reset(sink);
+
+    return RETVAL_SUCCESS;
+}
+
+uint8_t portpilot_sink_flush(struct portpilot_sink *sink)
+{
+    struct iovec iov_buf[SINK_NUM_CHUNKS + 1];
+    struct iovec *iov = iov_buf;
+    int32_t iovcnt;
+    uint8_t retval = RETVAL_SUCCESS;
+    ssize_t numbytes;
+
+    if (!sink->cur_chunk && !sink->iov[0].iov_len)
+        return RETVAL_SUCCESS;
+
+    //Messages (for example when a device is ready) are written through stdio,
+    //write them first to keep the output in order
+    if (sink->fd == STDOUT_FILENO)
+        fflush(stdout);
+
+    if (sink->io)
+        return portpilot_sink_submit(sink);
+
+    iovcnt = portpilot_sink_fill_iov(sink, iov);
+
+    while (iovcnt) {
+        numbytes = writev(sink->fd, iov, iovcnt);
+
+        if (numbytes < 0) {
+            if (errno == EINTR)
+                continue;
+
+            ++sink->num_errors;
+            retval = RETVAL_FAILURE;
+            break;
+        }
+
+        //Partial write, skip what has been written
+        while (iovcnt && numbytes >= iov->iov_len) {
+            numbytes -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt) {
+            iov->iov_base = (char*) iov->iov_base + numbytes;
+            iov->iov_len -= numbytes;
+        }
+    }
+
+    //The decoder would apply the next samples to the state of the ones that
+    //were lost, both sides have to start over
+    if (sink->codec) {
+        sink->codec_reset = !retval;
+
+        if (!retval)
+            portpilot_codec_reset(sink->codec);
+    }
+
+    ++sink->num_flushes;
+    portpilot_sink_reset(sink);
+
+    return retval;
+}
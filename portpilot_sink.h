@@ -0,0 +1,115 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef PORTPILOT_SINK_H
+#define PORTPILOT_SINK_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "portpilot_io.h"
+
+//Lines are appended to SINK_NUM_CHUNKS chunks of SINK_CHUNK_SIZE bytes. When a
+//chunk can not fit another line of up to SINK_MAX_LINE bytes, we move on to
+//the next one. The chunks are written with one writev() when all are full, or
+//every SINK_FLUSH_INTVL ms. With an I/O thread, a sink has SINK_NUM_BUFS sets
+//of chunks (buffers). A flush hands the current buffer to the I/O thread and
+//swaps to the next one, waiting only if that one has not been written yet
+#define SINK_CHUNK_SIZE 16384
+#define SINK_NUM_CHUNKS 8
+#define SINK_NUM_BUFS 2
+#define SINK_MAX_LINE 512
+#define SINK_FLUSH_INTVL 100
+
+//Max. length of the header of a frame in the compressed format, two varints
+#define SINK_FRAME_HDR_LEN 20
+
+struct portpilot_codec;
+struct portpilot_data;
+
+//SINK_FORMAT_DELTA is the compressed format of portpilot_codec.h. Sinks of
+//different shards can write to the same file, so every flush is written as a
+//frame: a varint of the stream id of the sink shifted left by one, a varint
+//with the length and then the encoded samples. Every stream id has its own
+//codec state. The lowest bit of the first varint is set when the codec state
+//starts over, which is the case for the first frame of a stream and after a
+//failed flush (samples were lost)
+enum {
+    SINK_FORMAT_TEXT = 0,
+    SINK_FORMAT_CSV,
+    SINK_FORMAT_DELTA,
+};
+
+//Output destination (fd) with its own format. num_errors counts the flushes
+//that failed, the data of a failed flush is dropped. codec is only used with
+//SINK_FORMAT_DELTA. iov and buf are the chunks of the buffer being filled
+//(cur_buf). io is NULL when the sink writes itself, reqs are only used with
+//an I/O thread. wait_ns is the time spent waiting for a buffer to be written
+//before it could be reused. first_ns/last_ns is when the first and last sample
+//in the current buffer were received
+struct portpilot_sink {
+    struct iovec iov[SINK_NUM_CHUNKS];
+    char *buf;
+    char *bufs;
+    struct portpilot_codec *codec;
+    struct portpilot_io *io;
+    struct portpilot_io_stream stream;
+    struct portpilot_io_req reqs[SINK_NUM_BUFS];
+    uint8_t frame_hdrs[SINK_NUM_BUFS][SINK_FRAME_HDR_LEN];
+    uint64_t num_lines;
+    uint64_t num_bytes;
+    uint64_t num_flushes;
+    uint64_t num_swaps;
+    uint64_t num_errors;
+    uint64_t wait_ns;
+    uint64_t first_ns;
+    uint64_t last_ns;
+    int32_t fd;
+    uint32_t stream_id;
+    uint8_t cur_chunk;
+    uint8_t cur_buf;
+    uint8_t format;
+    uint8_t codec_reset;
+};
+
+//Create a sink writing lines in format to fd. The fd is not owned by the sink.
+//stream_id is only used by SINK_FORMAT_DELTA. If io is not NULL, buffers are
+//written by the I/O thread. Returns NULL on failure
+struct portpilot_sink* portpilot_sink_create(int32_t fd, uint8_t format,
+        uint32_t stream_id, struct portpilot_io *io);
+
+//Flush and free the sink. With an I/O thread, this waits until all buffers
+//have been written
+void portpilot_sink_free(struct portpilot_sink *sink);
+
+//Append one line describing pp_data (from the device with the given serial
+//number) to the sink. Flushes if the sink is full
+void portpilot_sink_write(struct portpilot_sink *sink,
+        const uint8_t *serial_number, const struct portpilot_data *pp_data);
+
+//Write everything buffered in the sink. Returns RETVAL_SUCCESS/RETVAL_FAILURE
+uint8_t portpilot_sink_flush(struct portpilot_sink *sink);
+
+//Format pp_data as a line of text/CSV in buf, which must have room for at
+//least SINK_MAX_LINE bytes. The line is not zero-terminated. Returns the length
+//of the line
+uint32_t portpilot_sink_format_text(char *buf, const uint8_t *serial_number,
+        const struct portpilot_data *pp_data);
+uint32_t portpilot_sink_format_csv(char *buf, const uint8_t *serial_number,
+        const struct portpilot_data *pp_data);
+
+#endif
@@ -0,0 +1,382 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libusb-1.0/libusb.h>
+
+#include "portpilot_worker.h"
+#include "portpilot_logger.h"
+#include "portpilot_helpers.h"
+#include "portpilot_decode.h"
+#include "portpilot_ring.h"
+#include "portpilot_sink.h"
+#include "backend_event_loop.h"
+
+//Counters only have one writer, so no need for a compare-and-swap
+static inline void portpilot_worker_update_max(atomic_ullong *max,
+        uint64_t val)
+{
+    if (val > atomic_load_explicit(max, memory_order_relaxed))
+        atomic_store_explicit(max, val, memory_order_relaxed);
+}
+
+static void portpilot_worker_handle_pkt(struct portpilot_dev *pp_dev,
+        const struct portpilot_ring_entry *entry)
+{
+    struct portpilot_data pp_data = {0};
+    struct portpilot_data *data_ptr = pp_dev->agg_data ?
+        pp_dev->agg_data : &pp_data;
+
+    if (pp_dev->pp_ctx->verbose)
+        portpilot_helpers_print_pkt(entry->pkt, entry->len);
+
+    portpilot_helpers_trace_completion(pp_dev, entry->host_ns);
+
+    if (!data_ptr->num_readings)
+        data_ptr->host_ns = entry->host_ns;
+
+    portpilot_decode_pkt(data_ptr, (const struct portpilot_pkt*) entry->pkt);
+
+    //Aggregated data is written by the output timeout
+    if (!pp_dev->agg_data)
+        portpilot_helpers_output_data(pp_dev, data_ptr);
+}
+
+static void portpilot_worker_drain_dev(struct portpilot_worker *worker,
+        struct portpilot_dev *pp_dev, uint64_t cur_ns)
+{
+    uint32_t num_entries = portpilot_ring_available(pp_dev->ring), i, len;
+    const struct portpilot_ring_entry *entry;
+
+    if (!num_entries)
+        return;
+
+    //The oldest entry has waited the longest
+    entry = portpilot_ring_entry(pp_dev->ring, 0);
+
+    if (cur_ns > entry->host_ns)
+        portpilot_worker_update_max(&(worker->max_delay),
+                cur_ns - entry->host_ns);
+
+    //When aggregating, the packets in the ring can be decoded as a batch. The
+    //entries can wrap around the end of the ring
+    if (pp_dev->agg_data && !pp_dev->pp_ctx->verbose) {
+        len = PORTPILOT_RING_SIZE - (entry - pp_dev->ring->entries);
+
+        if (len > num_entries)
+            len = num_entries;
+
+        if (!pp_dev->agg_data->num_readings)
+            pp_dev->agg_data->host_ns = entry->host_ns;
+
+        if (pp_dev->trace) {
+            for (i = 0; i < num_entries; i++)
+                portpilot_helpers_trace_completion(pp_dev,
+                        portpilot_ring_entry(pp_dev->ring, i)->host_ns);
+        }
+
+        portpilot_decode_batch(pp_dev->agg_data, entry->pkt,
+                sizeof(struct portpilot_ring_entry), len);
+        portpilot_decode_batch(pp_dev->agg_data, pp_dev->ring->entries[0].pkt,
+                sizeof(struct portpilot_ring_entry), num_entries - len);
+    } else {
+        for (i = 0; i < num_entries; i++)
+            portpilot_worker_handle_pkt(pp_dev,
+                    portpilot_ring_entry(pp_dev->ring, i));
+    }
+
+    portpilot_ring_release(pp_dev->ring, num_entries);
+
+    atomic_fetch_add_explicit(&(worker->num_pkts), num_entries,
+            memory_order_relaxed);
+    atomic_fetch_add_explicit(&(worker->num_batches), 1,
+            memory_order_relaxed);
+
+    if (num_entries > atomic_load_explicit(&(worker->max_occupancy),
+                memory_order_relaxed))
+        atomic_store_explicit(&(worker->max_occupancy), num_entries,
+                memory_order_relaxed);
+}
+
+static void portpilot_worker_drain(struct portpilot_worker *worker)
+{
+    struct portpilot_dev *ppd_itr = worker->dev_head.lh_first;
+    uint64_t cur_ns = portpilot_helpers_now_ns();
+
+    while (ppd_itr != NULL) {
+        portpilot_worker_drain_dev(worker, ppd_itr, cur_ns);
+        ppd_itr = ppd_itr->next_worker_dev.le_next;
+    }
+}
+
+static void portpilot_worker_drain_cb(void *ptr)
+{
+    struct portpilot_worker *worker = ptr;
+
+    //Clear before draining, packets enqueued after this will post a new task
+    atomic_store(&(worker->drain_pending), 0);
+    portpilot_worker_drain(worker);
+}
+
+static void portpilot_worker_stop_cb(void *ptr)
+{
+    struct portpilot_worker *worker = ptr;
+
+    portpilot_worker_drain(worker);
+    backend_event_loop_stop(worker->event_loop);
+}
+
+//Run by the shard, the worker can not stop the loop of the shard
+static void portpilot_worker_done_read_cb(void *ptr)
+{
+    struct portpilot_ctx *pp_ctx = ptr;
+
+    pp_ctx->num_done_read++;
+    atomic_fetch_add(&(pp_ctx->shards->num_done_read), 1);
+    portpilot_helpers_stop_loop(pp_ctx);
+}
+
+static void portpilot_worker_output_cb(void *ptr)
+{
+    struct portpilot_worker *worker = ptr;
+    struct portpilot_ctx *pp_ctx = worker->pp_ctx;
+    struct portpilot_dev *ppd_itr = worker->dev_head.lh_first;
+
+    //Output the most recent data
+    portpilot_worker_drain(worker);
+
+    while (ppd_itr != NULL) {
+        if (ppd_itr->agg_data->num_readings) {
+            portpilot_helpers_output_data(ppd_itr, ppd_itr->agg_data);
+            memset(ppd_itr->agg_data, 0, sizeof(struct portpilot_data));
+
+            //The worker owns num_pkts of aggregating devices
+            if (++ppd_itr->num_pkts == pp_ctx->pkts_to_read &&
+                pp_ctx->pkts_to_read &&
+                backend_event_loop_post(pp_ctx->event_loop,
+                    portpilot_worker_done_read_cb, pp_ctx))
+                fprintf(stderr, "Failed to post to shard\n");
+        }
+
+        ppd_itr = ppd_itr->next_worker_dev.le_next;
+    }
+}
+
+static void portpilot_worker_trace_cb(void *ptr)
+{
+    struct portpilot_worker *worker = ptr;
+    struct portpilot_dev *ppd_itr = worker->dev_head.lh_first;
+
+    while (ppd_itr != NULL) {
+        portpilot_helpers_print_trace(ppd_itr);
+        ppd_itr = ppd_itr->next_worker_dev.le_next;
+    }
+}
+
+static void portpilot_worker_flush_cb(void *ptr)
+{
+    struct portpilot_worker *worker = ptr;
+
+    portpilot_helpers_flush_output(worker->pp_ctx);
+}
+
+static void portpilot_worker_add_dev_cb(void *ptr)
+{
+    struct portpilot_dev *pp_dev = ptr;
+
+    LIST_INSERT_HEAD(&(pp_dev->pp_ctx->worker->dev_head), pp_dev,
+            next_worker_dev);
+}
+
+static void portpilot_worker_remove_dev_cb(void *ptr)
+{
+    struct portpilot_dev *pp_dev = ptr;
+
+    portpilot_worker_drain_dev(pp_dev->pp_ctx->worker, pp_dev,
+            portpilot_helpers_now_ns());
+    LIST_REMOVE(pp_dev, next_worker_dev);
+
+    portpilot_ring_free(pp_dev->ring);
+
+    if (pp_dev->trace) {
+        portpilot_helpers_print_trace(pp_dev);
+        free(pp_dev->trace);
+    }
+
+    if (pp_dev->agg_data)
+        free(pp_dev->agg_data);
+
+    free(pp_dev);
+}
+
+static void* portpilot_worker_run(void *ptr)
+{
+    struct portpilot_worker *worker = ptr;
+
+    backend_event_loop_run(worker->event_loop);
+
+    return NULL;
+}
+
+static void portpilot_worker_free(struct portpilot_worker *worker)
+{
+    if (worker->output_timeout_handle)
+        backend_event_loop_free_timeout(worker->event_loop,
+                worker->output_timeout_handle);
+
+    if (worker->trace_timeout_handle)
+        backend_event_loop_free_timeout(worker->event_loop,
+                worker->trace_timeout_handle);
+
+    if (worker->flush_timeout_handle)
+        backend_event_loop_free_timeout(worker->event_loop,
+                worker->flush_timeout_handle);
+
+    backend_event_loop_free(worker->event_loop);
+    free(worker);
+}
+
+struct portpilot_worker* portpilot_worker_create(struct portpilot_ctx *pp_ctx,
+        uint16_t output_interval, uint32_t trace_interval)
+{
+    struct portpilot_worker *worker = calloc(sizeof(struct portpilot_worker),
+            1);
+
+    if (!worker)
+        return NULL;
+
+    worker->pp_ctx = pp_ctx;
+    worker->event_loop = backend_event_loop_create();
+    LIST_INIT(&(worker->dev_head));
+
+    if (!worker->event_loop) {
+        free(worker);
+        return NULL;
+    }
+
+    if (output_interval) {
+        worker->output_timeout_handle = backend_event_loop_add_timeout(
+                worker->event_loop, backend_event_loop_now() + output_interval,
+                portpilot_worker_output_cb, worker, output_interval);
+
+        if (!worker->output_timeout_handle) {
+            portpilot_worker_free(worker);
+            return NULL;
+        }
+    }
+
+    if (trace_interval) {
+        worker->trace_timeout_handle = backend_event_loop_add_timeout(
+                worker->event_loop, backend_event_loop_now() + trace_interval,
+                portpilot_worker_trace_cb, worker, trace_interval);
+
+        if (!worker->trace_timeout_handle) {
+            portpilot_worker_free(worker);
+            return NULL;
+        }
+    }
+
+    worker->flush_timeout_handle = backend_event_loop_add_timeout(
+            worker->event_loop, backend_event_loop_now() + SINK_FLUSH_INTVL,
+            portpilot_worker_flush_cb, worker, SINK_FLUSH_INTVL);
+
+    if (!worker->flush_timeout_handle) {
+        portpilot_worker_free(worker);
+        return NULL;
+    }
+
+    if (pthread_create(&(worker->thread), NULL, portpilot_worker_run,
+                worker)) {
+        portpilot_worker_free(worker);
+        return NULL;
+    }
+
+    return worker;
+}
+
+void portpilot_worker_stop(struct portpilot_worker *worker)
+{
+    if (backend_event_loop_post_task(worker->event_loop,
+                &(worker->stop_task), portpilot_worker_stop_cb, worker))
+        fprintf(stderr, "Failed to stop worker\n");
+    else
+        pthread_join(worker->thread, NULL);
+
+    portpilot_worker_free(worker);
+}
+
+uint8_t portpilot_worker_add_dev(struct portpilot_worker *worker,
+        struct portpilot_dev *pp_dev)
+{
+    pp_dev->ring = portpilot_ring_create();
+
+    if (!pp_dev->ring)
+        return RETVAL_FAILURE;
+
+    if (backend_event_loop_post_task(worker->event_loop, &(pp_dev->add_task),
+                portpilot_worker_add_dev_cb, pp_dev)) {
+        portpilot_ring_free(pp_dev->ring);
+        pp_dev->ring = NULL;
+        return RETVAL_FAILURE;
+    }
+
+    return RETVAL_SUCCESS;
+}
+
+void portpilot_worker_remove_dev(struct portpilot_worker *worker,
+        struct portpilot_dev *pp_dev)
+{
+    //The task fd of the worker loop was there when the device was added, so
+    //posting can not fail
+    backend_event_loop_post_task(worker->event_loop, &(pp_dev->remove_task),
+            portpilot_worker_remove_dev_cb, pp_dev);
+}
+
+uint8_t portpilot_worker_enqueue(struct portpilot_worker *worker,
+        struct portpilot_dev *pp_dev, const uint8_t *buf, uint16_t len,
+        uint64_t host_ns)
+{
+    struct portpilot_ring_entry *entry = portpilot_ring_reserve(pp_dev->ring);
+
+    //Worker is not keeping up, drop the packet
+    if (!entry) {
+        ++pp_dev->pp_ctx->num_ring_overflow;
+        return RETVAL_FAILURE;
+    }
+
+    if (len > PORTPILOT_RING_PKT_LEN)
+        len = PORTPILOT_RING_PKT_LEN;
+
+    entry->host_ns = host_ns;
+    entry->len = len;
+    memcpy(entry->pkt, buf, len);
+
+    //Short packets are decoded as if the rest was 0
+    if (len < sizeof(struct portpilot_pkt))
+        memset(entry->pkt + len, 0, sizeof(struct portpilot_pkt) - len);
+
+    portpilot_ring_commit(pp_dev->ring);
+
+    if (!atomic_exchange(&(worker->drain_pending), 1))
+        backend_event_loop_post_task(worker->event_loop,
+                &(worker->drain_task), portpilot_worker_drain_cb, worker);
+
+    return RETVAL_SUCCESS;
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright 2016 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Portpilot Logger. Portpilot Logger is free software: you
+ * can redistribute it and/or modify it under the terms of the Lesser GNU
+ * General Public License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * Portpilot Logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Portpilot Logger. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef PORTPILOT_WORKER_H
+#define PORTPILOT_WORKER_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#include "backend_task_queue.h"
+
+struct backend_event_loop;
+struct backend_timeout_handle;
+struct portpilot_ctx;
+struct portpilot_dev;
+
+//In worker mode (-w), the libusb completion callback only copies the raw
+//packet into the ring of the device and resubmits the transfer. Decoding,
+//aggregation and output is done by a worker thread (one per shard), which
+//drains the rings in batches. The worker runs its own event loop. The shard
+//posts tasks to it when devices are added/removed and when there are new
+//packets (drain_pending is set while a drain task is queued).
+//
+//The worker owns the devices of dev_head, which are linked through
+//next_worker_dev. A removed device is freed by the worker after its ring has
+//been drained. The counters are written by the worker, but can be read by any
+//thread
+struct portpilot_worker {
+    struct backend_event_loop *event_loop;
+    struct portpilot_ctx *pp_ctx;
+    struct backend_timeout_handle *output_timeout_handle;
+    struct backend_timeout_handle *trace_timeout_handle;
+    struct backend_timeout_handle *flush_timeout_handle;
+    LIST_HEAD(worker_dev_list, portpilot_dev) dev_head;
+    struct backend_task drain_task;
+    struct backend_task stop_task;
+    pthread_t thread;
+    atomic_uchar drain_pending;
+    atomic_ullong num_pkts;
+    atomic_ullong num_batches;
+    //Longest time a packet has been waiting in a ring (ns)
+    atomic_ullong max_delay;
+    atomic_uint max_occupancy;
+};
+
+//Create the worker of pp_ctx and start its thread. When output_interval is
+//set, the worker outputs the aggregated data of every device every
+//output_interval ms. Likewise, the latency summary of every device is printed
+//every trace_interval ms. The output sinks of pp_ctx are flushed by the worker.
+//Returns NULL on failure
+struct portpilot_worker* portpilot_worker_create(struct portpilot_ctx *pp_ctx,
+        uint16_t output_interval, uint32_t trace_interval);
+
+//Drain all rings, stop the worker thread and free the worker. All devices must
+//have been removed
+void portpilot_worker_stop(struct portpilot_worker *worker);
+
+//Allocate the ring of pp_dev and hand the device to the worker. Returns
+//RETVAL_SUCCESS/RETVAL_FAILURE
+uint8_t portpilot_worker_add_dev(struct portpilot_worker *worker,
+        struct portpilot_dev *pp_dev);
+
+//Hand the device back to the worker for it to be freed. pp_dev must not be
+//used after this call
+void portpilot_worker_remove_dev(struct portpilot_worker *worker,
+        struct portpilot_dev *pp_dev);
+
+//Copy a received packet, completed at host_ns, into the ring of pp_dev and
+//notify the worker. Called from the libusb completion callback. Returns
+//RETVAL_FAILURE if the packet was dropped because the ring was full
+uint8_t portpilot_worker_enqueue(struct portpilot_worker *worker,
+        struct portpilot_dev *pp_dev, const uint8_t *buf, uint16_t len,
+        uint64_t host_ns);
+
+#endif